@@ -0,0 +1,281 @@
+-- LuaJIT FFI bindings of ngx_prometheus_module.
+--
+-- A declared metric and a tuple of label values are resolved once into a
+-- series handle. Updates through the handle are direct FFI calls, without
+-- shared dictionary lookups or string keys.
+--
+--   local prometheus = require "resty.prometheus"
+--
+--   -- init_worker_by_lua_block
+--   local requests = prometheus.series("http_requests_total", "GET", "200")
+--
+--   -- log_by_lua_block
+--   requests:inc(1)
+--
+--   -- histograms declared with timer=msec|coarse|tsc time code directly
+--   local timer = latency:start()
+--   ...
+--   latency:stop(timer)
+--
+--   -- counters and histograms declared with exemplars keep a trace id
+--   requests:inc(1, ngx.var.opentelemetry_trace_id)
+--
+--   -- counters and histograms declared with window=time are read in place
+--   local rps = requests:rate(10)
+--   local p99 = latency:quantile(0.99, 60)
+--
+--   -- metrics declared with prometheus_topk count keys, not series
+--   local top_uris = prometheus.topk("http_top_uri_bytes_total")
+--   top_uris:add(ngx.var.uri, tonumber(ngx.var.bytes_sent))
+--
+--   -- gauges declared with prometheus_distinct count distinct keys
+--   local clients = prometheus.series("http_distinct_clients")
+--   clients:count(ngx.var.remote_addr)
+
+local ffi = require "ffi"
+local base = require "resty.core.base"  -- defines ngx_str_t
+
+local C = ffi.C
+local select = select
+local setmetatable = setmetatable
+local tostring = tostring
+local error = error
+
+
+ffi.cdef[[
+int ngx_prometheus_ffi_metric(const unsigned char *name, size_t len);
+int ngx_prometheus_ffi_metric_type(int index);
+int ngx_prometheus_ffi_metric_labels(int index);
+void *ngx_prometheus_ffi_series(int index, ngx_str_t *labels, int nlabels);
+int ngx_prometheus_ffi_inc(void *handle, double value);
+int ngx_prometheus_ffi_dec(void *handle, double value);
+int ngx_prometheus_ffi_set(void *handle, double value);
+int ngx_prometheus_ffi_observe(void *handle, double value);
+int ngx_prometheus_ffi_summarize(void *handle, double value);
+int ngx_prometheus_ffi_inc_exemplar(void *handle, double value,
+    const unsigned char *trace_id, size_t len);
+int ngx_prometheus_ffi_observe_exemplar(void *handle, double value,
+    const unsigned char *trace_id, size_t len);
+void *ngx_prometheus_ffi_window(void *handle, int type);
+void *ngx_prometheus_ffi_topk(int index);
+int ngx_prometheus_ffi_topk_add(void *handle, const unsigned char *key,
+    size_t len, double value);
+int ngx_prometheus_ffi_count_distinct(void *handle, const unsigned char *key,
+    size_t len);
+
+typedef struct {
+    void *histogram;
+    uint64_t start;
+} prom_timer_t;
+
+int prom_timer_start(prom_timer_t *handle);
+int prom_timer_observe(prom_timer_t *handle);
+
+double prom_window_rate(void *window, uint32_t seconds);
+double prom_window_quantile(void *window, uint32_t seconds, double q);
+]]
+
+
+local COUNTER = 0
+local GAUGE = 1
+local HISTOGRAM = 2
+local SUMMARY = 3
+
+local NGX_OK = base.FFI_OK
+
+-- PROM_WINDOW_SECONDS_MAX, reads are limited to the window
+local WINDOW_MAX = 3600
+
+local prom_timer_t = ffi.typeof("prom_timer_t")
+
+
+local _M = { _VERSION = "0.1" }
+
+
+-- the window of the series, resolved on first use
+local function window(self, type)
+    local w = self.window
+    if w == nil then
+        w = C.ngx_prometheus_ffi_window(self.handle, type)
+        if w == nil then
+            return nil
+        end
+        self.window = w
+    end
+    return w
+end
+
+
+local counter = {}
+counter.__index = counter
+
+function counter:inc(value, trace_id)
+    if trace_id then
+        return C.ngx_prometheus_ffi_inc_exemplar(self.handle, value or 1,
+                                                 trace_id, #trace_id) == NGX_OK
+    end
+    return C.ngx_prometheus_ffi_inc(self.handle, value or 1) == NGX_OK
+end
+
+-- the increase per second over the last seconds, the window by default
+function counter:rate(seconds)
+    local w = window(self, COUNTER)
+    if w == nil then
+        return nil, "counter is not declared with a window"
+    end
+    return tonumber(C.prom_window_rate(w, seconds or WINDOW_MAX))
+end
+
+
+local gauge = {}
+gauge.__index = gauge
+
+function gauge:inc(value)
+    return C.ngx_prometheus_ffi_inc(self.handle, value or 1) == NGX_OK
+end
+
+function gauge:dec(value)
+    return C.ngx_prometheus_ffi_dec(self.handle, value or 1) == NGX_OK
+end
+
+function gauge:set(value)
+    return C.ngx_prometheus_ffi_set(self.handle, value) == NGX_OK
+end
+
+-- counts a key in a gauge declared with prometheus_distinct
+function gauge:count(key)
+    key = tostring(key)
+    return C.ngx_prometheus_ffi_count_distinct(self.handle, key,
+                                               #key) == NGX_OK
+end
+
+
+local histogram = {}
+histogram.__index = histogram
+
+function histogram:observe(value, trace_id)
+    if trace_id then
+        return C.ngx_prometheus_ffi_observe_exemplar(self.handle, value,
+                                                     trace_id,
+                                                     #trace_id) == NGX_OK
+    end
+    return C.ngx_prometheus_ffi_observe(self.handle, value) == NGX_OK
+end
+
+-- the observations per second over the last seconds, the window by default
+function histogram:rate(seconds)
+    local w = window(self, HISTOGRAM)
+    if w == nil then
+        return nil, "histogram is not declared with a window"
+    end
+    return tonumber(C.prom_window_rate(w, seconds or WINDOW_MAX))
+end
+
+-- estimates a quantile of the last seconds, NaN without observations
+function histogram:quantile(q, seconds)
+    local w = window(self, HISTOGRAM)
+    if w == nil then
+        return nil, "histogram is not declared with a window"
+    end
+    return tonumber(C.prom_window_quantile(w, seconds or WINDOW_MAX, q))
+end
+
+-- starts measuring a duration with the clock the histogram is declared with
+function histogram:start()
+    local timer = prom_timer_t(self.handle)
+    if C.prom_timer_start(timer) ~= 0 then
+        return nil, "histogram is not declared with a timer"
+    end
+
+    return timer
+end
+
+function histogram:stop(timer)
+    return C.prom_timer_observe(timer) == 0
+end
+
+
+local summary = {}
+summary.__index = summary
+
+function summary:observe(value)
+    return C.ngx_prometheus_ffi_summarize(self.handle, value) == NGX_OK
+end
+
+
+local types = {
+    [COUNTER] = counter,
+    [GAUGE] = gauge,
+    [HISTOGRAM] = histogram,
+    [SUMMARY] = summary,
+}
+
+
+-- resolves the series of a metric declared in nginx.conf; label values are
+-- given in the order of the declaration
+function _M.series(name, ...)
+    local index = C.ngx_prometheus_ffi_metric(name, #name)
+    if index < 0 then
+        return nil, "unknown metric \"" .. name .. "\""
+    end
+
+    local n = select("#", ...)
+    if n ~= C.ngx_prometheus_ffi_metric_labels(index) then
+        return nil, "label values do not match the labels of \"" .. name
+                    .. "\""
+    end
+
+    -- keeps the label strings referenced until the call returns
+    local values = { ... }
+    local labels
+    if n > 0 then
+        labels = ffi.new("ngx_str_t[?]", n)
+
+        for i = 1, n do
+            values[i] = tostring(values[i])
+            labels[i - 1].data = values[i]
+            labels[i - 1].len = #values[i]
+        end
+    end
+
+    local handle = C.ngx_prometheus_ffi_series(index, labels, n)
+    if handle == nil then
+        return nil, "could not create the series of \"" .. name .. "\""
+    end
+
+    local mt = types[C.ngx_prometheus_ffi_metric_type(index)]
+    if mt == nil then
+        error("unsupported type of metric \"" .. name .. "\"")
+    end
+
+    return setmetatable({ handle = handle }, mt)
+end
+
+
+local topk = {}
+topk.__index = topk
+
+function topk:add(key, value)
+    key = tostring(key)
+    return C.ngx_prometheus_ffi_topk_add(self.handle, key, #key,
+                                         value or 1) == NGX_OK
+end
+
+
+-- resolves the sketch of a metric declared with prometheus_topk
+function _M.topk(name)
+    local index = C.ngx_prometheus_ffi_metric(name, #name)
+    if index < 0 then
+        return nil, "unknown metric \"" .. name .. "\""
+    end
+
+    local handle = C.ngx_prometheus_ffi_topk(index)
+    if handle == nil then
+        return nil, "metric \"" .. name .. "\" is not a top-K metric"
+    end
+
+    return setmetatable({ handle = handle }, topk)
+end
+
+
+return _M
@@ -0,0 +1,2207 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <zlib.h>
+#if (NGX_HAVE_ZSTD)
+#include <zstd.h>
+#endif
+#include <ngx_prometheus_module.h>
+#include "prom_metric.h"
+
+
+#define NGX_HTTP_PROMETHEUS_IDENTITY      0
+#define NGX_HTTP_PROMETHEUS_GZIP          1
+#define NGX_HTTP_PROMETHEUS_ZSTD          2
+#define NGX_HTTP_PROMETHEUS_ENCODINGS     3
+
+#define NGX_HTTP_PROMETHEUS_TEXT          0
+#define NGX_HTTP_PROMETHEUS_OPENMETRICS   1
+#define NGX_HTTP_PROMETHEUS_PROTOBUF      2
+#define NGX_HTTP_PROMETHEUS_FORMATS       3
+
+#define NGX_HTTP_PROMETHEUS_BUF_SIZE      65536
+
+#define NGX_HTTP_PROMETHEUS_RESPONSE_TIME  0
+#define NGX_HTTP_PROMETHEUS_CONNECT_TIME   1
+#define NGX_HTTP_PROMETHEUS_HEADER_TIME    2
+#define NGX_HTTP_PROMETHEUS_TIMES          3
+#define NGX_HTTP_PROMETHEUS_RESPONSES      3
+#define NGX_HTTP_PROMETHEUS_STATUSES       5    /* 1xx to 5xx */
+
+
+typedef struct {
+    ngx_uint_t                      refs;
+    size_t                          len;
+    u_char                         *data;
+} ngx_http_prometheus_blob_t;
+
+
+typedef struct {
+    ngx_http_prometheus_blob_t     *blob;
+    ngx_msec_t                      expires;
+    ngx_atomic_uint_t               generation;
+} ngx_http_prometheus_cache_t;
+
+
+typedef struct {
+    ngx_str_t                       name;
+    ngx_str_t                       content_type;
+    prom_metric_format_t            format;
+} ngx_http_prometheus_format_t;
+
+
+typedef struct {
+    ngx_str_t                       name;
+    prom_metric_sample_histogram_t *times[NGX_HTTP_PROMETHEUS_TIMES];
+    prom_metric_sample_t           *responses[NGX_HTTP_PROMETHEUS_STATUSES];
+} ngx_http_prometheus_peer_t;
+
+
+typedef struct {
+    ngx_http_upstream_srv_conf_t   *upstream;
+    ngx_http_prometheus_peer_t     *peers;
+    ngx_uint_t                      npeers;
+} ngx_http_prometheus_upstream_t;
+
+
+typedef struct {
+    ngx_str_t                       name;
+    char                           *help;
+    prom_metric_type_t              type;
+} ngx_http_prometheus_builtin_t;
+
+
+typedef struct {
+    ngx_flag_t                      upstream_metrics;
+    ngx_array_t                     upstreams;
+    ngx_uint_t                      metrics[NGX_HTTP_PROMETHEUS_TIMES + 1];
+} ngx_http_prometheus_main_conf_t;
+
+
+typedef struct {
+    ngx_uint_t                      index;
+    ngx_http_complex_value_t        value;
+    double                          number;
+    ngx_uint_t                      nlabels;
+    ngx_http_complex_value_t       *labels;     /* in declaration order */
+    ngx_http_complex_value_t       *exemplar;   /* the trace id */
+    unsigned                        constant:1;
+    unsigned                        distinct:1; /* the value is a key */
+    unsigned                        sampled:1;
+} ngx_http_prometheus_observe_t;
+
+
+typedef struct {
+    ngx_uint_t                      index;
+    ngx_uint_t                      nlabels;
+    ngx_http_complex_value_t       *labels;     /* in declaration order */
+} ngx_http_prometheus_inflight_t;
+
+
+typedef struct {
+    ngx_array_t                    *observe;
+    ngx_array_t                    *inflight;
+    ngx_uint_t                      encodings;
+    ngx_int_t                       gzip_level;
+#if (NGX_HAVE_ZSTD)
+    ngx_int_t                       zstd_level;
+#endif
+    ngx_msec_t                      cache_valid;
+    ngx_http_prometheus_cache_t    *cache;
+} ngx_http_prometheus_loc_conf_t;
+
+
+typedef struct {
+    ngx_http_request_t             *request;
+    ngx_uint_t                      encoding;
+    ngx_chain_t                    *out;
+    ngx_chain_t                   **last;
+    ngx_buf_t                      *buf;
+    off_t                           size;
+    z_stream                        zstream;
+    unsigned                        zstream_init:1;
+#if (NGX_HAVE_ZSTD)
+    ZSTD_CCtx                      *zstd;
+#endif
+} ngx_http_prometheus_render_t;
+
+
+static ngx_int_t ngx_http_prometheus_handler(ngx_http_request_t *r);
+static ngx_uint_t ngx_http_prometheus_negotiate(ngx_http_request_t *r,
+    ngx_str_t *header, ngx_str_t *names, size_t size, ngx_uint_t n,
+    ngx_uint_t allowed);
+static ngx_table_elt_t *ngx_http_prometheus_header(ngx_http_request_t *r,
+    ngx_str_t *name);
+static ngx_int_t ngx_http_prometheus_filters(ngx_http_request_t *r,
+    ngx_array_t **filters);
+static ngx_int_t ngx_http_prometheus_etag(ngx_http_request_t *r,
+    prom_collector_registry_t *registry, ngx_atomic_uint_t generation,
+    ngx_uint_t format, ngx_uint_t encoding, ngx_array_t *filters);
+static ngx_uint_t ngx_http_prometheus_not_modified(ngx_http_request_t *r);
+static ngx_int_t ngx_http_prometheus_render(ngx_http_request_t *r,
+    prom_collector_registry_t *registry, ngx_http_prometheus_loc_conf_t *plcf,
+    ngx_uint_t format, ngx_uint_t encoding, ngx_array_t *filters,
+    ngx_http_prometheus_render_t *ctx);
+static int ngx_http_prometheus_write(void *data, const char *buf, size_t len);
+static ngx_int_t ngx_http_prometheus_deflate(ngx_http_prometheus_render_t *ctx,
+    u_char *buf, size_t len, ngx_uint_t last);
+#if (NGX_HAVE_ZSTD)
+static ngx_int_t ngx_http_prometheus_zstd(ngx_http_prometheus_render_t *ctx,
+    u_char *buf, size_t len, ngx_uint_t last);
+#endif
+static ngx_int_t ngx_http_prometheus_copy(ngx_http_prometheus_render_t *ctx,
+    u_char *buf, size_t len);
+static ngx_buf_t *ngx_http_prometheus_buf(ngx_http_prometheus_render_t *ctx);
+static void ngx_http_prometheus_render_cleanup(void *data);
+static ngx_http_prometheus_blob_t *ngx_http_prometheus_blob(
+    ngx_http_prometheus_render_t *ctx);
+static ngx_int_t ngx_http_prometheus_blob_ref(ngx_http_request_t *r,
+    ngx_http_prometheus_blob_t *blob);
+static void ngx_http_prometheus_blob_unref(void *data);
+static ngx_int_t ngx_http_prometheus_send(ngx_http_request_t *r,
+    ngx_uint_t format, ngx_uint_t encoding, off_t size, ngx_chain_t *out);
+static ngx_int_t ngx_http_prometheus_log_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_prometheus_inflight_handler(ngx_http_request_t *r);
+static void ngx_http_prometheus_inflight_cleanup(void *data);
+static ngx_int_t ngx_http_prometheus_label_values(ngx_http_request_t *r,
+    ngx_uint_t nlabels, ngx_http_complex_value_t *cv, ngx_str_t **labels);
+static void ngx_http_prometheus_log_upstream(ngx_http_request_t *r,
+    ngx_http_prometheus_main_conf_t *pmcf);
+static ngx_int_t ngx_http_prometheus_init_upstreams(ngx_conf_t *cf,
+    ngx_http_prometheus_main_conf_t *pmcf);
+static ngx_int_t ngx_http_prometheus_init_peers(ngx_prometheus_ctx_t *ctx,
+    ngx_pool_t *pool, void *data);
+
+static ngx_int_t ngx_http_prometheus_init(ngx_conf_t *cf);
+static void *ngx_http_prometheus_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_prometheus_init_main_conf(ngx_conf_t *cf, void *conf);
+
+static void *ngx_http_prometheus_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_prometheus_merge_loc_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+static char *ngx_http_prometheus(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_prometheus_compression(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char *ngx_http_prometheus_observe(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_prometheus_inflight(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_prometheus_labels(ngx_conf_t *cf,
+    ngx_prometheus_metric_conf_t *mcf, ngx_uint_t first, ngx_uint_t last,
+    ngx_http_complex_value_t **labels);
+
+
+static ngx_conf_num_bounds_t  ngx_http_prometheus_gzip_level_bounds = {
+    ngx_conf_check_num_bounds, 1, 9
+};
+
+#if (NGX_HAVE_ZSTD)
+static ngx_conf_num_bounds_t  ngx_http_prometheus_zstd_level_bounds = {
+    ngx_conf_check_num_bounds, 1, 19
+};
+#endif
+
+
+static ngx_str_t  ngx_http_prometheus_encoding_names[] = {
+    ngx_string("identity"),
+    ngx_string("gzip"),
+    ngx_string("zstd")
+};
+
+
+static ngx_http_prometheus_format_t  ngx_http_prometheus_formats[] = {
+
+    { ngx_string("text/plain"),
+      ngx_string("text/plain; version=0.0.4; charset=utf-8"),
+      PROM_FORMAT_TEXT },
+
+    { ngx_string("application/openmetrics-text"),
+      ngx_string("application/openmetrics-text; version=1.0.0; "
+                 "charset=utf-8"),
+      PROM_FORMAT_OPENMETRICS },
+
+    { ngx_string("application/vnd.google.protobuf"),
+      ngx_string("application/vnd.google.protobuf; "
+                 "proto=io.prometheus.client.MetricFamily; "
+                 "encoding=delimited"),
+      PROM_FORMAT_PROTOBUF }
+};
+
+
+static ngx_http_prometheus_builtin_t  ngx_http_prometheus_upstream_metrics[] = {
+
+    { ngx_string("nginx_upstream_response_time_seconds"),
+      "Time spent receiving responses from upstream peers",
+      PROM_HISTOGRAM },
+
+    { ngx_string("nginx_upstream_connect_time_seconds"),
+      "Time spent establishing connections with upstream peers",
+      PROM_HISTOGRAM },
+
+    { ngx_string("nginx_upstream_header_time_seconds"),
+      "Time spent receiving response headers from upstream peers",
+      PROM_HISTOGRAM },
+
+    { ngx_string("nginx_upstream_responses_total"),
+      "Responses received from upstream peers by status class",
+      PROM_COUNTER }
+};
+
+
+static ngx_str_t  ngx_http_prometheus_status_classes[] = {
+    ngx_string("1xx"),
+    ngx_string("2xx"),
+    ngx_string("3xx"),
+    ngx_string("4xx"),
+    ngx_string("5xx")
+};
+
+
+static ngx_str_t  ngx_http_prometheus_accept = ngx_string("Accept");
+static ngx_str_t  ngx_http_prometheus_accept_encoding =
+    ngx_string("Accept-Encoding");
+
+
+static ngx_command_t  ngx_http_prometheus_commands[] = {
+
+    { ngx_string("prometheus"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_prometheus,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("prometheus_compression"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_prometheus_compression,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("prometheus_gzip_comp_level"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_prometheus_loc_conf_t, gzip_level),
+      &ngx_http_prometheus_gzip_level_bounds },
+
+#if (NGX_HAVE_ZSTD)
+
+    { ngx_string("prometheus_zstd_comp_level"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_prometheus_loc_conf_t, zstd_level),
+      &ngx_http_prometheus_zstd_level_bounds },
+
+#endif
+
+    { ngx_string("prometheus_cache_valid"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_prometheus_loc_conf_t, cache_valid),
+      NULL },
+
+    { ngx_string("prometheus_upstream_metrics"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_prometheus_main_conf_t, upstream_metrics),
+      NULL },
+
+    { ngx_string("prometheus_observe"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_2MORE,
+      ngx_http_prometheus_observe,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("prometheus_inflight"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_prometheus_inflight,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_prometheus_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_prometheus_init,              /* postconfiguration */
+
+    ngx_http_prometheus_create_main_conf,  /* create main configuration */
+    ngx_http_prometheus_init_main_conf,    /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_prometheus_create_loc_conf,   /* create location configuration */
+    ngx_http_prometheus_merge_loc_conf     /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_prometheus_module = {
+    NGX_MODULE_V1,
+    &ngx_http_prometheus_module_ctx,       /* module context */
+    ngx_http_prometheus_commands,          /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_prometheus_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                        rc;
+    ngx_uint_t                       format, encoding;
+    ngx_chain_t                      out;
+    ngx_buf_t                       *b;
+    ngx_array_t                     *filters;
+    ngx_atomic_uint_t                generation;
+    prom_collector_registry_t       *registry;
+    ngx_http_prometheus_blob_t      *blob;
+    ngx_http_prometheus_cache_t     *cache;
+    ngx_http_prometheus_render_t    *ctx;
+    ngx_http_prometheus_loc_conf_t  *plcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    registry = ngx_prometheus_registry((ngx_cycle_t *) ngx_cycle);
+
+    if (registry == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "prometheus_zone is not configured");
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    plcf = ngx_http_get_module_loc_conf(r, ngx_http_prometheus_module);
+
+    format = ngx_http_prometheus_negotiate(r, &ngx_http_prometheus_accept,
+                 &ngx_http_prometheus_formats[0].name,
+                 sizeof(ngx_http_prometheus_format_t),
+                 NGX_HTTP_PROMETHEUS_FORMATS,
+                 (1 << NGX_HTTP_PROMETHEUS_FORMATS) - 1);
+
+    encoding = ngx_http_prometheus_negotiate(r,
+                   &ngx_http_prometheus_accept_encoding,
+                   ngx_http_prometheus_encoding_names, sizeof(ngx_str_t),
+                   NGX_HTTP_PROMETHEUS_ENCODINGS, plcf->encodings);
+
+    if (ngx_http_prometheus_filters(r, &filters) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    generation = prom_collector_registry_generation(registry);
+
+    cache = NULL;
+    blob = NULL;
+
+    /* filtered scrapes are rendered on demand and never cached */
+
+    if (plcf->cache_valid && filters == NULL) {
+        cache = &plcf->cache[format * NGX_HTTP_PROMETHEUS_ENCODINGS
+                             + encoding];
+
+        /*
+         * a cached body stays valid as long as nothing has changed; one
+         * served within prometheus_cache_valid after a change is tagged
+         * with the generation it was rendered at, not the current one
+         */
+
+        if (cache->blob
+            && (cache->generation == generation
+                || (ngx_msec_int_t) (cache->expires - ngx_current_msec) > 0))
+        {
+            blob = cache->blob;
+            generation = cache->generation;
+        }
+    }
+
+    if (ngx_http_prometheus_etag(r, registry, generation, format, encoding,
+                                 filters)
+        != NGX_OK)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (ngx_http_prometheus_not_modified(r)) {
+        return ngx_http_prometheus_send(r, format, encoding, 0, NULL);
+    }
+
+    if (blob) {
+        goto send_blob;
+    }
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_prometheus_render_t));
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    rc = ngx_http_prometheus_render(r, registry, plcf, format, encoding,
+                                    filters, ctx);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (cache == NULL) {
+        return ngx_http_prometheus_send(r, format, encoding, ctx->size,
+                                        ctx->out);
+    }
+
+    /*
+     * keep the encoded body so that the following scrapes within
+     * prometheus_cache_valid neither render nor compress it again
+     */
+
+    blob = ngx_http_prometheus_blob(ctx);
+    if (blob == NULL) {
+        return ngx_http_prometheus_send(r, format, encoding, ctx->size,
+                                        ctx->out);
+    }
+
+    if (cache->blob) {
+        ngx_http_prometheus_blob_unref(cache->blob);
+    }
+
+    cache->blob = blob;
+    cache->expires = ngx_current_msec + plcf->cache_valid;
+    cache->generation = generation;
+
+send_blob:
+
+    if (ngx_http_prometheus_blob_ref(r, blob) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->pos = blob->data;
+    b->last = blob->data + blob->len;
+    b->memory = 1;
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_prometheus_send(r, format, encoding, blob->len, &out);
+}
+
+
+/*
+ * picks the entry of names, an array of n ngx_str_t placed size bytes apart,
+ * with the highest quality value in the header; entries not set in allowed
+ * are ignored, and the first entry is the default
+ */
+
+static ngx_uint_t
+ngx_http_prometheus_negotiate(ngx_http_request_t *r, ngx_str_t *header,
+    ngx_str_t *names, size_t size, ngx_uint_t n, ngx_uint_t allowed)
+{
+    u_char           *p, *last, *start, *end;
+    ngx_int_t         q, best_q;
+    ngx_str_t        *name;
+    ngx_uint_t        i, k, best;
+    ngx_table_elt_t  *h;
+
+    if ((allowed & ~1) == 0) {
+        return 0;
+    }
+
+    h = ngx_http_prometheus_header(r, header);
+    if (h == NULL) {
+        return 0;
+    }
+
+    best = 0;
+    best_q = 0;
+
+    p = h->value.data;
+    last = p + h->value.len;
+
+    while (p < last) {
+
+        while (p < last && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+
+        start = p;
+
+        while (p < last && *p != ',' && *p != ';'
+               && *p != ' ' && *p != '\t')
+        {
+            p++;
+        }
+
+        end = p;
+
+        /* the quality value, in thousandths */
+
+        q = 1000;
+
+        while (p < last && *p != ',') {
+
+            if (*p == 'q' && p + 1 < last && p[1] == '=') {
+                p += 2;
+                q = 0;
+
+                if (p < last && *p == '1') {
+                    q = 1000;
+
+                } else if (p + 1 < last && *p == '0' && p[1] == '.') {
+                    p += 2;
+
+                    for (k = 100; k && p < last && *p >= '0' && *p <= '9';
+                         k /= 10)
+                    {
+                        q += (*p++ - '0') * k;
+                    }
+                }
+
+                continue;
+            }
+
+            p++;
+        }
+
+        for (i = 0; i < n; i++) {
+            name = (ngx_str_t *) ((u_char *) names + i * size);
+
+            if ((size_t) (end - start) == name->len
+                && ngx_strncasecmp(start, name->data, name->len) == 0)
+            {
+                break;
+            }
+        }
+
+        if (i == n || !(allowed & (1 << i))) {
+            continue;
+        }
+
+        /* on equal quality, prefer the later, more efficient entry */
+
+        if (q > best_q || (q == best_q && q > 0 && i > best)) {
+            best = i;
+            best_q = q;
+        }
+    }
+
+    return best;
+}
+
+
+static ngx_table_elt_t *
+ngx_http_prometheus_header(ngx_http_request_t *r, ngx_str_t *name)
+{
+    ngx_uint_t        i;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *h;
+
+    part = &r->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (h[i].hash == 0) {
+            continue;
+        }
+
+        if (h[i].key.len == name->len
+            && ngx_strncasecmp(h[i].key.data, name->data, name->len) == 0)
+        {
+            return &h[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * collects the "name[]" arguments of the request, as sent by federating
+ * Prometheus servers, into metric name filters; a trailing "*" selects
+ * every metric name starting with the value
+ */
+
+static ngx_int_t
+ngx_http_prometheus_filters(ngx_http_request_t *r, ngx_array_t **filters)
+{
+    u_char                     *p, *last, *start, *end, *dst, *src;
+    size_t                      len;
+    ngx_uint_t                  i;
+    prom_metric_name_filter_t  *filter;
+
+    static ngx_str_t  keys[] = {
+        ngx_string("name[]"),
+        ngx_string("name%5B%5D"),
+        ngx_string("name")
+    };
+
+    *filters = NULL;
+
+    p = r->args.data;
+    last = p + r->args.len;
+
+    while (p < last) {
+
+        start = p;
+
+        p = ngx_strlchr(p, last, '&');
+        if (p == NULL) {
+            p = last;
+        }
+
+        end = p++;
+
+        for (i = 0; i < sizeof(keys) / sizeof(ngx_str_t); i++) {
+            len = keys[i].len;
+
+            if ((size_t) (end - start) > len
+                && start[len] == '='
+                && ngx_strncasecmp(start, keys[i].data, len) == 0)
+            {
+                break;
+            }
+        }
+
+        if (i == sizeof(keys) / sizeof(ngx_str_t)) {
+            continue;
+        }
+
+        src = start + keys[i].len + 1;
+        len = end - src;
+
+        if (len == 0) {
+            continue;
+        }
+
+        dst = ngx_pnalloc(r->pool, len);
+        if (dst == NULL) {
+            return NGX_ERROR;
+        }
+
+        start = dst;
+        ngx_unescape_uri(&dst, &src, len, NGX_UNESCAPE_URI);
+        len = dst - start;
+
+        if (*filters == NULL) {
+            *filters = ngx_array_create(r->pool, 4,
+                                        sizeof(prom_metric_name_filter_t));
+            if (*filters == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        filter = ngx_array_push(*filters);
+        if (filter == NULL) {
+            return NGX_ERROR;
+        }
+
+        filter->name = (const char *) start;
+        filter->len = len;
+        filter->prefix = 0;
+
+        if (len && start[len - 1] == '*') {
+            filter->len--;
+            filter->prefix = 1;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * the entity tag identifies the zone, the registry generation and the
+ * representation, that is the format, the encoding and the name filters
+ */
+
+static ngx_int_t
+ngx_http_prometheus_etag(ngx_http_request_t *r,
+    prom_collector_registry_t *registry, ngx_atomic_uint_t generation,
+    ngx_uint_t format, ngx_uint_t encoding, ngx_array_t *filters)
+{
+    u_char           *p;
+    size_t            len;
+    ngx_table_elt_t  *etag;
+
+    len = sizeof("\"--\"") - 1 + NGX_TIME_T_LEN + NGX_ATOMIC_T_LEN
+          + 2 * NGX_INT_T_LEN + sizeof("-") - 1 + 8;
+
+    p = ngx_pnalloc(r->pool, len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    etag = ngx_list_push(&r->headers_out.headers);
+    if (etag == NULL) {
+        return NGX_ERROR;
+    }
+
+    etag->hash = 1;
+    etag->next = NULL;
+    ngx_str_set(&etag->key, "ETag");
+    etag->value.data = p;
+
+    p = ngx_sprintf(p, "\"%xT-%xA-%ui%ui", registry->created, generation,
+                    format, encoding);
+
+    if (filters) {
+        p = ngx_sprintf(p, "-%08xD",
+                        ngx_crc32_short(r->args.data, r->args.len));
+    }
+
+    *p++ = '"';
+
+    etag->value.len = p - etag->value.data;
+    r->headers_out.etag = etag;
+
+    return NGX_OK;
+}
+
+
+/*
+ * tests If-None-Match against the entity tag, ignoring weak validators
+ * as a GET request does
+ */
+
+static ngx_uint_t
+ngx_http_prometheus_not_modified(ngx_http_request_t *r)
+{
+    u_char     *start, *end, *etag, *p;
+    size_t      len;
+    ngx_str_t  *value;
+
+    if (r->headers_in.if_none_match == NULL
+        || r->headers_out.etag == NULL)
+    {
+        return 0;
+    }
+
+    value = &r->headers_in.if_none_match->value;
+
+    if (value->len == 1 && value->data[0] == '*') {
+        return 1;
+    }
+
+    etag = r->headers_out.etag->value.data;
+    len = r->headers_out.etag->value.len;
+
+    start = value->data;
+    end = value->data + value->len;
+
+    while (start < end) {
+
+        while (start < end && (*start == ' ' || *start == ',')) {
+            start++;
+        }
+
+        if (end - start > 2 && start[0] == 'W' && start[1] == '/') {
+            start += 2;
+        }
+
+        p = ngx_strlchr(start, end, ',');
+        if (p == NULL) {
+            p = end;
+        }
+
+        while (p > start && p[-1] == ' ') {
+            p--;
+        }
+
+        if ((size_t) (p - start) == len && ngx_strncmp(start, etag, len) == 0)
+        {
+            return 1;
+        }
+
+        start = ngx_strlchr(start, end, ',');
+        if (start == NULL) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_http_prometheus_render(ngx_http_request_t *r,
+    prom_collector_registry_t *registry, ngx_http_prometheus_loc_conf_t *plcf,
+    ngx_uint_t format, ngx_uint_t encoding, ngx_array_t *filters,
+    ngx_http_prometheus_render_t *ctx)
+{
+    int                  rc;
+    ngx_pool_cleanup_t  *cln;
+
+    ctx->request = r;
+    ctx->encoding = encoding;
+    ctx->last = &ctx->out;
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cln->handler = ngx_http_prometheus_render_cleanup;
+    cln->data = ctx;
+
+    switch (encoding) {
+
+    case NGX_HTTP_PROMETHEUS_GZIP:
+
+        /* windowBits + 16 makes zlib emit the gzip header and trailer */
+
+        if (deflateInit2(&ctx->zstream, (int) plcf->gzip_level, Z_DEFLATED,
+                         MAX_WBITS + 16, MAX_MEM_LEVEL - 1,
+                         Z_DEFAULT_STRATEGY)
+            != Z_OK)
+        {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                          "deflateInit2() failed");
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ctx->zstream_init = 1;
+        break;
+
+#if (NGX_HAVE_ZSTD)
+
+    case NGX_HTTP_PROMETHEUS_ZSTD:
+
+        ctx->zstd = ZSTD_createCCtx();
+        if (ctx->zstd == NULL) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                          "ZSTD_createCCtx() failed");
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ZSTD_CCtx_setParameter(ctx->zstd, ZSTD_c_compressionLevel,
+                               (int) plcf->zstd_level);
+        break;
+
+#endif
+
+    default:
+        break;
+    }
+
+    rc = prom_collector_registry_render(registry,
+                                        ngx_http_prometheus_formats[format]
+                                            .format,
+                                        filters ? filters->elts : NULL,
+                                        filters ? filters->nelts : 0,
+                                        ngx_http_prometheus_write, ctx);
+    if (rc) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "prometheus: rendering metrics failed");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    switch (encoding) {
+
+    case NGX_HTTP_PROMETHEUS_GZIP:
+        rc = ngx_http_prometheus_deflate(ctx, NULL, 0, 1);
+        break;
+
+#if (NGX_HAVE_ZSTD)
+    case NGX_HTTP_PROMETHEUS_ZSTD:
+        rc = ngx_http_prometheus_zstd(ctx, NULL, 0, 1);
+        break;
+#endif
+
+    default:
+        rc = NGX_OK;
+        break;
+    }
+
+    /* release the compressor state now rather than with the request pool */
+
+    ngx_http_prometheus_render_cleanup(ctx);
+
+    if (rc != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (ctx->buf == NULL) {
+        if (ngx_http_prometheus_buf(ctx) == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    ctx->buf->last_buf = (r == r->main) ? 1 : 0;
+    ctx->buf->last_in_chain = 1;
+
+    return NGX_OK;
+}
+
+
+static int
+ngx_http_prometheus_write(void *data, const char *buf, size_t len)
+{
+    ngx_http_prometheus_render_t  *ctx = data;
+
+    ngx_int_t  rc;
+
+    switch (ctx->encoding) {
+
+    case NGX_HTTP_PROMETHEUS_GZIP:
+        rc = ngx_http_prometheus_deflate(ctx, (u_char *) buf, len, 0);
+        break;
+
+#if (NGX_HAVE_ZSTD)
+    case NGX_HTTP_PROMETHEUS_ZSTD:
+        rc = ngx_http_prometheus_zstd(ctx, (u_char *) buf, len, 0);
+        break;
+#endif
+
+    default:
+        rc = ngx_http_prometheus_copy(ctx, (u_char *) buf, len);
+        break;
+    }
+
+    return (rc == NGX_OK) ? 0 : 1;
+}
+
+
+static ngx_int_t
+ngx_http_prometheus_deflate(ngx_http_prometheus_render_t *ctx, u_char *buf,
+    size_t len, ngx_uint_t last)
+{
+    int         rc, flush;
+    ngx_buf_t  *b;
+
+    ctx->zstream.next_in = buf;
+    ctx->zstream.avail_in = len;
+
+    flush = last ? Z_FINISH : Z_NO_FLUSH;
+
+    for ( ;; ) {
+
+        b = ctx->buf;
+
+        if (b == NULL || b->last == b->end) {
+            b = ngx_http_prometheus_buf(ctx);
+            if (b == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        ctx->zstream.next_out = b->last;
+        ctx->zstream.avail_out = b->end - b->last;
+
+        rc = deflate(&ctx->zstream, flush);
+
+        if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, ctx->request->connection->log, 0,
+                          "deflate() failed: %d, %d", flush, rc);
+            return NGX_ERROR;
+        }
+
+        ctx->size += ctx->zstream.next_out - b->last;
+        b->last = ctx->zstream.next_out;
+
+        if (last) {
+            if (rc == Z_STREAM_END) {
+                return NGX_OK;
+            }
+
+            continue;
+        }
+
+        if (ctx->zstream.avail_in == 0 && ctx->zstream.avail_out != 0) {
+            return NGX_OK;
+        }
+    }
+}
+
+
+#if (NGX_HAVE_ZSTD)
+
+static ngx_int_t
+ngx_http_prometheus_zstd(ngx_http_prometheus_render_t *ctx, u_char *buf,
+    size_t len, ngx_uint_t last)
+{
+    size_t           rc;
+    ngx_buf_t       *b;
+    ZSTD_inBuffer    in;
+    ZSTD_outBuffer   out;
+
+    in.src = buf;
+    in.size = len;
+    in.pos = 0;
+
+    for ( ;; ) {
+
+        b = ctx->buf;
+
+        if (b == NULL || b->last == b->end) {
+            b = ngx_http_prometheus_buf(ctx);
+            if (b == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        out.dst = b->last;
+        out.size = b->end - b->last;
+        out.pos = 0;
+
+        rc = ZSTD_compressStream2(ctx->zstd, &out, &in,
+                                  last ? ZSTD_e_end : ZSTD_e_continue);
+
+        if (ZSTD_isError(rc)) {
+            ngx_log_error(NGX_LOG_ALERT, ctx->request->connection->log, 0,
+                          "ZSTD_compressStream2() failed: %s",
+                          ZSTD_getErrorName(rc));
+            return NGX_ERROR;
+        }
+
+        ctx->size += out.pos;
+        b->last += out.pos;
+
+        if (last) {
+            if (rc == 0) {
+                return NGX_OK;
+            }
+
+            continue;
+        }
+
+        if (in.pos == in.size && out.pos < out.size) {
+            return NGX_OK;
+        }
+    }
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_prometheus_copy(ngx_http_prometheus_render_t *ctx, u_char *buf,
+    size_t len)
+{
+    size_t      n;
+    ngx_buf_t  *b;
+
+    while (len) {
+
+        b = ctx->buf;
+
+        if (b == NULL || b->last == b->end) {
+            b = ngx_http_prometheus_buf(ctx);
+            if (b == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        n = ngx_min((size_t) (b->end - b->last), len);
+
+        b->last = ngx_cpymem(b->last, buf, n);
+
+        buf += n;
+        len -= n;
+        ctx->size += n;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_buf_t *
+ngx_http_prometheus_buf(ngx_http_prometheus_render_t *ctx)
+{
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    b = ngx_create_temp_buf(ctx->request->pool, NGX_HTTP_PROMETHEUS_BUF_SIZE);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    cl = ngx_alloc_chain_link(ctx->request->pool);
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    *ctx->last = cl;
+    ctx->last = &cl->next;
+    ctx->buf = b;
+
+    return b;
+}
+
+
+static void
+ngx_http_prometheus_render_cleanup(void *data)
+{
+    ngx_http_prometheus_render_t  *ctx = data;
+
+    if (ctx->zstream_init) {
+        deflateEnd(&ctx->zstream);
+        ctx->zstream_init = 0;
+    }
+
+#if (NGX_HAVE_ZSTD)
+    if (ctx->zstd) {
+        ZSTD_freeCCtx(ctx->zstd);
+        ctx->zstd = NULL;
+    }
+#endif
+}
+
+
+static ngx_http_prometheus_blob_t *
+ngx_http_prometheus_blob(ngx_http_prometheus_render_t *ctx)
+{
+    u_char                      *p;
+    ngx_chain_t                 *cl;
+    ngx_http_prometheus_blob_t  *blob;
+
+    blob = ngx_alloc(sizeof(ngx_http_prometheus_blob_t) + (size_t) ctx->size,
+                     ctx->request->connection->log);
+    if (blob == NULL) {
+        return NULL;
+    }
+
+    blob->refs = 1;
+    blob->len = (size_t) ctx->size;
+    blob->data = (u_char *) blob + sizeof(ngx_http_prometheus_blob_t);
+
+    p = blob->data;
+
+    for (cl = ctx->out; cl; cl = cl->next) {
+        p = ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+    }
+
+    return blob;
+}
+
+
+static ngx_int_t
+ngx_http_prometheus_blob_ref(ngx_http_request_t *r,
+    ngx_http_prometheus_blob_t *blob)
+{
+    ngx_pool_cleanup_t  *cln;
+
+    /* a cached body may be replaced while a slow client is still reading it */
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_prometheus_blob_unref;
+    cln->data = blob;
+
+    blob->refs++;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_prometheus_blob_unref(void *data)
+{
+    ngx_http_prometheus_blob_t  *blob = data;
+
+    if (--blob->refs == 0) {
+        ngx_free(blob);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_prometheus_send(ngx_http_request_t *r, ngx_uint_t format,
+    ngx_uint_t encoding, off_t size, ngx_chain_t *out)
+{
+    ngx_int_t                      rc;
+    ngx_table_elt_t               *h;
+    ngx_http_prometheus_format_t  *fmt;
+
+    if (out == NULL) {
+        r->headers_out.status = NGX_HTTP_NOT_MODIFIED;
+        r->header_only = 1;
+
+    } else {
+        r->headers_out.status = NGX_HTTP_OK;
+        r->headers_out.content_length_n = size;
+    }
+
+    fmt = &ngx_http_prometheus_formats[format];
+
+    r->headers_out.content_type = fmt->content_type;
+    r->headers_out.content_type_len = fmt->name.len;
+    r->headers_out.content_type_lowcase = NULL;
+
+    if (encoding != NGX_HTTP_PROMETHEUS_IDENTITY) {
+        h = ngx_list_push(&r->headers_out.headers);
+        if (h == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        h->hash = 1;
+        h->next = NULL;
+        ngx_str_set(&h->key, "Content-Encoding");
+        h->value = ngx_http_prometheus_encoding_names[encoding];
+        r->headers_out.content_encoding = h;
+    }
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    h->hash = 1;
+    h->next = NULL;
+    ngx_str_set(&h->key, "Vary");
+    ngx_str_set(&h->value, "Accept, Accept-Encoding");
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, out);
+}
+
+
+/* updates the metrics selected by prometheus_observe once per request */
+
+static ngx_int_t
+ngx_http_prometheus_log_handler(ngx_http_request_t *r)
+{
+    double                            number;
+    ngx_int_t                         rc;
+    ngx_str_t                         value, trace_id, *labels;
+    ngx_uint_t                        i;
+    ngx_http_prometheus_observe_t    *ob;
+    ngx_http_prometheus_loc_conf_t   *plcf;
+    ngx_http_prometheus_main_conf_t  *pmcf;
+
+    pmcf = ngx_http_get_module_main_conf(r, ngx_http_prometheus_module);
+
+    if (pmcf->upstream_metrics && r->upstream_states && r->upstream) {
+        ngx_http_prometheus_log_upstream(r, pmcf);
+    }
+
+    plcf = ngx_http_get_module_loc_conf(r, ngx_http_prometheus_module);
+
+    if (plcf->observe == NULL) {
+        return NGX_OK;
+    }
+
+    ob = plcf->observe->elts;
+
+    for (i = 0; i < plcf->observe->nelts; i++) {
+
+        /* an observation left out of the sample evaluates nothing */
+
+        if (ob[i].sampled
+            && ngx_prometheus_sample((ngx_cycle_t *) ngx_cycle, ob[i].index)
+               != NGX_OK)
+        {
+            continue;
+        }
+
+        number = 0;
+
+        if (ob[i].distinct) {
+            if (ngx_http_complex_value(r, &ob[i].value, &value) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+        } else if (ob[i].constant) {
+            number = ob[i].number;
+
+        } else {
+            if (ngx_http_complex_value(r, &ob[i].value, &value) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            /* e.g. "-" for a variable that is not set */
+
+            if (ngx_prometheus_parse_double(value.data, value.len, &number)
+                != NGX_OK)
+            {
+                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                               "prometheus: skipped value \"%V\"", &value);
+                continue;
+            }
+        }
+
+        if (ngx_http_prometheus_label_values(r, ob[i].nlabels, ob[i].labels,
+                                             &labels)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        trace_id.len = 0;
+
+        if (ob[i].exemplar
+            && ngx_http_complex_value(r, ob[i].exemplar, &trace_id) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        if (ob[i].distinct) {
+            rc = ngx_prometheus_count_distinct((ngx_cycle_t *) ngx_cycle,
+                                               ob[i].index, &value, labels,
+                                               r->pool);
+
+        } else {
+            rc = ngx_prometheus_observe_exemplar((ngx_cycle_t *) ngx_cycle,
+                                                 ob[i].index, number, labels,
+                                                 &trace_id, r->pool);
+        }
+
+        if (rc == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "prometheus: could not update metric");
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_prometheus_label_values(ngx_http_request_t *r, ngx_uint_t nlabels,
+    ngx_http_complex_value_t *cv, ngx_str_t **labels)
+{
+    ngx_uint_t   i;
+    ngx_str_t   *values;
+
+    *labels = NULL;
+
+    if (nlabels == 0) {
+        return NGX_OK;
+    }
+
+    values = ngx_palloc(r->pool, nlabels * sizeof(ngx_str_t));
+    if (values == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < nlabels; i++) {
+        if (ngx_http_complex_value(r, &cv[i], &values[i]) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    *labels = values;
+
+    return NGX_OK;
+}
+
+
+/*
+ * increments the gauges selected by prometheus_inflight in the shard of
+ * the worker; the series come from the cache of the worker and are kept in
+ * the request pool cleanup, which decrements them however the request
+ * ends, aborted requests included
+ */
+
+static ngx_int_t
+ngx_http_prometheus_inflight_handler(ngx_http_request_t *r)
+{
+    void                            *series;
+    ngx_str_t                       *labels;
+    ngx_uint_t                       i;
+    ngx_pool_cleanup_t              *cln;
+    ngx_prometheus_ctx_t            *ctx;
+    ngx_http_prometheus_inflight_t  *inf;
+    ngx_http_prometheus_loc_conf_t  *plcf;
+
+    if (r != r->main) {
+        return NGX_DECLINED;
+    }
+
+    plcf = ngx_http_get_module_loc_conf(r, ngx_http_prometheus_module);
+
+    if (plcf->inflight == NULL) {
+        return NGX_DECLINED;
+    }
+
+    ctx = ngx_prometheus_ctx((ngx_cycle_t *) ngx_cycle);
+    if (ctx == NULL) {
+        return NGX_DECLINED;
+    }
+
+    /* counted once, internal redirects run the phase again */
+
+    for (cln = r->pool->cleanup; cln; cln = cln->next) {
+        if (cln->handler == ngx_http_prometheus_inflight_cleanup) {
+            return NGX_DECLINED;
+        }
+    }
+
+    inf = plcf->inflight->elts;
+
+    for (i = 0; i < plcf->inflight->nelts; i++) {
+
+        if (ngx_http_prometheus_label_values(r, inf[i].nlabels, inf[i].labels,
+                                             &labels)
+            != NGX_OK)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        series = ngx_prometheus_series(ctx, inf[i].index, labels, r->pool);
+        if (series == NULL) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "prometheus: could not update metric");
+            continue;
+        }
+
+        /*
+         * the decrement is in place before the increment, a gauge is never
+         * left raised by a request that could not register its cleanup
+         */
+
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        cln->handler = ngx_http_prometheus_inflight_cleanup;
+        cln->data = series;
+
+        if (prom_metric_sample_add(series, 1) != 0) {
+            cln->handler = NULL;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+
+static void
+ngx_http_prometheus_inflight_cleanup(void *data)
+{
+    (void) prom_metric_sample_sub(data, 1);
+}
+
+
+/*
+ * peers of the upstream blocks are found in the series created with the
+ * configuration; other peers, e.g. those resolved at run time, go through
+ * the generic lookup
+ */
+
+static void
+ngx_http_prometheus_log_upstream(ngx_http_request_t *r,
+    ngx_http_prometheus_main_conf_t *pmcf)
+{
+    ngx_str_t                        labels[3];
+    ngx_msec_t                       ms[NGX_HTTP_PROMETHEUS_TIMES];
+    ngx_uint_t                       i, j, k, status;
+    ngx_http_upstream_state_t       *state;
+    ngx_http_prometheus_peer_t      *peer;
+    ngx_http_upstream_srv_conf_t    *uscf;
+    ngx_http_prometheus_upstream_t  *u, *upstream;
+
+    uscf = r->upstream->upstream;
+    upstream = NULL;
+
+    u = pmcf->upstreams.elts;
+
+    for (i = 0; i < pmcf->upstreams.nelts; i++) {
+        if (u[i].upstream == uscf) {
+            upstream = &u[i];
+            break;
+        }
+    }
+
+    if (uscf) {
+        labels[0] = uscf->host;
+
+    } else if (r->upstream->resolved) {
+        labels[0] = r->upstream->resolved->host;
+
+    } else {
+        ngx_str_null(&labels[0]);
+    }
+
+    state = r->upstream_states->elts;
+
+    for (i = 0; i < r->upstream_states->nelts; i++) {
+
+        /* separates the upstreams of internal redirects */
+
+        if (state[i].peer == NULL) {
+            continue;
+        }
+
+        ms[NGX_HTTP_PROMETHEUS_RESPONSE_TIME] = state[i].response_time;
+        ms[NGX_HTTP_PROMETHEUS_CONNECT_TIME] = state[i].connect_time;
+        ms[NGX_HTTP_PROMETHEUS_HEADER_TIME] = state[i].header_time;
+
+        status = (state[i].status >= 100 && state[i].status < 600)
+                 ? state[i].status / 100 - 1 : NGX_HTTP_PROMETHEUS_STATUSES;
+
+        peer = NULL;
+
+        if (upstream) {
+
+            /* round robin peers share the name with the configuration */
+
+            for (j = 0; j < upstream->npeers; j++) {
+                if (upstream->peers[j].name.data == state[i].peer->data) {
+                    peer = &upstream->peers[j];
+                    break;
+                }
+            }
+
+            for (j = 0; peer == NULL && j < upstream->npeers; j++) {
+                if (upstream->peers[j].name.len == state[i].peer->len
+                    && ngx_strncmp(upstream->peers[j].name.data,
+                                   state[i].peer->data, state[i].peer->len)
+                       == 0)
+                {
+                    peer = &upstream->peers[j];
+                }
+            }
+        }
+
+        if (peer) {
+            for (k = 0; k < NGX_HTTP_PROMETHEUS_TIMES; k++) {
+                if (ms[k] != (ngx_msec_t) -1) {
+                    (void) prom_metric_sample_histogram_observe(peer->times[k],
+                                                      (double) ms[k] / 1000);
+                }
+            }
+
+            if (status < NGX_HTTP_PROMETHEUS_STATUSES) {
+                (void) prom_metric_sample_add(peer->responses[status], 1);
+            }
+
+            continue;
+        }
+
+        labels[1] = *state[i].peer;
+
+        for (k = 0; k < NGX_HTTP_PROMETHEUS_TIMES; k++) {
+            if (ms[k] != (ngx_msec_t) -1) {
+                (void) ngx_prometheus_observe((ngx_cycle_t *) ngx_cycle,
+                                              pmcf->metrics[k],
+                                              (double) ms[k] / 1000,
+                                              labels, r->pool);
+            }
+        }
+
+        if (status < NGX_HTTP_PROMETHEUS_STATUSES) {
+            labels[2] = ngx_http_prometheus_status_classes[status];
+
+            (void) ngx_prometheus_observe((ngx_cycle_t *) ngx_cycle,
+                            pmcf->metrics[NGX_HTTP_PROMETHEUS_RESPONSES], 1,
+                            labels, r->pool);
+        }
+    }
+}
+
+
+static void *
+ngx_http_prometheus_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_prometheus_main_conf_t  *pmcf;
+
+    pmcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_prometheus_main_conf_t));
+    if (pmcf == NULL) {
+        return NULL;
+    }
+
+    pmcf->upstream_metrics = NGX_CONF_UNSET;
+
+    return pmcf;
+}
+
+
+static char *
+ngx_http_prometheus_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_http_prometheus_main_conf_t *pmcf = conf;
+
+    ngx_conf_init_value(pmcf->upstream_metrics, 0);
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_http_prometheus_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_prometheus_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_prometheus_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->cache = NULL;
+     */
+
+    conf->observe = NGX_CONF_UNSET_PTR;
+    conf->inflight = NGX_CONF_UNSET_PTR;
+    conf->encodings = NGX_CONF_UNSET_UINT;
+    conf->gzip_level = NGX_CONF_UNSET;
+#if (NGX_HAVE_ZSTD)
+    conf->zstd_level = NGX_CONF_UNSET;
+#endif
+    conf->cache_valid = NGX_CONF_UNSET_MSEC;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_prometheus_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_prometheus_loc_conf_t *prev = parent;
+    ngx_http_prometheus_loc_conf_t *conf = child;
+
+    ngx_conf_merge_ptr_value(conf->observe, prev->observe, NULL);
+    ngx_conf_merge_ptr_value(conf->inflight, prev->inflight, NULL);
+
+    ngx_conf_merge_uint_value(conf->encodings, prev->encodings,
+                              (1 << NGX_HTTP_PROMETHEUS_GZIP)
+#if (NGX_HAVE_ZSTD)
+                              |(1 << NGX_HTTP_PROMETHEUS_ZSTD)
+#endif
+                              );
+
+    ngx_conf_merge_value(conf->gzip_level, prev->gzip_level, 1);
+#if (NGX_HAVE_ZSTD)
+    ngx_conf_merge_value(conf->zstd_level, prev->zstd_level, 3);
+#endif
+    ngx_conf_merge_msec_value(conf->cache_valid, prev->cache_valid, 0);
+
+    if (conf->cache_valid && conf->cache == NULL) {
+        conf->cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_prometheus_cache_t)
+                                            * NGX_HTTP_PROMETHEUS_FORMATS
+                                            * NGX_HTTP_PROMETHEUS_ENCODINGS);
+        if (conf->cache == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_prometheus(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_prometheus_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_prometheus_compression(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_prometheus_loc_conf_t *plcf = conf;
+
+    ngx_str_t   *value;
+    ngx_uint_t   i, n;
+
+    if (plcf->encodings != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    plcf->encodings = 0;
+
+    if (cf->args->nelts == 2 && ngx_strcmp(value[1].data, "off") == 0) {
+        return NGX_CONF_OK;
+    }
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        for (n = NGX_HTTP_PROMETHEUS_GZIP; n < NGX_HTTP_PROMETHEUS_ENCODINGS;
+             n++)
+        {
+            if (value[i].len == ngx_http_prometheus_encoding_names[n].len
+                && ngx_strcmp(value[i].data,
+                              ngx_http_prometheus_encoding_names[n].data)
+                   == 0)
+            {
+                break;
+            }
+        }
+
+        if (n == NGX_HTTP_PROMETHEUS_ENCODINGS) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid compression \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+#if !(NGX_HAVE_ZSTD)
+        if (n == NGX_HTTP_PROMETHEUS_ZSTD) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "zstd compression requires nginx built "
+                               "with libzstd");
+            return NGX_CONF_ERROR;
+        }
+#endif
+
+        plcf->encodings |= 1 << n;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * prometheus_observe metric value [label=value ...] [exemplar=trace-id];
+ *
+ * label values are compiled once and evaluated into the request pool;
+ * the trace id, e.g. $opentelemetry_trace_id, is kept as the exemplar of
+ * a metric declared with "exemplars"; the value of a prometheus_distinct
+ * metric is the key counted, e.g. $remote_addr
+ */
+
+static char *
+ngx_http_prometheus_observe(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_prometheus_loc_conf_t *plcf = conf;
+
+    ngx_str_t                         *value, v;
+    ngx_int_t                          index;
+    ngx_uint_t                         last;
+    ngx_prometheus_metric_conf_t      *mcf;
+    ngx_http_prometheus_observe_t     *ob;
+    ngx_http_compile_complex_value_t   ccv;
+
+    value = cf->args->elts;
+    last = cf->args->nelts;
+
+    index = ngx_prometheus_metric_index(cf, &value[1]);
+
+    if (index == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "unknown metric \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    mcf = ngx_prometheus_metric_conf(cf, index);
+
+    /* shards are only ever incremented and decremented */
+
+    if (mcf->inflight) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "metric \"%V\" is updated by "
+                           "\"prometheus_inflight\" only", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (plcf->observe == NGX_CONF_UNSET_PTR) {
+        plcf->observe = ngx_array_create(cf->pool, 4,
+                                         sizeof(ngx_http_prometheus_observe_t));
+        if (plcf->observe == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    ob = ngx_array_push(plcf->observe);
+    if (ob == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(ob, sizeof(ngx_http_prometheus_observe_t));
+
+    ob->index = index;
+
+    /* the log handler draws before it evaluates anything */
+
+    if (mcf->sampling > 1) {
+        ob->sampled = 1;
+    }
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = &value[2];
+    ccv.complex_value = &ob->value;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (mcf->hll_precision) {
+        ob->distinct = 1;
+
+    } else if (ob->value.lengths == NULL) {
+        if (ngx_prometheus_parse_double(value[2].data, value[2].len,
+                                        &ob->number)
+            != NGX_OK)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid value \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        ob->constant = 1;
+    }
+
+    /* a label of the metric may be named "exemplar" as well */
+
+    if (mcf->exemplars && last > 3
+        && ngx_strncmp(value[last - 1].data, "exemplar=", 9) == 0)
+    {
+        last--;
+
+        v.data = value[last].data + 9;
+        v.len = value[last].len - 9;
+
+        ob->exemplar = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+        if (ob->exemplar == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+        ccv.cf = cf;
+        ccv.value = &v;
+        ccv.complex_value = ob->exemplar;
+
+        if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    ob->nlabels = mcf->labels.nelts;
+
+    return ngx_http_prometheus_labels(cf, mcf, 3, last, &ob->labels);
+}
+
+
+/*
+ * prometheus_inflight metric [label=value ...];
+ */
+
+static char *
+ngx_http_prometheus_inflight(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_prometheus_loc_conf_t *plcf = conf;
+
+    ngx_str_t                       *value;
+    ngx_int_t                        index;
+    ngx_prometheus_metric_conf_t    *mcf;
+    ngx_http_prometheus_inflight_t  *inf;
+
+    value = cf->args->elts;
+
+    index = ngx_prometheus_metric_index(cf, &value[1]);
+
+    if (index == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "unknown metric \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    mcf = ngx_prometheus_metric_conf(cf, index);
+
+    if (!mcf->inflight) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "metric \"%V\" is not declared "
+                           "with \"prometheus_inflight_gauge\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (plcf->inflight == NGX_CONF_UNSET_PTR) {
+        plcf->inflight = ngx_array_create(cf->pool, 2,
+                                      sizeof(ngx_http_prometheus_inflight_t));
+        if (plcf->inflight == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    inf = ngx_array_push(plcf->inflight);
+    if (inf == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(inf, sizeof(ngx_http_prometheus_inflight_t));
+
+    inf->index = index;
+    inf->nlabels = mcf->labels.nelts;
+
+    return ngx_http_prometheus_labels(cf, mcf, 2, cf->args->nelts,
+                                      &inf->labels);
+}
+
+
+/*
+ * compiles the label=value arguments from the first one up to the last one,
+ * exclusive, into complex values in the order of the declaration, see
+ * ngx_prometheus_parse_labels()
+ */
+
+static char *
+ngx_http_prometheus_labels(ngx_conf_t *cf, ngx_prometheus_metric_conf_t *mcf,
+    ngx_uint_t first, ngx_uint_t last, ngx_http_complex_value_t **labels)
+{
+    ngx_str_t                         *values;
+    ngx_uint_t                         n;
+    ngx_http_complex_value_t          *cv;
+    ngx_http_compile_complex_value_t   ccv;
+
+    *labels = NULL;
+
+    if (ngx_prometheus_parse_labels(cf, mcf, first, last, &values)
+        != NGX_CONF_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    if (values == NULL) {
+        return NGX_CONF_OK;
+    }
+
+    cv = ngx_pcalloc(cf->pool,
+                     mcf->labels.nelts * sizeof(ngx_http_complex_value_t));
+    if (cv == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    for (n = 0; n < mcf->labels.nelts; n++) {
+        ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+        ccv.cf = cf;
+        ccv.value = &values[n];
+        ccv.complex_value = &cv[n];
+
+        if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    *labels = cv;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_prometheus_init(ngx_conf_t *cf)
+{
+    ngx_http_handler_pt              *h;
+    ngx_http_core_main_conf_t        *cmcf;
+    ngx_http_prometheus_main_conf_t  *pmcf;
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_prometheus_log_handler;
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_PREACCESS_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_prometheus_inflight_handler;
+
+    pmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_prometheus_module);
+
+    if (pmcf->upstream_metrics) {
+        return ngx_http_prometheus_init_upstreams(cf, pmcf);
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * declares the upstream metrics and lists the peers of all upstream blocks,
+ * which are known by now, so that their series are created with the zone
+ */
+
+static ngx_int_t
+ngx_http_prometheus_init_upstreams(ngx_conf_t *cf,
+    ngx_http_prometheus_main_conf_t *pmcf)
+{
+    char                            **label;
+    ngx_uint_t                        i, j, k, n;
+    ngx_http_upstream_server_t       *server;
+    ngx_http_prometheus_builtin_t    *builtin;
+    ngx_http_prometheus_upstream_t   *u;
+    ngx_prometheus_metric_conf_t     *mcf;
+    ngx_http_upstream_srv_conf_t    **uscfp;
+    ngx_http_upstream_main_conf_t    *umcf;
+
+    builtin = ngx_http_prometheus_upstream_metrics;
+
+    for (i = 0; i <= NGX_HTTP_PROMETHEUS_TIMES; i++) {
+        mcf = ngx_prometheus_add_metric(cf, &builtin[i].name, builtin[i].type);
+        if (mcf == NULL) {
+            return NGX_ERROR;
+        }
+
+        mcf->help.data = (u_char *) builtin[i].help;
+        mcf->help.len = ngx_strlen(builtin[i].help);
+
+        n = (i == NGX_HTTP_PROMETHEUS_RESPONSES) ? 3 : 2;
+
+        label = ngx_array_push_n(&mcf->labels, n);
+        if (label == NULL) {
+            return NGX_ERROR;
+        }
+
+        label[0] = "upstream";
+        label[1] = "peer";
+
+        if (n == 3) {
+            label[2] = "status";
+        }
+
+        pmcf->metrics[i] = ngx_prometheus_metric_index(cf, &builtin[i].name);
+    }
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+    uscfp = umcf->upstreams.elts;
+
+    if (ngx_array_init(&pmcf->upstreams, cf->pool, umcf->upstreams.nelts + 1,
+                       sizeof(ngx_http_prometheus_upstream_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->servers == NULL) {
+            continue;
+        }
+
+        server = uscfp[i]->servers->elts;
+        n = 0;
+
+        for (j = 0; j < uscfp[i]->servers->nelts; j++) {
+            n += server[j].naddrs;
+        }
+
+        if (n == 0) {
+            continue;
+        }
+
+        u = ngx_array_push(&pmcf->upstreams);
+        if (u == NULL) {
+            return NGX_ERROR;
+        }
+
+        u->upstream = uscfp[i];
+        u->npeers = n;
+
+        u->peers = ngx_pcalloc(cf->pool,
+                               n * sizeof(ngx_http_prometheus_peer_t));
+        if (u->peers == NULL) {
+            return NGX_ERROR;
+        }
+
+        n = 0;
+
+        for (j = 0; j < uscfp[i]->servers->nelts; j++) {
+            for (k = 0; k < server[j].naddrs; k++) {
+                u->peers[n++].name = server[j].addrs[k].name;
+            }
+        }
+    }
+
+    return ngx_prometheus_add_init(cf, ngx_http_prometheus_init_peers, pmcf);
+}
+
+
+static ngx_int_t
+ngx_http_prometheus_init_peers(ngx_prometheus_ctx_t *ctx, ngx_pool_t *pool,
+    void *data)
+{
+    ngx_http_prometheus_main_conf_t *pmcf = data;
+
+    ngx_str_t                        labels[3];
+    ngx_uint_t                       i, j, k;
+    ngx_http_prometheus_peer_t      *peer;
+    ngx_http_prometheus_upstream_t  *u;
+
+    u = pmcf->upstreams.elts;
+
+    for (i = 0; i < pmcf->upstreams.nelts; i++) {
+
+        labels[0] = u[i].upstream->host;
+
+        for (j = 0; j < u[i].npeers; j++) {
+            peer = &u[i].peers[j];
+            labels[1] = peer->name;
+
+            for (k = 0; k < NGX_HTTP_PROMETHEUS_TIMES; k++) {
+                peer->times[k] = ngx_prometheus_series(ctx, pmcf->metrics[k],
+                                                       labels, pool);
+                if (peer->times[k] == NULL) {
+                    return NGX_ERROR;
+                }
+            }
+
+            for (k = 0; k < NGX_HTTP_PROMETHEUS_STATUSES; k++) {
+                labels[2] = ngx_http_prometheus_status_classes[k];
+
+                peer->responses[k] = ngx_prometheus_series(ctx,
+                                 pmcf->metrics[NGX_HTTP_PROMETHEUS_RESPONSES],
+                                 labels, pool);
+                if (peer->responses[k] == NULL) {
+                    return NGX_ERROR;
+                }
+            }
+        }
+    }
+
+    return NGX_OK;
+}
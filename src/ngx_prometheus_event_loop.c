@@ -0,0 +1,178 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_prometheus_module.h>
+#include "prom_metric_sample_histogram.h"
+
+
+/*
+ * per-worker histograms of the event loop, see prometheus_event_loop_metrics
+ *
+ * the lag is how late a periodic timer runs past its expiry, that is, how
+ * long the worker was busy with other events and could not run it; it uses
+ * the msec clock
+ *
+ * the iteration time is measured around the process_events action of the
+ * event module, which is asked to post the events it collects: from its
+ * return until the worker waits again, which covers the accepted
+ * connections, the expired timers and the posted events, as with
+ * "accept_mutex"; it is read from the tsc clock of prom_timer.h
+ *
+ * an iteration only costs two clock reads and an integer search of the
+ * bucket, counted in memory of the worker; the counts are added to the
+ * shared histogram on the lag timer
+ */
+
+
+static ngx_int_t ngx_prometheus_event_loop_process_events(ngx_cycle_t *cycle,
+    ngx_msec_t timer, ngx_uint_t flags);
+static void ngx_prometheus_event_loop_tick(ngx_event_t *ev);
+
+
+static ngx_int_t (*ngx_prometheus_event_loop_next)(ngx_cycle_t *cycle,
+    ngx_msec_t timer, ngx_uint_t flags);
+
+static ngx_event_t                      ngx_prometheus_event_loop_event;
+static ngx_msec_t                       ngx_prometheus_event_loop_interval;
+static ngx_msec_t                       ngx_prometheus_event_loop_expiry;
+static uint64_t                         ngx_prometheus_event_loop_woken;
+static uint64_t                        *ngx_prometheus_event_loop_counts;
+static uint64_t                         ngx_prometheus_event_loop_ticks;
+static prom_histogram_buckets_t        *ngx_prometheus_event_loop_buckets;
+static prom_metric_sample_histogram_t  *ngx_prometheus_event_loop_lag;
+static prom_metric_sample_histogram_t  *ngx_prometheus_event_loop_iteration;
+
+
+ngx_int_t
+ngx_prometheus_event_loop_init(ngx_cycle_t *cycle, ngx_prometheus_conf_t *pcf)
+{
+    u_char       buf[NGX_INT_T_LEN];
+    ngx_str_t    worker;
+    ngx_pool_t  *pool;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, cycle->log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    worker.data = buf;
+    worker.len = ngx_sprintf(buf, "%ui", ngx_worker) - buf;
+
+    ngx_prometheus_event_loop_lag = ngx_prometheus_series(pcf->ctx,
+                                                          pcf->loop_lag,
+                                                          &worker, pool);
+
+    ngx_prometheus_event_loop_iteration = ngx_prometheus_series(pcf->ctx,
+                                                      pcf->loop_iteration,
+                                                      &worker, pool);
+
+    ngx_destroy_pool(pool);
+
+    /* the worker keeps serving without the metrics */
+
+    if (ngx_prometheus_event_loop_lag == NULL
+        || ngx_prometheus_event_loop_iteration == NULL)
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, 0,
+                      "prometheus: could not create the event loop series "
+                      "of worker %ui", ngx_worker);
+        return NGX_OK;
+    }
+
+    ngx_prometheus_event_loop_buckets =
+                                  ngx_prometheus_event_loop_iteration->buckets;
+
+    ngx_prometheus_event_loop_counts = ngx_pcalloc(cycle->pool,
+                      (prom_histogram_buckets_count(
+                                          ngx_prometheus_event_loop_buckets)
+                       + 1) * sizeof(uint64_t));
+    if (ngx_prometheus_event_loop_counts == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_prometheus_event_loop_interval = pcf->loop_interval;
+    ngx_prometheus_event_loop_woken = prom_timer_now(PROM_TIMER_TSC);
+
+    ngx_prometheus_event_loop_next = ngx_event_actions.process_events;
+    ngx_event_actions.process_events =
+                                      ngx_prometheus_event_loop_process_events;
+
+    ngx_prometheus_event_loop_event.handler = ngx_prometheus_event_loop_tick;
+    ngx_prometheus_event_loop_event.log = cycle->log;
+    ngx_prometheus_event_loop_event.cancelable = 1;
+
+    ngx_prometheus_event_loop_expiry = ngx_current_msec
+                                       + ngx_prometheus_event_loop_interval;
+
+    ngx_add_timer(&ngx_prometheus_event_loop_event,
+                  ngx_prometheus_event_loop_interval);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_prometheus_event_loop_process_events(ngx_cycle_t *cycle,
+    ngx_msec_t timer, ngx_uint_t flags)
+{
+    uint64_t   now, ticks;
+    ngx_int_t  rc;
+
+    now = prom_timer_now(PROM_TIMER_TSC);
+
+    /* the counters of different cores may be slightly apart */
+
+    ticks = now > ngx_prometheus_event_loop_woken
+            ? now - ngx_prometheus_event_loop_woken : 0;
+
+    ngx_prometheus_event_loop_counts[prom_histogram_buckets_tick_index(
+                             ngx_prometheus_event_loop_buckets, ticks)]++;
+    ngx_prometheus_event_loop_ticks += ticks;
+
+    rc = ngx_prometheus_event_loop_next(cycle, timer,
+                                        flags | NGX_POST_EVENTS);
+
+    ngx_prometheus_event_loop_woken = prom_timer_now(PROM_TIMER_TSC);
+
+    return rc;
+}
+
+
+static void
+ngx_prometheus_event_loop_tick(ngx_event_t *ev)
+{
+    size_t          n;
+    ngx_msec_int_t  lag;
+
+    lag = (ngx_msec_int_t) (ngx_current_msec
+                            - ngx_prometheus_event_loop_expiry);
+
+    (void) prom_metric_sample_histogram_observe_ticks(
+                   ngx_prometheus_event_loop_lag, lag > 0 ? lag : 0);
+
+    n = prom_histogram_buckets_count(ngx_prometheus_event_loop_buckets) + 1;
+
+    (void) prom_metric_sample_histogram_add_counts(
+                   ngx_prometheus_event_loop_iteration,
+                   ngx_prometheus_event_loop_counts,
+                   (double) ngx_prometheus_event_loop_ticks
+                   * ngx_prometheus_event_loop_buckets->tick_seconds);
+
+    ngx_memzero(ngx_prometheus_event_loop_counts, n * sizeof(uint64_t));
+    ngx_prometheus_event_loop_ticks = 0;
+
+    if (ngx_exiting || ngx_terminate || ngx_quit) {
+        return;
+    }
+
+    ngx_prometheus_event_loop_expiry = ngx_current_msec
+                                       + ngx_prometheus_event_loop_interval;
+
+    ngx_add_timer(ev, ngx_prometheus_event_loop_interval);
+}
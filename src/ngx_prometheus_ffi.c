@@ -0,0 +1,282 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_prometheus_module.h>
+#include "prom_metric.h"
+
+
+/*
+ * C ABI for the LuaJIT FFI, see lib/resty/prometheus.lua
+ *
+ * a metric and its label values are resolved once into an opaque handle,
+ * the series itself; updates through the handle are plain calls the JIT
+ * compiles, without string keys or lookups
+ */
+
+
+int ngx_prometheus_ffi_metric(const u_char *name, size_t len);
+int ngx_prometheus_ffi_metric_type(int index);
+int ngx_prometheus_ffi_metric_labels(int index);
+void *ngx_prometheus_ffi_series(int index, ngx_str_t *labels, int nlabels);
+int ngx_prometheus_ffi_inc(void *handle, double value);
+int ngx_prometheus_ffi_dec(void *handle, double value);
+int ngx_prometheus_ffi_set(void *handle, double value);
+int ngx_prometheus_ffi_observe(void *handle, double value);
+int ngx_prometheus_ffi_summarize(void *handle, double value);
+int ngx_prometheus_ffi_inc_exemplar(void *handle, double value,
+    const u_char *trace_id, size_t len);
+int ngx_prometheus_ffi_observe_exemplar(void *handle, double value,
+    const u_char *trace_id, size_t len);
+void *ngx_prometheus_ffi_topk(int index);
+int ngx_prometheus_ffi_topk_add(void *handle, const u_char *key, size_t len,
+    double value);
+int ngx_prometheus_ffi_count_distinct(void *handle, const u_char *key,
+    size_t len);
+void *ngx_prometheus_ffi_window(void *handle, int type);
+
+
+static ngx_prometheus_conf_t *
+ngx_prometheus_ffi_conf(void)
+{
+    ngx_prometheus_conf_t  *pcf;
+
+    pcf = (ngx_prometheus_conf_t *) ngx_get_conf(ngx_cycle->conf_ctx,
+                                                  ngx_prometheus_module);
+
+    if (pcf == NULL || pcf->ctx == NULL) {
+        return NULL;
+    }
+
+    return pcf;
+}
+
+
+/* returns the index of the declared metric, or -1 */
+
+int
+ngx_prometheus_ffi_metric(const u_char *name, size_t len)
+{
+    ngx_uint_t                     i;
+    ngx_prometheus_conf_t         *pcf;
+    ngx_prometheus_metric_conf_t  *mcf;
+
+    pcf = ngx_prometheus_ffi_conf();
+    if (pcf == NULL) {
+        return -1;
+    }
+
+    mcf = pcf->metrics.elts;
+
+    for (i = 0; i < pcf->ctx->nmetrics; i++) {
+        if (mcf[i].name.len == len
+            && ngx_strncmp(mcf[i].name.data, name, len) == 0)
+        {
+            return (int) i;
+        }
+    }
+
+    return -1;
+}
+
+
+int
+ngx_prometheus_ffi_metric_type(int index)
+{
+    prom_metric_t  *metric;
+
+    metric = ngx_prometheus_metric((ngx_cycle_t *) ngx_cycle, index);
+    if (metric == NULL) {
+        return -1;
+    }
+
+    return metric->type;
+}
+
+
+int
+ngx_prometheus_ffi_metric_labels(int index)
+{
+    prom_metric_t  *metric;
+
+    metric = ngx_prometheus_metric((ngx_cycle_t *) ngx_cycle, index);
+    if (metric == NULL) {
+        return -1;
+    }
+
+    return (int) metric->label_key_count;
+}
+
+
+/* the series is created on first use; the handle stays valid for the cycle */
+
+void *
+ngx_prometheus_ffi_series(int index, ngx_str_t *labels, int nlabels)
+{
+    void                   *series;
+    ngx_pool_t             *pool;
+    prom_metric_t          *metric;
+    ngx_prometheus_conf_t  *pcf;
+
+    pcf = ngx_prometheus_ffi_conf();
+    if (pcf == NULL) {
+        return NULL;
+    }
+
+    metric = ngx_prometheus_metric((ngx_cycle_t *) ngx_cycle, index);
+
+    if (metric == NULL || nlabels < 0
+        || (size_t) nlabels != metric->label_key_count)
+    {
+        return NULL;
+    }
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    series = ngx_prometheus_series(pcf->ctx, index, labels, pool);
+
+    ngx_destroy_pool(pool);
+
+    return series;
+}
+
+
+int
+ngx_prometheus_ffi_inc(void *handle, double value)
+{
+    return prom_metric_sample_add(handle, value) ? NGX_ERROR : NGX_OK;
+}
+
+
+int
+ngx_prometheus_ffi_dec(void *handle, double value)
+{
+    return prom_metric_sample_sub(handle, value) ? NGX_ERROR : NGX_OK;
+}
+
+
+int
+ngx_prometheus_ffi_set(void *handle, double value)
+{
+    return prom_metric_sample_set(handle, value) ? NGX_ERROR : NGX_OK;
+}
+
+
+/* an observation of a sampled histogram is drawn before it is recorded */
+
+int
+ngx_prometheus_ffi_observe(void *handle, double value)
+{
+    prom_metric_sample_histogram_t  *h = handle;
+
+    if (!prom_histogram_buckets_sample(h->buckets)) {
+        return NGX_OK;
+    }
+
+    return prom_metric_sample_histogram_observe(h, value)
+           ? NGX_ERROR : NGX_OK;
+}
+
+
+int
+ngx_prometheus_ffi_summarize(void *handle, double value)
+{
+    return prom_metric_sample_summary_observe(handle, value)
+           ? NGX_ERROR : NGX_OK;
+}
+
+
+/* the trace id is kept as an exemplar if the metric is declared with them */
+
+int
+ngx_prometheus_ffi_inc_exemplar(void *handle, double value,
+    const u_char *trace_id, size_t len)
+{
+    ngx_str_t  id;
+
+    id.data = (u_char *) trace_id;
+    id.len = len;
+
+    return ngx_prometheus_update_exemplar(PROM_COUNTER, handle, value, &id);
+}
+
+
+int
+ngx_prometheus_ffi_observe_exemplar(void *handle, double value,
+    const u_char *trace_id, size_t len)
+{
+    ngx_str_t                        id;
+    prom_metric_sample_histogram_t  *h = handle;
+
+    if (!prom_histogram_buckets_sample(h->buckets)) {
+        return NGX_OK;
+    }
+
+    id.data = (u_char *) trace_id;
+    id.len = len;
+
+    return ngx_prometheus_update_exemplar(PROM_HISTOGRAM, handle, value, &id);
+}
+
+
+/* the sketch of a top-K metric, whose keys are not series */
+
+void *
+ngx_prometheus_ffi_topk(int index)
+{
+    prom_metric_t  *metric;
+
+    metric = ngx_prometheus_metric((ngx_cycle_t *) ngx_cycle, index);
+    if (metric == NULL) {
+        return NULL;
+    }
+
+    return metric->topk;
+}
+
+
+int
+ngx_prometheus_ffi_topk_add(void *handle, const u_char *key, size_t len,
+    double value)
+{
+    return prom_topk_add(handle, (const char *) key, len, value)
+           ? NGX_ERROR : NGX_OK;
+}
+
+
+/*
+ * the window of a counter or histogram series, read directly with
+ * prom_window_rate() and prom_window_quantile()
+ */
+
+void *
+ngx_prometheus_ffi_window(void *handle, int type)
+{
+    if (type == PROM_COUNTER) {
+        return ((prom_metric_sample_t *) handle)->window;
+    }
+
+    if (type == PROM_HISTOGRAM) {
+        return ((prom_metric_sample_histogram_t *) handle)->window;
+    }
+
+    return NULL;
+}
+
+
+/* the series of a distinct count is a gauge estimated from its sketch */
+
+int
+ngx_prometheus_ffi_count_distinct(void *handle, const u_char *key,
+    size_t len)
+{
+    prom_metric_sample_t  *series = handle;
+
+    if (series->hll == NULL) {
+        return NGX_ERROR;
+    }
+
+    return prom_hll_add(series->hll, (const char *) key, len)
+           ? NGX_ERROR : NGX_OK;
+}
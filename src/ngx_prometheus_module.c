@@ -1,14 +1,183 @@
 #include <ngx_prometheus_module.h>
+#include <ngx_event.h>
+#include <math.h>
 #include "prom_metric.h"
 
 #define ngx_prometheus_zone_name "ngx_prometheus"
 
+/* how often a worker publishes its updates to the registry generation */
+#define NGX_PROMETHEUS_GENERATION_TICK  1000
+
+/* the default period of the event loop lag timer */
+#define NGX_PROMETHEUS_EVENT_LOOP_INTERVAL  100
+
+/* a bound on the series of a preset, against a mistyped value list */
+#define NGX_PROMETHEUS_PRESET_MAX  65536
+
+/* a bound on log-linear buckets, each of which is a sample of every series */
+#define NGX_PROMETHEUS_LOG_BUCKETS_MAX  1024
+
+/* the keys a top-K metric exposes, and monitors per key exposed */
+#define NGX_PROMETHEUS_TOPK  10
+#define NGX_PROMETHEUS_TOPK_CAPACITY  10
+
+/* the series a worker remembers, and the label values a slot holds */
+#define NGX_PROMETHEUS_SERIES_CACHE  1024
+#define NGX_PROMETHEUS_SERIES_KEY_LEN  104
+
+
+typedef struct {
+    ngx_uint_t                 index;
+    ngx_uint_t                 nlabels;
+    ngx_array_t               *values;    /* of ngx_array_t of ngx_str_t */
+} ngx_prometheus_preset_t;
+
+typedef struct {
+    void                      *series;
+    ngx_uint_t                 index;
+    ngx_uint_t                 hash;
+    size_t                     len;
+    u_char                     key[NGX_PROMETHEUS_SERIES_KEY_LEN];
+} ngx_prometheus_series_cache_t;
+
+
+static void *
+ngx_prometheus_module_create_conf(ngx_cycle_t *cycle);
+
+static char *
+ngx_prometheus_module_init_conf(ngx_cycle_t *cycle, void *conf);
+
 static char *
 ngx_prometheus_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 
+static char *
+ngx_prometheus_declare(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+static char *
+ngx_prometheus_declare_labels(ngx_conf_t *cf,
+    ngx_prometheus_metric_conf_t *mcf, ngx_str_t *value);
+
+static char *
+ngx_prometheus_declare_buckets(ngx_conf_t *cf,
+    ngx_prometheus_metric_conf_t *mcf, ngx_str_t *value);
+
+static char *
+ngx_prometheus_declare_log_buckets(ngx_conf_t *cf,
+    ngx_prometheus_metric_conf_t *mcf, ngx_str_t *value);
+
+static char *
+ngx_prometheus_declare_timer(ngx_conf_t *cf,
+    ngx_prometheus_metric_conf_t *mcf, ngx_str_t *value);
+
+static char *
+ngx_prometheus_declare_native(ngx_conf_t *cf,
+    ngx_prometheus_metric_conf_t *mcf, ngx_str_t *value);
+
+static char *
+ngx_prometheus_declare_quantiles(ngx_conf_t *cf,
+    ngx_prometheus_metric_conf_t *mcf, ngx_str_t *value);
+
+static char *
+ngx_prometheus_declare_topk(ngx_conf_t *cf,
+    ngx_prometheus_metric_conf_t *mcf, ngx_str_t *value);
+
+static char *
+ngx_prometheus_declare_distinct(ngx_conf_t *cf,
+    ngx_prometheus_metric_conf_t *mcf, ngx_str_t *value);
+
+static char *
+ngx_prometheus_declare_window(ngx_conf_t *cf,
+    ngx_prometheus_metric_conf_t *mcf, ngx_str_t *value);
+
+static char *
+ngx_prometheus_declare_sampling(ngx_conf_t *cf,
+    ngx_prometheus_metric_conf_t *mcf, ngx_str_t *value);
+
+static char *
+ngx_prometheus_event_loop(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+static ngx_prometheus_metric_conf_t *
+ngx_prometheus_event_loop_metric(ngx_conf_t *cf, char *name, char *help,
+    prom_timer_precision_t precision, double *buckets, ngx_uint_t n);
+
+static char *
+ngx_prometheus_preset(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+static ngx_int_t
+ngx_prometheus_preset_init(ngx_prometheus_ctx_t *ctx, ngx_pool_t *pool,
+    void *data);
+
+static ngx_uint_t
+ngx_prometheus_valid_name(ngx_str_t *name, ngx_uint_t colon);
+
+static uintptr_t
+ngx_prometheus_escape(u_char *dst, u_char *src, size_t size);
+
 static ngx_int_t
 ngx_prometheus_init_zone(ngx_shm_zone_t *shm_zone, void *data);
 
+static ngx_int_t
+ngx_prometheus_init_metrics(ngx_shm_zone_t *shm_zone,
+    ngx_prometheus_conf_t *pcf, ngx_prometheus_ctx_t *ctx);
+
+static ngx_int_t
+ngx_prometheus_run_inits(ngx_shm_zone_t *shm_zone,
+    ngx_prometheus_conf_t *pcf, ngx_prometheus_ctx_t *ctx);
+
+static ngx_int_t
+ngx_prometheus_init_process(ngx_cycle_t *cycle);
+
+static void
+ngx_prometheus_generation_tick(ngx_event_t *ev);
+
+
+static ngx_event_t  ngx_prometheus_generation_event;
+
+static ngx_prometheus_series_cache_t  *ngx_prometheus_series_cache;
+static ngx_prometheus_ctx_t           *ngx_prometheus_series_ctx;
+
+static prom_metric_type_t  ngx_prometheus_counter = PROM_COUNTER;
+static prom_metric_type_t  ngx_prometheus_gauge = PROM_GAUGE;
+static prom_metric_type_t  ngx_prometheus_histogram = PROM_HISTOGRAM;
+static prom_metric_type_t  ngx_prometheus_summary = PROM_SUMMARY;
+static prom_metric_type_t  ngx_prometheus_inflight = PROM_GAUGE;
+static prom_metric_type_t  ngx_prometheus_topk = PROM_COUNTER;
+static prom_metric_type_t  ngx_prometheus_distinct = PROM_GAUGE;
+
+
+/* the usual Prometheus client defaults */
+
+static double  ngx_prometheus_default_buckets[] = {
+    .005, .01, .025, .05, .1, .25, .5, 1, 2.5, 5, 10
+};
+
+static double  ngx_prometheus_default_quantiles[] = {
+    .5, .9, .99
+};
+
+
+static ngx_conf_enum_t  ngx_prometheus_timers[] = {
+    { ngx_string("msec"), PROM_TIMER_MSEC },
+    { ngx_string("coarse"), PROM_TIMER_COARSE },
+    { ngx_string("tsc"), PROM_TIMER_TSC },
+    { ngx_null_string, 0 }
+};
+
+
+/* a timer is late by milliseconds at least, the lag runs on the msec clock */
+
+static double  ngx_prometheus_event_loop_lag_buckets[] = {
+    .001, .0025, .005, .01, .025, .05, .1, .25, .5, 1, 2.5, 5
+};
+
+/* most iterations take microseconds, they are timed with the tsc clock */
+
+static double  ngx_prometheus_event_loop_iteration_buckets[] = {
+    .00001, .000025, .00005, .0001, .00025, .0005, .001, .0025, .005, .01,
+    .025, .05, .1, .25, .5, 1, 2.5, 5
+};
+
+
 static ngx_command_t  ngx_prometheus_commands[] = {
 
     { ngx_string("prometheus_zone"),
@@ -18,6 +187,76 @@ static ngx_command_t  ngx_prometheus_commands[] = {
       0,
       NULL },
 
+    { ngx_string("prometheus_counter"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_2MORE,
+      ngx_prometheus_declare,
+      0,
+      0,
+      &ngx_prometheus_counter },
+
+    { ngx_string("prometheus_gauge"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_2MORE,
+      ngx_prometheus_declare,
+      0,
+      0,
+      &ngx_prometheus_gauge },
+
+    { ngx_string("prometheus_histogram"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_2MORE,
+      ngx_prometheus_declare,
+      0,
+      0,
+      &ngx_prometheus_histogram },
+
+    { ngx_string("prometheus_summary"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_2MORE,
+      ngx_prometheus_declare,
+      0,
+      0,
+      &ngx_prometheus_summary },
+
+    { ngx_string("prometheus_inflight_gauge"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_2MORE,
+      ngx_prometheus_declare,
+      0,
+      0,
+      &ngx_prometheus_inflight },
+
+    { ngx_string("prometheus_topk"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_2MORE,
+      ngx_prometheus_declare,
+      0,
+      0,
+      &ngx_prometheus_topk },
+
+    { ngx_string("prometheus_distinct"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_2MORE,
+      ngx_prometheus_declare,
+      0,
+      0,
+      &ngx_prometheus_distinct },
+
+    { ngx_string("prometheus_nginx_metrics"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      0,
+      offsetof(ngx_prometheus_conf_t, nginx_metrics),
+      NULL },
+
+    { ngx_string("prometheus_event_loop_metrics"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE12,
+      ngx_prometheus_event_loop,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("prometheus_preset"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_1MORE,
+      ngx_prometheus_preset,
+      0,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -25,7 +264,7 @@ static ngx_command_t  ngx_prometheus_commands[] = {
 static ngx_core_module_t  ngx_prometheus_module_ctx = {
     ngx_string("prometheus"),
     ngx_prometheus_module_create_conf,
-    NULL
+    ngx_prometheus_module_init_conf
 };
 
 
@@ -36,7 +275,7 @@ ngx_module_t  ngx_prometheus_module = {
     NGX_CORE_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_prometheus_init_process,           /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -54,10 +293,53 @@ ngx_prometheus_module_create_conf(ngx_cycle_t *cycle)
         return NULL;
     }
 
+    if (ngx_array_init(&pcf->metrics, cycle->pool, 4,
+                       sizeof(ngx_prometheus_metric_conf_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (ngx_array_init(&pcf->inits, cycle->pool, 2,
+                       sizeof(ngx_prometheus_init_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    pcf->nginx_metrics = NGX_CONF_UNSET;
+    pcf->loop_interval = NGX_CONF_UNSET_MSEC;
+
     return pcf;
 }
 
 
+static char *
+ngx_prometheus_module_init_conf(ngx_cycle_t *cycle, void *conf)
+{
+    ngx_prometheus_conf_t  *pcf = conf;
+
+    ngx_core_conf_t  *ccf;
+
+    ngx_conf_init_value(pcf->nginx_metrics, 0);
+    ngx_conf_init_msec_value(pcf->loop_interval, 0);
+
+    if ((pcf->metrics.nelts || pcf->nginx_metrics) && pcf->shm_zone == NULL) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "prometheus metrics are declared "
+                      "but \"prometheus_zone\" is not");
+        return NGX_CONF_ERROR;
+    }
+
+    /* the core module is configured first */
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    pcf->nworkers = ccf->worker_processes > 0 ? ccf->worker_processes : 1;
+
+    return NGX_CONF_OK;
+}
+
 
 static char *
 ngx_prometheus_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
@@ -73,11 +355,11 @@ ngx_prometheus_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     value = cf->args->elts;
 
     if (cf->args->nelts == 2) {
-        size = ngx_parse_size(&value[2]);
+        size = ngx_parse_size(&value[1]);
 
         if (size == NGX_ERROR) {
             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "invalid zone size \"%V\"", &value[2]);
+                               "invalid zone size \"%V\"", &value[1]);
             return NGX_CONF_ERROR;
         }
 
@@ -105,39 +387,1947 @@ ngx_prometheus_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     return NGX_CONF_OK;
 }
 
-static ngx_int_t
-ngx_prometheus_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+/*
+ * prometheus_counter name help [labels=key,...] [exemplars] [window=time];
+ * prometheus_gauge name help [labels=key,...];
+ * prometheus_histogram name help [labels=key,...]
+ *     [buckets=bound,...|log_buckets=min,max,sub-buckets]
+ *     [timer=msec|coarse|tsc] [native[=schema]] [exemplars] [window=time]
+ *     [sampling=number];
+ * prometheus_inflight_gauge name help [labels=key,...];
+ * prometheus_topk name help labels=key [k=number] [capacity=number];
+ * prometheus_distinct name help [labels=key,...] [precision=number]
+ *     [window=time];
+ */
+
+static char *
+ngx_prometheus_declare(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    size_t                          len;
-    ngx_uint_t                      i;
-    ngx_slab_pool_t                *shpool;
-    ngx_prometheus_conf_t          *pcf;
-    ngx_prometheus_ctx_t           *ctx;
+    ngx_prometheus_conf_t  *pcf = conf;
 
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
-    pcf = shm_zone->data;
+    char                          *rv;
+    ngx_str_t                     *value;
+    ngx_uint_t                     i;
+    ngx_prometheus_metric_conf_t  *mcf;
 
-    if (shm_zone->shm.exists) {
-        ctx = shpool->data;
-        return NGX_OK;
+    value = cf->args->elts;
+
+    mcf = ngx_prometheus_add_metric(cf, &value[1],
+                                    *(prom_metric_type_t *) cmd->post);
+    if (mcf == NULL) {
+        return NGX_CONF_ERROR;
     }
 
-    len = sizeof(" in upstream zone \"\"") + shm_zone->shm.name.len;
+    /* arguments are null-terminated, as prom_metric_new() expects */
 
-    shpool->log_ctx = ngx_slab_alloc(shpool, len);
-    if (shpool->log_ctx == NULL) {
-        return NGX_ERROR;
+    mcf->help = value[2];
+
+    /* a gauge kept in per-worker shards, see prometheus_inflight */
+
+    if (cmd->post == &ngx_prometheus_inflight) {
+        mcf->inflight = 1;
     }
 
-    ngx_sprintf(shpool->log_ctx, " in upstream zone \"%V\"%Z",
-                &shm_zone->shm.name);
+    /* a counter whose label values are keys of a sketch, see prom_topk.h */
 
+    if (cmd->post == &ngx_prometheus_topk) {
+        mcf->topk = NGX_PROMETHEUS_TOPK;
+    }
 
-    ctx->registry = prom_collector_registry_new("default", shpool);
-    if (ctx->registry == NULL) {
+    /* a gauge estimating the distinct keys observed, see prom_hll.h */
+
+    if (cmd->post == &ngx_prometheus_distinct) {
+        mcf->hll_precision = PROM_HLL_PRECISION;
+    }
+
+    for (i = 3; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "labels=", 7) == 0) {
+            rv = ngx_prometheus_declare_labels(cf, mcf, &value[i]);
+
+        } else if (mcf->type == PROM_HISTOGRAM
+                   && ngx_strncmp(value[i].data, "buckets=", 8) == 0)
+        {
+            rv = ngx_prometheus_declare_buckets(cf, mcf, &value[i]);
+
+        } else if (mcf->type == PROM_HISTOGRAM
+                   && ngx_strncmp(value[i].data, "log_buckets=", 12) == 0)
+        {
+            rv = ngx_prometheus_declare_log_buckets(cf, mcf, &value[i]);
+
+        } else if (mcf->type == PROM_HISTOGRAM
+                   && ngx_strncmp(value[i].data, "timer=", 6) == 0)
+        {
+            rv = ngx_prometheus_declare_timer(cf, mcf, &value[i]);
+
+        } else if (mcf->type == PROM_HISTOGRAM
+                   && ngx_strncmp(value[i].data, "native", 6) == 0
+                   && (value[i].len == 6 || value[i].data[6] == '='))
+        {
+            rv = ngx_prometheus_declare_native(cf, mcf, &value[i]);
+
+        } else if (mcf->type == PROM_HISTOGRAM
+                   && ngx_strncmp(value[i].data, "sampling=", 9) == 0)
+        {
+            rv = ngx_prometheus_declare_sampling(cf, mcf, &value[i]);
+
+        } else if (mcf->topk
+                   && (ngx_strncmp(value[i].data, "k=", 2) == 0
+                       || ngx_strncmp(value[i].data, "capacity=", 9) == 0))
+        {
+            rv = ngx_prometheus_declare_topk(cf, mcf, &value[i]);
+
+        } else if (mcf->hll_precision
+                   && (ngx_strncmp(value[i].data, "precision=", 10) == 0
+                       || ngx_strncmp(value[i].data, "window=", 7) == 0))
+        {
+            rv = ngx_prometheus_declare_distinct(cf, mcf, &value[i]);
+
+        } else if ((mcf->type == PROM_COUNTER || mcf->type == PROM_HISTOGRAM)
+                   && !mcf->topk
+                   && ngx_strncmp(value[i].data, "window=", 7) == 0)
+        {
+            rv = ngx_prometheus_declare_window(cf, mcf, &value[i]);
+
+        } else if ((mcf->type == PROM_COUNTER || mcf->type == PROM_HISTOGRAM)
+                   && !mcf->inflight && !mcf->topk
+                   && ngx_strcmp(value[i].data, "exemplars") == 0)
+        {
+            mcf->exemplars = 1;
+            rv = NGX_CONF_OK;
+
+        } else if (mcf->type == PROM_SUMMARY
+                   && ngx_strncmp(value[i].data, "quantiles=", 10) == 0)
+        {
+            rv = ngx_prometheus_declare_quantiles(cf, mcf, &value[i]);
+
+        } else {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        if (rv != NGX_CONF_OK) {
+            return rv;
+        }
+    }
+
+    if (mcf->topk) {
+        if (mcf->labels.nelts != 1) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "top-K metric \"%V\" must have one label",
+                               &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        if (mcf->topk_capacity == 0) {
+            mcf->topk_capacity = ngx_min(mcf->topk
+                                         * NGX_PROMETHEUS_TOPK_CAPACITY,
+                                         PROM_TOPK_CAPACITY_MAX);
+
+        } else if (mcf->topk_capacity < mcf->topk) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "capacity of top-K metric \"%V\" "
+                               "is below k", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    /*
+     * windowed rates and quantiles, and a windowed distinct count, decay
+     * without updates, see the tick
+     */
+
+    if (mcf->window || mcf->hll_window) {
+        pcf->windowed = 1;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * adds a declaration for the caller to fill in; the name MUST be
+ * null-terminated, and so MUST the help text and the label keys added
+ */
+
+ngx_prometheus_metric_conf_t *
+ngx_prometheus_add_metric(ngx_conf_t *cf, ngx_str_t *name,
+    prom_metric_type_t type)
+{
+    ngx_prometheus_conf_t         *pcf;
+    ngx_prometheus_metric_conf_t  *mcf;
+
+    pcf = (ngx_prometheus_conf_t *) ngx_get_conf(cf->cycle->conf_ctx,
+                                                  ngx_prometheus_module);
+
+    if (!ngx_prometheus_valid_name(name, 1)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid metric name \"%V\"", name);
+        return NULL;
+    }
+
+    if (ngx_prometheus_metric_index(cf, name) != NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate metric \"%V\"", name);
+        return NULL;
+    }
+
+    mcf = ngx_array_push(&pcf->metrics);
+    if (mcf == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(mcf, sizeof(ngx_prometheus_metric_conf_t));
+
+    mcf->name = *name;
+    mcf->type = type;
+    ngx_str_set(&mcf->help, "");
+
+    if (ngx_array_init(&mcf->labels, cf->pool, 4, sizeof(char *)) != NGX_OK) {
+        return NULL;
+    }
+
+    return mcf;
+}
+
+
+/*
+ * the handler is called once the declared metrics exist in a new zone,
+ * e.g. to create series ahead of the first request
+ */
+
+ngx_int_t
+ngx_prometheus_add_init(ngx_conf_t *cf, ngx_prometheus_init_pt handler,
+    void *data)
+{
+    ngx_prometheus_conf_t  *pcf;
+    ngx_prometheus_init_t  *init;
+
+    pcf = (ngx_prometheus_conf_t *) ngx_get_conf(cf->cycle->conf_ctx,
+                                                  ngx_prometheus_module);
+
+    init = ngx_array_push(&pcf->inits);
+    if (init == NULL) {
         return NGX_ERROR;
     }
 
+    init->handler = handler;
+    init->data = data;
+
     return NGX_OK;
 }
 
+
+static char *
+ngx_prometheus_declare_labels(ngx_conf_t *cf,
+    ngx_prometheus_metric_conf_t *mcf, ngx_str_t *value)
+{
+    u_char      *p, *last, *start, **key;
+    ngx_str_t    name;
+    ngx_uint_t   i;
+
+    if (mcf->labels.nelts) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate \"labels\" parameter");
+        return NGX_CONF_ERROR;
+    }
+
+    p = value->data + 7;
+    last = value->data + value->len;
+
+    while (p <= last) {
+        start = p;
+
+        p = ngx_strlchr(p, last, ',');
+        if (p == NULL) {
+            p = last;
+        }
+
+        name.data = start;
+        name.len = p++ - start;
+
+        /* "le" and "quantile" are set by the exposition itself */
+
+        if (!ngx_prometheus_valid_name(&name, 0)
+            || (name.len == 2 && ngx_strncmp(name.data, "le", 2) == 0)
+            || (name.len == 8 && ngx_strncmp(name.data, "quantile", 8) == 0))
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid label \"%V\"", &name);
+            return NGX_CONF_ERROR;
+        }
+
+        key = mcf->labels.elts;
+
+        for (i = 0; i < mcf->labels.nelts; i++) {
+            if (ngx_strlen(key[i]) == name.len
+                && ngx_strncmp(key[i], name.data, name.len) == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "duplicate label \"%V\"", &name);
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        key = ngx_array_push(&mcf->labels);
+        if (key == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *key = ngx_pnalloc(cf->pool, name.len + 1);
+        if (*key == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memcpy(*key, name.data, name.len);
+        (*key)[name.len] = '\0';
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_prometheus_declare_buckets(ngx_conf_t *cf,
+    ngx_prometheus_metric_conf_t *mcf, ngx_str_t *value)
+{
+    u_char  *p, *last, *start;
+    double  *bound;
+
+    if (mcf->buckets || mcf->log_sub) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate \"buckets\" parameter");
+        return NGX_CONF_ERROR;
+    }
+
+    mcf->buckets = ngx_array_create(cf->pool, 8, sizeof(double));
+    if (mcf->buckets == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    p = value->data + 8;
+    last = value->data + value->len;
+
+    while (p <= last) {
+        start = p;
+
+        p = ngx_strlchr(p, last, ',');
+        if (p == NULL) {
+            p = last;
+        }
+
+        bound = ngx_array_push(mcf->buckets);
+        if (bound == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_prometheus_parse_double(start, p - start, bound) != NGX_OK) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid bucket bound in \"%V\"", value);
+            return NGX_CONF_ERROR;
+        }
+
+        p++;
+
+        /* the +Inf bucket is implicit */
+
+        if (mcf->buckets->nelts > 1 && *bound <= bound[-1]) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "bucket bounds must increase in \"%V\"",
+                               value);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * log-linear buckets: each power of two from the one at or below min to the
+ * one at or above max is divided into sub-buckets, a power of two, of equal
+ * width; the bucket of a value is indexed from its bits in constant time and
+ * bounds its relative error to 1 / sub-buckets
+ */
+
+static char *
+ngx_prometheus_declare_log_buckets(ngx_conf_t *cf,
+    ngx_prometheus_metric_conf_t *mcf, ngx_str_t *value)
+{
+    u_char     *p, *last, *start;
+    size_t      n;
+    double      sub;
+    double     *params[3];
+    ngx_uint_t  i;
+
+    if (mcf->buckets || mcf->log_sub) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate \"buckets\" parameter");
+        return NGX_CONF_ERROR;
+    }
+
+    params[0] = &mcf->log_min;
+    params[1] = &mcf->log_max;
+    params[2] = &sub;
+
+    p = value->data + 12;
+    last = value->data + value->len;
+
+    for (i = 0; i < 3; i++) {
+        start = p;
+
+        p = ngx_strlchr(p, last, ',');
+        if (p == NULL) {
+            p = last;
+        }
+
+        if ((p == last) != (i == 2)
+            || ngx_prometheus_parse_double(start, p - start, params[i])
+               != NGX_OK)
+        {
+            goto invalid;
+        }
+
+        p++;
+    }
+
+    if (sub < 1 || sub > PROM_HISTOGRAM_BUCKETS_LOG_SUB_MAX
+        || sub != (double) (ngx_uint_t) sub)
+    {
+        goto invalid;
+    }
+
+    mcf->log_sub = (ngx_uint_t) sub;
+
+    n = prom_histogram_buckets_log_linear_count(mcf->log_min, mcf->log_max,
+                                                mcf->log_sub);
+    if (n == 0) {
+        goto invalid;
+    }
+
+    if (n > NGX_PROMETHEUS_LOG_BUCKETS_MAX) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" makes %uz buckets, at most %d are allowed",
+                           value, n, NGX_PROMETHEUS_LOG_BUCKETS_MAX);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid \"%V\", it must be \"log_buckets=min,max,"
+                       "sub-buckets\" with 0 < min < max and sub-buckets "
+                       "a power of two up to %d", value,
+                       PROM_HISTOGRAM_BUCKETS_LOG_SUB_MAX);
+    return NGX_CONF_ERROR;
+}
+
+
+/* the clock of duration measurements, see prom_timer.h */
+
+static char *
+ngx_prometheus_declare_timer(ngx_conf_t *cf,
+    ngx_prometheus_metric_conf_t *mcf, ngx_str_t *value)
+{
+    ngx_uint_t  i;
+
+    if (mcf->precision != PROM_TIMER_NONE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate \"timer\" parameter");
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 0; ngx_prometheus_timers[i].name.len; i++) {
+        if (ngx_prometheus_timers[i].name.len == value->len - 6
+            && ngx_strncmp(ngx_prometheus_timers[i].name.data,
+                           value->data + 6, value->len - 6) == 0)
+        {
+            mcf->precision = ngx_prometheus_timers[i].value;
+            return NGX_CONF_OK;
+        }
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid timer \"%V\"", value);
+    return NGX_CONF_ERROR;
+}
+
+
+/*
+ * sparse exponential buckets, exposed in the protobuf format only; without
+ * "buckets=" the histogram has no classic buckets, and the text formats
+ * only show its count and sum
+ */
+
+static char *
+ngx_prometheus_declare_native(ngx_conf_t *cf,
+    ngx_prometheus_metric_conf_t *mcf, ngx_str_t *value)
+{
+    ngx_int_t  schema, sign;
+
+    if (mcf->native) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate \"native\" parameter");
+        return NGX_CONF_ERROR;
+    }
+
+    mcf->native = 1;
+    mcf->schema = PROM_NATIVE_HISTOGRAM_SCHEMA;
+
+    if (value->len == 6) {
+        return NGX_CONF_OK;
+    }
+
+    sign = (value->len > 7 && value->data[7] == '-');
+
+    schema = ngx_atoi(value->data + 7 + sign, value->len - 7 - sign);
+
+    if (schema == NGX_ERROR) {
+        goto invalid;
+    }
+
+    schema = sign ? -schema : schema;
+
+    if (schema < PROM_NATIVE_HISTOGRAM_SCHEMA_MIN
+        || schema > PROM_NATIVE_HISTOGRAM_SCHEMA_MAX)
+    {
+        goto invalid;
+    }
+
+    mcf->schema = schema;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid native histogram schema \"%V\", "
+                       "it must be from %d to %d", value,
+                       PROM_NATIVE_HISTOGRAM_SCHEMA_MIN,
+                       PROM_NATIVE_HISTOGRAM_SCHEMA_MAX);
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_prometheus_declare_quantiles(ngx_conf_t *cf,
+    ngx_prometheus_metric_conf_t *mcf, ngx_str_t *value)
+{
+    u_char  *p, *last, *start;
+    double  *quantile;
+
+    if (mcf->quantiles) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate \"quantiles\" parameter");
+        return NGX_CONF_ERROR;
+    }
+
+    mcf->quantiles = ngx_array_create(cf->pool, 4, sizeof(double));
+    if (mcf->quantiles == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    p = value->data + 10;
+    last = value->data + value->len;
+
+    while (p <= last) {
+        start = p;
+
+        p = ngx_strlchr(p, last, ',');
+        if (p == NULL) {
+            p = last;
+        }
+
+        quantile = ngx_array_push(mcf->quantiles);
+        if (quantile == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_prometheus_parse_double(start, p - start, quantile) != NGX_OK
+            || *quantile < 0 || *quantile > 1)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid quantile in \"%V\"", value);
+            return NGX_CONF_ERROR;
+        }
+
+        p++;
+    }
+
+    if (mcf->quantiles->nelts > PROM_SUMMARY_QUANTILES_MAX) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "too many quantiles in \"%V\"", value);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * k=number sets the keys exposed, capacity=number the keys monitored by
+ * each worker; the more keys are monitored, the more accurate the counts
+ * of the top ones
+ */
+
+static char *
+ngx_prometheus_declare_topk(ngx_conf_t *cf,
+    ngx_prometheus_metric_conf_t *mcf, ngx_str_t *value)
+{
+    ngx_int_t  n;
+
+    if (value->data[0] == 'k') {
+        n = ngx_atoi(value->data + 2, value->len - 2);
+
+        if (n == NGX_ERROR || n == 0 || n > PROM_TOPK_CAPACITY_MAX) {
+            goto invalid;
+        }
+
+        mcf->topk = n;
+
+        return NGX_CONF_OK;
+    }
+
+    n = ngx_atoi(value->data + 9, value->len - 9);
+
+    if (n == NGX_ERROR || n == 0 || n > PROM_TOPK_CAPACITY_MAX) {
+        goto invalid;
+    }
+
+    mcf->topk_capacity = n;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\", it must be from 1 to %d",
+                       value, PROM_TOPK_CAPACITY_MAX);
+    return NGX_CONF_ERROR;
+}
+
+
+/*
+ * precision=number sets 2^number registers per sketch, window=time counts
+ * the keys of the last time only, in PROM_HLL_SETS rotating periods: the
+ * estimate covers from 0.75 of the window to all of it, as they rotate
+ */
+
+static char *
+ngx_prometheus_declare_distinct(ngx_conf_t *cf,
+    ngx_prometheus_metric_conf_t *mcf, ngx_str_t *value)
+{
+    time_t     window;
+    ngx_str_t  s;
+    ngx_int_t  n;
+
+    if (value->data[0] == 'p') {
+        n = ngx_atoi(value->data + 10, value->len - 10);
+
+        if (n == NGX_ERROR || n < PROM_HLL_PRECISION_MIN
+            || n > PROM_HLL_PRECISION_MAX)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid precision \"%V\", "
+                               "it must be from %d to %d", value,
+                               PROM_HLL_PRECISION_MIN,
+                               PROM_HLL_PRECISION_MAX);
+            return NGX_CONF_ERROR;
+        }
+
+        mcf->hll_precision = n;
+
+        return NGX_CONF_OK;
+    }
+
+    s.data = value->data + 7;
+    s.len = value->len - 7;
+
+    window = ngx_parse_time(&s, 1);
+
+    if (window == (time_t) NGX_ERROR || window < PROM_HLL_SETS) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid window \"%V\", "
+                           "it must be at least %ds", value, PROM_HLL_SETS);
+        return NGX_CONF_ERROR;
+    }
+
+    mcf->hll_window = window;
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * window=time keeps the per-second counts of the last time in every series,
+ * for the rates and quantiles read in place and exposed as a gauge family
+ */
+
+static char *
+ngx_prometheus_declare_window(ngx_conf_t *cf,
+    ngx_prometheus_metric_conf_t *mcf, ngx_str_t *value)
+{
+    time_t     window;
+    ngx_str_t  s;
+
+    s.data = value->data + 7;
+    s.len = value->len - 7;
+
+    window = ngx_parse_time(&s, 1);
+
+    if (window == (time_t) NGX_ERROR || window < 1
+        || window > PROM_WINDOW_SECONDS_MAX)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid window \"%V\", "
+                           "it must be from 1s to %ds", value,
+                           PROM_WINDOW_SECONDS_MAX);
+        return NGX_CONF_ERROR;
+    }
+
+    mcf->window = window;
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * sampling=number records one in number observations, drawn at random, each
+ * counting number times in the buckets, the count and the sum
+ */
+
+static char *
+ngx_prometheus_declare_sampling(ngx_conf_t *cf,
+    ngx_prometheus_metric_conf_t *mcf, ngx_str_t *value)
+{
+    ngx_int_t  sampling;
+
+    sampling = ngx_atoi(value->data + 9, value->len - 9);
+
+    if (sampling == NGX_ERROR || sampling < 1
+        || sampling > PROM_HISTOGRAM_SAMPLING_MAX)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid sampling \"%V\", "
+                           "it must be from 1 to %d", value,
+                           PROM_HISTOGRAM_SAMPLING_MAX);
+        return NGX_CONF_ERROR;
+    }
+
+    mcf->sampling = sampling;
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * prometheus_event_loop_metrics on | off [interval=time];
+ *
+ * declares the per-worker histograms of ngx_prometheus_event_loop.c
+ */
+
+static char *
+ngx_prometheus_event_loop(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_prometheus_conf_t  *pcf = conf;
+
+    ngx_str_t                     *value, s;
+    ngx_msec_t                     interval;
+    ngx_prometheus_metric_conf_t  *mcf;
+
+    if (pcf->loop_interval != NGX_CONF_UNSET_MSEC) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        pcf->loop_interval = 0;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[1].data, "on") != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    interval = NGX_PROMETHEUS_EVENT_LOOP_INTERVAL;
+
+    if (cf->args->nelts == 3) {
+        if (ngx_strncmp(value[2].data, "interval=", 9) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        s.data = value[2].data + 9;
+        s.len = value[2].len - 9;
+
+        interval = ngx_parse_time(&s, 0);
+        if (interval == (ngx_msec_t) NGX_ERROR || interval == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid interval \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    pcf->loop_interval = interval;
+
+    pcf->loop_lag = pcf->metrics.nelts;
+
+    mcf = ngx_prometheus_event_loop_metric(cf,
+              "nginx_event_loop_lag_seconds",
+              "How late the event loop ran a periodic timer of the worker",
+              PROM_TIMER_MSEC, ngx_prometheus_event_loop_lag_buckets,
+              sizeof(ngx_prometheus_event_loop_lag_buckets) / sizeof(double));
+    if (mcf == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    pcf->loop_iteration = pcf->metrics.nelts;
+
+    mcf = ngx_prometheus_event_loop_metric(cf,
+              "nginx_event_loop_iteration_seconds",
+              "Time the worker spent handling events per event loop "
+              "iteration",
+              PROM_TIMER_TSC, ngx_prometheus_event_loop_iteration_buckets,
+              sizeof(ngx_prometheus_event_loop_iteration_buckets)
+              / sizeof(double));
+    if (mcf == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_prometheus_metric_conf_t *
+ngx_prometheus_event_loop_metric(ngx_conf_t *cf, char *name, char *help,
+    prom_timer_precision_t precision, double *buckets, ngx_uint_t n)
+{
+    char                         **key;
+    ngx_str_t                      s;
+    ngx_uint_t                     i;
+    ngx_prometheus_metric_conf_t  *mcf;
+
+    s.data = (u_char *) name;
+    s.len = ngx_strlen(name);
+
+    mcf = ngx_prometheus_add_metric(cf, &s, PROM_HISTOGRAM);
+    if (mcf == NULL) {
+        return NULL;
+    }
+
+    mcf->help.data = (u_char *) help;
+    mcf->help.len = ngx_strlen(help);
+
+    mcf->precision = precision;
+
+    key = ngx_array_push(&mcf->labels);
+    if (key == NULL) {
+        return NULL;
+    }
+
+    *key = "worker";
+
+    mcf->buckets = ngx_array_create(cf->pool, n, sizeof(double));
+    if (mcf->buckets == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < n; i++) {
+        *(double *) ngx_array_push(mcf->buckets) = buckets[i];
+    }
+
+    return mcf;
+}
+
+
+/*
+ * prometheus_preset metric value[,value...] ...;
+ *
+ * creates the series of every combination of the listed label values, one
+ * list per label in the order of the declaration, together with the zone;
+ * the first requests then find their series instead of creating them
+ */
+
+static char *
+ngx_prometheus_preset(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    u_char                        *p, *last, *start;
+    ngx_int_t                      index;
+    ngx_str_t                     *value, *v;
+    ngx_uint_t                     i, n;
+    ngx_array_t                   *list;
+    ngx_prometheus_preset_t       *preset;
+    ngx_prometheus_metric_conf_t  *mcf;
+
+    value = cf->args->elts;
+
+    index = ngx_prometheus_metric_index(cf, &value[1]);
+    if (index == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "unknown metric \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    mcf = ngx_prometheus_metric_conf(cf, index);
+
+    if (mcf->topk) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "top-K metric \"%V\" has no series to preset",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (cf->args->nelts - 2 != mcf->labels.nelts) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "metric \"%V\" has %ui labels", &value[1],
+                           mcf->labels.nelts);
+        return NGX_CONF_ERROR;
+    }
+
+    preset = ngx_palloc(cf->pool, sizeof(ngx_prometheus_preset_t));
+    if (preset == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    preset->index = index;
+    preset->nlabels = mcf->labels.nelts;
+
+    preset->values = ngx_array_create(cf->pool, preset->nlabels + 1,
+                                      sizeof(ngx_array_t));
+    if (preset->values == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    n = 1;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        list = ngx_array_push(preset->values);
+        if (list == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_array_init(list, cf->pool, 4, sizeof(ngx_str_t)) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        p = value[i].data;
+        last = value[i].data + value[i].len;
+
+        while (p <= last) {
+            start = p;
+
+            p = ngx_strlchr(p, last, ',');
+            if (p == NULL) {
+                p = last;
+            }
+
+            v = ngx_array_push(list);
+            if (v == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            v->data = start;
+            v->len = p - start;
+
+            p++;
+        }
+
+        n *= list->nelts;
+
+        if (n > NGX_PROMETHEUS_PRESET_MAX) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "preset of \"%V\" has more than %d series",
+                               &value[1], NGX_PROMETHEUS_PRESET_MAX);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (ngx_prometheus_add_init(cf, ngx_prometheus_preset_init, preset)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_prometheus_preset_init(ngx_prometheus_ctx_t *ctx, ngx_pool_t *pool,
+    void *data)
+{
+    ngx_prometheus_preset_t *preset = data;
+
+    ngx_int_t     k;
+    ngx_str_t    *labels, *values;
+    ngx_uint_t    i, n, *pos;
+    ngx_array_t  *lists;
+
+    n = preset->nlabels;
+    lists = preset->values->elts;
+
+    labels = NULL;
+    pos = NULL;
+
+    if (n) {
+        labels = ngx_palloc(pool, n * sizeof(ngx_str_t));
+        pos = ngx_pcalloc(pool, n * sizeof(ngx_uint_t));
+
+        if (labels == NULL || pos == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    for ( ;; ) {
+
+        for (i = 0; i < n; i++) {
+            values = lists[i].elts;
+            labels[i] = values[pos[i]];
+        }
+
+        if (ngx_prometheus_series(ctx, preset->index, labels, pool) == NULL) {
+            return NGX_ERROR;
+        }
+
+        /* the next combination, the last label changes fastest */
+
+        for (k = n - 1; k >= 0; k--) {
+            if (++pos[k] < lists[k].nelts) {
+                break;
+            }
+
+            pos[k] = 0;
+        }
+
+        if (k < 0) {
+            return NGX_OK;
+        }
+    }
+}
+
+
+static ngx_uint_t
+ngx_prometheus_valid_name(ngx_str_t *name, ngx_uint_t colon)
+{
+    u_char      ch;
+    ngx_uint_t  i;
+
+    if (name->len == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < name->len; i++) {
+        ch = name->data[i];
+
+        if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z')
+            || ch == '_' || (ch == ':' && colon)
+            || (ch >= '0' && ch <= '9' && i > 0))
+        {
+            continue;
+        }
+
+        return 0;
+    }
+
+    return 1;
+}
+
+
+static ngx_int_t
+ngx_prometheus_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    size_t                          len;
+    ngx_slab_pool_t                *shpool;
+    ngx_prometheus_conf_t          *pcf;
+    ngx_prometheus_ctx_t           *ctx;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    pcf = shm_zone->data;
+
+    if (shm_zone->shm.exists) {
+        ctx = shpool->data;
+        pcf->ctx = ctx;
+        return NGX_OK;
+    }
+
+    len = sizeof(" in upstream zone \"\"") + shm_zone->shm.name.len;
+
+    shpool->log_ctx = ngx_slab_alloc(shpool, len);
+    if (shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(shpool->log_ctx, " in upstream zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    ctx = ngx_slab_calloc(shpool, sizeof(ngx_prometheus_ctx_t));
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    shpool->data = ctx;
+    pcf->ctx = ctx;
+
+    ctx->registry = prom_collector_registry_new("default", shpool);
+    if (ctx->registry == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (pcf->nginx_metrics
+        && ngx_prometheus_nginx_init(shm_zone, ctx, pcf->nworkers) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return ngx_prometheus_init_metrics(shm_zone, pcf, ctx);
+}
+
+
+/*
+ * creates the declared metrics once, so that the rest of the module
+ * refers to them by index instead of looking them up by name
+ */
+
+static ngx_int_t
+ngx_prometheus_init_metrics(ngx_shm_zone_t *shm_zone,
+    ngx_prometheus_conf_t *pcf, ngx_prometheus_ctx_t *ctx)
+{
+    int                            rc;
+    ngx_uint_t                     i;
+    ngx_slab_pool_t               *shpool;
+    prom_metric_t                 *metric;
+    prom_collector_t              *collector;
+    prom_histogram_buckets_t      *buckets;
+    ngx_prometheus_metric_conf_t  *mcf;
+
+    if (pcf->metrics.nelts == 0) {
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    collector = prom_map_get(ctx->registry->collectors, "default");
+    if (collector == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->metrics = ngx_slab_calloc(shpool, pcf->metrics.nelts
+                                           * sizeof(prom_metric_t *));
+    if (ctx->metrics == NULL) {
+        return NGX_ERROR;
+    }
+
+    mcf = pcf->metrics.elts;
+
+    for (i = 0; i < pcf->metrics.nelts; i++) {
+
+        metric = prom_metric_new(shpool, mcf[i].type, (char *) mcf[i].name.data,
+                                 (char *) mcf[i].help.data,
+                                 mcf[i].labels.nelts,
+                                 (const char **) mcf[i].labels.elts);
+        if (metric == NULL) {
+            goto failed;
+        }
+
+        if (mcf[i].type == PROM_HISTOGRAM) {
+            if (mcf[i].buckets) {
+                buckets = prom_histogram_buckets_from_array(shpool,
+                              mcf[i].buckets->elts, mcf[i].buckets->nelts);
+
+            } else if (mcf[i].log_sub) {
+                buckets = prom_histogram_buckets_log_linear(shpool,
+                              mcf[i].log_min, mcf[i].log_max, mcf[i].log_sub);
+
+            } else if (mcf[i].native) {
+                buckets = prom_histogram_buckets_from_array(shpool, NULL, 0);
+
+            } else {
+                buckets = prom_histogram_buckets_from_array(shpool,
+                              ngx_prometheus_default_buckets,
+                              sizeof(ngx_prometheus_default_buckets)
+                              / sizeof(double));
+            }
+
+            if (buckets == NULL
+                || (mcf[i].native
+                    && prom_histogram_buckets_set_native(buckets,
+                                  mcf[i].schema,
+                                  PROM_NATIVE_HISTOGRAM_MAX_BUCKETS))
+                || (mcf[i].sampling > 1
+                    && prom_histogram_buckets_set_sampling(buckets,
+                                  (uint32_t) mcf[i].sampling))
+                || prom_histogram_buckets_set_precision(buckets,
+                                                        mcf[i].precision)
+                || prom_metric_set_buckets(metric, buckets))
+            {
+                goto failed;
+            }
+        }
+
+        /* each worker updates the sketch of its own shard */
+
+        if (mcf[i].type == PROM_SUMMARY) {
+            if (mcf[i].quantiles) {
+                rc = prom_metric_set_quantiles(metric,
+                                               mcf[i].quantiles->elts,
+                                               mcf[i].quantiles->nelts);
+
+            } else {
+                rc = prom_metric_set_quantiles(metric,
+                                    ngx_prometheus_default_quantiles,
+                                    sizeof(ngx_prometheus_default_quantiles)
+                                    / sizeof(double));
+            }
+
+            if (rc != 0 || prom_metric_set_shards(metric, pcf->nworkers)) {
+                goto failed;
+            }
+        }
+
+        if (mcf[i].inflight
+            && prom_metric_set_shards(metric, pcf->nworkers) != 0)
+        {
+            goto failed;
+        }
+
+        if (mcf[i].exemplars && prom_metric_set_exemplars(metric) != 0) {
+            goto failed;
+        }
+
+        if (mcf[i].topk
+            && prom_metric_set_topk(metric, mcf[i].topk, mcf[i].topk_capacity,
+                                    pcf->nworkers)
+               != 0)
+        {
+            goto failed;
+        }
+
+        if (mcf[i].hll_precision
+            && prom_metric_set_distinct(metric, mcf[i].hll_precision,
+                                        mcf[i].hll_window)
+               != 0)
+        {
+            goto failed;
+        }
+
+        if (mcf[i].window
+            && prom_metric_set_window(metric, (uint32_t) mcf[i].window) != 0)
+        {
+            goto failed;
+        }
+
+        if (prom_collector_add_metric(collector, metric)) {
+            goto failed;
+        }
+
+        ctx->metrics[i] = metric;
+    }
+
+    ctx->nmetrics = pcf->metrics.nelts;
+
+    return ngx_prometheus_run_inits(shm_zone, pcf, ctx);
+
+failed:
+
+    ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                  "prometheus: could not create metric \"%V\"",
+                  &mcf[i].name);
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_prometheus_init_process(ngx_cycle_t *cycle)
+{
+    ngx_prometheus_conf_t  *pcf;
+
+    pcf = (ngx_prometheus_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                                  ngx_prometheus_module);
+
+    if (pcf == NULL || pcf->ctx == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_prometheus_nginx_update(cycle, pcf->ctx);
+
+    /* the cache outlives the cycle, its series are those of the context */
+
+    if (ngx_prometheus_series_cache == NULL) {
+        ngx_prometheus_series_cache = ngx_calloc(NGX_PROMETHEUS_SERIES_CACHE
+                                      * sizeof(ngx_prometheus_series_cache_t),
+                                      cycle->log);
+        if (ngx_prometheus_series_cache == NULL) {
+            return NGX_ERROR;
+        }
+
+    } else if (ngx_prometheus_series_ctx != pcf->ctx) {
+        ngx_memzero(ngx_prometheus_series_cache, NGX_PROMETHEUS_SERIES_CACHE
+                    * sizeof(ngx_prometheus_series_cache_t));
+    }
+
+    ngx_prometheus_series_ctx = pcf->ctx;
+
+    if (pcf->loop_interval
+        && ngx_prometheus_event_loop_init(cycle, pcf) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_prometheus_generation_event.handler = ngx_prometheus_generation_tick;
+    ngx_prometheus_generation_event.data = cycle;
+    ngx_prometheus_generation_event.log = cycle->log;
+    ngx_prometheus_generation_event.cancelable = 1;
+
+    ngx_add_timer(&ngx_prometheus_generation_event,
+                  NGX_PROMETHEUS_GENERATION_TICK);
+
+    return NGX_OK;
+}
+
+
+/*
+ * updates only mark the worker; the mark is turned into a single increment
+ * of the shared generation once per tick; windowed values are read relative
+ * to the current time and change every tick, updated or not
+ */
+
+static void
+ngx_prometheus_generation_tick(ngx_event_t *ev)
+{
+    ngx_cycle_t            *cycle;
+    ngx_prometheus_conf_t  *pcf;
+
+    cycle = ev->data;
+
+    pcf = (ngx_prometheus_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                                  ngx_prometheus_module);
+
+    if (pcf != NULL && pcf->ctx != NULL) {
+        ngx_prometheus_nginx_update(cycle, pcf->ctx);
+
+        if (pcf->windowed) {
+            prom_metric_sample_updated = 1;
+        }
+
+        (void) prom_collector_registry_generation(pcf->ctx->registry);
+    }
+
+    if (ngx_exiting || ngx_terminate || ngx_quit) {
+        return;
+    }
+
+    ngx_add_timer(ev, NGX_PROMETHEUS_GENERATION_TICK);
+}
+
+
+static ngx_int_t
+ngx_prometheus_run_inits(ngx_shm_zone_t *shm_zone,
+    ngx_prometheus_conf_t *pcf, ngx_prometheus_ctx_t *ctx)
+{
+    ngx_int_t               rc;
+    ngx_uint_t              i;
+    ngx_pool_t             *pool;
+    ngx_prometheus_init_t  *init;
+
+    if (pcf->inits.nelts == 0) {
+        return NGX_OK;
+    }
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, shm_zone->shm.log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    init = pcf->inits.elts;
+    rc = NGX_OK;
+
+    for (i = 0; i < pcf->inits.nelts; i++) {
+        rc = init[i].handler(ctx, pool, init[i].data);
+        if (rc != NGX_OK) {
+            break;
+        }
+
+        ngx_reset_pool(pool);
+    }
+
+    ngx_destroy_pool(pool);
+
+    return rc;
+}
+
+
+prom_collector_registry_t *
+ngx_prometheus_registry(ngx_cycle_t *cycle)
+{
+    ngx_prometheus_conf_t  *pcf;
+
+    pcf = (ngx_prometheus_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                                  ngx_prometheus_module);
+
+    if (pcf == NULL || pcf->ctx == NULL) {
+        return NULL;
+    }
+
+    return pcf->ctx->registry;
+}
+
+
+ngx_prometheus_ctx_t *
+ngx_prometheus_ctx(ngx_cycle_t *cycle)
+{
+    ngx_prometheus_conf_t  *pcf;
+
+    pcf = (ngx_prometheus_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                                  ngx_prometheus_module);
+
+    if (pcf == NULL) {
+        return NULL;
+    }
+
+    return pcf->ctx;
+}
+
+
+ngx_int_t
+ngx_prometheus_metric_index(ngx_conf_t *cf, ngx_str_t *name)
+{
+    ngx_uint_t                     i;
+    ngx_prometheus_conf_t         *pcf;
+    ngx_prometheus_metric_conf_t  *mcf;
+
+    pcf = (ngx_prometheus_conf_t *) ngx_get_conf(cf->cycle->conf_ctx,
+                                                  ngx_prometheus_module);
+
+    mcf = pcf->metrics.elts;
+
+    for (i = 0; i < pcf->metrics.nelts; i++) {
+        if (mcf[i].name.len == name->len
+            && ngx_strncmp(mcf[i].name.data, name->data, name->len) == 0)
+        {
+            return i;
+        }
+    }
+
+    return NGX_ERROR;
+}
+
+
+ngx_prometheus_metric_conf_t *
+ngx_prometheus_metric_conf(ngx_conf_t *cf, ngx_uint_t index)
+{
+    ngx_prometheus_conf_t  *pcf;
+
+    pcf = (ngx_prometheus_conf_t *) ngx_get_conf(cf->cycle->conf_ctx,
+                                                  ngx_prometheus_module);
+
+    return (ngx_prometheus_metric_conf_t *) pcf->metrics.elts + index;
+}
+
+
+prom_metric_t *
+ngx_prometheus_metric(ngx_cycle_t *cycle, ngx_uint_t index)
+{
+    ngx_prometheus_conf_t  *pcf;
+
+    pcf = (ngx_prometheus_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                                  ngx_prometheus_module);
+
+    if (pcf == NULL || pcf->ctx == NULL || index >= pcf->ctx->nmetrics) {
+        return NULL;
+    }
+
+    return pcf->ctx->metrics[index];
+}
+
+
+ngx_int_t
+ngx_prometheus_parse_double(u_char *data, size_t len, double *value)
+{
+    char    *end;
+    u_char   buf[64];
+
+    if (len == 0 || len >= sizeof(buf)) {
+        return NGX_ERROR;
+    }
+
+    *ngx_cpymem(buf, data, len) = '\0';
+
+    *value = strtod((char *) buf, &end);
+
+    if (*end != '\0' || isnan(*value) || isinf(*value)) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * checks the label=value arguments from the first one up to the last one,
+ * exclusive, against the declaration of the metric, and returns their values
+ * in the order of the declaration in the temporary pool; every label must be
+ * set; the http and stream modules compile the values with their variables
+ */
+
+char *
+ngx_prometheus_parse_labels(ngx_conf_t *cf, ngx_prometheus_metric_conf_t *mcf,
+    ngx_uint_t first, ngx_uint_t last, ngx_str_t **labels)
+{
+    u_char      *p, **keys;
+    ngx_str_t   *value, *values, key;
+    ngx_uint_t   i, n, nlabels;
+
+    value = cf->args->elts;
+    nlabels = mcf->labels.nelts;
+
+    *labels = NULL;
+
+    if (nlabels == 0) {
+        if (last > first) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "metric \"%V\" has no labels", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        return NGX_CONF_OK;
+    }
+
+    /* a label not set yet has no data */
+
+    values = ngx_pcalloc(cf->temp_pool, nlabels * sizeof(ngx_str_t));
+    if (values == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    keys = mcf->labels.elts;
+
+    for (i = first; i < last; i++) {
+
+        p = (u_char *) ngx_strchr(value[i].data, '=');
+
+        if (p == NULL) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        key.data = value[i].data;
+        key.len = p - value[i].data;
+
+        for (n = 0; n < nlabels; n++) {
+            if (ngx_strlen(keys[n]) == key.len
+                && ngx_strncmp(keys[n], key.data, key.len) == 0)
+            {
+                break;
+            }
+        }
+
+        if (n == nlabels) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "metric \"%V\" has no label \"%V\"",
+                               &value[1], &key);
+            return NGX_CONF_ERROR;
+        }
+
+        if (values[n].data != NULL) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "duplicate label \"%V\"", &key);
+            return NGX_CONF_ERROR;
+        }
+
+        values[n].data = p + 1;
+        values[n].len = value[i].data + value[i].len - values[n].data;
+    }
+
+    for (n = 0; n < nlabels; n++) {
+        if (values[n].data == NULL) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "label \"%s\" of metric \"%V\" is not set",
+                               keys[n], &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    *labels = values;
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * returns the series of the declared metric selected by the label values,
+ * given in the order of the declaration, and creates it on first use;
+ * all temporary memory comes from the pool
+ *
+ * series are never removed from the zone, so a worker keeps the ones it
+ * resolved in a direct-mapped cache keyed by the raw label values; a repeated
+ * label set then costs a hash and a compare instead of the escaping, the
+ * label value string and the lookup under the metric lock
+ */
+
+void *
+ngx_prometheus_series(ngx_prometheus_ctx_t *ctx, ngx_uint_t index,
+    ngx_str_t *labels, ngx_pool_t *pool)
+{
+    u_char                         *p, *last;
+    u_char                          key[NGX_PROMETHEUS_SERIES_KEY_LEN];
+    char                           *l_value, **values;
+    void                           *series;
+    size_t                          len, size;
+    ngx_uint_t                      i, n, hash;
+    prom_metric_t                  *metric;
+    ngx_prometheus_series_cache_t  *cache;
+
+    if (ctx == NULL || index >= ctx->nmetrics) {
+        return NULL;
+    }
+
+    metric = ctx->metrics[index];
+
+    n = metric->label_key_count;
+
+    cache = NULL;
+    hash = 0;
+    size = 0;
+
+    /* the values are length-prefixed, a set too long is not cached */
+
+    if (ngx_prometheus_series_cache && ctx == ngx_prometheus_series_ctx) {
+        p = key;
+        last = key + sizeof(key);
+
+        for (i = 0; i < n; i++) {
+            if (labels[i].len > 0xff
+                || (size_t) (last - p) < labels[i].len + 1)
+            {
+                break;
+            }
+
+            *p++ = (u_char) labels[i].len;
+            p = ngx_cpymem(p, labels[i].data, labels[i].len);
+        }
+
+        if (i == n) {
+            size = p - key;
+            hash = ngx_hash(ngx_hash_key(key, size), index);
+
+            cache = &ngx_prometheus_series_cache[hash
+                                             % NGX_PROMETHEUS_SERIES_CACHE];
+
+            if (cache->series
+                && cache->hash == hash
+                && cache->index == index
+                && cache->len == size
+                && ngx_memcmp(cache->key, key, size) == 0)
+            {
+                return cache->series;
+            }
+        }
+    }
+
+    values = NULL;
+
+    if (n) {
+        values = ngx_palloc(pool, n * sizeof(char *));
+        if (values == NULL) {
+            return NULL;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        len = labels[i].len
+              + ngx_prometheus_escape(NULL, labels[i].data, labels[i].len);
+
+        p = ngx_pnalloc(pool, len + 1);
+        if (p == NULL) {
+            return NULL;
+        }
+
+        values[i] = (char *) p;
+
+        if (len == labels[i].len) {
+            p = ngx_cpymem(p, labels[i].data, len);
+
+        } else {
+            p = (u_char *) ngx_prometheus_escape(p, labels[i].data,
+                                                 labels[i].len);
+        }
+
+        *p = '\0';
+    }
+
+    len = prom_metric_l_value_len(metric, (const char **) values);
+
+    l_value = ngx_pnalloc(pool, len + 1);
+    if (l_value == NULL) {
+        return NULL;
+    }
+
+    prom_metric_l_value_write(metric, (const char **) values, l_value);
+
+    series = prom_metric_sample_from_l_value(metric, l_value,
+                                             (const char **) values);
+
+    if (series && cache) {
+        cache->series = series;
+        cache->index = index;
+        cache->hash = hash;
+        cache->len = size;
+        ngx_memcpy(cache->key, key, size);
+    }
+
+    return series;
+}
+
+
+/*
+ * counters are incremented by the value, gauges set, and histograms and
+ * summaries observe
+ */
+
+ngx_int_t
+ngx_prometheus_update(prom_metric_type_t type, void *series, double value)
+{
+    return ngx_prometheus_update_exemplar(type, series, value, NULL);
+}
+
+
+/*
+ * same, and records the trace id as the exemplar of the counter or of the
+ * histogram bucket if the metric keeps exemplars; an exemplar that does not
+ * fit, or that another process is recording at the same time, is dropped
+ */
+
+ngx_int_t
+ngx_prometheus_update_exemplar(prom_metric_type_t type, void *series,
+    double value, ngx_str_t *trace_id)
+{
+    int      rc;
+    u_char  *p, buf[PROM_EXEMPLAR_LABELS_LEN];
+    size_t   len;
+
+    len = 0;
+
+    if (trace_id && trace_id->len) {
+        len = sizeof("trace_id=\"\"") - 1 + trace_id->len
+              + ngx_prometheus_escape(NULL, trace_id->data, trace_id->len);
+    }
+
+    if (len > sizeof(buf)) {
+        len = 0;
+    }
+
+    if (len) {
+        p = ngx_cpymem(buf, "trace_id=\"", sizeof("trace_id=\"") - 1);
+        p = (u_char *) ngx_prometheus_escape(p, trace_id->data, trace_id->len);
+        *p = '"';
+    }
+
+    switch (type) {
+
+    case PROM_COUNTER:
+        if (len) {
+            rc = prom_metric_sample_add_exemplar(series, value,
+                                                 (char *) buf, len);
+
+        } else {
+            rc = prom_metric_sample_add(series, value);
+        }
+        break;
+
+    case PROM_GAUGE:
+        rc = prom_metric_sample_set(series, value);
+        break;
+
+    case PROM_HISTOGRAM:
+        if (len) {
+            rc = prom_metric_sample_histogram_observe_exemplar(series, value,
+                                                         (char *) buf, len);
+
+        } else {
+            rc = prom_metric_sample_histogram_observe(series, value);
+        }
+        break;
+
+    case PROM_SUMMARY:
+        rc = prom_metric_sample_summary_observe(series, value);
+        break;
+
+    default:
+        rc = 1;
+        break;
+    }
+
+    return rc ? NGX_ERROR : NGX_OK;
+}
+
+
+/*
+ * draws whether an observation of a sampled histogram is recorded; callers
+ * draw before they evaluate the value and the labels, so that observations
+ * left out cost no lookup of the series either; NGX_DECLINED skips them
+ */
+
+ngx_int_t
+ngx_prometheus_sample(ngx_cycle_t *cycle, ngx_uint_t index)
+{
+    prom_metric_t  *metric;
+
+    metric = ngx_prometheus_metric(cycle, index);
+
+    if (metric == NULL || metric->buckets == NULL) {
+        return NGX_OK;
+    }
+
+    return prom_histogram_buckets_sample(metric->buckets)
+           ? NGX_OK : NGX_DECLINED;
+}
+
+
+/*
+ * updates the series selected by the labels; an observation of a sampled
+ * histogram is recorded with its weight, the caller drew it before with
+ * ngx_prometheus_sample()
+ */
+
+ngx_int_t
+ngx_prometheus_observe(ngx_cycle_t *cycle, ngx_uint_t index, double value,
+    ngx_str_t *labels, ngx_pool_t *pool)
+{
+    return ngx_prometheus_observe_exemplar(cycle, index, value, labels, NULL,
+                                           pool);
+}
+
+
+ngx_int_t
+ngx_prometheus_observe_exemplar(ngx_cycle_t *cycle, ngx_uint_t index,
+    double value, ngx_str_t *labels, ngx_str_t *trace_id, ngx_pool_t *pool)
+{
+    void                   *series;
+    prom_metric_t          *metric;
+    ngx_prometheus_conf_t  *pcf;
+
+    pcf = (ngx_prometheus_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                                  ngx_prometheus_module);
+
+    if (pcf == NULL || pcf->ctx == NULL || index >= pcf->ctx->nmetrics) {
+        return NGX_DECLINED;
+    }
+
+    metric = pcf->ctx->metrics[index];
+
+    /* the key is counted in the sketch, no series is created for it */
+
+    if (metric->topk) {
+        return prom_topk_add(metric->topk, (char *) labels[0].data,
+                             labels[0].len, value)
+               ? NGX_ERROR : NGX_OK;
+    }
+
+    series = ngx_prometheus_series(pcf->ctx, index, labels, pool);
+    if (series == NULL) {
+        return NGX_ERROR;
+    }
+
+    return ngx_prometheus_update_exemplar(metric->type, series, value,
+                                          trace_id);
+}
+
+
+/* counts the key in the sketch of the series of a distinct count */
+
+ngx_int_t
+ngx_prometheus_count_distinct(ngx_cycle_t *cycle, ngx_uint_t index,
+    ngx_str_t *key, ngx_str_t *labels, ngx_pool_t *pool)
+{
+    void                   *series;
+    ngx_prometheus_conf_t  *pcf;
+
+    pcf = (ngx_prometheus_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                                  ngx_prometheus_module);
+
+    if (pcf == NULL || pcf->ctx == NULL || index >= pcf->ctx->nmetrics) {
+        return NGX_DECLINED;
+    }
+
+    series = ngx_prometheus_series(pcf->ctx, index, labels, pool);
+    if (series == NULL) {
+        return NGX_ERROR;
+    }
+
+    return ngx_prometheus_update_distinct(series, key);
+}
+
+
+ngx_int_t
+ngx_prometheus_update_distinct(void *series, ngx_str_t *key)
+{
+    prom_metric_sample_t  *sample = series;
+
+    if (sample->hll == NULL) {
+        return NGX_ERROR;
+    }
+
+    return prom_hll_add(sample->hll, (char *) key->data, key->len)
+           ? NGX_ERROR : NGX_OK;
+}
+
+
+/* escapes label values as the text exposition format requires */
+
+static uintptr_t
+ngx_prometheus_escape(u_char *dst, u_char *src, size_t size)
+{
+    u_char      ch;
+    ngx_uint_t  n;
+
+    if (dst == NULL) {
+        n = 0;
+
+        while (size) {
+            ch = *src++;
+
+            if (ch == '\\' || ch == '"' || ch == '\n') {
+                n++;
+            }
+
+            size--;
+        }
+
+        return (uintptr_t) n;
+    }
+
+    while (size) {
+        ch = *src++;
+
+        switch (ch) {
+
+        case '\\':
+        case '"':
+            *dst++ = '\\';
+            *dst++ = ch;
+            break;
+
+        case '\n':
+            *dst++ = '\\';
+            *dst++ = 'n';
+            break;
+
+        default:
+            *dst++ = ch;
+            break;
+        }
+
+        size--;
+    }
+
+    return (uintptr_t) dst;
+}
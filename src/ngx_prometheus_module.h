@@ -6,13 +6,105 @@
 #include <ngx_core.h>
 #include "prom.h"
 
+typedef struct {
+    ngx_pid_t                  pid;
+    ngx_uint_t                 connections;
+    ngx_uint_t                 free_connections;
+    ngx_uint_t                 timers;
+} ngx_prometheus_worker_t;
+
 typedef struct {
     prom_collector_registry_t *registry;
+    prom_metric_t            **metrics;     /* indexed as the declarations */
+    ngx_uint_t                 nmetrics;
+    ngx_prometheus_worker_t   *workers;     /* indexed by ngx_worker */
+    ngx_uint_t                 nworkers;
 } ngx_prometheus_ctx_t;
 
+typedef struct {
+    ngx_str_t                        name;
+    ngx_str_t                        help;
+    prom_metric_type_t               type;
+    ngx_array_t                      labels;    /* of char * */
+    ngx_array_t                     *buckets;   /* of double */
+    double                           log_min;   /* log-linear buckets */
+    double                           log_max;
+    ngx_uint_t                       log_sub;
+    ngx_array_t                     *quantiles; /* of double */
+    prom_timer_precision_t           precision;
+    ngx_int_t                        schema;    /* of native buckets */
+    unsigned                         native:1;
+    ngx_uint_t                       topk;      /* keys exposed */
+    ngx_uint_t                       topk_capacity;
+    ngx_uint_t                       hll_precision; /* of a distinct count */
+    time_t                           hll_window;
+    time_t                           window;    /* of per-second counts */
+    ngx_uint_t                       sampling;  /* one in sampling observed */
+    unsigned                         exemplars:1;
+    unsigned                         inflight:1;
+} ngx_prometheus_metric_conf_t;
+
+typedef ngx_int_t (*ngx_prometheus_init_pt)(ngx_prometheus_ctx_t *ctx,
+    ngx_pool_t *pool, void *data);
+
+typedef struct {
+    ngx_prometheus_init_pt           handler;
+    void                            *data;
+} ngx_prometheus_init_t;
+
 typedef struct {
     ngx_shm_zone_t                  *shm_zone;
     ngx_prometheus_ctx_t            *ctx;
+    ngx_array_t                      metrics;   /* of ngx_prometheus_metric_conf_t */
+    ngx_array_t                      inits;     /* of ngx_prometheus_init_t */
+    ngx_flag_t                       nginx_metrics;
+    ngx_uint_t                       nworkers;
+    ngx_msec_t                       loop_interval;
+    ngx_uint_t                       loop_lag;         /* metric indices */
+    ngx_uint_t                       loop_iteration;
+    unsigned                         windowed:1; /* values that decay */
 } ngx_prometheus_conf_t;
 
+
+prom_collector_registry_t *ngx_prometheus_registry(ngx_cycle_t *cycle);
+ngx_prometheus_ctx_t *ngx_prometheus_ctx(ngx_cycle_t *cycle);
+ngx_prometheus_metric_conf_t *ngx_prometheus_add_metric(ngx_conf_t *cf,
+    ngx_str_t *name, prom_metric_type_t type);
+ngx_int_t ngx_prometheus_add_init(ngx_conf_t *cf,
+    ngx_prometheus_init_pt handler, void *data);
+ngx_int_t ngx_prometheus_metric_index(ngx_conf_t *cf, ngx_str_t *name);
+ngx_prometheus_metric_conf_t *ngx_prometheus_metric_conf(ngx_conf_t *cf,
+    ngx_uint_t index);
+prom_metric_t *ngx_prometheus_metric(ngx_cycle_t *cycle, ngx_uint_t index);
+ngx_int_t ngx_prometheus_parse_double(u_char *data, size_t len,
+    double *value);
+char *ngx_prometheus_parse_labels(ngx_conf_t *cf,
+    ngx_prometheus_metric_conf_t *mcf, ngx_uint_t first, ngx_uint_t last,
+    ngx_str_t **labels);
+void *ngx_prometheus_series(ngx_prometheus_ctx_t *ctx, ngx_uint_t index,
+    ngx_str_t *labels, ngx_pool_t *pool);
+ngx_int_t ngx_prometheus_update(prom_metric_type_t type, void *series,
+    double value);
+ngx_int_t ngx_prometheus_update_exemplar(prom_metric_type_t type,
+    void *series, double value, ngx_str_t *trace_id);
+ngx_int_t ngx_prometheus_sample(ngx_cycle_t *cycle, ngx_uint_t index);
+ngx_int_t ngx_prometheus_observe(ngx_cycle_t *cycle, ngx_uint_t index,
+    double value, ngx_str_t *labels, ngx_pool_t *pool);
+ngx_int_t ngx_prometheus_observe_exemplar(ngx_cycle_t *cycle,
+    ngx_uint_t index, double value, ngx_str_t *labels, ngx_str_t *trace_id,
+    ngx_pool_t *pool);
+ngx_int_t ngx_prometheus_count_distinct(ngx_cycle_t *cycle, ngx_uint_t index,
+    ngx_str_t *key, ngx_str_t *labels, ngx_pool_t *pool);
+ngx_int_t ngx_prometheus_update_distinct(void *series, ngx_str_t *key);
+
+ngx_int_t ngx_prometheus_nginx_init(ngx_shm_zone_t *shm_zone,
+    ngx_prometheus_ctx_t *ctx, ngx_uint_t nworkers);
+void ngx_prometheus_nginx_update(ngx_cycle_t *cycle,
+    ngx_prometheus_ctx_t *ctx);
+ngx_int_t ngx_prometheus_event_loop_init(ngx_cycle_t *cycle,
+    ngx_prometheus_conf_t *pcf);
+
+
+extern ngx_module_t  ngx_prometheus_module;
+
 #endif /* _NGX_HTTP_PROMETHEUS_MODULE_H_INCLUDED_ */
\ No newline at end of file
@@ -0,0 +1,542 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_prometheus_module.h>
+#include "prom_metric.h"
+
+
+/*
+ * built-in collector of the state nginx maintains anyway: connection and
+ * request counters, per-worker connections and timers, and the slab
+ * statistics of the shared memory zones
+ *
+ * nothing is mirrored into samples; the values are read and rendered at
+ * scrape time, except for the per-worker values, which only the worker
+ * itself can read and which are published by the generation tick
+ */
+
+
+typedef struct {
+    char                *name;
+    ngx_uint_t           pages;
+    ngx_uint_t           free;
+    ngx_uint_t           nslots;
+    ngx_slab_stat_t     *stats;
+} ngx_prometheus_nginx_zone_t;
+
+
+static int ngx_prometheus_nginx_render(prom_collector_t *self,
+    prom_metric_formatter_t *formatter);
+#if (NGX_STAT_STUB)
+static int ngx_prometheus_nginx_render_stub(prom_metric_formatter_t *fmt);
+#endif
+static int ngx_prometheus_nginx_render_workers(prom_metric_formatter_t *fmt,
+    ngx_prometheus_ctx_t *ctx);
+static int ngx_prometheus_nginx_render_zones(prom_metric_formatter_t *fmt,
+    ngx_pool_t *pool);
+static ngx_prometheus_nginx_zone_t *ngx_prometheus_nginx_zones(
+    ngx_pool_t *pool, ngx_uint_t *nzones);
+static uint32_t ngx_prometheus_nginx_zones_crc(void);
+
+
+static const char  *ngx_prometheus_nginx_state_key[] = { "state" };
+static const char  *ngx_prometheus_nginx_worker_key[] = { "worker" };
+static const char  *ngx_prometheus_nginx_zone_keys[] = { "zone", "state" };
+static const char  *ngx_prometheus_nginx_slot_keys[] = { "zone", "size" };
+
+#if (NGX_STAT_STUB)
+
+/*
+ * the stub counters as last seen by the generation tick of this process;
+ * requests, active and writing are left out, every scrape moves them
+ */
+
+static ngx_atomic_uint_t  ngx_prometheus_nginx_stub[4];
+
+#endif
+
+/* the slab statistics of every zone as last seen by the generation tick */
+
+static uint32_t  ngx_prometheus_nginx_zones_last;
+
+
+ngx_int_t
+ngx_prometheus_nginx_init(ngx_shm_zone_t *shm_zone, ngx_prometheus_ctx_t *ctx,
+    ngx_uint_t nworkers)
+{
+    ngx_slab_pool_t   *shpool;
+    prom_collector_t  *collector;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    ctx->nworkers = nworkers;
+
+    ctx->workers = ngx_slab_calloc(shpool, ctx->nworkers
+                                   * sizeof(ngx_prometheus_worker_t));
+    if (ctx->workers == NULL) {
+        return NGX_ERROR;
+    }
+
+    collector = prom_collector_new("nginx", shpool);
+    if (collector == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (prom_collector_set_render_fn(collector, ngx_prometheus_nginx_render,
+                                     ctx)
+        != 0)
+    {
+        return NGX_ERROR;
+    }
+
+    if (prom_collector_registry_register_collector(ctx->registry, collector)
+        != 0)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/* publishes the values only the worker itself can read, once per tick */
+
+void
+ngx_prometheus_nginx_update(ngx_cycle_t *cycle, ngx_prometheus_ctx_t *ctx)
+{
+    uint32_t                  crc;
+    ngx_uint_t                n, changed;
+    ngx_rbtree_node_t        *node, *root, *sentinel;
+    ngx_prometheus_worker_t  *worker;
+#if (NGX_STAT_STUB)
+    ngx_uint_t                i;
+    ngx_atomic_uint_t         stub[4];
+#endif
+
+    /* cache helpers run with ngx_worker 0 as well */
+
+    if (ctx->workers == NULL || ngx_worker >= ctx->nworkers
+        || (ngx_process != NGX_PROCESS_WORKER
+            && ngx_process != NGX_PROCESS_SINGLE))
+    {
+        return;
+    }
+
+    worker = &ctx->workers[ngx_worker];
+
+    n = 0;
+    root = ngx_event_timer_rbtree.root;
+    sentinel = ngx_event_timer_rbtree.sentinel;
+
+    if (root != sentinel) {
+        for (node = ngx_rbtree_min(root, sentinel);
+             node;
+             node = ngx_rbtree_next(&ngx_event_timer_rbtree, node))
+        {
+            n++;
+        }
+    }
+
+    /*
+     * the values are not samples, let cached scrapes see them change, and
+     * only then: an idle server keeps its generation and answers with 304
+     */
+
+    changed = worker->pid != ngx_pid
+              || worker->connections
+                 != cycle->connection_n - cycle->free_connection_n
+              || worker->free_connections != cycle->free_connection_n
+              || worker->timers != n;
+
+    worker->pid = ngx_pid;
+    worker->connections = cycle->connection_n - cycle->free_connection_n;
+    worker->free_connections = cycle->free_connection_n;
+    worker->timers = n;
+
+#if (NGX_STAT_STUB)
+
+    stub[0] = *ngx_stat_accepted;
+    stub[1] = *ngx_stat_handled;
+    stub[2] = *ngx_stat_reading;
+    stub[3] = *ngx_stat_waiting;
+
+    for (i = 0; i < sizeof(stub) / sizeof(stub[0]); i++) {
+        if (stub[i] != ngx_prometheus_nginx_stub[i]) {
+            ngx_prometheus_nginx_stub[i] = stub[i];
+            changed = 1;
+        }
+    }
+
+#endif
+
+    crc = ngx_prometheus_nginx_zones_crc();
+
+    if (crc != ngx_prometheus_nginx_zones_last) {
+        ngx_prometheus_nginx_zones_last = crc;
+        changed = 1;
+    }
+
+    if (changed) {
+        prom_metric_sample_updated = 1;
+    }
+}
+
+
+static int
+ngx_prometheus_nginx_render(prom_collector_t *self,
+    prom_metric_formatter_t *formatter)
+{
+    int          r;
+    ngx_pool_t  *pool;
+
+#if (NGX_STAT_STUB)
+    r = ngx_prometheus_nginx_render_stub(formatter);
+    if (r) {
+        return r;
+    }
+#endif
+
+    r = ngx_prometheus_nginx_render_workers(formatter, self->data);
+    if (r) {
+        return r;
+    }
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+    if (pool == NULL) {
+        return 1;
+    }
+
+    r = ngx_prometheus_nginx_render_zones(formatter, pool);
+
+    ngx_destroy_pool(pool);
+
+    return r;
+}
+
+
+#if (NGX_STAT_STUB)
+
+static int
+ngx_prometheus_nginx_render_stub(prom_metric_formatter_t *fmt)
+{
+    int          r;
+    ngx_uint_t   i;
+    const char  *state[1];
+
+    static const char  *states[] = { "active", "reading", "writing",
+                                     "waiting" };
+
+    double  values[] = {
+        (double) *ngx_stat_active,
+        (double) *ngx_stat_reading,
+        (double) *ngx_stat_writing,
+        (double) *ngx_stat_waiting
+    };
+
+    r = prom_metric_formatter_begin_family(fmt,
+            "nginx_connections_accepted_total",
+            "Client connections accepted", PROM_COUNTER);
+    if (r) return r;
+    r = prom_metric_formatter_load_family_value(fmt, 0, NULL, NULL,
+                                                (double) *ngx_stat_accepted);
+    if (r) return r;
+    r = prom_metric_formatter_end_family(fmt);
+    if (r) return r;
+
+    r = prom_metric_formatter_begin_family(fmt,
+            "nginx_connections_handled_total",
+            "Client connections handled", PROM_COUNTER);
+    if (r) return r;
+    r = prom_metric_formatter_load_family_value(fmt, 0, NULL, NULL,
+                                                (double) *ngx_stat_handled);
+    if (r) return r;
+    r = prom_metric_formatter_end_family(fmt);
+    if (r) return r;
+
+    r = prom_metric_formatter_begin_family(fmt, "nginx_http_requests_total",
+            "Client requests", PROM_COUNTER);
+    if (r) return r;
+    r = prom_metric_formatter_load_family_value(fmt, 0, NULL, NULL,
+                                                (double) *ngx_stat_requests);
+    if (r) return r;
+    r = prom_metric_formatter_end_family(fmt);
+    if (r) return r;
+
+    r = prom_metric_formatter_begin_family(fmt, "nginx_connections",
+            "Client connections by state", PROM_GAUGE);
+    if (r) return r;
+
+    for (i = 0; i < sizeof(states) / sizeof(states[0]); i++) {
+        state[0] = states[i];
+
+        r = prom_metric_formatter_load_family_value(fmt, 1,
+                ngx_prometheus_nginx_state_key, state, values[i]);
+        if (r) return r;
+    }
+
+    return prom_metric_formatter_end_family(fmt);
+}
+
+#endif
+
+
+static int
+ngx_prometheus_nginx_render_workers(prom_metric_formatter_t *fmt,
+    ngx_prometheus_ctx_t *ctx)
+{
+    int                       r;
+    u_char                    buf[NGX_INT_T_LEN + 1];
+    ngx_uint_t                i, k;
+    const char               *worker[1];
+    ngx_prometheus_worker_t  *w;
+
+    static const char  *names[] = {
+        "nginx_worker_connections",
+        "nginx_worker_connections_free",
+        "nginx_worker_timers"
+    };
+
+    static const char  *helps[] = {
+        "Connections in use by the worker",
+        "Connections the worker can still accept",
+        "Timers pending in the worker"
+    };
+
+    worker[0] = (const char *) buf;
+
+    for (k = 0; k < sizeof(names) / sizeof(names[0]); k++) {
+
+        r = prom_metric_formatter_begin_family(fmt, names[k], helps[k],
+                                               PROM_GAUGE);
+        if (r) return r;
+
+        for (i = 0; i < ctx->nworkers; i++) {
+            w = &ctx->workers[i];
+
+            /* not started yet, or nothing published */
+
+            if (w->pid == 0) {
+                continue;
+            }
+
+            *ngx_sprintf(buf, "%ui", i) = '\0';
+
+            r = prom_metric_formatter_load_family_value(fmt, 1,
+                    ngx_prometheus_nginx_worker_key, worker,
+                    (double) (k == 0 ? w->connections
+                              : k == 1 ? w->free_connections : w->timers));
+            if (r) return r;
+        }
+
+        r = prom_metric_formatter_end_family(fmt);
+        if (r) return r;
+    }
+
+    return 0;
+}
+
+
+static int
+ngx_prometheus_nginx_render_zones(prom_metric_formatter_t *fmt,
+    ngx_pool_t *pool)
+{
+    int                           r;
+    u_char                        buf[NGX_INT_T_LEN + 1];
+    ngx_uint_t                    i, j, k, nzones;
+    const char                   *values[2];
+    ngx_prometheus_nginx_zone_t  *zones;
+
+    static const char  *names[] = {
+        "nginx_slab_allocations_total",
+        "nginx_slab_allocation_failures_total",
+        "nginx_slab_slots"
+    };
+
+    static const char  *helps[] = {
+        "Allocations from the slots of a shared memory zone",
+        "Allocations from the slots of a shared memory zone that failed",
+        "Slots of a shared memory zone in use"
+    };
+
+    zones = ngx_prometheus_nginx_zones(pool, &nzones);
+    if (zones == NULL) {
+        return 1;
+    }
+
+    r = prom_metric_formatter_begin_family(fmt, "nginx_slab_pages",
+            "Pages of a shared memory zone", PROM_GAUGE);
+    if (r) return r;
+
+    for (i = 0; i < nzones; i++) {
+        values[0] = zones[i].name;
+
+        values[1] = "used";
+        r = prom_metric_formatter_load_family_value(fmt, 2,
+                ngx_prometheus_nginx_zone_keys, values,
+                (double) (zones[i].pages - zones[i].free));
+        if (r) return r;
+
+        values[1] = "free";
+        r = prom_metric_formatter_load_family_value(fmt, 2,
+                ngx_prometheus_nginx_zone_keys, values,
+                (double) zones[i].free);
+        if (r) return r;
+    }
+
+    r = prom_metric_formatter_end_family(fmt);
+    if (r) return r;
+
+    values[1] = (const char *) buf;
+
+    for (k = 0; k < sizeof(names) / sizeof(names[0]); k++) {
+
+        r = prom_metric_formatter_begin_family(fmt, names[k], helps[k],
+                                               k < 2 ? PROM_COUNTER
+                                                     : PROM_GAUGE);
+        if (r) return r;
+
+        for (i = 0; i < nzones; i++) {
+            values[0] = zones[i].name;
+
+            for (j = 0; j < zones[i].nslots; j++) {
+
+                /* slot sizes start at 8 bytes, see ngx_slab_init() */
+
+                *ngx_sprintf(buf, "%uz", (size_t) 8 << j) = '\0';
+
+                r = prom_metric_formatter_load_family_value(fmt, 2,
+                        ngx_prometheus_nginx_slot_keys, values,
+                        (double) (k == 0 ? zones[i].stats[j].reqs
+                                  : k == 1 ? zones[i].stats[j].fails
+                                  : zones[i].stats[j].used));
+                if (r) return r;
+            }
+        }
+
+        r = prom_metric_formatter_end_family(fmt);
+        if (r) return r;
+    }
+
+    return 0;
+}
+
+
+/* copies the statistics of every zone, holding each lock only briefly */
+
+static ngx_prometheus_nginx_zone_t *
+ngx_prometheus_nginx_zones(ngx_pool_t *pool, ngx_uint_t *nzones)
+{
+    ngx_uint_t                    i, n;
+    ngx_list_part_t              *part;
+    ngx_shm_zone_t               *shm_zone;
+    ngx_slab_pool_t              *sp;
+    ngx_prometheus_nginx_zone_t  *zones, *zone;
+
+    n = 0;
+
+    for (part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+         part;
+         part = part->next)
+    {
+        n += part->nelts;
+    }
+
+    zones = ngx_palloc(pool, (n ? n : 1)
+                             * sizeof(ngx_prometheus_nginx_zone_t));
+    if (zones == NULL) {
+        return NULL;
+    }
+
+    n = 0;
+
+    for (part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+         part;
+         part = part->next)
+    {
+        shm_zone = part->elts;
+
+        for (i = 0; i < part->nelts; i++) {
+            sp = (ngx_slab_pool_t *) shm_zone[i].shm.addr;
+
+            if (sp == NULL) {
+                continue;
+            }
+
+            zone = &zones[n];
+
+            zone->name = ngx_pnalloc(pool, shm_zone[i].shm.name.len + 1);
+            if (zone->name == NULL) {
+                return NULL;
+            }
+
+            *ngx_cpymem(zone->name, shm_zone[i].shm.name.data,
+                        shm_zone[i].shm.name.len) = '\0';
+
+            zone->nslots = ngx_pagesize_shift - sp->min_shift;
+
+            zone->stats = ngx_palloc(pool,
+                                     zone->nslots * sizeof(ngx_slab_stat_t));
+            if (zone->stats == NULL) {
+                return NULL;
+            }
+
+            ngx_shmtx_lock(&sp->mutex);
+
+            zone->pages = sp->last - sp->pages;
+            zone->free = sp->pfree;
+            ngx_memcpy(zone->stats, sp->stats,
+                       zone->nslots * sizeof(ngx_slab_stat_t));
+
+            ngx_shmtx_unlock(&sp->mutex);
+
+            n++;
+        }
+    }
+
+    *nzones = n;
+
+    return zones;
+}
+
+
+/*
+ * checksums the exported slab statistics of every zone, the free pages and
+ * the slots; they are read without the zone locks, a torn read only costs
+ * an extra generation
+ */
+
+static uint32_t
+ngx_prometheus_nginx_zones_crc(void)
+{
+    uint32_t          crc;
+    ngx_uint_t        i;
+    ngx_list_part_t  *part;
+    ngx_shm_zone_t   *shm_zone;
+    ngx_slab_pool_t  *sp;
+
+    ngx_crc32_init(crc);
+
+    for (part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+         part;
+         part = part->next)
+    {
+        shm_zone = part->elts;
+
+        for (i = 0; i < part->nelts; i++) {
+            sp = (ngx_slab_pool_t *) shm_zone[i].shm.addr;
+
+            if (sp == NULL) {
+                continue;
+            }
+
+            ngx_crc32_update(&crc, (u_char *) &sp->pfree, sizeof(ngx_uint_t));
+            ngx_crc32_update(&crc, (u_char *) sp->stats,
+                             (ngx_pagesize_shift - sp->min_shift)
+                             * sizeof(ngx_slab_stat_t));
+        }
+    }
+
+    ngx_crc32_final(crc);
+
+    return crc;
+}
@@ -0,0 +1,621 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+#include <ngx_prometheus_module.h>
+#include "prom_metric.h"
+
+
+#define NGX_STREAM_PROMETHEUS_DURATION      0
+#define NGX_STREAM_PROMETHEUS_RECEIVED      1
+#define NGX_STREAM_PROMETHEUS_SENT          2
+#define NGX_STREAM_PROMETHEUS_CONNECT_TIME  3
+#define NGX_STREAM_PROMETHEUS_METRICS       4
+#define NGX_STREAM_PROMETHEUS_STATUSES      6
+
+
+typedef struct {
+    ngx_uint_t                      code;
+    ngx_str_t                       name;
+} ngx_stream_prometheus_status_t;
+
+
+typedef struct {
+    ngx_str_t                       name;
+    char                           *help;
+    prom_metric_type_t              type;
+    unsigned                        status:1;
+} ngx_stream_prometheus_builtin_t;
+
+
+typedef struct {
+    ngx_flag_t                      session_metrics;
+    ngx_uint_t                      metrics[NGX_STREAM_PROMETHEUS_METRICS];
+    void                           *duration[NGX_STREAM_PROMETHEUS_STATUSES];
+    void                           *received;
+    void                           *sent;
+    void                           *connect_time;
+} ngx_stream_prometheus_main_conf_t;
+
+
+typedef struct {
+    ngx_uint_t                      index;
+    prom_metric_type_t              type;
+    ngx_stream_complex_value_t      value;
+    double                          number;
+    ngx_uint_t                      nlabels;
+    ngx_stream_complex_value_t     *labels;     /* in declaration order */
+    void                           *series;     /* without labels */
+    unsigned                        constant:1;
+    unsigned                        distinct:1; /* the value is a key */
+    unsigned                        sampled:1;
+} ngx_stream_prometheus_observe_t;
+
+
+typedef struct {
+    ngx_array_t                    *observe;
+} ngx_stream_prometheus_srv_conf_t;
+
+
+static ngx_int_t ngx_stream_prometheus_log_handler(ngx_stream_session_t *s);
+static void ngx_stream_prometheus_log_session(ngx_stream_session_t *s,
+    ngx_stream_prometheus_main_conf_t *pmcf);
+static ngx_int_t ngx_stream_prometheus_init_series(ngx_prometheus_ctx_t *ctx,
+    ngx_pool_t *pool, void *data);
+static ngx_int_t ngx_stream_prometheus_init_observe(ngx_prometheus_ctx_t *ctx,
+    ngx_pool_t *pool, void *data);
+
+static ngx_int_t ngx_stream_prometheus_init(ngx_conf_t *cf);
+static void *ngx_stream_prometheus_create_main_conf(ngx_conf_t *cf);
+static char *ngx_stream_prometheus_init_main_conf(ngx_conf_t *cf,
+    void *conf);
+static void *ngx_stream_prometheus_create_srv_conf(ngx_conf_t *cf);
+static char *ngx_stream_prometheus_merge_srv_conf(ngx_conf_t *cf,
+    void *parent, void *child);
+static char *ngx_stream_prometheus_observe(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+
+
+/* the statuses the stream core sets, so that all series exist up front */
+
+static ngx_stream_prometheus_status_t  ngx_stream_prometheus_statuses[] = {
+    { NGX_STREAM_OK, ngx_string("200") },
+    { NGX_STREAM_BAD_REQUEST, ngx_string("400") },
+    { NGX_STREAM_FORBIDDEN, ngx_string("403") },
+    { NGX_STREAM_INTERNAL_SERVER_ERROR, ngx_string("500") },
+    { NGX_STREAM_BAD_GATEWAY, ngx_string("502") },
+    { NGX_STREAM_SERVICE_UNAVAILABLE, ngx_string("503") }
+};
+
+
+static ngx_stream_prometheus_builtin_t  ngx_stream_prometheus_metrics[] = {
+
+    { ngx_string("nginx_stream_session_duration_seconds"),
+      "Duration of stream sessions by status",
+      PROM_HISTOGRAM, 1 },
+
+    { ngx_string("nginx_stream_received_bytes_total"),
+      "Bytes received from stream clients",
+      PROM_COUNTER, 0 },
+
+    { ngx_string("nginx_stream_sent_bytes_total"),
+      "Bytes sent to stream clients",
+      PROM_COUNTER, 0 },
+
+    { ngx_string("nginx_stream_upstream_connect_time_seconds"),
+      "Time spent establishing connections with stream upstream peers",
+      PROM_HISTOGRAM, 0 }
+};
+
+
+static ngx_command_t  ngx_stream_prometheus_commands[] = {
+
+    { ngx_string("prometheus_session_metrics"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      offsetof(ngx_stream_prometheus_main_conf_t, session_metrics),
+      NULL },
+
+    { ngx_string("prometheus_observe"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_2MORE,
+      ngx_stream_prometheus_observe,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_stream_module_t  ngx_stream_prometheus_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_stream_prometheus_init,            /* postconfiguration */
+
+    ngx_stream_prometheus_create_main_conf, /* create main configuration */
+    ngx_stream_prometheus_init_main_conf,  /* init main configuration */
+
+    ngx_stream_prometheus_create_srv_conf, /* create server configuration */
+    ngx_stream_prometheus_merge_srv_conf   /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_stream_prometheus_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_prometheus_module_ctx,     /* module context */
+    ngx_stream_prometheus_commands,        /* module directives */
+    NGX_STREAM_MODULE,                     /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_stream_prometheus_log_handler(ngx_stream_session_t *s)
+{
+    double                              number;
+    ngx_int_t                           rc;
+    ngx_str_t                           value, *labels;
+    ngx_uint_t                          i, j;
+    ngx_stream_prometheus_observe_t    *ob;
+    ngx_stream_prometheus_srv_conf_t   *pscf;
+    ngx_stream_prometheus_main_conf_t  *pmcf;
+
+    pmcf = ngx_stream_get_module_main_conf(s, ngx_stream_prometheus_module);
+
+    if (pmcf->session_metrics) {
+        ngx_stream_prometheus_log_session(s, pmcf);
+    }
+
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_prometheus_module);
+
+    if (pscf->observe == NULL) {
+        return NGX_OK;
+    }
+
+    ob = pscf->observe->elts;
+
+    for (i = 0; i < pscf->observe->nelts; i++) {
+
+        if (ob[i].sampled
+            && ngx_prometheus_sample((ngx_cycle_t *) ngx_cycle, ob[i].index)
+               != NGX_OK)
+        {
+            continue;
+        }
+
+        number = 0;
+
+        if (ob[i].distinct) {
+            if (ngx_stream_complex_value(s, &ob[i].value, &value) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+        } else if (ob[i].constant) {
+            number = ob[i].number;
+
+        } else {
+            if (ngx_stream_complex_value(s, &ob[i].value, &value) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            if (ngx_prometheus_parse_double(value.data, value.len, &number)
+                != NGX_OK)
+            {
+                ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                               "prometheus: skipped value \"%V\"", &value);
+                continue;
+            }
+        }
+
+        /* a series without labels is resolved with the zone */
+
+        if (ob[i].series) {
+            rc = ob[i].distinct
+                 ? ngx_prometheus_update_distinct(ob[i].series, &value)
+                 : ngx_prometheus_update(ob[i].type, ob[i].series, number);
+
+            if (rc == NGX_ERROR) {
+                ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                              "prometheus: could not update metric");
+            }
+
+            continue;
+        }
+
+        labels = NULL;
+
+        if (ob[i].nlabels) {
+            labels = ngx_palloc(s->connection->pool,
+                                ob[i].nlabels * sizeof(ngx_str_t));
+            if (labels == NULL) {
+                return NGX_ERROR;
+            }
+
+            for (j = 0; j < ob[i].nlabels; j++) {
+                if (ngx_stream_complex_value(s, &ob[i].labels[j], &labels[j])
+                    != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+            }
+        }
+
+        if (ob[i].distinct) {
+            rc = ngx_prometheus_count_distinct((ngx_cycle_t *) ngx_cycle,
+                                               ob[i].index, &value, labels,
+                                               s->connection->pool);
+
+        } else {
+            rc = ngx_prometheus_observe((ngx_cycle_t *) ngx_cycle,
+                                        ob[i].index, number, labels,
+                                        s->connection->pool);
+        }
+
+        if (rc == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                          "prometheus: could not update metric");
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/* all series are created with the zone, a session only updates them */
+
+static void
+ngx_stream_prometheus_log_session(ngx_stream_session_t *s,
+    ngx_stream_prometheus_main_conf_t *pmcf)
+{
+    ngx_uint_t                    i;
+    ngx_msec_int_t                ms;
+    ngx_time_t                   *tp;
+    ngx_stream_upstream_state_t  *state;
+
+    tp = ngx_timeofday();
+
+    ms = (ngx_msec_int_t) ((tp->sec - s->start_sec) * 1000
+                           + (tp->msec - s->start_msec));
+    ms = ngx_max(ms, 0);
+
+    for (i = 0; i < NGX_STREAM_PROMETHEUS_STATUSES; i++) {
+        if (ngx_stream_prometheus_statuses[i].code == s->status) {
+            (void) prom_metric_sample_histogram_observe(pmcf->duration[i],
+                                                        (double) ms / 1000);
+            break;
+        }
+    }
+
+    (void) prom_metric_sample_add(pmcf->received, (double) s->received);
+    (void) prom_metric_sample_add(pmcf->sent, (double) s->connection->sent);
+
+    if (s->upstream_states == NULL) {
+        return;
+    }
+
+    state = s->upstream_states->elts;
+
+    for (i = 0; i < s->upstream_states->nelts; i++) {
+        if (state[i].peer == NULL
+            || state[i].connect_time == (ngx_msec_t) -1)
+        {
+            continue;
+        }
+
+        (void) prom_metric_sample_histogram_observe(pmcf->connect_time,
+                                       (double) state[i].connect_time / 1000);
+    }
+}
+
+
+static ngx_int_t
+ngx_stream_prometheus_init_series(ngx_prometheus_ctx_t *ctx, ngx_pool_t *pool,
+    void *data)
+{
+    ngx_stream_prometheus_main_conf_t *pmcf = data;
+
+    ngx_uint_t  i;
+
+    for (i = 0; i < NGX_STREAM_PROMETHEUS_STATUSES; i++) {
+        pmcf->duration[i] = ngx_prometheus_series(ctx,
+                                pmcf->metrics[NGX_STREAM_PROMETHEUS_DURATION],
+                                &ngx_stream_prometheus_statuses[i].name, pool);
+        if (pmcf->duration[i] == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    pmcf->received = ngx_prometheus_series(ctx,
+                             pmcf->metrics[NGX_STREAM_PROMETHEUS_RECEIVED],
+                             NULL, pool);
+    pmcf->sent = ngx_prometheus_series(ctx,
+                             pmcf->metrics[NGX_STREAM_PROMETHEUS_SENT],
+                             NULL, pool);
+    pmcf->connect_time = ngx_prometheus_series(ctx,
+                             pmcf->metrics[NGX_STREAM_PROMETHEUS_CONNECT_TIME],
+                             NULL, pool);
+
+    if (pmcf->received == NULL || pmcf->sent == NULL
+        || pmcf->connect_time == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * the series of observes without labels are resolved once, the others
+ * go through the series cache of the worker
+ */
+
+static ngx_int_t
+ngx_stream_prometheus_init_observe(ngx_prometheus_ctx_t *ctx,
+    ngx_pool_t *pool, void *data)
+{
+    ngx_array_t *observe = data;
+
+    ngx_uint_t                        i;
+    ngx_stream_prometheus_observe_t  *ob;
+
+    ob = observe->elts;
+
+    for (i = 0; i < observe->nelts; i++) {
+        if (ob[i].nlabels) {
+            continue;
+        }
+
+        ob[i].series = ngx_prometheus_series(ctx, ob[i].index, NULL, pool);
+        if (ob[i].series == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_prometheus_init(ngx_conf_t *cf)
+{
+    char                               **label;
+    ngx_uint_t                           i;
+    ngx_stream_handler_pt               *h;
+    ngx_stream_core_main_conf_t         *cmcf;
+    ngx_prometheus_metric_conf_t        *mcf;
+    ngx_stream_prometheus_builtin_t     *builtin;
+    ngx_stream_prometheus_main_conf_t   *pmcf;
+
+    cmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_STREAM_LOG_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_stream_prometheus_log_handler;
+
+    pmcf = ngx_stream_conf_get_module_main_conf(cf,
+                                                ngx_stream_prometheus_module);
+
+    if (!pmcf->session_metrics) {
+        return NGX_OK;
+    }
+
+    builtin = ngx_stream_prometheus_metrics;
+
+    for (i = 0; i < NGX_STREAM_PROMETHEUS_METRICS; i++) {
+        mcf = ngx_prometheus_add_metric(cf, &builtin[i].name, builtin[i].type);
+        if (mcf == NULL) {
+            return NGX_ERROR;
+        }
+
+        mcf->help.data = (u_char *) builtin[i].help;
+        mcf->help.len = ngx_strlen(builtin[i].help);
+
+        if (builtin[i].status) {
+            label = ngx_array_push(&mcf->labels);
+            if (label == NULL) {
+                return NGX_ERROR;
+            }
+
+            *label = "status";
+        }
+
+        pmcf->metrics[i] = ngx_prometheus_metric_index(cf, &builtin[i].name);
+    }
+
+    return ngx_prometheus_add_init(cf, ngx_stream_prometheus_init_series,
+                                   pmcf);
+}
+
+
+static void *
+ngx_stream_prometheus_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_stream_prometheus_main_conf_t  *pmcf;
+
+    pmcf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_prometheus_main_conf_t));
+    if (pmcf == NULL) {
+        return NULL;
+    }
+
+    pmcf->session_metrics = NGX_CONF_UNSET;
+
+    return pmcf;
+}
+
+
+static char *
+ngx_stream_prometheus_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_stream_prometheus_main_conf_t *pmcf = conf;
+
+    ngx_conf_init_value(pmcf->session_metrics, 0);
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_stream_prometheus_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_stream_prometheus_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_prometheus_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->observe = NGX_CONF_UNSET_PTR;
+
+    return conf;
+}
+
+
+static char *
+ngx_stream_prometheus_merge_srv_conf(ngx_conf_t *cf, void *parent,
+    void *child)
+{
+    ngx_stream_prometheus_srv_conf_t *prev = parent;
+    ngx_stream_prometheus_srv_conf_t *conf = child;
+
+    ngx_conf_merge_ptr_value(conf->observe, prev->observe, NULL);
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * prometheus_observe metric value [label=value ...];
+ *
+ * as in http, with stream variables
+ */
+
+static char *
+ngx_stream_prometheus_observe(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_prometheus_srv_conf_t *pscf = conf;
+
+    ngx_str_t                           *value, *values;
+    ngx_int_t                            index;
+    ngx_uint_t                           n;
+    ngx_prometheus_metric_conf_t        *mcf;
+    ngx_stream_prometheus_observe_t     *ob;
+    ngx_stream_compile_complex_value_t   ccv;
+
+    value = cf->args->elts;
+
+    index = ngx_prometheus_metric_index(cf, &value[1]);
+
+    if (index == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "unknown metric \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    mcf = ngx_prometheus_metric_conf(cf, index);
+
+    if (mcf->inflight) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "metric \"%V\" is updated by "
+                           "\"prometheus_inflight\" only", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (pscf->observe == NGX_CONF_UNSET_PTR) {
+        pscf->observe = ngx_array_create(cf->pool, 4,
+                                    sizeof(ngx_stream_prometheus_observe_t));
+        if (pscf->observe == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_prometheus_add_init(cf, ngx_stream_prometheus_init_observe,
+                                    pscf->observe)
+            != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    ob = ngx_array_push(pscf->observe);
+    if (ob == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(ob, sizeof(ngx_stream_prometheus_observe_t));
+
+    ob->index = index;
+    ob->type = mcf->type;
+
+    /* the log handler draws before it evaluates anything */
+
+    if (mcf->sampling > 1) {
+        ob->sampled = 1;
+    }
+
+    ngx_memzero(&ccv, sizeof(ngx_stream_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = &value[2];
+    ccv.complex_value = &ob->value;
+
+    if (ngx_stream_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (mcf->hll_precision) {
+        ob->distinct = 1;
+
+    } else if (ob->value.lengths == NULL) {
+        if (ngx_prometheus_parse_double(value[2].data, value[2].len,
+                                        &ob->number)
+            != NGX_OK)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid value \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        ob->constant = 1;
+    }
+
+    ob->nlabels = mcf->labels.nelts;
+
+    if (ngx_prometheus_parse_labels(cf, mcf, 3, cf->args->nelts, &values)
+        != NGX_CONF_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    if (values == NULL) {
+        return NGX_CONF_OK;
+    }
+
+    ob->labels = ngx_pcalloc(cf->pool,
+                             ob->nlabels * sizeof(ngx_stream_complex_value_t));
+    if (ob->labels == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    for (n = 0; n < ob->nlabels; n++) {
+        ngx_memzero(&ccv, sizeof(ngx_stream_compile_complex_value_t));
+
+        ccv.cf = cf;
+        ccv.value = &values[n];
+        ccv.complex_value = &ob->labels[n];
+
+        if (ngx_stream_compile_complex_value(&ccv) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
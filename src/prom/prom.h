@@ -0,0 +1,24 @@
+#ifndef PROM_H
+#define PROM_H
+
+/**
+ * @file prom.h
+ * @brief Umbrella header of the prom library
+ */
+
+#include "prom_alloc.h"
+#include "prom_collector.h"
+#include "prom_collector_registry.h"
+#include "prom_exemplar.h"
+#include "prom_histogram_buckets.h"
+#include "prom_hll.h"
+#include "prom_metric.h"
+#include "prom_metric_sample.h"
+#include "prom_metric_sample_histogram.h"
+#include "prom_metric_sample_summary.h"
+#include "prom_native_histogram.h"
+#include "prom_timer.h"
+#include "prom_topk.h"
+#include "prom_window.h"
+
+#endif  // PROM_H
@@ -0,0 +1,34 @@
+/*
+Copyright 2019-2020 DigitalOcean Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+
+/**
+ * @file prom_assert.h
+ * @brief assertions, compiled out unless PROM_ASSERT_ENABLE is defined
+ */
+
+#ifndef PROM_ASSERT_H
+#define PROM_ASSERT_H
+
+#include <assert.h>
+
+#ifdef PROM_ASSERT_ENABLE
+#define PROM_ASSERT(i) assert(i)
+#else
+#define PROM_ASSERT(i) ((void)0)
+#endif  // PROM_ASSERT_ENABLE
+
+#endif  // PROM_ASSERT_H
@@ -0,0 +1,56 @@
+#ifndef PROM_ATOMIC_H
+#define PROM_ATOMIC_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/**
+ * @file prom_atomic.h
+ * @brief API PRIVATE Lock-free helpers shared by the samples and the sketches in shared memory
+ *
+ * They are inline: the observations of a histogram and the updates of a window call them on every write.
+ */
+
+/**
+ * @brief API PRIVATE Adds the value to an atomic double
+ */
+static inline void prom_atomic_add_double(_Atomic double *target, double value) {
+  double old = atomic_load_explicit(target, memory_order_relaxed);
+
+  // A failed exchange reloads old
+  while (!atomic_compare_exchange_weak(target, &old, old + value)) continue;
+}
+
+/**
+ * @brief API PRIVATE Claims the slot of a ring that rotates lazily with the writes, stamped with the period it holds.
+ *
+ * The first writer of a new period stamps the slot -1, clears it and then publishes it with prom_atomic_publish().
+ * Writers meanwhile, and writers of an earlier period late to the rotation, must leave the slot alone and drop their
+ * update.
+ *
+ * @param stamp The stamp of the slot: the period it holds, 0 before any, -1 while it is cleared
+ * @param period The period of the write, at least 1
+ * @return 0 if the slot holds the period, 1 if the caller must clear and publish it, -1 if the update is dropped
+ */
+static inline int prom_atomic_claim(_Atomic int64_t *stamp, int64_t period) {
+  int64_t current = atomic_load_explicit(stamp, memory_order_acquire);
+
+  for (;;) {
+    if (current == period) return 0;
+
+    // A later period only, a process late to the rotation must not clear the slot again
+    if (current == -1 || current > period) return -1;
+
+    // A failed exchange reloads current, which another process may just have stamped with the period
+    if (atomic_compare_exchange_weak(stamp, &current, -1)) return 1;
+  }
+}
+
+/**
+ * @brief API PRIVATE Publishes a slot claimed with prom_atomic_claim() once it is cleared
+ */
+static inline void prom_atomic_publish(_Atomic int64_t *stamp, int64_t period) {
+  atomic_store_explicit(stamp, period, memory_order_release);
+}
+
+#endif  // PROM_ATOMIC_H
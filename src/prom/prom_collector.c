@@ -1,4 +1,6 @@
 #include "prom_collector.h"
+#include "prom_assert.h"
+#include "prom_log.h"
 
 prom_map_t *prom_collector_default_collect(prom_collector_t *self) { return self->metrics; }
 
@@ -8,13 +10,14 @@ prom_collector_t *prom_collector_new(const char *name, ngx_slab_pool_t *shpool)
     if (self == NULL) {
         return NULL;
     }
+    self->shpool = shpool;
 
     if (name) {
-        self->name = ngx_slab_calloc(shpool, ngx_strlen(name));
+        self->name = ngx_slab_calloc(shpool, ngx_strlen(name) + 1);
         if (self->name == NULL) {
             return NULL;
         }
-        ngx_memcpy(self->name, name, ngx_strlen(name));
+        ngx_memcpy((char *)self->name, name, ngx_strlen(name));
     }
 
     self->metrics = prom_map_new(shpool);
@@ -36,6 +39,30 @@ prom_collector_t *prom_collector_new(const char *name, ngx_slab_pool_t *shpool)
     return self;
 }
 
+int prom_collector_destroy(prom_collector_t *self) {
+  if (self == NULL) return 0;
+
+  int r = 0;
+  int ret = 0;
+
+  r = prom_map_destroy(self->metrics);
+  if (r) ret = r;
+  self->metrics = NULL;
+
+  r = prom_string_builder_destroy(self->string_builder);
+  if (r) ret = r;
+  self->string_builder = NULL;
+
+  if (self->name != NULL) {
+    ngx_slab_free(self->shpool, (void *)self->name);
+    self->name = NULL;
+  }
+
+  ngx_slab_free(self->shpool, self);
+  self = NULL;
+  return ret;
+}
+
 int prom_collector_destroy_generic(void *gen) {
   int r = 0;
   prom_collector_t *self = (prom_collector_t *)gen;
@@ -56,6 +83,14 @@ int prom_collector_set_collect_fn(prom_collector_t *self, prom_collect_fn *fn) {
   return 0;
 }
 
+int prom_collector_set_render_fn(prom_collector_t *self, prom_render_fn *fn, void *data) {
+  PROM_ASSERT(self != NULL);
+  if (self == NULL) return 1;
+  self->render_fn = fn;
+  self->data = data;
+  return 0;
+}
+
 int prom_collector_add_metric(prom_collector_t *self, prom_metric_t *metric) {
   PROM_ASSERT(self != NULL);
   if (self == NULL) return 1;
@@ -63,5 +98,6 @@ int prom_collector_add_metric(prom_collector_t *self, prom_metric_t *metric) {
     PROM_LOG("metric already found in collector");
     return 1;
   }
+  prom_metric_sample_updated = 1;
   return prom_map_set(self->metrics, metric->name, metric);
 }
\ No newline at end of file
@@ -32,14 +32,6 @@ limitations under the License.
  */
 typedef struct prom_collector prom_collector_t;
 
-struct prom_collector {
-  const char *name;
-  prom_map_t *metrics;
-  prom_collect_fn *collect_fn;
-  prom_string_builder_t *string_builder;
-  ngx_slab_pool_t *shpool;
-};
-
 /**
  * @brief The function responsible for preparing metric data and returning metrics for a given collector.
  *
@@ -51,6 +43,35 @@ struct prom_collector {
  */
 typedef prom_map_t *prom_collect_fn(prom_collector_t *self);
 
+/**
+ * @brief Renders the metrics of a collector straight into the formatter at scrape time.
+ *
+ * A render function reads values that are maintained elsewhere and loads them with
+ * prom_metric_formatter_begin_family(), prom_metric_formatter_load_family_value() and
+ * prom_metric_formatter_end_family(), so that no prom_metric_t or prom_metric_sample_t has to mirror them.
+ *
+ * @param self The target prom_collector_t*
+ * @param formatter The prom_metric_formatter_t* of the scrape
+ * @return A non-zero integer value upon failure
+ */
+typedef int prom_render_fn(prom_collector_t *self, prom_metric_formatter_t *formatter);
+
+struct prom_collector {
+  const char *name;
+  prom_map_t *metrics;
+  prom_collect_fn *collect_fn;
+  prom_string_builder_t *string_builder;
+  ngx_slab_pool_t *shpool;
+  prom_render_fn *render_fn; /**< Renders the collector instead of collect_fn when set */
+  void *data;                /**< Opaque pointer for render_fn. It MUST be valid in every process. */
+};
+
+/**
+ * @brief API PRIVATE The default prom_collect_fn. It returns the metrics added to the collector through
+ * prom_collector_add_metric().
+ */
+prom_map_t *prom_collector_default_collect(prom_collector_t *self);
+
 /**
  * @brief Create a collector
  * @param name The name of the collector. The name MUST NOT be default or process.
@@ -96,4 +117,13 @@ int prom_collector_add_metric(prom_collector_t *self, prom_metric_t *metric);
  */
 int prom_collector_set_collect_fn(prom_collector_t *self, prom_collect_fn *fn);
 
+/**
+ * @brief Renders the collector with fn instead of its metrics
+ * @param self The target prom_collector_t*
+ * @param fn The prom_render_fn* called on every scrape
+ * @param data The opaque pointer stored in the data field of the collector
+ * @return A non-zero integer value upon failure.
+ */
+int prom_collector_set_render_fn(prom_collector_t *self, prom_render_fn *fn, void *data);
+
 #endif  // PROM_COLLECTOR_H
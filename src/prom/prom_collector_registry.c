@@ -1,23 +1,52 @@
 #include "prom_collector.h"
 #include <regex.h>
 #include "prom_collector_registry.h"
+#include "prom_assert.h"
+
+prom_collector_registry_t *PROM_COLLECTOR_REGISTRY_DEFAULT;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Static Declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief API PRIVATE A contiguous run [lo, hi) of the metric name index selected by a filter
+ */
+typedef struct prom_collector_registry_range {
+  size_t lo;
+  size_t hi;
+} prom_collector_registry_range_t;
+
+static size_t prom_collector_registry_metric_count(prom_collector_registry_t *self);
+
+static int prom_collector_registry_index_build(prom_collector_registry_t *self, size_t metric_count);
+
+static int prom_collector_registry_index_compare(const void *a, const void *b);
+
+static int prom_collector_registry_range_compare(const void *a, const void *b);
+
+static int prom_collector_registry_load_filtered(prom_collector_registry_t *self,
+                                                 const prom_metric_name_filter_t *filters, size_t filter_count);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// End static declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 prom_collector_registry_t *prom_collector_registry_new(const char *name, ngx_slab_pool_t *shpool)
 {
-    int r = 0;
-
     prom_collector_registry_t *self = (prom_collector_registry_t *)ngx_slab_calloc(shpool, sizeof(prom_collector_registry_t));
     if (self == NULL) {
         return NULL;
     }
     if (name) {
-        self->name = ngx_slab_calloc(shpool, ngx_strlen(name));
+        self->name = ngx_slab_calloc(shpool, ngx_strlen(name) + 1);
         if (self->name == NULL) {
             return NULL;
         }
-        ngx_memcpy(self->name, name, ngx_strlen(name));
+        ngx_memcpy((char *)self->name, name, ngx_strlen(name));
     }
     self->shpool = shpool;
+    self->created = ngx_time();
     self->collectors = prom_map_new(shpool);
     prom_map_set_free_value_fn(self->collectors, &prom_collector_free_generic);
     prom_map_set(self->collectors, "default", prom_collector_new("default", shpool));
@@ -55,6 +84,12 @@ int prom_collector_registry_destroy(prom_collector_registry_t *self) {
   self->string_builder = NULL;
   if (r) ret = r;
 
+  if (self->index != NULL) {
+    ngx_slab_free(self->shpool, self->index);
+    self->index = NULL;
+    self->index_size = 0;
+  }
+
 
   ngx_slab_free(self->shpool,(char *)self->name);
   self->name = NULL;
@@ -92,17 +127,18 @@ int prom_collector_registry_register_collector(prom_collector_registry_t *self,
 
   int r = 0;
 
-  ngx_rwlock_wlock(self->rwlock);
+  ngx_rwlock_wlock(&self->rwlock);
   if (prom_map_get(self->collectors, collector->name) != NULL) {
-    ngx_rwlock_unlock(self->rwlock);
+    ngx_rwlock_unlock(&self->rwlock);
     return 1;
   }
   r = prom_map_set(self->collectors, collector->name, collector);
   if (r) {
-    ngx_rwlock_unlock(self->rwlock);
+    ngx_rwlock_unlock(&self->rwlock);
     return r;
   }
-ngx_rwlock_unlock(self->rwlock);
+  prom_metric_sample_updated = 1;
+  ngx_rwlock_unlock(&self->rwlock);
   return 0;
 }
 
@@ -129,3 +165,259 @@ const char *prom_collector_registry_bridge(prom_collector_registry_t *self) {
   prom_metric_formatter_load_metrics(self->metric_formatter, self->collectors);
   return (const char *)prom_metric_formatter_dump(self->metric_formatter);
 }
+
+ngx_atomic_uint_t prom_collector_registry_generation(prom_collector_registry_t *self) {
+  PROM_ASSERT(self != NULL);
+
+  if (prom_metric_sample_updated) {
+    prom_metric_sample_updated = 0;
+    return ngx_atomic_fetch_add(&self->generation, 1) + 1;
+  }
+
+  return self->generation;
+}
+
+int prom_collector_registry_render(prom_collector_registry_t *self, prom_metric_format_t format,
+                                   const prom_metric_name_filter_t *filters, size_t filter_count,
+                                   prom_metric_formatter_flush_fn *fn, void *data) {
+  int r = 0;
+  PROM_ASSERT(self != NULL);
+  if (self == NULL) return 1;
+
+  prom_metric_formatter_clear(self->metric_formatter);
+  prom_metric_formatter_set_format(self->metric_formatter, format);
+  prom_metric_formatter_set_flush_fn(self->metric_formatter, fn, data);
+
+  if (filters != NULL && filter_count != 0) {
+    prom_metric_formatter_set_filters(self->metric_formatter, filters, filter_count);
+    r = prom_collector_registry_load_filtered(self, filters, filter_count);
+    prom_metric_formatter_set_filters(self->metric_formatter, NULL, 0);
+  } else {
+    r = prom_metric_formatter_load_metrics(self->metric_formatter, self->collectors);
+  }
+
+  if (r == 0) {
+    r = prom_metric_formatter_finish(self->metric_formatter);
+  }
+
+  prom_metric_formatter_set_flush_fn(self->metric_formatter, NULL, NULL);
+  prom_metric_formatter_set_format(self->metric_formatter, PROM_FORMAT_TEXT);
+  prom_metric_formatter_clear(self->metric_formatter);
+  return r;
+}
+
+/**
+ * @brief API PRIVATE Counts the metrics held by collectors using the default collect function.
+ *
+ * Metrics are never unregistered, so the count changes whenever a metric is added and tells whether the index is
+ * stale without hooking every registration path.
+ */
+static size_t prom_collector_registry_metric_count(prom_collector_registry_t *self) {
+  size_t count = 0;
+  for (prom_linked_list_node_t *current_node = self->collectors->keys->head; current_node != NULL;
+       current_node = current_node->next) {
+    prom_collector_t *collector = (prom_collector_t *)prom_map_get(self->collectors, (const char *)current_node->item);
+    if (collector == NULL || collector->collect_fn != &prom_collector_default_collect) continue;
+    count += prom_map_size(collector->metrics);
+  }
+  return count;
+}
+
+static int prom_collector_registry_index_compare(const void *a, const void *b) {
+  const prom_collector_registry_index_entry_t *entry_a = (const prom_collector_registry_index_entry_t *)a;
+  const prom_collector_registry_index_entry_t *entry_b = (const prom_collector_registry_index_entry_t *)b;
+  return strcmp(entry_a->name, entry_b->name);
+}
+
+/**
+ * @brief API PRIVATE Rebuilds the metric name index, with an entry for each metric and one for each window family.
+ * The caller MUST hold the registry write lock.
+ */
+static int prom_collector_registry_index_build(prom_collector_registry_t *self, size_t metric_count) {
+  prom_collector_registry_index_entry_t *index = NULL;
+  size_t n = 0;
+  size_t m = 0;
+
+  if (metric_count != 0) {
+    index = (prom_collector_registry_index_entry_t *)ngx_slab_alloc(
+        self->shpool, sizeof(prom_collector_registry_index_entry_t) * metric_count * 2);
+    if (index == NULL) return 1;
+  }
+
+  for (prom_linked_list_node_t *current_node = self->collectors->keys->head; current_node != NULL;
+       current_node = current_node->next) {
+    prom_collector_t *collector = (prom_collector_t *)prom_map_get(self->collectors, (const char *)current_node->item);
+    if (collector == NULL || collector->collect_fn != &prom_collector_default_collect) continue;
+
+    for (prom_linked_list_node_t *metric_node = collector->metrics->keys->head; metric_node != NULL && m < metric_count;
+         metric_node = metric_node->next) {
+      prom_metric_t *metric = (prom_metric_t *)prom_map_get(collector->metrics, (const char *)metric_node->item);
+      if (metric == NULL) continue;
+      index[n].name = metric->name;
+      index[n].metric = metric;
+      index[n].window = 0;
+      n++;
+      m++;
+
+      if (metric->window != 0 && metric->window_name != NULL) {
+        index[n].name = metric->window_name;
+        index[n].metric = metric;
+        index[n].window = 1;
+        n++;
+      }
+    }
+  }
+
+  if (n != 0) {
+    qsort(index, n, sizeof(prom_collector_registry_index_entry_t), &prom_collector_registry_index_compare);
+  }
+
+  if (self->index != NULL) {
+    ngx_slab_free(self->shpool, self->index);
+  }
+  self->index = index;
+  self->index_size = n;
+  self->index_metrics = m;
+  return 0;
+}
+
+static int prom_collector_registry_range_compare(const void *a, const void *b) {
+  const prom_collector_registry_range_t *range_a = (const prom_collector_registry_range_t *)a;
+  const prom_collector_registry_range_t *range_b = (const prom_collector_registry_range_t *)b;
+  if (range_a->lo < range_b->lo) return -1;
+  return range_a->lo > range_b->lo;
+}
+
+static int prom_collector_registry_load_filtered(prom_collector_registry_t *self,
+                                                 const prom_metric_name_filter_t *filters, size_t filter_count) {
+  int r = 0;
+  size_t range_count = 0;
+
+  prom_collector_registry_range_t *ranges =
+      (prom_collector_registry_range_t *)prom_malloc(sizeof(prom_collector_registry_range_t) * filter_count);
+  if (ranges == NULL) return 1;
+
+  ngx_rwlock_rlock(&self->rwlock);
+
+  size_t metric_count = prom_collector_registry_metric_count(self);
+  if (self->index == NULL || self->index_metrics != metric_count) {
+    // Upgrade to the write lock and check again, another process may have rebuilt the index meanwhile
+    ngx_rwlock_unlock(&self->rwlock);
+    ngx_rwlock_wlock(&self->rwlock);
+    metric_count = prom_collector_registry_metric_count(self);
+    if (self->index == NULL || self->index_metrics != metric_count) {
+      r = prom_collector_registry_index_build(self, metric_count);
+    }
+    // The lookups only read the index, other processes may read it along with this one
+    ngx_rwlock_unlock(&self->rwlock);
+    if (r) {
+      prom_free(ranges);
+      return r;
+    }
+    ngx_rwlock_rlock(&self->rwlock);
+  }
+
+  // Binary search the first name that is not lower than the filter, then take the run of names it matches
+  for (size_t i = 0; i < filter_count; i++) {
+    size_t lo = 0;
+    size_t hi = self->index_size;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (ngx_strncmp(self->index[mid].name, filters[i].name, filters[i].len) < 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+
+    hi = lo;
+    while (hi < self->index_size && prom_metric_formatter_filter_match(&filters[i], self->index[hi].name)) {
+      hi++;
+      if (!filters[i].prefix) break;
+    }
+
+    if (hi > lo) {
+      ranges[range_count].lo = lo;
+      ranges[range_count].hi = hi;
+      range_count++;
+    }
+  }
+
+  // Overlapping filters must not render a family twice
+  qsort(ranges, range_count, sizeof(prom_collector_registry_range_t), &prom_collector_registry_range_compare);
+
+  // Only the index needs the lock. Metrics are never unregistered, so the matches stay valid once it is released and
+  // the render and its compressing flushes do not hold up the scrapes of other processes.
+  size_t match_count = 0;
+  prom_collector_registry_index_entry_t *matches = NULL;
+  if (range_count != 0) {
+    matches = (prom_collector_registry_index_entry_t *)prom_malloc(sizeof(prom_collector_registry_index_entry_t) *
+                                                                   self->index_size);
+    if (matches == NULL) r = 1;
+  }
+
+  size_t next = 0;
+  for (size_t i = 0; i < range_count && r == 0; i++) {
+    size_t lo = ranges[i].lo > next ? ranges[i].lo : next;
+    for (size_t j = lo; j < ranges[i].hi; j++) {
+      matches[match_count++] = self->index[j];
+    }
+    if (ranges[i].hi > next) next = ranges[i].hi;
+  }
+
+  ngx_rwlock_unlock(&self->rwlock);
+  prom_free(ranges);
+
+  // A window family is rendered on its own, the metric does not render it under filters
+  for (size_t i = 0; i < match_count && r == 0; i++) {
+    if (matches[i].window) {
+      r = prom_metric_formatter_load_window(self->metric_formatter, matches[i].metric);
+    } else {
+      r = prom_metric_formatter_load_metric(self->metric_formatter, matches[i].metric);
+    }
+    if (r == 0) r = prom_metric_formatter_flush_if_full(self->metric_formatter);
+  }
+
+  if (matches != NULL) prom_free(matches);
+  if (r) return r;
+
+  // Collectors with a custom collect or render function decide their metrics at scrape time and cannot be indexed
+  for (prom_linked_list_node_t *current_node = self->collectors->keys->head; current_node != NULL;
+       current_node = current_node->next) {
+    prom_collector_t *collector = (prom_collector_t *)prom_map_get(self->collectors, (const char *)current_node->item);
+    if (collector == NULL) continue;
+
+    // Render functions skip the families the formatter filters out themselves
+    if (collector->render_fn != NULL) {
+      r = collector->render_fn(collector, self->metric_formatter);
+      if (r) return r;
+      r = prom_metric_formatter_flush_if_full(self->metric_formatter);
+      if (r) return r;
+      continue;
+    }
+
+    if (collector->collect_fn == &prom_collector_default_collect) continue;
+
+    prom_map_t *metrics = collector->collect_fn(collector);
+    if (metrics == NULL) return 1;
+
+    for (prom_linked_list_node_t *metric_node = metrics->keys->head; metric_node != NULL;
+         metric_node = metric_node->next) {
+      const char *metric_name = (const char *)metric_node->item;
+      size_t i;
+      for (i = 0; i < filter_count; i++) {
+        if (prom_metric_formatter_filter_match(&filters[i], metric_name)) break;
+      }
+      if (i == filter_count) continue;
+
+      prom_metric_t *metric = (prom_metric_t *)prom_map_get(metrics, metric_name);
+      if (metric == NULL) return 1;
+      r = prom_metric_formatter_load_metric(self->metric_formatter, metric);
+      if (r) return r;
+      r = prom_metric_formatter_flush_if_full(self->metric_formatter);
+      if (r) return r;
+    }
+  }
+
+  return 0;
+}
@@ -4,20 +4,36 @@
 
 #include "ngx_core.h"
 
+#include "prom_collector.h"
 #include "prom_map.h"
+#include "prom_metric.h"
 #include "prom_string_builder.h"
 #include "prom_metric_formatter.h"
 
-prom_collector_registry_t *PROM_COLLECTOR_REGISTRY_DEFAULT;
-
 typedef struct prom_collector_registry_s prom_collector_registry_t;
 
+extern prom_collector_registry_t *PROM_COLLECTOR_REGISTRY_DEFAULT;
+
+/**
+ * @brief API PRIVATE An entry of the metric name index of a registry
+ */
+typedef struct prom_collector_registry_index_entry {
+    const char *name;
+    prom_metric_t *metric;
+    int window;                                /**< The name is the window family of the metric, see prom_window.h */
+} prom_collector_registry_index_entry_t;
+
 struct prom_collector_registry_s {
     const char *name;
     prom_map_t *collectors;                    /**< Map of collectors keyed by name */
     prom_string_builder_t *string_builder;     /**< Enables string building */
     prom_metric_formatter_t *metric_formatter; /**< metric formatter for metric exposition on bridge call */
     ngx_atomic_t    rwlock;                    /**< mutex for safety against concurrent registration */
+    prom_collector_registry_index_entry_t *index; /**< Metrics of default collectors sorted by name */
+    size_t index_size;                         /**< Number of entries in index */
+    size_t index_metrics;                      /**< Number of metrics indexed, with one or two entries each */
+    ngx_atomic_t    generation;                /**< Bumped when the exposed data may have changed */
+    time_t          created;                   /**< Creation time, tells generations of earlier zones apart */
     ngx_slab_pool_t *shpool;
 };
 
@@ -84,6 +100,40 @@ int prom_collector_registry_register_collector(prom_collector_registry_t *self,
  */
 const char *prom_collector_registry_bridge(prom_collector_registry_t *self);
 
+/**
+ * @brief Returns the registry generation after publishing the updates made by the executing process.
+ *
+ * Updating a sample only marks the executing process, see prom_metric_sample_updated. The mark turns into a single
+ * increment of the shared generation on the next call, so processes SHOULD call this periodically. Until then, an
+ * unchanged generation MAY hide the updates made by other processes since their last call.
+ *
+ * @param self The target prom_collector_registry_t*
+ * @return The current generation
+ */
+ngx_atomic_uint_t prom_collector_registry_generation(prom_collector_registry_t *self);
+
+/**
+ * @brief Renders the metric exposition in the given format and streams it to fn in chunks instead of returning a
+ * single string. Nothing is buffered once this function returns.
+ *
+ * When filters are given, only the matching metric families are rendered. They are located through a sorted index
+ * of metric names kept in the registry, so a filtered scrape costs time proportional to the matching families rather
+ * than to the whole registry. Collectors with a custom prom_collect_fn are not indexed; their metrics are matched
+ * one by one. The window family of a windowed metric has an index entry of its own, and is matched by its own name.
+ * The index is locked while the matches are looked up only, never while they are rendered and flushed.
+ *
+ * @param self The target prom_collector_registry_t*
+ * @param format The exposition format to render
+ * @param filters The metric name filters, NULL to render every metric
+ * @param filter_count The number of filters
+ * @param fn Receives the rendered data, see prom_metric_formatter_flush_fn
+ * @param data Opaque pointer handed to fn
+ * @return A non-zero integer value upon failure
+ */
+int prom_collector_registry_render(prom_collector_registry_t *self, prom_metric_format_t format,
+                                   const prom_metric_name_filter_t *filters, size_t filter_count,
+                                   prom_metric_formatter_flush_fn *fn, void *data);
+
 /**
  *@brief Validates that the given metric name complies with the specification:
  *
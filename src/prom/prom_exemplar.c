@@ -0,0 +1,57 @@
+#include "prom_exemplar.h"
+#include "prom_metric_sample.h"
+
+int prom_exemplar_record(prom_exemplar_t *self, const char *labels, size_t len, double value) {
+  if (self == NULL || len > PROM_EXEMPLAR_LABELS_LEN) return 1;
+
+  // The first process to record wins, the exemplars of the others are as good and are dropped. A slot left claimed
+  // by a process that died while it recorded is taken over, its number stays odd.
+  uint64_t seq = atomic_load(&self->seq);
+  if (seq & 1) {
+    uint64_t claimed = atomic_load(&self->claimed);
+    if (claimed == 0 || ngx_current_msec - claimed < PROM_EXEMPLAR_STALE_MSEC) return 0;
+  }
+
+  uint64_t claim = (seq & 1) ? seq + 2 : seq + 1;
+  if (!atomic_compare_exchange_strong(&self->seq, &seq, claim)) return 0;
+
+  atomic_store_explicit(&self->claimed, ngx_current_msec ? ngx_current_msec : 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  prom_exemplar_buffer_t *buffer = &self->buffer;
+  buffer->value = value;
+  buffer->timestamp = prom_metric_sample_timestamp();
+  buffer->len = len;
+  ngx_memcpy(buffer->labels, labels, len);
+
+  // The next process to claim the slot finds it fresh. A process that took the slot over meanwhile publishes it.
+  atomic_store_explicit(&self->claimed, 0, memory_order_relaxed);
+  (void)atomic_compare_exchange_strong_explicit(&self->seq, &claim, claim + 1, memory_order_release,
+                                                memory_order_relaxed);
+  return 0;
+}
+
+int prom_exemplar_load(prom_exemplar_t *self, prom_exemplar_buffer_t *copy) {
+  if (self == NULL) return 1;
+
+  for (int i = 0; i < PROM_EXEMPLAR_READ_RETRIES; i++) {
+    uint64_t seq = atomic_load_explicit(&self->seq, memory_order_acquire);
+    if (seq == 0) return 1;
+
+    if (seq & 1) {
+      ngx_cpu_pause();
+      continue;
+    }
+
+    prom_exemplar_buffer_t *buffer = &self->buffer;
+    copy->value = buffer->value;
+    copy->timestamp = buffer->timestamp;
+    copy->len = buffer->len;
+    ngx_memcpy(copy->labels, buffer->labels, copy->len <= PROM_EXEMPLAR_LABELS_LEN ? copy->len : 0);
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&self->seq, memory_order_relaxed) == seq) return 0;
+  }
+
+  return 1;
+}
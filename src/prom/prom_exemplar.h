@@ -0,0 +1,78 @@
+#ifndef PROM_EXEMPLAR_H
+#define PROM_EXEMPLAR_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "ngx_core.h"
+
+/**
+ * @file prom_exemplar.h
+ * @brief Exemplars: the label set of one observation, typically a trace id, with its value and time
+ *
+ * A counter series or a histogram bucket keeps the latest exemplar in a slot of fixed size in shared memory, guarded
+ * by a sequence number that is odd while a process records. Of the processes recording at the same moment only the
+ * one that made it odd writes, the others drop their exemplar, so recording never waits. A reader copies the slot and
+ * retries a bounded number of times if the sequence number was odd or changed meanwhile.
+ *
+ * A process that dies while it records leaves the number odd. Recording takes nanoseconds, so a slot claimed for
+ * longer than PROM_EXEMPLAR_STALE_MSEC is taken over by the next process that records.
+ *
+ * Reference: https://github.com/OpenObservability/OpenMetrics/blob/main/specification/OpenMetrics.md#exemplars
+ */
+
+/**
+ * @brief The longest label set of an exemplar, as written in the exposition: {trace_id="..."} without the braces.
+ * OpenMetrics limits the label names and values of an exemplar to 128 characters, escaping may add a few.
+ */
+#define PROM_EXEMPLAR_LABELS_LEN 160
+
+/**
+ * @brief The attempts of a reader to copy a slot that writers keep recording into
+ */
+#define PROM_EXEMPLAR_READ_RETRIES 16
+
+/**
+ * @brief How long a slot may stay claimed before it is taken over, in milliseconds
+ */
+#define PROM_EXEMPLAR_STALE_MSEC 1000
+
+/**
+ * @brief API PRIVATE The content of an exemplar, as a reader copies it
+ */
+typedef struct prom_exemplar_buffer {
+  double value;                           /**< value     The observed value */
+  double timestamp;                       /**< timestamp Seconds since the epoch */
+  size_t len;                             /**< len       The length of labels */
+  char labels[PROM_EXEMPLAR_LABELS_LEN];  /**< labels    The label set, escaped, not null-terminated */
+} prom_exemplar_buffer_t;
+
+/**
+ * @brief The exemplar slot of a counter series or of a histogram bucket
+ */
+typedef struct prom_exemplar {
+  _Atomic uint64_t seq;          /**< seq      Odd while a process records, 0 before the first record */
+  _Atomic uint64_t claimed;      /**< claimed  When the recording process made seq odd, in ngx_current_msec, or 0 */
+  prom_exemplar_buffer_t buffer; /**< buffer   The latest exemplar */
+} prom_exemplar_t;
+
+/**
+ * @brief Records an exemplar, replacing the previous one. It never waits: if another process is recording in the
+ * same slot, the exemplar is dropped.
+ * @param self The target prom_exemplar_t*
+ * @param labels The label set as written in the exposition, e.g. trace_id="4bf92f3577b34da6", with escaped values
+ * @param len The length of labels, at most PROM_EXEMPLAR_LABELS_LEN
+ * @param value The observed value
+ * @return Non-zero integer value if the label set is too long
+ */
+int prom_exemplar_record(prom_exemplar_t *self, const char *labels, size_t len, double value);
+
+/**
+ * @brief API PRIVATE Copies the latest exemplar
+ * @param self The target prom_exemplar_t*
+ * @param copy Receives the exemplar
+ * @return Non-zero integer value if there is no exemplar yet, or if writers kept recording meanwhile
+ */
+int prom_exemplar_load(prom_exemplar_t *self, prom_exemplar_buffer_t *copy);
+
+#endif  // PROM_EXEMPLAR_H
@@ -0,0 +1,18 @@
+#include "prom_hash.h"
+
+uint64_t prom_hash(const char *key, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)key[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb93fe53e2b85ULL;
+  hash ^= hash >> 33;
+
+  return hash;
+}
@@ -0,0 +1,20 @@
+#ifndef PROM_HASH_H
+#define PROM_HASH_H
+
+#include <stdint.h>
+
+#include "ngx_core.h"
+
+/**
+ * @file prom_hash.h
+ * @brief The hash of the keys of the sketches
+ */
+
+/**
+ * @brief API PRIVATE 64-bit FNV-1a, mixed with the finalizer of MurmurHash3 so that every bit depends on every byte
+ * @param key The key, it need not be null-terminated
+ * @param len The length of the key
+ */
+uint64_t prom_hash(const char *key, size_t len);
+
+#endif  // PROM_HASH_H
@@ -14,15 +14,29 @@
  * limitations under the License.
  */
 
+#include <math.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 // Public
 #include "prom_alloc.h"
 #include "prom_histogram_buckets.h"
+#include "prom_native_histogram.h"
+#include "prom_timer.h"
+#include "prom_assert.h"
+#include "prom_log.h"
 
 prom_histogram_buckets_t *prom_histogram_default_buckets = NULL;
 
+/**
+ * @brief The state of the generator that samples observations, and the process that seeded it. A worker forked from
+ * the master inherits the state, and reseeds it so that the workers do not draw the same sequence.
+ */
+static uint64_t prom_histogram_buckets_random_state;
+static ngx_pid_t prom_histogram_buckets_random_pid;
+
 prom_histogram_buckets_t *prom_histogram_buckets_new(ngx_slab_pool_t *shpool, size_t count, double bucket, ...) {
   prom_histogram_buckets_t *self = (prom_histogram_buckets_t *)ngx_slab_alloc(shpool, sizeof(prom_histogram_buckets_t));
   if (self == NULL) {
@@ -30,6 +44,16 @@ prom_histogram_buckets_t *prom_histogram_buckets_new(ngx_slab_pool_t *shpool, si
   }
   self->count = count;
   self->shpool = shpool;
+  self->tick_bounds = NULL;
+  self->tick_seconds = 0.0;
+  self->precision = PROM_TIMER_NONE;
+  self->log_sub_buckets = 0;
+  self->log_sub_shift = 0;
+  self->log_min_exponent = 0;
+  self->native_schema = 0;
+  self->native_max_buckets = 0;
+  self->sampling = 0;
+  self->sampling_below = UINT64_MAX;
   double *upper_bounds = (double *)ngx_slab_alloc(shpool, sizeof(double) * count);
   if (upper_bounds == NULL) {
     return NULL;
@@ -41,7 +65,7 @@ prom_histogram_buckets_t *prom_histogram_buckets_new(ngx_slab_pool_t *shpool, si
   }
   va_list arg_list;
   va_start(arg_list, bucket);
-  for (int i = 1; i < count; i++) {
+  for (size_t i = 1; i < count; i++) {
     upper_bounds[i] = va_arg(arg_list, double);
   }
   va_end(arg_list);
@@ -49,6 +73,39 @@ prom_histogram_buckets_t *prom_histogram_buckets_new(ngx_slab_pool_t *shpool, si
   return self;
 }
 
+prom_histogram_buckets_t *prom_histogram_buckets_from_array(ngx_slab_pool_t *shpool, const double *upper_bounds,
+                                                            size_t count) {
+
+  prom_histogram_buckets_t *self = (prom_histogram_buckets_t *)ngx_slab_alloc(shpool, sizeof(prom_histogram_buckets_t));
+  if (self == NULL) {
+    return NULL;
+  }
+  self->count = count;
+  self->shpool = shpool;
+  self->tick_bounds = NULL;
+  self->tick_seconds = 0.0;
+  self->precision = PROM_TIMER_NONE;
+  self->log_sub_buckets = 0;
+  self->log_sub_shift = 0;
+  self->log_min_exponent = 0;
+  self->native_schema = 0;
+  self->native_max_buckets = 0;
+  self->sampling = 0;
+  self->sampling_below = UINT64_MAX;
+  if (count == 0) {
+    self->upper_bounds = NULL;
+    return self;
+  }
+  double *bounds = (double *)ngx_slab_alloc(shpool, sizeof(double) * count);
+  if (bounds == NULL) {
+    ngx_slab_free(shpool, self);
+    return NULL;
+  }
+  ngx_memcpy(bounds, upper_bounds, sizeof(double) * count);
+  self->upper_bounds = bounds;
+  return self;
+}
+
 prom_histogram_buckets_t *prom_histogram_buckets_linear(ngx_slab_pool_t *shpool, double start, double width, size_t count) {
   if (count <= 1) return NULL;
 
@@ -58,6 +115,16 @@ prom_histogram_buckets_t *prom_histogram_buckets_linear(ngx_slab_pool_t *shpool,
   }
   self->count = count;
   self->shpool = shpool;
+  self->tick_bounds = NULL;
+  self->tick_seconds = 0.0;
+  self->precision = PROM_TIMER_NONE;
+  self->log_sub_buckets = 0;
+  self->log_sub_shift = 0;
+  self->log_min_exponent = 0;
+  self->native_schema = 0;
+  self->native_max_buckets = 0;
+  self->sampling = 0;
+  self->sampling_below = UINT64_MAX;
   double *upper_bounds = (double *)ngx_slab_alloc(shpool, sizeof(double) * count);
   if (upper_bounds == NULL) {
     return NULL;
@@ -90,12 +157,21 @@ prom_histogram_buckets_t *prom_histogram_buckets_exponential(ngx_slab_pool_t *sh
   }
   self->count = count;
   self->shpool = shpool;
+  self->tick_bounds = NULL;
+  self->tick_seconds = 0.0;
+  self->precision = PROM_TIMER_NONE;
+  self->log_sub_buckets = 0;
+  self->log_sub_shift = 0;
+  self->log_min_exponent = 0;
+  self->native_schema = 0;
+  self->native_max_buckets = 0;
+  self->sampling = 0;
+  self->sampling_below = UINT64_MAX;
   double *upper_bounds = (double *)ngx_slab_alloc(shpool, sizeof(double) * count);
   if (upper_bounds == NULL) {
     return NULL;
   }
 
-  double *upper_bounds = (double *)prom_malloc(sizeof(double) * count);
   upper_bounds[0] = start;
   for (size_t i = 1; i < count; i++) {
     upper_bounds[i] = upper_bounds[i - 1] * factor;
@@ -104,10 +180,128 @@ prom_histogram_buckets_t *prom_histogram_buckets_exponential(ngx_slab_pool_t *sh
   return self;
 }
 
+/**
+ * @brief API PRIVATE Returns the exponents of the first and the last bound of log-linear buckets, and the mantissa bits
+ * of a sub-bucket. The first bound is kept a normal double, so that its exponent field is meaningful.
+ */
+static int prom_histogram_buckets_log_range(double min, double max, size_t sub_buckets, int *first, int *last,
+                                            int *shift) {
+  int exp;
+
+  if (!(min > 0.0) || !(max > min) || !isfinite(max)) return 1;
+  if (sub_buckets == 0 || sub_buckets > PROM_HISTOGRAM_BUCKETS_LOG_SUB_MAX) return 1;
+  if (sub_buckets & (sub_buckets - 1)) return 1;
+
+  // frexp() gives x = frac * 2^exp with frac in [0.5, 1)
+  frexp(min, &exp);
+  *first = exp - 1 < -1022 ? -1022 : exp - 1;
+
+  double frac = frexp(max, &exp);
+  *last = frac == 0.5 ? exp - 1 : exp;
+
+  *shift = 0;
+  while (((size_t)1 << *shift) < sub_buckets) (*shift)++;
+
+  return 0;
+}
+
+size_t prom_histogram_buckets_log_linear_count(double min, double max, size_t sub_buckets) {
+  int first, last, shift;
+
+  if (prom_histogram_buckets_log_range(min, max, sub_buckets, &first, &last, &shift)) return 0;
+
+  // The last power of two closes the range and has no sub-buckets above it
+  return (size_t)(last - first) * sub_buckets + 1;
+}
+
+prom_histogram_buckets_t *prom_histogram_buckets_log_linear(ngx_slab_pool_t *shpool, double min, double max,
+                                                            size_t sub_buckets) {
+  int first, last, shift;
+
+  if (prom_histogram_buckets_log_range(min, max, sub_buckets, &first, &last, &shift)) {
+    PROM_LOG("invalid log-linear buckets");
+    return NULL;
+  }
+
+  size_t count = prom_histogram_buckets_log_linear_count(min, max, sub_buckets);
+
+  double *upper_bounds = (double *)prom_malloc(sizeof(double) * count);
+  if (upper_bounds == NULL) return NULL;
+
+  // The bounds are exact doubles, the le labels and the bit-level indexing agree on them
+  for (size_t i = 0; i < count; i++) {
+    upper_bounds[i] = ldexp(1.0 + (double)(i % sub_buckets) / (double)sub_buckets, first + (int)(i / sub_buckets));
+  }
+
+  prom_histogram_buckets_t *self = prom_histogram_buckets_from_array(shpool, upper_bounds, count);
+  prom_free(upper_bounds);
+  if (self == NULL) return NULL;
+
+  self->log_sub_buckets = sub_buckets;
+  self->log_sub_shift = shift;
+  self->log_min_exponent = first;
+  return self;
+}
+
+size_t prom_histogram_buckets_index(prom_histogram_buckets_t *self, double value) {
+  size_t count = self->count;
+
+  if (self->log_sub_buckets != 0) {
+    // NaN is counted in every bucket, as the comparisons of the search below would do
+    if (!(value > self->upper_bounds[0])) return 0;
+    if (value > self->upper_bounds[count - 1]) return count;
+
+    // Above the first bound the value is a normal double: 1.mantissa * 2^(exponent - 1023)
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    int exponent = (int)((bits >> 52) & 0x7ff) - 1023;
+    uint64_t mantissa = bits & (((uint64_t)1 << 52) - 1);
+    int rest_bits = 52 - self->log_sub_shift;
+
+    // The high mantissa bits select the sub-bucket whose lower bound the value is at or above. Buckets are closed on
+    // the upper side, so a value above that bound belongs to the next one.
+    size_t i = (size_t)(exponent - self->log_min_exponent) * self->log_sub_buckets + (size_t)(mantissa >> rest_bits);
+    if (mantissa & (((uint64_t)1 << rest_bits) - 1)) i++;
+
+    return i;
+  }
+
+  size_t lo = 0, hi = count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (self->upper_bounds[mid] < value) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+size_t prom_histogram_buckets_tick_index(prom_histogram_buckets_t *self, uint64_t ticks) {
+  const uint64_t *tick_bounds = self->tick_bounds;
+
+  size_t lo = 0, hi = self->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (tick_bounds[mid] < ticks) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
 int prom_histogram_buckets_destroy(prom_histogram_buckets_t *self) {
   PROM_ASSERT(self != NULL);
   if (self == NULL) return 0;
-  ngx_slab_free(self->shpool, (double *)self->upper_bounds);
+  if (self->tick_bounds != NULL) {
+    ngx_slab_free(self->shpool, self->tick_bounds);
+    self->tick_bounds = NULL;
+  }
+  if (self->upper_bounds != NULL) ngx_slab_free(self->shpool, (double *)self->upper_bounds);
   self->upper_bounds = NULL;
   ngx_slab_free(self->shpool, (double *)self);
   self = NULL;
@@ -118,3 +312,77 @@ size_t prom_histogram_buckets_count(prom_histogram_buckets_t *self) {
   PROM_ASSERT(self != NULL);
   return self->count;
 }
+
+int prom_histogram_buckets_set_precision(prom_histogram_buckets_t *self, prom_timer_precision_t precision) {
+  if (self == NULL || self->tick_bounds != NULL) return 1;
+  if (precision == PROM_TIMER_NONE) return 0;
+
+  double tick_seconds = prom_timer_tick_seconds(precision);
+  if (tick_seconds <= 0.0) return 1;
+
+  // Without classic buckets a single unused bound marks the buckets as timed
+  uint64_t *tick_bounds = (uint64_t *)ngx_slab_alloc(self->shpool, sizeof(uint64_t) * (self->count ? self->count : 1));
+  if (tick_bounds == NULL) return 1;
+
+  // A duration of t ticks falls into a bucket if t * tick_seconds <= upper bound, i.e. if t <= floor(bound / tick)
+  for (int i = 0; i < self->count; i++) {
+    double ticks = floor(self->upper_bounds[i] / tick_seconds * (1.0 + 1e-12));
+    tick_bounds[i] = ticks <= 0.0 ? 0 : ticks >= 18446744073709551615.0 ? UINT64_MAX : (uint64_t)ticks;
+  }
+
+  self->tick_bounds = tick_bounds;
+  self->tick_seconds = tick_seconds;
+  self->precision = precision;
+  return 0;
+}
+
+int prom_histogram_buckets_set_sampling(prom_histogram_buckets_t *self, uint32_t sampling) {
+  if (self == NULL || sampling == 0 || sampling > PROM_HISTOGRAM_SAMPLING_MAX) return 1;
+
+  // A uniform 64-bit draw is below with a probability of 1 / sampling
+  self->sampling = sampling;
+  self->sampling_below = sampling == 1 ? UINT64_MAX : UINT64_MAX / sampling;
+  return 0;
+}
+
+/**
+ * @brief API PRIVATE Returns a uniform 64-bit draw of the process-local xorshift64* generator. It takes no lock and
+ * touches no shared memory.
+ */
+static uint64_t prom_histogram_buckets_random(void) {
+  uint64_t x = prom_histogram_buckets_random_state;
+
+  if (prom_histogram_buckets_random_pid != ngx_pid || x == 0) {
+    ngx_time_t *tp = ngx_timeofday();
+
+    // The finalizer of SplitMix64 spreads the pid and the time over every bit, the state must not be 0
+    x = ((uint64_t)ngx_pid << 32) ^ (uint64_t)tp->sec ^ ((uint64_t)tp->msec << 40);
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    if (x == 0) x = 0x9e3779b97f4a7c15ULL;
+    prom_histogram_buckets_random_pid = ngx_pid;
+  }
+
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  prom_histogram_buckets_random_state = x;
+
+  return x * 0x2545f4914f6cdd1dULL;
+}
+
+int prom_histogram_buckets_sample(prom_histogram_buckets_t *self) {
+  if (self->sampling <= 1) return 1;
+  return prom_histogram_buckets_random() < self->sampling_below;
+}
+
+int prom_histogram_buckets_set_native(prom_histogram_buckets_t *self, int32_t schema, uint32_t max_buckets) {
+  if (self == NULL || max_buckets == 0) return 1;
+  if (schema < PROM_NATIVE_HISTOGRAM_SCHEMA_MIN || schema > PROM_NATIVE_HISTOGRAM_SCHEMA_MAX) return 1;
+
+  self->native_schema = schema;
+  self->native_max_buckets = max_buckets;
+  return 0;
+}
@@ -1,16 +1,32 @@
 
-#include "stdlib.h"
-#include "prom_metric.h"
-
 #ifndef PROM_HISTOGRAM_BUCKETS_H
 #define PROM_HISTOGRAM_BUCKETS_H
 
+#include "stdlib.h"
+#include "ngx_core.h"
+#include "prom_timer.h"
+
 typedef struct prom_histogram_buckets {
-  int count;                  /**< Number of buckets */
-  const double *upper_bounds; /**< The bucket values */
+  int count;                        /**< Number of buckets */
+  const double *upper_bounds;       /**< The bucket values */
   ngx_slab_pool_t *shpool; 
+  uint64_t *tick_bounds;            /**< The upper bounds in timer ticks, NULL unless timed */
+  double tick_seconds;              /**< The duration of a timer tick */
+  prom_timer_precision_t precision; /**< The clock of prom_timer_t handles on the histogram */
+  size_t log_sub_buckets;           /**< The buckets per power of two of log-linear buckets, 0 for other buckets */
+  int log_sub_shift;                /**< log2(log_sub_buckets), the mantissa bits that index a sub-bucket */
+  int log_min_exponent;             /**< The exponent of the first bound of log-linear buckets */
+  int32_t native_schema;            /**< The initial schema of the native histogram */
+  uint32_t native_max_buckets;      /**< The bucket limit of the native histogram, 0 without one */
+  uint32_t sampling;                /**< One in sampling observations is recorded, 0 or 1 to record all */
+  uint64_t sampling_below;          /**< The random draws that record an observation are below it */
 } prom_histogram_buckets_t;
 
+/**
+ * @brief The sparsest sampling of observations
+ */
+#define PROM_HISTOGRAM_SAMPLING_MAX (1 << 20)
+
 /**
  * @brief Construct a prom_histogram_buckets_t*
  * @param count The number of buckets
@@ -20,6 +36,16 @@ typedef struct prom_histogram_buckets {
  */
 prom_histogram_buckets_t *prom_histogram_buckets_new(ngx_slab_pool_t *shpool, size_t count, double bucket, ...);
 
+/**
+ * @brief Construct a prom_histogram_buckets_t* from an array of upper bounds
+ * @param upper_bounds The bucket upper bounds in increasing order. They are copied.
+ * @param count The number of buckets. The final +Inf bucket is not counted and not included. It MAY be 0 for a
+ *              native histogram, which then has no classic buckets.
+ * @return The constructed prom_histogram_buckets_t*
+ */
+prom_histogram_buckets_t *prom_histogram_buckets_from_array(ngx_slab_pool_t *shpool, const double *upper_bounds,
+                                                            size_t count);
+
 /**
  * @brief the default histogram buckets: .005, .01, .025, .05, .1, .25, .5, 1, 2.5, 5, 10
  */
@@ -32,7 +58,7 @@ extern prom_histogram_buckets_t *prom_histogram_default_buckets;
  * @param count The total number of buckets. The final +Inf bucket is not counted and not included.
  * @return The constructed prom_histogram_buckets_t*
  */
-prom_histogram_buckets_t *prom_histogram_buckets_linear(double start, double width, size_t count);
+prom_histogram_buckets_t *prom_histogram_buckets_linear(ngx_slab_pool_t *shpool, double start, double width, size_t count);
 
 /**
  * @brief Construct an exponentially sized prom_histogram_buckets_t*
@@ -43,7 +69,99 @@ prom_histogram_buckets_t *prom_histogram_buckets_linear(double start, double wid
  *              greater than or equal to 1
  * @return The constructed prom_histogram_buckets_t*
  */
-prom_histogram_buckets_t *prom_histogram_buckets_exponential(double start, double factor, size_t count);
+prom_histogram_buckets_t *prom_histogram_buckets_exponential(ngx_slab_pool_t *shpool, double start, double factor,
+                                                             size_t count);
+
+/**
+ * @brief Construct log-linear prom_histogram_buckets_t*, as in HDR histograms
+ *
+ * Every power of two from the one at or below min to the one at or above max is divided into sub_buckets buckets of
+ * equal width, so that 2^e * (1 + j / sub_buckets) is an upper bound for each exponent e and each j. An observation
+ * finds its bucket in constant time from the exponent and the high mantissa bits of the double, and a bucket bounds
+ * the relative error of any value it holds to 1 / sub_buckets. The buckets are exposed as classic le buckets.
+ *
+ * @param min The lowest upper bound is the power of two at or below it. The value MUST be greater than 0.
+ * @param max The highest upper bound is the power of two at or above it. The value MUST be greater than min.
+ * @param sub_buckets The buckets per power of two. The value MUST be a power of two, at most
+ *                    PROM_HISTOGRAM_BUCKETS_LOG_SUB_MAX.
+ * @return The constructed prom_histogram_buckets_t*
+ */
+prom_histogram_buckets_t *prom_histogram_buckets_log_linear(ngx_slab_pool_t *shpool, double min, double max,
+                                                            size_t sub_buckets);
+
+/**
+ * @brief The largest number of log-linear buckets per power of two
+ */
+#define PROM_HISTOGRAM_BUCKETS_LOG_SUB_MAX 1024
+
+/**
+ * @brief Returns the number of log-linear buckets from min to max, as prom_histogram_buckets_log_linear() creates
+ * them, or 0 if the arguments are invalid
+ */
+size_t prom_histogram_buckets_log_linear_count(double min, double max, size_t sub_buckets);
+
+/**
+ * @brief API PRIVATE Returns the index of the first bucket whose upper bound is not below the value, or the count of
+ * buckets if the value only falls into +Inf. It takes constant time for log-linear buckets, a binary search otherwise.
+ */
+size_t prom_histogram_buckets_index(prom_histogram_buckets_t *self, double value);
+
+/**
+ * @brief API PRIVATE Returns the index of the first bucket whose upper bound in ticks is not below the duration, or
+ * the count of buckets if it only falls into +Inf, by integer comparisons. The buckets MUST be timed.
+ */
+size_t prom_histogram_buckets_tick_index(prom_histogram_buckets_t *self, uint64_t ticks);
+
+/**
+ * @brief Selects the clock of the prom_timer_t handles on histograms with these buckets.
+ *
+ * The upper bounds are converted once into ticks of the clock, so that a timed duration is bucketed by integer
+ * comparisons. It MUST be called before the first sample of the histogram is created.
+ *
+ * @param self The target prom_histogram_buckets_t*
+ * @param precision The clock
+ * @return Non-zero integer value upon failure
+ */
+int prom_histogram_buckets_set_precision(prom_histogram_buckets_t *self, prom_timer_precision_t precision);
+
+/**
+ * @brief Gives the histograms with these buckets a native histogram, besides the classic buckets.
+ *
+ * The native buckets are only exposed in the protobuf format. It MUST be called before the first sample of the
+ * histogram is created.
+ *
+ * @param self The target prom_histogram_buckets_t*
+ * @param schema The initial schema, from PROM_NATIVE_HISTOGRAM_SCHEMA_MIN to PROM_NATIVE_HISTOGRAM_SCHEMA_MAX
+ * @param max_buckets The bucket limit of each sign, the schema is reduced when it is reached
+ * @return Non-zero integer value upon failure
+ */
+int prom_histogram_buckets_set_native(prom_histogram_buckets_t *self, int32_t schema, uint32_t max_buckets);
+
+/**
+ * @brief Records one in sampling observations of the histograms with these buckets, drawn at random.
+ *
+ * The caller draws each observation with prom_histogram_buckets_sample() before it computes the value and finds the
+ * sample, and only observes those drawn. A recorded observation counts sampling times in its bucket and its value
+ * sampling times in the sum, so the count, the buckets and the sum stay consistent estimates of the true ones in every
+ * format and window. An observation that is not recorded costs the draw from the generator of the executing process
+ * and touches no shared memory. The estimates are exact in the mean, and their relative error for n recorded
+ * observations is about 1 / sqrt(n).
+ *
+ * It MUST be called before the first sample of the histogram is created.
+ *
+ * @param self The target prom_histogram_buckets_t*
+ * @param sampling From 1, recording every observation, to PROM_HISTOGRAM_SAMPLING_MAX
+ * @return Non-zero integer value upon failure
+ */
+int prom_histogram_buckets_set_sampling(prom_histogram_buckets_t *self, uint32_t sampling);
+
+/**
+ * @brief Draws whether an observation of a histogram with these buckets is recorded, see
+ * prom_histogram_buckets_set_sampling(). It takes no lock and touches no shared memory.
+ * @param self The target prom_histogram_buckets_t*
+ * @return Non-zero if the observation is recorded, always without sampling
+ */
+int prom_histogram_buckets_sample(prom_histogram_buckets_t *self);
 
 /**
  * @brief Destroy a prom_histogram_buckets_t*. Self MUST be set to NULL after destruction. Returns a non-zero integer
@@ -0,0 +1,154 @@
+#include <math.h>
+
+#include "prom_atomic.h"
+#include "prom_hash.h"
+#include "prom_hll.h"
+#include "prom_metric_sample.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Static Declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static _Atomic uint8_t *prom_hll_set(prom_hll_t *self, int64_t period);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// End static declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief API PRIVATE Returns the registers of the period, clearing the set the period rotates onto. NULL while another
+ * process clears it, the key is then not counted.
+ */
+static _Atomic uint8_t *prom_hll_set(prom_hll_t *self, int64_t period) {
+  uint32_t set = (uint32_t)(period % self->set_count);
+  _Atomic uint8_t *registers = self->registers + ((size_t)set << self->precision);
+  int claim = prom_atomic_claim(&self->periods[set], period);
+
+  if (claim == 0) return registers;
+  if (claim == -1) return NULL;
+
+  for (size_t i = 0; i < ((size_t)1 << self->precision); i++) {
+    atomic_store_explicit(&registers[i], 0, memory_order_relaxed);
+  }
+
+  prom_atomic_publish(&self->periods[set], period);
+  return registers;
+}
+
+prom_hll_t *prom_hll_new(ngx_slab_pool_t *shpool, uint32_t precision, time_t window) {
+  if (precision < PROM_HLL_PRECISION_MIN || precision > PROM_HLL_PRECISION_MAX) return NULL;
+  if (window < 0 || (window != 0 && window < PROM_HLL_SETS)) return NULL;
+
+  prom_hll_t *self = (prom_hll_t *)ngx_slab_calloc(shpool, sizeof(prom_hll_t));
+  if (self == NULL) return NULL;
+
+  self->shpool = shpool;
+  self->precision = precision;
+  self->set_count = window ? PROM_HLL_SETS : 1;
+  self->period = window / PROM_HLL_SETS;
+
+  self->periods = (_Atomic int64_t *)ngx_slab_calloc(shpool, sizeof(_Atomic int64_t) * self->set_count);
+  self->registers = (_Atomic uint8_t *)ngx_slab_calloc(shpool, (size_t)self->set_count << precision);
+  if (self->periods == NULL || self->registers == NULL) {
+    prom_hll_destroy(self);
+    return NULL;
+  }
+
+  return self;
+}
+
+int prom_hll_destroy(prom_hll_t *self) {
+  if (self == NULL) return 0;
+
+  if (self->periods != NULL) ngx_slab_free(self->shpool, (void *)self->periods);
+  if (self->registers != NULL) ngx_slab_free(self->shpool, (void *)self->registers);
+
+  ngx_slab_free(self->shpool, self);
+  return 0;
+}
+
+int prom_hll_add(prom_hll_t *self, const char *key, size_t len) {
+  if (self == NULL || key == NULL) return 1;
+
+  _Atomic uint8_t *registers = self->registers;
+
+  if (self->period != 0) {
+    registers = prom_hll_set(self, (int64_t)(ngx_time() / self->period));
+    if (registers == NULL) return 0;
+  }
+
+  uint64_t hash = prom_hash(key, len);
+  size_t index = (size_t)(hash >> (64 - self->precision));
+
+  // The position of the first set bit of the remaining bits, one past them if none is set
+  uint64_t bits = hash << self->precision;
+  uint8_t rank = 1;
+  while (rank <= 64 - self->precision && !(bits & ((uint64_t)1 << 63))) {
+    bits <<= 1;
+    rank++;
+  }
+
+  uint8_t old = atomic_load_explicit(&registers[index], memory_order_relaxed);
+  while (old < rank) {
+    if (atomic_compare_exchange_weak_explicit(&registers[index], &old, rank, memory_order_relaxed,
+                                              memory_order_relaxed)) {
+      prom_metric_sample_updated = 1;
+      break;
+    }
+  }
+
+  return 0;
+}
+
+double prom_hll_estimate(prom_hll_t *self) {
+  if (self == NULL) return 0.0;
+
+  size_t m = (size_t)1 << self->precision;
+  int64_t now = self->period ? (int64_t)(ngx_time() / self->period) : 0;
+  int valid[PROM_HLL_SETS];
+
+  for (uint32_t set = 0; set < self->set_count; set++) {
+    int64_t period = atomic_load_explicit(&self->periods[set], memory_order_acquire);
+    valid[set] = period >= 0 && period > now - (int64_t)self->set_count && period <= now;
+  }
+
+  // The sets of the window merge register by register with max
+  double sum = 0.0;
+  size_t zeros = 0;
+  for (size_t i = 0; i < m; i++) {
+    uint8_t max = 0;
+    for (uint32_t set = 0; set < self->set_count; set++) {
+      if (!valid[set]) continue;
+      size_t r = ((size_t)set << self->precision) + i;
+      uint8_t value = atomic_load_explicit(&self->registers[r], memory_order_relaxed);
+      if (value > max) max = value;
+    }
+    sum += ldexp(1.0, -max);
+    if (max == 0) zeros++;
+  }
+
+  double alpha;
+  switch (m) {
+    case 16:
+      alpha = 0.673;
+      break;
+    case 32:
+      alpha = 0.697;
+      break;
+    case 64:
+      alpha = 0.709;
+      break;
+    default:
+      alpha = 0.7213 / (1.0 + 1.079 / m);
+      break;
+  }
+
+  double estimate = alpha * m * m / sum;
+
+  // Linear counting is more accurate while many registers are still empty
+  if (estimate <= 2.5 * m && zeros != 0) {
+    estimate = m * log((double)m / zeros);
+  }
+
+  return estimate;
+}
@@ -0,0 +1,83 @@
+#ifndef PROM_HLL_H
+#define PROM_HLL_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "ngx_core.h"
+
+/**
+ * @file prom_hll.h
+ * @brief Distinct counts with HyperLogLog
+ *
+ * A key is hashed to 64 bits: the top precision bits select one of 2^precision registers, and the register keeps the
+ * highest position of the first set bit among the remaining bits. An update is one hash and one atomic max, every
+ * worker writes the same registers and nothing is ever locked. The scrape estimates the number of distinct keys from
+ * the registers with a standard error of 1.04 / sqrt(2^precision), e.g. 1.6% at precision 12 for 4KB of registers.
+ *
+ * A windowed sketch rotates PROM_HLL_SETS register sets, each covering window / PROM_HLL_SETS seconds. The first update
+ * of a set in a new period clears it, and the estimate merges the sets of the periods within the window: it counts
+ * the keys seen in the current period and the PROM_HLL_SETS - 1 previous ones. The current period is partial, so the
+ * estimate covers from 0.75 of the window, just after a rotation, to all of it, just before the next one.
+ *
+ * Reference: Flajolet, Fusy, Gandouet, Meunier. HyperLogLog: the analysis of a near-optimal cardinality estimation
+ * algorithm.
+ */
+
+/**
+ * @brief The bounds of the precision, the base-2 logarithm of the number of registers of a set
+ */
+#define PROM_HLL_PRECISION_MIN 4
+#define PROM_HLL_PRECISION_MAX 16
+
+/**
+ * @brief The default precision
+ */
+#define PROM_HLL_PRECISION 12
+
+/**
+ * @brief The register sets of a windowed sketch
+ */
+#define PROM_HLL_SETS 4
+
+/**
+ * @brief A HyperLogLog sketch in shared memory
+ */
+typedef struct prom_hll {
+  uint32_t precision;            /**< precision The base-2 logarithm of the registers per set */
+  uint32_t set_count;            /**< set_count PROM_HLL_SETS with a window, 1 without */
+  time_t period;                 /**< period    The seconds each set covers, 0 without a window */
+  _Atomic int64_t *periods;      /**< periods   The period of each set, -1 while it is cleared */
+  _Atomic uint8_t *registers;    /**< registers set_count sets of 2^precision registers */
+  ngx_slab_pool_t *shpool;
+} prom_hll_t;
+
+/**
+ * @brief API PRIVATE Creates a sketch
+ * @param shpool The slab pool of the zone
+ * @param precision From PROM_HLL_PRECISION_MIN to PROM_HLL_PRECISION_MAX
+ * @param window The seconds of keys counted, at least PROM_HLL_SETS, or 0 to count keys forever
+ * @return The prom_hll_t*, NULL upon failure
+ */
+prom_hll_t *prom_hll_new(ngx_slab_pool_t *shpool, uint32_t precision, time_t window);
+
+/**
+ * @brief API PRIVATE Destroys a sketch
+ */
+int prom_hll_destroy(prom_hll_t *self);
+
+/**
+ * @brief Counts a key
+ * @param self The target prom_hll_t*
+ * @param key The key, it need not be null-terminated
+ * @param len The length of the key
+ * @return Non-zero integer value upon failure
+ */
+int prom_hll_add(prom_hll_t *self, const char *key, size_t len);
+
+/**
+ * @brief Estimates the number of distinct keys counted, within the window if the sketch has one
+ */
+double prom_hll_estimate(prom_hll_t *self);
+
+#endif  // PROM_HLL_H
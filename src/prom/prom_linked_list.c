@@ -71,8 +71,8 @@ void *prom_linked_list_last(prom_linked_list_t *self) {
 int prom_linked_list_append(prom_linked_list_t *self, void *item) {
     if (self == NULL) return 1;
     prom_linked_list_node_t *node = (prom_linked_list_node_t *)ngx_slab_calloc(self->shpool, sizeof(prom_linked_list_node_t));
-    if (node == NULL) {;
-        return NULL;
+    if (node == NULL) {
+        return 1;
     }
 
     node->item = item;
@@ -90,8 +90,8 @@ int prom_linked_list_append(prom_linked_list_t *self, void *item) {
 int prom_linked_list_push(prom_linked_list_t *self, void *item) {
     if (self == NULL) return 1;
     prom_linked_list_node_t *node = (prom_linked_list_node_t *)ngx_slab_calloc(self->shpool, sizeof(prom_linked_list_node_t));
-    if (node == NULL) {;
-        return NULL;
+    if (node == NULL) {
+        return 1;
     }
     node->item = item;
     node->next = self->head;
@@ -16,11 +16,11 @@ prom_map_node_t *prom_map_node_new(ngx_slab_pool_t *shpool, const char *key, voi
         return NULL;
     }
 
-    self->key = ngx_slab_calloc(shpool, ngx_strlen(key));
+    self->key = ngx_slab_calloc(shpool, ngx_strlen(key) + 1);
     if (self->key == NULL) {
         return NULL;
     }
-    ngx_memcpy(self->key, key, ngx_strlen(key));
+    ngx_memcpy((char *)self->key, key, ngx_strlen(key));
 
     self->value = value;
     self->free_value_fn = free_value_fn;
@@ -29,7 +29,7 @@ prom_map_node_t *prom_map_node_new(ngx_slab_pool_t *shpool, const char *key, voi
 
 int prom_map_node_destroy(prom_map_node_t *self) {
     if (self == NULL) return 0;
-    ngx_slab_free(self->shpool, self->key);
+    ngx_slab_free(self->shpool, (void *)self->key);
     self->key = NULL;
     if (self->value != NULL) (*self->free_value_fn)(self->value);
     self->value = NULL;
@@ -77,7 +77,7 @@ prom_map_t *prom_map_new(ngx_slab_pool_t *shpool)
     self->addrs = ngx_slab_calloc(shpool, sizeof(prom_linked_list_t) * self->max_size);
     self->free_value_fn = destroy_map_node_value_no_op;
 
-    for (int i = 0; i < self->max_size; i++) {
+    for (size_t i = 0; i < self->max_size; i++) {
         self->addrs[i] = prom_linked_list_new(shpool);
         r = prom_linked_list_set_free_fn(self->addrs[i], prom_map_node_free);
         if (r) {
@@ -162,7 +162,6 @@ static void *prom_map_get_internal(const char *key, size_t *size, size_t *max_si
 
 void *prom_map_get(prom_map_t *self, const char *key) {
     if (self == NULL) return NULL;
-    int r = 0;
     ngx_rwlock_rlock(&self->rwlock);
     void *payload =
         prom_map_get_internal(key, &self->size, &self->max_size, self->keys, self->addrs, self->free_value_fn);
@@ -186,7 +185,7 @@ static int prom_map_set_internal(const char *key, void *value, size_t *size, siz
                 free_value_fn(current_map_node->value);
                 current_map_node->value = NULL;
             }
-            ngx_slab_free(current_map_node->shpool, current_map_node->key);
+            ngx_slab_free(current_map_node->shpool, (void *)current_map_node->key);
             current_map_node->key = NULL;
             ngx_slab_free(current_map_node->shpool, current_map_node);
             current_map_node = NULL;
@@ -223,7 +222,7 @@ int prom_map_ensure_space(prom_map_t *self) {
     prom_linked_list_t **new_addrs  = ngx_slab_calloc(self->shpool, sizeof(prom_linked_list_t) * new_max);
 
     // Initialize the new array
-    for (int i = 0; i < new_max; i++) {
+    for (size_t i = 0; i < new_max; i++) {
         new_addrs[i] = prom_linked_list_new(self->shpool);
         r = prom_linked_list_set_free_fn(new_addrs[i], prom_map_node_free);
         if (r) return r;
@@ -232,7 +231,7 @@ int prom_map_ensure_space(prom_map_t *self) {
     }
 
     // Iterate through each linked-list at each memory region in the map's backbone
-    for (int i = 0; i < self->max_size; i++) {
+    for (size_t i = 0; i < self->max_size; i++) {
         // Create a new map node for each node in the linked list and insert it into the new map. Afterwards, deallocate
         // the old map node
         prom_linked_list_t *list = self->addrs[i];
@@ -246,7 +245,7 @@ int prom_map_ensure_space(prom_map_t *self) {
             prom_linked_list_node_t *next = current_node->next;
             ngx_slab_free(self->shpool, current_node);
             current_node = NULL;
-            ngx_slab_free(self->shpool, map_node->key);
+            ngx_slab_free(self->shpool, (void *)map_node->key);
             map_node->key = NULL;
             ngx_slab_free(self->shpool, map_node);
             map_node = NULL;
@@ -310,7 +309,7 @@ static int prom_map_delete_internal(const char *key, size_t *size, size_t *max_s
         }
     }
 
-    return NULL;
+    return 0;
 }
 
 int prom_map_delete(prom_map_t *self, const char *key) {
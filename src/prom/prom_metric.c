@@ -1,4 +1,6 @@
 #include "prom_metric.h"
+#include "prom_metric_formatter.h"
+#include "prom_log.h"
 
 char *prom_metric_type_map[4] = {"counter", "gauge", "histogram", "summary"};
 
@@ -14,24 +16,24 @@ prom_metric_t *prom_metric_new(ngx_slab_pool_t *shpool, prom_metric_type_t metri
         return NULL;
     }
 
-    self->name = ngx_slab_alloc(shpool, ngx_strlen(name));
+    self->name = ngx_slab_calloc(shpool, ngx_strlen(name) + 1);
     if (self->name == NULL) {
         return NULL;
     }
-    ngx_memcpy(self->name, name, ngx_strlen(name));
+    ngx_memcpy((char *)self->name, name, ngx_strlen(name));
 
-    self->help = ngx_slab_alloc(shpool, ngx_strlen(help));
+    self->help = ngx_slab_calloc(shpool, ngx_strlen(help) + 1);
     if (self->help == NULL) {
         return NULL;
     }
-    ngx_memcpy(self->help, help, ngx_strlen(help));
+    ngx_memcpy((char *)self->help, help, ngx_strlen(help));
 
     self->type = metric_type;
     self->buckets = NULL;
 
     const char **k = (const char **)ngx_slab_alloc(shpool, sizeof(const char *) * label_key_count);
 
-    for (int i = 0; i < label_key_count; i++) {
+    for (size_t i = 0; i < label_key_count; i++) {
         if (strcmp(label_keys[i], "le") == 0) {
             prom_metric_destroy(self);
             return NULL;
@@ -40,12 +42,12 @@ prom_metric_t *prom_metric_new(ngx_slab_pool_t *shpool, prom_metric_type_t metri
             prom_metric_destroy(self);
             return NULL;
         }
-        k[i] = ngx_slab_alloc(shpool, ngx_strlen(help));
+        k[i] = ngx_slab_calloc(shpool, ngx_strlen(label_keys[i]) + 1);
         if (k[i] == NULL) {
             prom_metric_destroy(self);
             return NULL;
         }
-        ngx_memcpy(k[i], label_keys[i], ngx_strlen(label_keys[i]));
+        ngx_memcpy((char *)k[i], label_keys[i], ngx_strlen(label_keys[i]));
     }
 
     self->label_keys = k;
@@ -59,6 +61,12 @@ prom_metric_t *prom_metric_new(ngx_slab_pool_t *shpool, prom_metric_type_t metri
             prom_metric_destroy(self);
             return NULL;
         }
+    } else if (metric_type == PROM_SUMMARY) {
+        r = prom_map_set_free_value_fn(self->samples, &prom_metric_sample_summary_free_generic);
+        if (r) {
+            prom_metric_destroy(self);
+            return NULL;
+        }
     } else {
         r = prom_map_set_free_value_fn(self->samples, &prom_metric_sample_free_generic);
         if (r) {
@@ -76,13 +84,128 @@ prom_metric_t *prom_metric_new(ngx_slab_pool_t *shpool, prom_metric_type_t metri
     return self;
 }
 
+int prom_metric_set_buckets(prom_metric_t *self, prom_histogram_buckets_t *buckets) {
+    if (self == NULL || buckets == NULL) return 1;
+    if (self->type != PROM_HISTOGRAM || self->buckets != NULL) return 1;
+    self->buckets = buckets;
+    return 0;
+}
+
+int prom_metric_set_shards(prom_metric_t *self, size_t shard_count) {
+    if (self == NULL || shard_count == 0) return 1;
+    if (self->type != PROM_GAUGE && self->type != PROM_SUMMARY) return 1;
+    if (prom_map_size(self->samples) != 0) return 1;
+    self->shard_count = shard_count;
+    return 0;
+}
+
+int prom_metric_set_exemplars(prom_metric_t *self) {
+    if (self == NULL || (self->type != PROM_COUNTER && self->type != PROM_HISTOGRAM)) return 1;
+    if (prom_map_size(self->samples) != 0) return 1;
+    self->exemplars = 1;
+    return 0;
+}
+
+int prom_metric_set_topk(prom_metric_t *self, size_t k, size_t capacity, size_t shard_count) {
+    if (self == NULL || (self->type != PROM_COUNTER && self->type != PROM_GAUGE)) return 1;
+    if (self->label_key_count != 1 || self->topk != NULL || prom_map_size(self->samples) != 0) return 1;
+    self->topk = prom_topk_new(self->shpool, k, capacity, shard_count);
+    return self->topk == NULL;
+}
+
+int prom_metric_set_distinct(prom_metric_t *self, uint32_t precision, time_t window) {
+    if (self == NULL || self->type != PROM_GAUGE || self->shard_count != 0) return 1;
+    if (self->topk != NULL || prom_map_size(self->samples) != 0) return 1;
+    if (precision < PROM_HLL_PRECISION_MIN || precision > PROM_HLL_PRECISION_MAX) return 1;
+    if (window < 0 || (window != 0 && window < PROM_HLL_SETS)) return 1;
+    self->hll_precision = precision;
+    self->hll_window = window;
+    return 0;
+}
+
+int prom_metric_set_window(prom_metric_t *self, uint32_t seconds) {
+    if (self == NULL || (self->type != PROM_COUNTER && self->type != PROM_HISTOGRAM)) return 1;
+    if (self->topk != NULL || self->window != 0 || prom_map_size(self->samples) != 0) return 1;
+    if (seconds == 0 || seconds > PROM_WINDOW_SECONDS_MAX) return 1;
+
+    size_t name_len = ngx_strlen(self->name);
+    const char *suffix = "_window";
+
+    if (self->type == PROM_COUNTER) {
+        suffix = "_rate";
+        if (name_len > sizeof("_total") - 1
+            && strcmp(self->name + name_len - (sizeof("_total") - 1), "_total") == 0) {
+            name_len -= sizeof("_total") - 1;
+        }
+    }
+
+    char *name = ngx_slab_calloc(self->shpool, name_len + ngx_strlen(suffix) + 1);
+    if (name == NULL) return 1;
+    ngx_memcpy(ngx_cpymem(name, self->name, name_len), suffix, ngx_strlen(suffix));
+
+    self->window = seconds;
+    self->window_name = name;
+    return 0;
+}
+
+int prom_metric_set_quantiles(prom_metric_t *self, const double *quantiles, size_t quantile_count) {
+    if (self == NULL || self->type != PROM_SUMMARY || prom_map_size(self->samples) != 0) return 1;
+    if (quantile_count > PROM_SUMMARY_QUANTILES_MAX || (quantile_count != 0 && quantiles == NULL)) return 1;
+
+    for (size_t i = 0; i < quantile_count; i++) {
+        if (!(quantiles[i] >= 0.0 && quantiles[i] <= 1.0)) return 1;
+    }
+
+    double *q = NULL;
+    if (quantile_count != 0) {
+        q = (double *)ngx_slab_alloc(self->shpool, sizeof(double) * quantile_count);
+        if (q == NULL) return 1;
+        ngx_memcpy(q, quantiles, sizeof(double) * quantile_count);
+    }
+
+    if (self->quantiles != NULL) {
+        ngx_slab_free(self->shpool, self->quantiles);
+    }
+    self->quantiles = q;
+    self->quantile_count = quantile_count;
+    return 0;
+}
+
+int prom_metric_set_unit(prom_metric_t *self, const char *unit) {
+    if (self == NULL || unit == NULL) return 1;
+
+    size_t name_len = ngx_strlen(self->name);
+    size_t unit_len = ngx_strlen(unit);
+
+    if (self->type == PROM_COUNTER && name_len > sizeof("_total") - 1
+        && strcmp(self->name + name_len - (sizeof("_total") - 1), "_total") == 0) {
+        name_len -= sizeof("_total") - 1;
+    }
+
+    if (name_len <= unit_len || self->name[name_len - unit_len - 1] != '_'
+        || ngx_strncmp(self->name + name_len - unit_len, unit, unit_len) != 0) {
+        PROM_LOG("metric name must end with its unit");
+        return 1;
+    }
+
+    char *u = ngx_slab_calloc(self->shpool, unit_len + 1);
+    if (u == NULL) return 1;
+    ngx_memcpy(u, unit, unit_len);
+
+    if (self->unit != NULL) {
+        ngx_slab_free(self->shpool, (void *)self->unit);
+    }
+    self->unit = u;
+    return 0;
+}
+
 int prom_metric_destroy(prom_metric_t *self) {
     if (self == NULL) return 0;
 
     int r = 0;
     int ret = 0;
 
-    ngx_rwlock_wlock(self->rwlock);
+    ngx_rwlock_wlock(&self->rwlock);
 
     if (self->buckets != NULL) {
         r = prom_histogram_buckets_destroy(self->buckets);
@@ -99,13 +222,32 @@ int prom_metric_destroy(prom_metric_t *self) {
     if (r) ret = r;
 
 
-    for (int i = 0; i < self->label_key_count; i++) {
+    for (size_t i = 0; i < self->label_key_count; i++) {
         ngx_slab_free(self->shpool, (void *)self->label_keys[i]);
         self->label_keys[i] = NULL;
     }
     ngx_slab_free(self->shpool, self->label_keys);
     self->label_keys = NULL;
 
+    if (self->unit != NULL) {
+        ngx_slab_free(self->shpool, (void *)self->unit);
+        self->unit = NULL;
+    }
+
+    if (self->quantiles != NULL) {
+        ngx_slab_free(self->shpool, self->quantiles);
+        self->quantiles = NULL;
+    }
+
+    r = prom_topk_destroy(self->topk);
+    self->topk = NULL;
+    if (r) ret = r;
+
+    if (self->window_name != NULL) {
+        ngx_slab_free(self->shpool, self->window_name);
+        self->window_name = NULL;
+    }
+
     ngx_slab_free(self->shpool, self);
     self = NULL;
 
@@ -127,13 +269,13 @@ void prom_metric_free_generic(void *item) {
 
 prom_metric_sample_t *prom_metric_sample_from_labels(prom_metric_t *self, const char **label_values) {
     int r = 0;
-    if (self == NULL) {
+    if (self == NULL || self->type == PROM_SUMMARY || self->topk != NULL) {
         return NULL;
     }
-    ngx_rwlock_wlock(self->rwlock);
+    ngx_rwlock_wlock(&self->rwlock);
 
 #define PROM_METRIC_SAMPLE_FROM_LABELS_HANDLE_UNLOCK() \
-    ngx_rwlock_unlock(self->rwlock);                     \
+    ngx_rwlock_unlock(&self->rwlock);                    \
     return NULL;
 
     // Get l_value
@@ -153,25 +295,134 @@ prom_metric_sample_t *prom_metric_sample_from_labels(prom_metric_t *self, const
     prom_metric_sample_t *sample = (prom_metric_sample_t *)prom_map_get(self->samples, l_value);
     if (sample == NULL) {
         sample = prom_metric_sample_new(self->shpool, self->type, l_value, 0.0);
+        if (sample != NULL && ((self->shard_count != 0 && prom_metric_sample_set_shards(sample, self->shard_count))
+                               || (self->exemplars && prom_metric_sample_set_exemplar(sample))
+                               || (self->window != 0 && prom_metric_sample_set_window(sample, self->window))
+                               || (self->hll_precision != 0
+                                   && prom_metric_sample_set_distinct(sample, self->hll_precision,
+                                                                      self->hll_window)))) {
+            prom_metric_sample_destroy(sample);
+            sample = NULL;
+        }
+        if (sample == NULL) {
+            ngx_rwlock_unlock(&self->rwlock);
+            prom_free((void *)l_value);
+            return NULL;
+        }
         r = prom_map_set(self->samples, l_value, sample);
         if (r) {
         PROM_METRIC_SAMPLE_FROM_LABELS_HANDLE_UNLOCK();
         }
     }
 
-    ngx_rwlock_unlock(self->rwlock); 
+    ngx_rwlock_unlock(&self->rwlock);
     prom_free((void *)l_value);
     return sample;
 }
 
+size_t prom_metric_l_value_len(prom_metric_t *self, const char **label_values) {
+    size_t len = ngx_strlen(self->name);
+
+    for (size_t i = 0; i < self->label_key_count; i++) {
+        // key="value" followed by a comma or the closing brace
+        len += ngx_strlen(self->label_keys[i]) + ngx_strlen(label_values[i]) + 4;
+    }
+
+    if (self->label_key_count) {
+        // The opening brace
+        len++;
+    }
+
+    return len;
+}
+
+char *prom_metric_l_value_write(prom_metric_t *self, const char **label_values, char *buf) {
+    char *p = (char *)ngx_cpymem(buf, self->name, ngx_strlen(self->name));
+
+    for (size_t i = 0; i < self->label_key_count; i++) {
+        *p++ = (i == 0) ? '{' : ',';
+        p = (char *)ngx_cpymem(p, self->label_keys[i], ngx_strlen(self->label_keys[i]));
+        *p++ = '=';
+        *p++ = '"';
+        p = (char *)ngx_cpymem(p, label_values[i], ngx_strlen(label_values[i]));
+        *p++ = '"';
+    }
+
+    if (self->label_key_count) {
+        *p++ = '}';
+    }
+
+    *p = '\0';
+    return p;
+}
+
+void *prom_metric_sample_from_l_value(prom_metric_t *self, const char *l_value, const char **label_values) {
+    if (self == NULL || self->topk != NULL) return NULL;
+
+    void *sample = prom_map_get(self->samples, l_value);
+    if (sample != NULL) return sample;
+
+    ngx_rwlock_wlock(&self->rwlock);
+
+    // Another process may have created the sample meanwhile
+    sample = prom_map_get(self->samples, l_value);
+    if (sample == NULL) {
+        if (self->type == PROM_HISTOGRAM) {
+            sample = prom_metric_sample_histogram_new(self->shpool, self->name, self->buckets, self->label_key_count,
+                                                      self->label_keys, label_values);
+            if (sample != NULL
+                && ((self->exemplars
+                     && prom_metric_sample_histogram_set_exemplars((prom_metric_sample_histogram_t *)sample))
+                    || (self->window != 0
+                        && prom_metric_sample_histogram_set_window((prom_metric_sample_histogram_t *)sample,
+                                                                   self->window)))) {
+                prom_metric_sample_histogram_destroy((prom_metric_sample_histogram_t *)sample);
+                sample = NULL;
+            }
+        } else if (self->type == PROM_SUMMARY) {
+            sample = prom_metric_sample_summary_new(self->shpool, self->name, self->quantiles, self->quantile_count,
+                                                    self->shard_count ? self->shard_count : 1,
+                                                    self->label_key_count, self->label_keys, label_values);
+        } else {
+            sample = prom_metric_sample_new(self->shpool, self->type, l_value, 0.0);
+            if (sample != NULL
+                && ((self->shard_count != 0
+                     && prom_metric_sample_set_shards((prom_metric_sample_t *)sample, self->shard_count))
+                    || (self->exemplars && prom_metric_sample_set_exemplar((prom_metric_sample_t *)sample))
+                    || (self->window != 0
+                        && prom_metric_sample_set_window((prom_metric_sample_t *)sample, self->window))
+                    || (self->hll_precision != 0
+                        && prom_metric_sample_set_distinct((prom_metric_sample_t *)sample, self->hll_precision,
+                                                           self->hll_window)))) {
+                prom_metric_sample_destroy((prom_metric_sample_t *)sample);
+                sample = NULL;
+            }
+        }
+
+        if (sample != NULL && prom_map_set(self->samples, l_value, sample)) {
+            if (self->type == PROM_HISTOGRAM) {
+                prom_metric_sample_histogram_destroy((prom_metric_sample_histogram_t *)sample);
+            } else if (self->type == PROM_SUMMARY) {
+                prom_metric_sample_summary_destroy((prom_metric_sample_summary_t *)sample);
+            } else {
+                prom_metric_sample_destroy((prom_metric_sample_t *)sample);
+            }
+            sample = NULL;
+        }
+    }
+
+    ngx_rwlock_unlock(&self->rwlock);
+    return sample;
+}
+
 prom_metric_sample_histogram_t *prom_metric_sample_histogram_from_labels(prom_metric_t *self,
                                                                          const char **label_values) {
 
     int r = 0;
-    ngx_rwlock_wlock(self->rwlock);
+    ngx_rwlock_wlock(&self->rwlock);
 
 #define PROM_METRIC_SAMPLE_HISTOGRAM_FROM_LABELS_HANDLE_UNLOCK() \
-    ngx_rwlock_unlock(self->rwlock);                             \
+    ngx_rwlock_unlock(&self->rwlock);                            \
     return NULL;
 
     // Load the l_value
@@ -192,6 +443,12 @@ prom_metric_sample_histogram_t *prom_metric_sample_histogram_from_labels(prom_me
     if (sample == NULL) {
         sample = prom_metric_sample_histogram_new(self->shpool, self->name, self->buckets, self->label_key_count, self->label_keys,
                                                 label_values);
+        if (sample != NULL
+            && ((self->exemplars && prom_metric_sample_histogram_set_exemplars(sample))
+                || (self->window != 0 && prom_metric_sample_histogram_set_window(sample, self->window)))) {
+            prom_metric_sample_histogram_destroy(sample);
+            sample = NULL;
+        }
         if (sample == NULL) {
             prom_free((void *)l_value);
             PROM_METRIC_SAMPLE_HISTOGRAM_FROM_LABELS_HANDLE_UNLOCK();
@@ -199,11 +456,10 @@ prom_metric_sample_histogram_t *prom_metric_sample_histogram_from_labels(prom_me
         r = prom_map_set(self->samples, l_value, sample);
         if (r) {
             prom_free((void *)l_value);
-            pthread_rwlock_unlock(self->rwlock);
             PROM_METRIC_SAMPLE_HISTOGRAM_FROM_LABELS_HANDLE_UNLOCK();
         }
     }
-    pthread_rwlock_unlock(self->rwlock);
+    ngx_rwlock_unlock(&self->rwlock);
     prom_free((void *)l_value);
     return sample;
 }
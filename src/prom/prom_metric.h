@@ -1,25 +1,30 @@
 #ifndef PROM_METRIC_T_H
 #define PROM_METRIC_T_H
 
-#include <pthread.h>
+#include "ngx_core.h"
+
+/**
+ * @brief API PRIVATE Contains metric type constants
+ */
+typedef enum prom_metric_type { PROM_COUNTER, PROM_GAUGE, PROM_HISTOGRAM, PROM_SUMMARY } prom_metric_type_t;
+
+/*
+ * The headers below refer back to these types, declare them before including them.
+ */
+typedef struct prom_metric prom_metric_t;
+typedef struct prom_metric_formatter prom_metric_formatter_t;
+typedef struct prom_metric_sample prom_metric_sample_t;
+typedef struct prom_metric_sample_histogram prom_metric_sample_histogram_t;
 
 // Public
-#include "prom_metric_formatter.h"
 #include "prom_string_builder.h"
 #include "prom_histogram_buckets.h"
 #include "prom_metric_sample.h"
 #include "prom_metric_sample_histogram.h"
-#include "prom_collector.h"
+#include "prom_metric_sample_summary.h"
 #include "prom_map.h"
 #include "prom_alloc.h"
-#include "prom_collector.h"
-#include "prom_collector_registry.h"
-
-
-/**
- * @brief API PRIVATE Contains metric type constants
- */
-typedef enum prom_metric_type { PROM_COUNTER, PROM_GAUGE, PROM_HISTOGRAM, PROM_SUMMARY } prom_metric_type_t;
+#include "prom_topk.h"
 
 /**
  * @brief API PRIVATE Maps metric type constants to human readable string values
@@ -30,7 +35,7 @@ extern char *prom_metric_type_map[4];
  * @brief API PRIVATE An opaque struct to users containing metric metadata; one or more metric samples; and a metric
  * formatter for locating metric samples and exporting metric data
  */
-typedef struct prom_metric {
+struct prom_metric {
   prom_metric_type_t type;            /**< metric_type      The type of metric */
   const char *name;                   /**< name             The name of the metric */
   const char *help;                   /**< help             The help output for the metric */
@@ -40,8 +45,18 @@ typedef struct prom_metric {
   prom_metric_formatter_t *formatter; /**< formatter        The metric formatter  */
   ngx_atomic_t rwlock;           /**< rwlock           Required for locking on certain non-atomic operations */
   const char **label_keys;            /**< labels           Array comprised of const char **/
+  const char *unit;                   /**< unit             The unit of the metric, NULL if not set */
   ngx_slab_pool_t *shpool;
-} prom_metric_t;
+  size_t shard_count;                 /**< shard_count      Shards of every sample of a sharded gauge or a summary */
+  double *quantiles;                  /**< quantiles        The quantiles of a summary */
+  size_t quantile_count;              /**< quantile_count   The number of quantiles */
+  int exemplars;                      /**< exemplars        Whether the samples keep exemplars */
+  prom_topk_t *topk;                  /**< topk             The heavy hitters of a top-K metric, NULL otherwise */
+  uint32_t hll_precision;             /**< hll_precision    The precision of the sketches of a distinct count, or 0 */
+  time_t hll_window;                  /**< hll_window       The window of the sketches of a distinct count */
+  uint32_t window;                    /**< window           The seconds of the sliding window of every sample, or 0 */
+  char *window_name;                  /**< window_name      The family exposing the windows, NULL without */
+};
 
 /**
  * @brief Returns a prom_metric_sample_t*. The order of label_values is significant.
@@ -74,12 +89,152 @@ prom_metric_sample_t *prom_metric_sample_from_labels(prom_metric_t *self, const
 prom_metric_sample_histogram_t *prom_metric_sample_histogram_from_labels(prom_metric_t *self,
                                                                          const char **label_values);
 
+/**
+ * @brief Returns the length of the l_value of the sample with the given label values, without the terminating null
+ * character.
+ *
+ * Together with prom_metric_l_value_write() and prom_metric_sample_from_l_value(), it lets callers locate a sample in
+ * memory they own instead of building the l_value with the metric formatter.
+ *
+ * @param self The target prom_metric_t*
+ * @param label_values The label values, in the order of the label keys
+ * @return The length of the l_value
+ */
+size_t prom_metric_l_value_len(prom_metric_t *self, const char **label_values);
+
+/**
+ * @brief Writes the null-terminated l_value of the sample with the given label values to buf.
+ * @param self The target prom_metric_t*
+ * @param label_values The label values, in the order of the label keys
+ * @param buf At least prom_metric_l_value_len() + 1 bytes
+ * @return A pointer to the terminating null character in buf
+ */
+char *prom_metric_l_value_write(prom_metric_t *self, const char **label_values, char *buf);
+
+/**
+ * @brief Returns the sample with the given l_value, creating it on first use.
+ *
+ * The lookup takes the read lock of the samples map only; the metric is write-locked when the sample is created.
+ *
+ * @param self The target prom_metric_t*
+ * @param l_value The l_value written by prom_metric_l_value_write()
+ * @param label_values The label values the l_value was written from
+ * @return A prom_metric_sample_t*, a prom_metric_sample_histogram_t* for histograms or a
+ *         prom_metric_sample_summary_t* for summaries. NULL upon failure.
+ */
+void *prom_metric_sample_from_l_value(prom_metric_t *self, const char *l_value, const char **label_values);
+
 /**
  * @brief API PRIVATE Returns a *prom_metric
  */
 prom_metric_t *prom_metric_new(ngx_slab_pool_t *shpool, prom_metric_type_t type, const char *name, const char *help, size_t label_key_count,
                                const char **label_keys);
 
+/**
+ * @brief Sets the bucket upper bounds of a histogram. The metric takes ownership of buckets.
+ *
+ * It MUST be called before the first sample of the histogram is created.
+ *
+ * @param self The target prom_metric_t*
+ * @param buckets The bucket upper bounds
+ * @return A non-zero integer value upon failure, if the metric is not a histogram or if its buckets are already set
+ */
+int prom_metric_set_buckets(prom_metric_t *self, prom_histogram_buckets_t *buckets);
+
+/**
+ * @brief Creates every sample of a gauge or a summary with one shard per worker, see prom_metric_sample_set_shards().
+ *
+ * It MUST be called before the first sample of the metric is created. Summaries without shards have a single one.
+ *
+ * @param self The target prom_metric_t*
+ * @param shard_count The number of workers
+ * @return A non-zero integer value upon failure, if the metric is not a gauge or a summary or if it already has
+ *         samples
+ */
+int prom_metric_set_shards(prom_metric_t *self, size_t shard_count);
+
+/**
+ * @brief Sets the quantiles every sample of a summary reports. The quantiles are copied.
+ *
+ * It MUST be called before the first sample of the summary is created. Summaries without quantiles report their sum
+ * and count only.
+ *
+ * @param self The target prom_metric_t*
+ * @param quantiles The quantiles, each between 0 and 1
+ * @param quantile_count The number of quantiles, at most PROM_SUMMARY_QUANTILES_MAX
+ * @return A non-zero integer value upon failure, if the metric is not a summary or if it already has samples
+ */
+int prom_metric_set_quantiles(prom_metric_t *self, const double *quantiles, size_t quantile_count);
+
+/**
+ * @brief Makes a counter or a gauge with a single label a top-K metric, see prom_topk.h.
+ *
+ * The values of the label are keys of a sketch of fixed size instead of series: prom_topk_add() counts a value for a
+ * key, and the scrape exposes the K keys of the highest counts as the series of the metric. No sample is ever created.
+ * It MUST be called before the first sample of the metric is created.
+ *
+ * @param self The target prom_metric_t*
+ * @param k The number of keys exposed
+ * @param capacity The number of keys monitored, at least k
+ * @param shard_count The number of workers, each updates a sketch of its own
+ * @return A non-zero integer value upon failure, if the metric is not a counter or a gauge, if it does not have
+ *         exactly one label or if it already has samples
+ */
+int prom_metric_set_topk(prom_metric_t *self, size_t k, size_t capacity, size_t shard_count);
+
+/**
+ * @brief Makes a gauge a distinct count: every sample estimates the number of distinct keys counted with prom_hll_add()
+ * in its HyperLogLog sketch, see prom_hll.h.
+ *
+ * It MUST be called before the first sample of the metric is created.
+ *
+ * @param self The target prom_metric_t*
+ * @param precision The precision of the sketches, from PROM_HLL_PRECISION_MIN to PROM_HLL_PRECISION_MAX
+ * @param window The seconds of keys counted, or 0 to count keys forever
+ * @return A non-zero integer value upon failure, if the metric is not a gauge, if it is sharded or if it already has
+ *         samples
+ */
+int prom_metric_set_distinct(prom_metric_t *self, uint32_t precision, time_t window);
+
+/**
+ * @brief Gives every sample of a counter or a histogram a sliding window of per-second counts, see prom_window.h.
+ *
+ * The windows are read with prom_window_rate() and prom_window_quantile(). The scrape exposes them as a gauge family:
+ * the rate of a counter over the window as <name>_rate, its _total suffix removed, and PROM_WINDOW_QUANTILES of a
+ * histogram over the window as <name>_window with a quantile label. It MUST be called before the first sample of the
+ * metric is created.
+ *
+ * @param self The target prom_metric_t*
+ * @param seconds The seconds of the windows, from 1 to PROM_WINDOW_SECONDS_MAX
+ * @return A non-zero integer value upon failure, if the metric is not a counter or a histogram, if it is a top-K
+ *         metric or if it already has samples
+ */
+int prom_metric_set_window(prom_metric_t *self, uint32_t seconds);
+
+/**
+ * @brief Gives every sample of a counter, and every bucket of every sample of a histogram, an exemplar slot.
+ *
+ * The exemplars are exposed in the OpenMetrics format only. It MUST be called before the first sample of the metric
+ * is created.
+ *
+ * @param self The target prom_metric_t*
+ * @return A non-zero integer value upon failure, if the metric is not a counter or a histogram or if it already has
+ *         samples
+ */
+int prom_metric_set_exemplars(prom_metric_t *self);
+
+/**
+ * @brief Sets the unit exposed in the OpenMetrics UNIT metadata of the metric.
+ *
+ * OpenMetrics requires the metric name to carry the unit as a suffix, e.g. http_request_duration_seconds for the unit
+ * seconds. Counters may additionally end in _total.
+ *
+ * @param self The target prom_metric_t*
+ * @param unit The unit, e.g. seconds or bytes
+ * @return A non-zero integer value upon failure or if the metric name does not end with the unit
+ */
+int prom_metric_set_unit(prom_metric_t *self, const char *unit);
+
 /**
  * @brief API PRIVATE Destroys a *prom_metric
  */
@@ -1,4 +1,47 @@
+#include <math.h>
+
+#include "prom_collector.h"
 #include "prom_metric_formatter.h"
+#include "prom_protobuf.h"
+
+// The amount of rendered data buffered before it is handed to the flush function
+#define PROM_METRIC_FORMATTER_FLUSH_SIZE 16384
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Static Declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static int prom_metric_formatter_load_value(prom_metric_formatter_t *self, double value);
+
+static int prom_metric_formatter_load_histogram(prom_metric_formatter_t *self,
+                                                prom_metric_sample_histogram_t *hist_sample);
+
+static int prom_metric_formatter_load_histogram_snapshot(prom_metric_formatter_t *self,
+                                                         prom_metric_sample_histogram_t *hist_sample,
+                                                         uint64_t count, double sum);
+
+static int prom_metric_formatter_load_summary(prom_metric_formatter_t *self, prom_metric_sample_summary_t *summary);
+
+static int prom_metric_formatter_load_line(prom_metric_formatter_t *self, const char *l_value, double value);
+
+static int prom_metric_formatter_load_line_exemplar(prom_metric_formatter_t *self, const char *l_value, double value,
+                                                    prom_exemplar_t *exemplar);
+
+static int prom_metric_formatter_load_exemplar(prom_metric_formatter_t *self, prom_exemplar_t *exemplar);
+
+static int prom_metric_formatter_load_metric_openmetrics(prom_metric_formatter_t *self, prom_metric_t *metric);
+
+static int prom_metric_formatter_load_topk(prom_metric_formatter_t *self, prom_metric_t *metric);
+
+static int prom_metric_formatter_load_openmetrics_line(prom_metric_formatter_t *self, const char *family,
+                                                       size_t family_len, const char *suffix, const char *labels,
+                                                       double value, const char *format, prom_exemplar_t *exemplar);
+
+static int prom_metric_formatter_load_label_value(prom_metric_formatter_t *self, const char *value);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// End static declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 prom_metric_formatter_t *prom_metric_formatter_new() {
     prom_metric_formatter_t *self = (prom_metric_formatter_t *)prom_malloc(sizeof(prom_metric_formatter_t));
@@ -12,6 +55,17 @@ prom_metric_formatter_t *prom_metric_formatter_new() {
         prom_metric_formatter_destroy(self);
         return NULL;
     }
+    self->format = PROM_FORMAT_TEXT;
+    self->flush_fn = NULL;
+    self->flush_data = NULL;
+    self->filters = NULL;
+    self->filter_count = 0;
+    self->family = NULL;
+    self->family_len = 0;
+    self->family_type = PROM_GAUGE;
+    self->family_start = 0;
+    self->family_values = 0;
+    self->family_skip = 0;
     return self;
 }
 
@@ -93,7 +147,7 @@ int prom_metric_formatter_load_l_value(prom_metric_formatter_t *self, const char
 
     if (label_count == 0) return 0;
 
-    for (int i = 0; i < label_count; i++) {
+    for (size_t i = 0; i < label_count; i++) {
         if (i == 0) {
         r = prom_string_builder_add_char(self->string_builder, '{');
         if (r) return r;
@@ -127,22 +181,117 @@ int prom_metric_formatter_load_l_value(prom_metric_formatter_t *self, const char
 int prom_metric_formatter_load_sample(prom_metric_formatter_t *self, prom_metric_sample_t *sample) {
     if (self == NULL) return 1;
 
+    return prom_metric_formatter_load_line(self, sample->l_value, prom_metric_sample_value(sample));
+}
+
+static int prom_metric_formatter_load_line(prom_metric_formatter_t *self, const char *l_value, double value) {
+    return prom_metric_formatter_load_line_exemplar(self, l_value, value, NULL);
+}
+
+static int prom_metric_formatter_load_line_exemplar(prom_metric_formatter_t *self, const char *l_value, double value,
+                                                    prom_exemplar_t *exemplar) {
     int r = 0;
 
-    r = prom_string_builder_add_str(self->string_builder, sample->l_value);
+    r = prom_string_builder_add_str(self->string_builder, l_value);
     if (r) return r;
 
     r = prom_string_builder_add_char(self->string_builder, ' ');
     if (r) return r;
 
-    char buffer[50];
-    sprintf(buffer, "%.17g", sample->r_value);
-    r = prom_string_builder_add_str(self->string_builder, buffer);
+    r = prom_metric_formatter_load_value(self, value);
+    if (r) return r;
+
+    r = prom_metric_formatter_load_exemplar(self, exemplar);
     if (r) return r;
 
     return prom_string_builder_add_char(self->string_builder, '\n');
 }
 
+/**
+ * @brief API PRIVATE Appends the exemplar of a line, " # {labels} value timestamp". Only OpenMetrics has exemplars,
+ * nothing is appended in the text format or if the slot is empty.
+ */
+static int prom_metric_formatter_load_exemplar(prom_metric_formatter_t *self, prom_exemplar_t *exemplar) {
+    int r = 0;
+    char buffer[50];
+    prom_exemplar_buffer_t copy;
+
+    if (exemplar == NULL || self->format != PROM_FORMAT_OPENMETRICS) return 0;
+    if (prom_exemplar_load(exemplar, &copy)) return 0;
+
+    r = prom_string_builder_add_str(self->string_builder, " # {");
+    if (r) return r;
+    r = prom_string_builder_add_data(self->string_builder, copy.labels, copy.len);
+    if (r) return r;
+    r = prom_string_builder_add_str(self->string_builder, "} ");
+    if (r) return r;
+    r = prom_metric_formatter_load_value(self, copy.value);
+    if (r) return r;
+
+    sprintf(buffer, " %.3f", copy.timestamp);
+    return prom_string_builder_add_str(self->string_builder, buffer);
+}
+
+static int prom_metric_formatter_load_value(prom_metric_formatter_t *self, double value) {
+    char buffer[50];
+
+    // printf spells these nan and inf, the exposition formats NaN and +Inf
+    if (isnan(value)) return prom_string_builder_add_str(self->string_builder, "NaN");
+    if (isinf(value)) return prom_string_builder_add_str(self->string_builder, value > 0 ? "+Inf" : "-Inf");
+
+    sprintf(buffer, "%.17g", value);
+    return prom_string_builder_add_str(self->string_builder, buffer);
+}
+
+int prom_metric_formatter_set_format(prom_metric_formatter_t *self, prom_metric_format_t format) {
+    if (self == NULL) return 1;
+    self->format = format;
+    return 0;
+}
+
+int prom_metric_formatter_finish(prom_metric_formatter_t *self) {
+    int r = 0;
+    if (self == NULL) return 1;
+
+    if (self->format == PROM_FORMAT_OPENMETRICS) {
+        r = prom_string_builder_add_str(self->string_builder, "# EOF\n");
+        if (r) return r;
+    }
+
+    return prom_metric_formatter_flush(self);
+}
+
+int prom_metric_formatter_set_flush_fn(prom_metric_formatter_t *self, prom_metric_formatter_flush_fn *fn,
+                                       void *data) {
+    if (self == NULL) return 1;
+    self->flush_fn = fn;
+    self->flush_data = data;
+    return 0;
+}
+
+int prom_metric_formatter_flush(prom_metric_formatter_t *self) {
+    int r = 0;
+    if (self == NULL) return 1;
+    if (self->flush_fn == NULL) return 0;
+
+    size_t len = prom_string_builder_len(self->string_builder);
+    if (len == 0) return 0;
+
+    r = self->flush_fn(self->flush_data, prom_string_builder_str(self->string_builder), len);
+    if (r) return r;
+
+    // Keep the allocation around, the next metric will most likely need the same amount of space
+    return prom_string_builder_truncate(self->string_builder, 0);
+}
+
+int prom_metric_formatter_flush_if_full(prom_metric_formatter_t *self) {
+    if (self == NULL) return 1;
+    if (self->flush_fn == NULL || prom_string_builder_len(self->string_builder) < PROM_METRIC_FORMATTER_FLUSH_SIZE) {
+        return 0;
+    }
+    return prom_metric_formatter_flush(self);
+}
+
 int prom_metric_formatter_clear(prom_metric_formatter_t *self) {
     return prom_string_builder_clear(self->string_builder);
 }
@@ -163,6 +312,24 @@ char *prom_metric_formatter_dump(prom_metric_formatter_t *self) {
 int prom_metric_formatter_load_metric(prom_metric_formatter_t *self, prom_metric_t *metric) {
     if (self == NULL) return 1;
 
+    if (metric->topk != NULL) {
+        return prom_metric_formatter_load_topk(self, metric);
+    }
+
+    // The windows are a gauge family of their own, ahead of the metric. A filtered render indexes them by their name.
+    if (metric->window != 0 && self->filters == NULL) {
+        int r = prom_metric_formatter_load_window(self, metric);
+        if (r) return r;
+    }
+
+    if (self->format == PROM_FORMAT_OPENMETRICS) {
+        return prom_metric_formatter_load_metric_openmetrics(self, metric);
+    }
+
+    if (self->format == PROM_FORMAT_PROTOBUF) {
+        return prom_protobuf_load_metric(self->string_builder, metric);
+    }
+
     int r = 0;
 
     r = prom_metric_formatter_load_help(self, metric->name, metric->help);
@@ -180,14 +347,14 @@ int prom_metric_formatter_load_metric(prom_metric_formatter_t *self, prom_metric
 
             if (hist_sample == NULL) return 1;
 
-            for (prom_linked_list_node_t *current_hist_node = hist_sample->l_value_list->head; current_hist_node != NULL;
-                current_hist_node = current_hist_node->next) {
-                const char *hist_key = (const char *)current_hist_node->item;
-                prom_metric_sample_t *sample = (prom_metric_sample_t *)prom_map_get(hist_sample->samples, hist_key);
-                if (sample == NULL) return 1;
-                r = prom_metric_formatter_load_sample(self, sample);
-                if (r) return r;
-            }
+            r = prom_metric_formatter_load_histogram(self, hist_sample);
+            if (r) return r;
+        } else if (metric->type == PROM_SUMMARY) {
+            prom_metric_sample_summary_t *summary = (prom_metric_sample_summary_t *)prom_map_get(metric->samples, key);
+            if (summary == NULL) return 1;
+
+            r = prom_metric_formatter_load_summary(self, summary);
+            if (r) return r;
         } else {
             prom_metric_sample_t *sample = (prom_metric_sample_t *)prom_map_get(metric->samples, key);
             if (sample == NULL) return 1;
@@ -198,6 +365,491 @@ int prom_metric_formatter_load_metric(prom_metric_formatter_t *self, prom_metric
   return prom_string_builder_add_char(self->string_builder, '\n');
 }
 
+static int prom_metric_formatter_load_histogram(prom_metric_formatter_t *self,
+                                                prom_metric_sample_histogram_t *hist_sample) {
+    int r = 0;
+    uint64_t count;
+    double sum;
+
+    // The buckets, the count and the sum of one snapshot always agree
+    r = prom_metric_sample_histogram_snapshot(hist_sample, &count, &sum);
+    if (r) return r;
+
+    r = prom_metric_formatter_load_histogram_snapshot(self, hist_sample, count, sum);
+
+    prom_metric_sample_histogram_snapshot_end(hist_sample);
+    return r;
+}
+
+static int prom_metric_formatter_load_histogram_snapshot(prom_metric_formatter_t *self,
+                                                         prom_metric_sample_histogram_t *hist_sample,
+                                                         uint64_t count, double sum) {
+    int r = 0;
+
+    // The samples are referenced directly, rendering a histogram does not need any l_value lookups. The buckets are
+    // made cumulative as they are rendered.
+    uint64_t cumulative = 0;
+    int bucket_count = prom_histogram_buckets_count(hist_sample->buckets);
+    for (int i = 0; i < bucket_count; i++) {
+        cumulative += prom_metric_sample_histogram_snapshot_bucket(hist_sample, i);
+        r = prom_metric_formatter_load_line_exemplar(self, hist_sample->bucket_samples[i]->l_value,
+                                                     (double)cumulative,
+                                                     hist_sample->exemplars ? &hist_sample->exemplars[i] : NULL);
+        if (r) return r;
+    }
+
+    r = prom_metric_formatter_load_line_exemplar(self, hist_sample->inf_sample->l_value, (double)count,
+                                                 hist_sample->exemplars ? &hist_sample->exemplars[bucket_count] : NULL);
+    if (r) return r;
+
+    r = prom_metric_formatter_load_line(self, hist_sample->count_sample->l_value, (double)count);
+    if (r) return r;
+
+    return prom_metric_formatter_load_line(self, hist_sample->sum_sample->l_value, sum);
+}
+
+static int prom_metric_formatter_load_summary(prom_metric_formatter_t *self, prom_metric_sample_summary_t *summary) {
+    int r = 0;
+    double values[PROM_SUMMARY_QUANTILES_MAX];
+    uint64_t count;
+    double sum;
+
+    r = prom_metric_sample_summary_snapshot(summary, values, &count, &sum);
+    if (r) return r;
+
+    for (size_t i = 0; i < summary->quantile_count; i++) {
+        r = prom_metric_formatter_load_line(self, summary->quantile_l_values[i], values[i]);
+        if (r) return r;
+    }
+
+    r = prom_metric_formatter_load_line(self, summary->sum_l_value, sum);
+    if (r) return r;
+
+    return prom_metric_formatter_load_line(self, summary->count_l_value, (double)count);
+}
+
+/**
+ * @brief API PRIVATE Loads the K keys of the highest counts of a top-K metric as its series, in any format
+ */
+static int prom_metric_formatter_load_topk(prom_metric_formatter_t *self, prom_metric_t *metric) {
+    int r = 0;
+    const char *label_values[1];
+
+    prom_topk_entry_t *entries = (prom_topk_entry_t *)prom_malloc(sizeof(prom_topk_entry_t) * metric->topk->capacity
+                                                                  * metric->topk->shard_count);
+    if (entries == NULL) return 1;
+
+    size_t n = prom_topk_snapshot(metric->topk, entries);
+    if (n > metric->topk->k) n = metric->topk->k;
+
+    r = prom_metric_formatter_begin_family(self, metric->name, metric->help, metric->type);
+
+    for (size_t i = 0; r == 0 && i < n; i++) {
+        label_values[0] = entries[i].key;
+        r = prom_metric_formatter_load_family_value(self, 1, metric->label_keys, label_values, entries[i].count);
+    }
+
+    if (r == 0) r = prom_metric_formatter_end_family(self);
+
+    prom_free(entries);
+    return r;
+}
+
+int prom_metric_formatter_load_window(prom_metric_formatter_t *self, prom_metric_t *metric) {
+    static const double quantiles[PROM_WINDOW_QUANTILE_COUNT] = PROM_WINDOW_QUANTILES;
+
+    int r = 0;
+    char quantile[32];
+    size_t name_len = ngx_strlen(metric->name);
+
+    r = prom_metric_formatter_begin_family(self, metric->window_name, metric->help, PROM_GAUGE);
+
+    for (prom_linked_list_node_t *current_node = metric->samples->keys->head; r == 0 && current_node != NULL;
+         current_node = current_node->next) {
+        const char *key = (const char *)current_node->item;
+
+        if (metric->type == PROM_COUNTER) {
+            prom_metric_sample_t *sample = (prom_metric_sample_t *)prom_map_get(metric->samples, key);
+            if (sample == NULL || sample->window == NULL) return 1;
+
+            r = prom_metric_formatter_load_family_l_value(self, sample->l_value + name_len, NULL, NULL,
+                                                          prom_window_rate(sample->window, metric->window));
+            continue;
+        }
+
+        prom_metric_sample_histogram_t *hist_sample =
+            (prom_metric_sample_histogram_t *)prom_map_get(metric->samples, key);
+        if (hist_sample == NULL || hist_sample->window == NULL) return 1;
+
+        // The count l_value carries the label set of the series without the le label
+        const char *labels = hist_sample->count_sample->l_value + name_len + sizeof("_count") - 1;
+
+        for (size_t i = 0; r == 0 && i < PROM_WINDOW_QUANTILE_COUNT; i++) {
+            double value = prom_window_quantile(hist_sample->window, metric->window, quantiles[i]);
+
+            snprintf(quantile, sizeof(quantile), "%g", quantiles[i]);
+            r = prom_metric_formatter_load_family_l_value(self, labels, "quantile", quantile, value);
+        }
+    }
+
+    if (r == 0) r = prom_metric_formatter_end_family(self);
+    return r;
+}
+
+/**
+ * @brief API PRIVATE Loads a metric family in the OpenMetrics text format.
+ *
+ * Reference: https://github.com/OpenObservability/OpenMetrics/blob/main/specification/OpenMetrics.md
+ *
+ * Counter families are named without the _total suffix, which is added to every counter sample instead. Counters,
+ * histograms and summaries are followed by a _created sample carrying the creation time of the series. Unlike the
+ * text format, families are not separated by blank lines.
+ */
+static int prom_metric_formatter_load_metric_openmetrics(prom_metric_formatter_t *self, prom_metric_t *metric) {
+    int r = 0;
+    size_t name_len = ngx_strlen(metric->name);
+    size_t family_len = name_len;
+
+    if (metric->type == PROM_COUNTER && family_len > sizeof("_total") - 1
+        && strcmp(metric->name + family_len - (sizeof("_total") - 1), "_total") == 0) {
+        family_len -= sizeof("_total") - 1;
+    }
+
+    r = prom_string_builder_add_str(self->string_builder, "# TYPE ");
+    if (r) return r;
+    r = prom_string_builder_add_data(self->string_builder, metric->name, family_len);
+    if (r) return r;
+    r = prom_string_builder_add_char(self->string_builder, ' ');
+    if (r) return r;
+    r = prom_string_builder_add_str(self->string_builder, prom_metric_type_map[metric->type]);
+    if (r) return r;
+    r = prom_string_builder_add_char(self->string_builder, '\n');
+    if (r) return r;
+
+    if (metric->unit != NULL) {
+        r = prom_string_builder_add_str(self->string_builder, "# UNIT ");
+        if (r) return r;
+        r = prom_string_builder_add_data(self->string_builder, metric->name, family_len);
+        if (r) return r;
+        r = prom_string_builder_add_char(self->string_builder, ' ');
+        if (r) return r;
+        r = prom_string_builder_add_str(self->string_builder, metric->unit);
+        if (r) return r;
+        r = prom_string_builder_add_char(self->string_builder, '\n');
+        if (r) return r;
+    }
+
+    r = prom_string_builder_add_str(self->string_builder, "# HELP ");
+    if (r) return r;
+    r = prom_string_builder_add_data(self->string_builder, metric->name, family_len);
+    if (r) return r;
+    r = prom_string_builder_add_char(self->string_builder, ' ');
+    if (r) return r;
+    r = prom_string_builder_add_str(self->string_builder, metric->help);
+    if (r) return r;
+    r = prom_string_builder_add_char(self->string_builder, '\n');
+    if (r) return r;
+
+    for (prom_linked_list_node_t *current_node = metric->samples->keys->head; current_node != NULL;
+         current_node = current_node->next) {
+        const char *key = (const char *)current_node->item;
+
+        if (metric->type == PROM_HISTOGRAM) {
+            prom_metric_sample_histogram_t *hist_sample =
+                (prom_metric_sample_histogram_t *)prom_map_get(metric->samples, key);
+            if (hist_sample == NULL) return 1;
+
+            r = prom_metric_formatter_load_histogram(self, hist_sample);
+            if (r) return r;
+
+            // The label set of the series is whatever follows name_count in the count l_value
+            const char *labels = hist_sample->count_sample->l_value + name_len + sizeof("_count") - 1;
+            r = prom_metric_formatter_load_openmetrics_line(self, metric->name, family_len, "_created", labels,
+                                                            hist_sample->created, "%.3f", NULL);
+            if (r) return r;
+            continue;
+        }
+
+        if (metric->type == PROM_SUMMARY) {
+            prom_metric_sample_summary_t *summary = (prom_metric_sample_summary_t *)prom_map_get(metric->samples, key);
+            if (summary == NULL) return 1;
+
+            r = prom_metric_formatter_load_summary(self, summary);
+            if (r) return r;
+
+            const char *labels = summary->count_l_value + name_len + sizeof("_count") - 1;
+            r = prom_metric_formatter_load_openmetrics_line(self, metric->name, family_len, "_created", labels,
+                                                            summary->created, "%.3f", NULL);
+            if (r) return r;
+            continue;
+        }
+
+        prom_metric_sample_t *sample = (prom_metric_sample_t *)prom_map_get(metric->samples, key);
+        if (sample == NULL) return 1;
+
+        if (metric->type != PROM_COUNTER) {
+            r = prom_metric_formatter_load_sample(self, sample);
+            if (r) return r;
+            continue;
+        }
+
+        const char *labels = sample->l_value + name_len;
+        r = prom_metric_formatter_load_openmetrics_line(self, metric->name, family_len, "_total", labels,
+                                                        prom_metric_sample_value(sample), "%.17g",
+                                                        sample->exemplar);
+        if (r) return r;
+        r = prom_metric_formatter_load_openmetrics_line(self, metric->name, family_len, "_created", labels,
+                                                        sample->created, "%.3f", NULL);
+        if (r) return r;
+    }
+
+    return 0;
+}
+
+static int prom_metric_formatter_load_openmetrics_line(prom_metric_formatter_t *self, const char *family,
+                                                       size_t family_len, const char *suffix, const char *labels,
+                                                       double value, const char *format, prom_exemplar_t *exemplar) {
+    int r = 0;
+    char buffer[50];
+
+    r = prom_string_builder_add_data(self->string_builder, family, family_len);
+    if (r) return r;
+    r = prom_string_builder_add_str(self->string_builder, suffix);
+    if (r) return r;
+    r = prom_string_builder_add_str(self->string_builder, labels);
+    if (r) return r;
+    r = prom_string_builder_add_char(self->string_builder, ' ');
+    if (r) return r;
+
+    sprintf(buffer, format, value);
+    r = prom_string_builder_add_str(self->string_builder, buffer);
+    if (r) return r;
+
+    r = prom_metric_formatter_load_exemplar(self, exemplar);
+    if (r) return r;
+
+    return prom_string_builder_add_char(self->string_builder, '\n');
+}
+
+int prom_metric_formatter_set_filters(prom_metric_formatter_t *self, const prom_metric_name_filter_t *filters,
+                                      size_t filter_count) {
+    if (self == NULL) return 1;
+    self->filters = filters;
+    self->filter_count = filters != NULL ? filter_count : 0;
+    return 0;
+}
+
+int prom_metric_formatter_filter_match(const prom_metric_name_filter_t *filter, const char *name) {
+    if (ngx_strncmp(name, filter->name, filter->len) != 0) return 0;
+    return filter->prefix || name[filter->len] == '\0';
+}
+
+int prom_metric_formatter_begin_family(prom_metric_formatter_t *self, const char *name, const char *help,
+                                       prom_metric_type_t type) {
+    int r = 0;
+    if (self == NULL) return 1;
+
+    // Only counters and gauges are a single value per series
+    if (type != PROM_COUNTER && type != PROM_GAUGE) return 1;
+
+    self->family = name;
+    self->family_len = ngx_strlen(name);
+    self->family_type = type;
+    self->family_values = 0;
+    self->family_skip = 0;
+
+    if (self->filters != NULL) {
+        size_t i;
+        for (i = 0; i < self->filter_count; i++) {
+            if (prom_metric_formatter_filter_match(&self->filters[i], name)) break;
+        }
+        if (i == self->filter_count) {
+            self->family_skip = 1;
+            return 0;
+        }
+    }
+
+    if (self->format == PROM_FORMAT_PROTOBUF) {
+        return prom_protobuf_begin_family(self->string_builder, name, self->family_len, help, type,
+                                          &self->family_start);
+    }
+
+    if (self->format == PROM_FORMAT_TEXT) {
+        r = prom_metric_formatter_load_help(self, name, help);
+        if (r) return r;
+        return prom_metric_formatter_load_type(self, name, type);
+    }
+
+    // OpenMetrics names the counter family without the _total suffix of its samples
+    if (type == PROM_COUNTER && self->family_len > sizeof("_total") - 1
+        && strcmp(name + self->family_len - (sizeof("_total") - 1), "_total") == 0) {
+        self->family_len -= sizeof("_total") - 1;
+    }
+
+    r = prom_string_builder_add_str(self->string_builder, "# TYPE ");
+    if (r) return r;
+    r = prom_string_builder_add_data(self->string_builder, name, self->family_len);
+    if (r) return r;
+    r = prom_string_builder_add_char(self->string_builder, ' ');
+    if (r) return r;
+    r = prom_string_builder_add_str(self->string_builder, prom_metric_type_map[type]);
+    if (r) return r;
+    r = prom_string_builder_add_str(self->string_builder, "\n# HELP ");
+    if (r) return r;
+    r = prom_string_builder_add_data(self->string_builder, name, self->family_len);
+    if (r) return r;
+    r = prom_string_builder_add_char(self->string_builder, ' ');
+    if (r) return r;
+    r = prom_string_builder_add_str(self->string_builder, help);
+    if (r) return r;
+    return prom_string_builder_add_char(self->string_builder, '\n');
+}
+
+int prom_metric_formatter_load_family_value(prom_metric_formatter_t *self, size_t label_count,
+                                            const char **label_keys, const char **label_values, double value) {
+    int r = 0;
+    if (self == NULL || self->family == NULL) return 1;
+    if (self->family_skip) return 0;
+
+    self->family_values++;
+
+    if (self->format == PROM_FORMAT_PROTOBUF) {
+        return prom_protobuf_load_value(self->string_builder, self->family_type, label_count, label_keys,
+                                        label_values, value);
+    }
+
+    r = prom_string_builder_add_data(self->string_builder, self->family, self->family_len);
+    if (r) return r;
+
+    if (self->format == PROM_FORMAT_OPENMETRICS && self->family_type == PROM_COUNTER) {
+        r = prom_string_builder_add_str(self->string_builder, "_total");
+        if (r) return r;
+    }
+
+    for (size_t i = 0; i < label_count; i++) {
+        r = prom_string_builder_add_char(self->string_builder, i == 0 ? '{' : ',');
+        if (r) return r;
+        r = prom_string_builder_add_str(self->string_builder, label_keys[i]);
+        if (r) return r;
+        r = prom_string_builder_add_str(self->string_builder, "=\"");
+        if (r) return r;
+        r = prom_metric_formatter_load_label_value(self, label_values[i]);
+        if (r) return r;
+        r = prom_string_builder_add_char(self->string_builder, '"');
+        if (r) return r;
+    }
+
+    if (label_count != 0) {
+        r = prom_string_builder_add_char(self->string_builder, '}');
+        if (r) return r;
+    }
+
+    r = prom_string_builder_add_char(self->string_builder, ' ');
+    if (r) return r;
+
+    r = prom_metric_formatter_load_value(self, value);
+    if (r) return r;
+
+    return prom_string_builder_add_char(self->string_builder, '\n');
+}
+
+int prom_metric_formatter_load_family_l_value(prom_metric_formatter_t *self, const char *labels, const char *key,
+                                              const char *label_value, double value) {
+    int r = 0;
+    if (self == NULL || self->family == NULL) return 1;
+    if (self->family_skip) return 0;
+
+    self->family_values++;
+
+    if (self->format == PROM_FORMAT_PROTOBUF) {
+        return prom_protobuf_load_value_l_value(self->string_builder, self->family_type, labels, key, label_value,
+                                                value);
+    }
+
+    r = prom_string_builder_add_data(self->string_builder, self->family, self->family_len);
+    if (r) return r;
+
+    if (self->format == PROM_FORMAT_OPENMETRICS && self->family_type == PROM_COUNTER) {
+        r = prom_string_builder_add_str(self->string_builder, "_total");
+        if (r) return r;
+    }
+
+    // The labels of the sample without their closing brace, which follows the additional label
+    size_t len = ngx_strlen(labels);
+    if (len != 0) {
+        r = prom_string_builder_add_data(self->string_builder, labels, len - 1);
+        if (r) return r;
+    }
+
+    if (key != NULL) {
+        r = prom_string_builder_add_char(self->string_builder, len != 0 ? ',' : '{');
+        if (r) return r;
+        r = prom_string_builder_add_str(self->string_builder, key);
+        if (r) return r;
+        r = prom_string_builder_add_str(self->string_builder, "=\"");
+        if (r) return r;
+        r = prom_metric_formatter_load_label_value(self, label_value);
+        if (r) return r;
+        r = prom_string_builder_add_char(self->string_builder, '"');
+        if (r) return r;
+    }
+
+    if (len != 0 || key != NULL) {
+        r = prom_string_builder_add_char(self->string_builder, '}');
+        if (r) return r;
+    }
+
+    r = prom_string_builder_add_char(self->string_builder, ' ');
+    if (r) return r;
+
+    r = prom_metric_formatter_load_value(self, value);
+    if (r) return r;
+
+    return prom_string_builder_add_char(self->string_builder, '\n');
+}
+
+int prom_metric_formatter_end_family(prom_metric_formatter_t *self) {
+    int r = 0;
+    if (self == NULL || self->family == NULL) return 1;
+
+    int skip = self->family_skip;
+    self->family = NULL;
+    self->family_skip = 0;
+    if (skip) return 0;
+
+    if (self->format == PROM_FORMAT_PROTOBUF) {
+        // As in prom_protobuf_load_metric(), families without series are left out
+        if (self->family_values == 0) {
+            return prom_string_builder_truncate(self->string_builder, self->family_start - PROM_PROTOBUF_LEN_RESERVED);
+        }
+        return prom_protobuf_end(self->string_builder, self->family_start);
+    }
+
+    if (self->format == PROM_FORMAT_TEXT) {
+        r = prom_string_builder_add_char(self->string_builder, '\n');
+        if (r) return r;
+    }
+
+    return 0;
+}
+
+static int prom_metric_formatter_load_label_value(prom_metric_formatter_t *self, const char *value) {
+    int r = 0;
+
+    for (const char *p = value; *p != '\0'; p++) {
+        if (*p == '\\' || *p == '"') {
+            r = prom_string_builder_add_char(self->string_builder, '\\');
+            if (r) return r;
+            r = prom_string_builder_add_char(self->string_builder, *p);
+        } else if (*p == '\n') {
+            r = prom_string_builder_add_str(self->string_builder, "\\n");
+        } else {
+            r = prom_string_builder_add_char(self->string_builder, *p);
+        }
+        if (r) return r;
+    }
+    return 0;
+}
 
 int prom_metric_formatter_load_metrics(prom_metric_formatter_t *self, prom_map_t *collectors) {
     int r = 0;
@@ -206,6 +858,15 @@ int prom_metric_formatter_load_metrics(prom_metric_formatter_t *self, prom_map_t
         prom_collector_t *collector = (prom_collector_t *)prom_map_get(collectors, collector_name);
         if (collector == NULL) return 1;
 
+        if (collector->render_fn != NULL) {
+            r = collector->render_fn(collector, self);
+            if (r) return r;
+
+            r = prom_metric_formatter_flush_if_full(self);
+            if (r) return r;
+            continue;
+        }
+
         prom_map_t *metrics = collector->collect_fn(collector);
         if (metrics == NULL) return 1;
 
@@ -216,6 +877,9 @@ int prom_metric_formatter_load_metrics(prom_metric_formatter_t *self, prom_map_t
             if (metric == NULL) return 1;
             r = prom_metric_formatter_load_metric(self, metric);
             if (r) return r;
+
+            r = prom_metric_formatter_flush_if_full(self);
+            if (r) return r;
         }
     }
     return r;
@@ -4,10 +4,48 @@
 // Private
 #include "prom_metric.h"
 
-typedef struct prom_metric_formatter {
+/**
+ * @brief API PRIVATE Receives rendered exposition data when the formatter flushes its string builder.
+ * @param data The opaque pointer passed to prom_metric_formatter_set_flush_fn()
+ * @param buf The rendered bytes. They are only valid for the duration of the call.
+ * @param len The number of bytes in buf
+ * @return A non-zero integer value upon failure
+ */
+typedef int prom_metric_formatter_flush_fn(void *data, const char *buf, size_t len);
+
+/**
+ * @brief API PRIVATE The exposition formats a prom_metric_formatter can render
+ */
+typedef enum prom_metric_format {
+  PROM_FORMAT_TEXT,        /**< The Prometheus text-based format, version 0.0.4 */
+  PROM_FORMAT_OPENMETRICS, /**< The OpenMetrics text format, version 1.0.0 */
+  PROM_FORMAT_PROTOBUF     /**< Length-delimited io.prometheus.client.MetricFamily messages */
+} prom_metric_format_t;
+
+/**
+ * @brief Selects the metric families rendered by prom_collector_registry_render()
+ */
+typedef struct prom_metric_name_filter {
+    const char *name; /**< The metric name, or the prefix of metric names if prefix is set. Need not be terminated. */
+    size_t len;       /**< The length of name */
+    int prefix;       /**< Non-zero to select every metric whose name starts with name */
+} prom_metric_name_filter_t;
+
+struct prom_metric_formatter {
   prom_string_builder_t *string_builder;
   prom_string_builder_t *err_builder;
-} prom_metric_formatter_t;
+  prom_metric_format_t format;              /**< format     The exposition format rendered by load_metric(s) */
+  prom_metric_formatter_flush_fn *flush_fn; /**< flush_fn   Consumer of rendered data, NULL to accumulate */
+  void *flush_data;                         /**< flush_data Opaque pointer handed to flush_fn */
+  const prom_metric_name_filter_t *filters; /**< filters    Families rendered by begin_family, NULL for all */
+  size_t filter_count;                      /**< filter_count The number of filters */
+  const char *family;                       /**< family     The name of the family begun by begin_family */
+  size_t family_len;                        /**< family_len The length of family without the OpenMetrics suffix */
+  prom_metric_type_t family_type;           /**< family_type The type of family */
+  size_t family_start;                      /**< family_start The protobuf offset of the family message */
+  size_t family_values;                     /**< family_values The number of series loaded into family */
+  int family_skip;                          /**< family_skip Non-zero while the family is filtered out */
+};
 
 /**
  * @brief API PRIVATE prom_metric_formatter constructor
@@ -48,15 +86,102 @@ int prom_metric_formatter_load_l_value(prom_metric_formatter_t *metric_formatter
 int prom_metric_formatter_load_sample(prom_metric_formatter_t *metric_formatter, prom_metric_sample_t *sample);
 
 /**
- * @brief API PRIVATE Loads a metric in the string exposition format
+ * @brief API PRIVATE Loads a metric in the string exposition format. Without filters, a windowed metric is preceded by
+ * its window family; a filtered render loads the window families it matches with prom_metric_formatter_load_window().
  */
 int prom_metric_formatter_load_metric(prom_metric_formatter_t *self, prom_metric_t *metric);
 
+/**
+ * @brief API PRIVATE Loads the window family of a windowed counter or histogram, in any format: the rate of a counter,
+ * or the PROM_WINDOW_QUANTILES of a histogram, over the window. See prom_metric_set_window().
+ */
+int prom_metric_formatter_load_window(prom_metric_formatter_t *self, prom_metric_t *metric);
+
+/**
+ * @brief API PRIVATE Starts a counter or gauge family whose series are loaded one by one with
+ * prom_metric_formatter_load_family_value() and which is ended with prom_metric_formatter_end_family().
+ *
+ * This renders values read at scrape time, e.g. by a collector render function, in the current format without
+ * creating a prom_metric_t or any prom_metric_sample_t. A family not selected by the filters of the formatter is
+ * skipped silently, the following calls are no-ops.
+ *
+ * @param name The family name. It MUST be null-terminated and remain valid until the family is ended.
+ * @param help The help text. It MUST be null-terminated.
+ * @return A non-zero integer value upon failure
+ */
+int prom_metric_formatter_begin_family(prom_metric_formatter_t *self, const char *name, const char *help,
+                                       prom_metric_type_t type);
+
+/**
+ * @brief API PRIVATE Loads a series of the family begun by prom_metric_formatter_begin_family()
+ * @param label_values Unescaped label values, escaped as the format requires
+ * @return A non-zero integer value upon failure
+ */
+int prom_metric_formatter_load_family_value(prom_metric_formatter_t *self, size_t label_count,
+                                            const char **label_keys, const char **label_values, double value);
+
+/**
+ * @brief API PRIVATE Loads a series of the family begun by prom_metric_formatter_begin_family() with the labels of a
+ * sample, e.g. a value derived from it, and optionally one more label.
+ * @param labels Either empty or {key="value",...} as written by prom_metric_formatter_load_l_value(), already escaped
+ * @param key The additional label, e.g. quantile, or NULL
+ * @param label_value The unescaped value of the additional label
+ * @return A non-zero integer value upon failure
+ */
+int prom_metric_formatter_load_family_l_value(prom_metric_formatter_t *self, const char *labels, const char *key,
+                                              const char *label_value, double value);
+
+/**
+ * @brief API PRIVATE Ends the family begun by prom_metric_formatter_begin_family()
+ */
+int prom_metric_formatter_end_family(prom_metric_formatter_t *self);
+
+/**
+ * @brief API PRIVATE Restricts the families rendered by prom_metric_formatter_begin_family(). Pass NULL to render all.
+ */
+int prom_metric_formatter_set_filters(prom_metric_formatter_t *self, const prom_metric_name_filter_t *filters,
+                                      size_t filter_count);
+
+/**
+ * @brief API PRIVATE Returns non-zero if the metric name is selected by the filter
+ */
+int prom_metric_formatter_filter_match(const prom_metric_name_filter_t *filter, const char *name);
+
 /**
  * @brief API PRIVATE Loads the given metrics
  */
 int prom_metric_formatter_load_metrics(prom_metric_formatter_t *self, prom_map_t *collectors);
 
+/**
+ * @brief API PRIVATE Stream rendered data to fn instead of accumulating the whole exposition in memory.
+ *
+ * While a flush function is set, prom_metric_formatter_load_metrics() hands the string builder contents to fn
+ * whenever they grow past PROM_METRIC_FORMATTER_FLUSH_SIZE at a metric boundary. Pass NULL to restore the default
+ * behaviour.
+ */
+int prom_metric_formatter_set_flush_fn(prom_metric_formatter_t *self, prom_metric_formatter_flush_fn *fn,
+                                       void *data);
+
+/**
+ * @brief API PRIVATE Selects the exposition format rendered by prom_metric_formatter_load_metric(s)
+ */
+int prom_metric_formatter_set_format(prom_metric_formatter_t *self, prom_metric_format_t format);
+
+/**
+ * @brief API PRIVATE Terminates the exposition (# EOF for OpenMetrics) and flushes any pending data
+ */
+int prom_metric_formatter_finish(prom_metric_formatter_t *self);
+
+/**
+ * @brief API PRIVATE Hands any pending data to the flush function and empties the string builder
+ */
+int prom_metric_formatter_flush(prom_metric_formatter_t *self);
+
+/**
+ * @brief API PRIVATE Flushes once PROM_METRIC_FORMATTER_FLUSH_SIZE bytes are pending. Call it between metrics.
+ */
+int prom_metric_formatter_flush_if_full(prom_metric_formatter_t *self);
+
 /**
  * @brief API PRIVATE Clear the underlying string_builder
  */
@@ -1,5 +1,8 @@
 #include "prom_metric_sample.h"
 #include "stdatomic.h"
+#include "prom_assert.h"
+
+ngx_uint_t prom_metric_sample_updated;
 
 prom_metric_sample_t *prom_metric_sample_new(ngx_slab_pool_t *shpool, prom_metric_type_t type, const char *l_value, double r_value) {
     prom_metric_sample_t *self = (prom_metric_sample_t *)ngx_slab_calloc(shpool, sizeof(prom_metric_sample_t));
@@ -14,11 +17,30 @@ prom_metric_sample_t *prom_metric_sample_new(ngx_slab_pool_t *shpool, prom_metri
 
     self->shpool = shpool;
     self->r_value = ATOMIC_VAR_INIT(r_value);
+    self->created = prom_metric_sample_timestamp();
+    prom_metric_sample_updated = 1;
     return self;
 }
 
+double prom_metric_sample_timestamp(void) {
+    ngx_time_t *tp = ngx_timeofday();
+    return (double)tp->sec + (double)tp->msec / 1000.0;
+}
+
 int prom_metric_sample_destroy(prom_metric_sample_t *self) {
     if (self == NULL) return 0;
+    if (self->shards != NULL) {
+        ngx_slab_free(self->shpool, self->shards);
+        self->shards = NULL;
+    }
+    if (self->exemplar != NULL) {
+        ngx_slab_free(self->shpool, self->exemplar);
+        self->exemplar = NULL;
+    }
+    prom_hll_destroy(self->hll);
+    self->hll = NULL;
+    prom_window_destroy(self->window);
+    self->window = NULL;
     ngx_slab_free(self->shpool, (void *)self->l_value);
     self->l_value = NULL;
     ngx_slab_free(self->shpool, (void *)self);
@@ -40,11 +62,90 @@ void prom_metric_sample_free_generic(void *gen) {
   prom_metric_sample_destroy(self);
 }
 
+int prom_metric_sample_set_shards(prom_metric_sample_t *self, size_t shard_count) {
+    if (self == NULL || self->type != PROM_GAUGE || self->shards != NULL || shard_count == 0) return 1;
+
+    self->shards = ngx_slab_calloc(self->shpool, sizeof(prom_metric_sample_shard_t) * shard_count);
+    if (self->shards == NULL) return 1;
+
+    self->shard_count = shard_count;
+    return 0;
+}
+
+int prom_metric_sample_set_exemplar(prom_metric_sample_t *self) {
+    if (self == NULL || self->type != PROM_COUNTER || self->exemplar != NULL) return 1;
+
+    self->exemplar = ngx_slab_calloc(self->shpool, sizeof(prom_exemplar_t));
+    if (self->exemplar == NULL) return 1;
+
+    return 0;
+}
+
+int prom_metric_sample_set_distinct(prom_metric_sample_t *self, uint32_t precision, time_t window) {
+    if (self == NULL || self->type != PROM_GAUGE || self->hll != NULL || self->shards != NULL) return 1;
+
+    self->hll = prom_hll_new(self->shpool, precision, window);
+    if (self->hll == NULL) return 1;
+
+    return 0;
+}
+
+int prom_metric_sample_set_window(prom_metric_sample_t *self, uint32_t seconds) {
+    if (self == NULL || self->type != PROM_COUNTER || self->window != NULL) return 1;
+
+    self->window = prom_window_new(self->shpool, seconds, NULL);
+    if (self->window == NULL) return 1;
+
+    return 0;
+}
+
+/**
+ * @brief API PRIVATE Returns the shard of the executing worker, or NULL if the sample is not sharded for it
+ */
+static prom_metric_sample_shard_t *prom_metric_sample_shard(prom_metric_sample_t *self) {
+    if (self->shards == NULL || ngx_worker >= self->shard_count
+        || (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE)) {
+        return NULL;
+    }
+
+    prom_metric_sample_shard_t *shard = &self->shards[ngx_worker];
+
+    // The previous process of this worker exited, and with it everything it had counted
+    if (shard->pid != ngx_pid) {
+        shard->value = 0.0;
+        shard->pid = ngx_pid;
+    }
+
+    return shard;
+}
+
+double prom_metric_sample_value(prom_metric_sample_t *self) {
+    if (self->hll != NULL) return prom_hll_estimate(self->hll);
+
+    double value = atomic_load(&self->r_value);
+    for (size_t i = 0; i < self->shard_count; i++) {
+        value += self->shards[i].value;
+    }
+    return value;
+}
+
 int prom_metric_sample_add(prom_metric_sample_t *self, double r_value) {
     if (self == NULL) return 0;
     if (r_value < 0) {
         return 1;
     }
+    prom_metric_sample_updated = 1;
+
+    if (self->window != NULL) {
+        (void)prom_window_add(self->window, r_value);
+    }
+
+    prom_metric_sample_shard_t *shard = prom_metric_sample_shard(self);
+    if (shard != NULL) {
+        shard->value += r_value;
+        return 0;
+    }
+
     _Atomic double old = atomic_load(&self->r_value);
     for (;;) {
         _Atomic double new = ATOMIC_VAR_INIT(old + r_value);
@@ -54,11 +155,28 @@ int prom_metric_sample_add(prom_metric_sample_t *self, double r_value) {
     }
 }
 
+int prom_metric_sample_add_exemplar(prom_metric_sample_t *self, double r_value, const char *labels, size_t len) {
+    int r = prom_metric_sample_add(self, r_value);
+    if (r || self == NULL || self->exemplar == NULL || labels == NULL) return r;
+
+    // A label set too long for the slot is dropped, the increment counts all the same
+    (void)prom_exemplar_record(self->exemplar, labels, len, r_value);
+    return 0;
+}
+
 int prom_metric_sample_sub(prom_metric_sample_t *self, double r_value) {
   PROM_ASSERT(self != NULL);
   if (self->type != PROM_GAUGE) {
     return 1;
   }
+  prom_metric_sample_updated = 1;
+
+  prom_metric_sample_shard_t *shard = prom_metric_sample_shard(self);
+  if (shard != NULL) {
+    shard->value -= r_value;
+    return 0;
+  }
+
   _Atomic double old = atomic_load(&self->r_value);
   for (;;) {
     _Atomic double new = ATOMIC_VAR_INIT(old - r_value);
@@ -69,9 +187,10 @@ int prom_metric_sample_sub(prom_metric_sample_t *self, double r_value) {
 }
 
 int prom_metric_sample_set(prom_metric_sample_t *self, double r_value) {
-  if (self->type != PROM_GAUGE) {
+  if (self->type != PROM_GAUGE || self->shards != NULL) {
     return 1;
   }
+  prom_metric_sample_updated = 1;
   atomic_store(&self->r_value, r_value);
   return 0;
 }
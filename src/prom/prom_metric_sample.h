@@ -1,15 +1,34 @@
+#ifndef PROM_METRIC_SAMPLE_I_H
+#define PROM_METRIC_SAMPLE_I_H
+
 #include "prom_metric.h"
 #include "stdatomic.h"
+#include "prom_exemplar.h"
+#include "prom_hll.h"
+#include "prom_window.h"
 
-#ifndef PROM_METRIC_SAMPLE_I_H
-#define PROM_METRIC_SAMPLE_I_H
+/**
+ * @brief API PRIVATE The part of a sharded gauge owned by one worker. Only the owner writes it, so updates need no
+ * atomic operation, and the padding keeps the shards of different workers on different cache lines.
+ */
+typedef struct prom_metric_sample_shard {
+  double value;  /**< value is the contribution of the worker */
+  ngx_pid_t pid; /**< pid is the process that wrote value. A new process of the same worker starts over from 0. */
+  char padding[NGX_CPU_CACHE_LINE - sizeof(double) - sizeof(ngx_pid_t)];
+} prom_metric_sample_shard_t;
 
-typedef struct prom_metric_sample {
+struct prom_metric_sample {
   prom_metric_type_t type; /**< type is the metric type for the sample */
   char *l_value;           /**< l_value is the full metric name and label set represeted as a string */
   _Atomic double r_value;  /**< r_value is the value of the metric sample */
+  double created;          /**< created is the creation time of the sample in seconds since the epoch */
   ngx_slab_pool_t *shpool;
-} prom_metric_sample_t;
+  prom_metric_sample_shard_t *shards; /**< shards is indexed by ngx_worker, NULL unless the gauge is sharded */
+  size_t shard_count;                 /**< shard_count is the number of shards */
+  prom_exemplar_t *exemplar;          /**< exemplar is the exemplar slot of a counter, NULL without exemplars */
+  prom_hll_t *hll;                    /**< hll is the sketch of a distinct-count gauge, whose value it estimates */
+  prom_window_t *window;              /**< window is the per-second increments of a windowed counter, or NULL */
+};
 
 /**
  * @brief API PRIVATE Return a prom_metric_sample_t*
@@ -20,6 +39,73 @@ typedef struct prom_metric_sample {
  */
 prom_metric_sample_t *prom_metric_sample_new(ngx_slab_pool_t *shpool, prom_metric_type_t type, const char *l_value, double r_value);
 
+/**
+ * @brief API PRIVATE Set by the executing process whenever it creates or updates a sample. It is published to the
+ * registry generation by prom_collector_registry_generation(), which keeps the hot path free of shared writes.
+ */
+extern ngx_uint_t prom_metric_sample_updated;
+
+/**
+ * @brief API PRIVATE Returns the cached wall clock time in seconds since the epoch with millisecond precision
+ */
+double prom_metric_sample_timestamp(void);
+
+/**
+ * @brief API PRIVATE Splits a gauge sample into one shard per worker.
+ *
+ * prom_metric_sample_add() and prom_metric_sample_sub() then update the shard of the calling worker without a
+ * compare-and-swap loop on a shared cache line. Processes outside the shard range fall back to r_value.
+ *
+ * @param shard_count The number of workers
+ * @return A non-zero integer value upon failure or if the sample is not a gauge
+ */
+int prom_metric_sample_set_shards(prom_metric_sample_t *self, size_t shard_count);
+
+/**
+ * @brief API PRIVATE Gives a counter sample an exemplar slot, see prom_exemplar_record()
+ * @return A non-zero integer value upon failure or if the sample is not a counter
+ */
+int prom_metric_sample_set_exemplar(prom_metric_sample_t *self);
+
+/**
+ * @brief API PRIVATE Makes a gauge sample a distinct count, see prom_hll.h. Its value is then the estimate of the
+ * sketch, keys are counted with prom_hll_add().
+ * @return A non-zero integer value upon failure or if the sample is not a gauge
+ */
+int prom_metric_sample_set_distinct(prom_metric_sample_t *self, uint32_t precision, time_t window);
+
+/**
+ * @brief API PRIVATE Gives a counter sample a sliding window of its increments, see prom_window.h
+ * @return A non-zero integer value upon failure or if the sample is not a counter
+ */
+int prom_metric_sample_set_window(prom_metric_sample_t *self, uint32_t seconds);
+
+/**
+ * @brief API PRIVATE Adds r_value to the sample. Counters MUST NOT be decreased.
+ */
+int prom_metric_sample_add(prom_metric_sample_t *self, double r_value);
+
+/**
+ * @brief API PRIVATE Adds r_value to a counter sample and records it as the exemplar of the series, see
+ * prom_exemplar_record(). Without an exemplar slot, r_value is only added.
+ */
+int prom_metric_sample_add_exemplar(prom_metric_sample_t *self, double r_value, const char *labels, size_t len);
+
+/**
+ * @brief API PRIVATE Subtracts r_value from a gauge sample
+ */
+int prom_metric_sample_sub(prom_metric_sample_t *self, double r_value);
+
+/**
+ * @brief API PRIVATE Sets a gauge sample. Sharded gauges cannot be set.
+ */
+int prom_metric_sample_set(prom_metric_sample_t *self, double r_value);
+
+/**
+ * @brief API PRIVATE Returns the value of the sample, the sum of its shards for a sharded gauge
+ */
+double prom_metric_sample_value(prom_metric_sample_t *self);
+
 /**
  * @brief API PRIVATE Destroy the prom_metric_sample**
  */
@@ -1,4 +1,7 @@
+#include "prom_atomic.h"
+#include "prom_metric_formatter.h"
 #include "prom_metric_sample_histogram.h"
+#include "prom_assert.h"
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Static Declarations
@@ -31,6 +34,9 @@ static int prom_metric_sample_histogram_init_summary(prom_metric_sample_histogra
                                                      size_t label_count, const char **label_keys,
                                                      const char **label_values);
 
+static void prom_metric_sample_histogram_count(prom_metric_sample_histogram_t *self, size_t bucket, double value,
+                                               uint64_t weight);
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // End static declarations
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -92,6 +98,18 @@ prom_metric_sample_histogram_t *prom_metric_sample_histogram_new(ngx_slab_pool_t
 
     self->buckets = buckets;
     self->shpool = shpool;
+    self->created = prom_metric_sample_timestamp();
+
+    // Allocate both sets of counts, with room for the values above every bound
+    size_t bucket_count = prom_histogram_buckets_count(buckets);
+    for (int i = 0; i < 2; i++) {
+        self->counts[i].buckets =
+            (_Atomic uint64_t *)ngx_slab_calloc(shpool, sizeof(_Atomic uint64_t) * (bucket_count + 1));
+        if (self->counts[i].buckets == NULL) {
+            prom_metric_sample_histogram_destroy(self);
+            return NULL;
+        }
+    }
 
     // Allocate and initialize bucket metric samples
     r = prom_metric_sample_histogram_init_bucket_samples(self, name, label_count, label_keys, label_values);
@@ -121,6 +139,15 @@ prom_metric_sample_histogram_t *prom_metric_sample_histogram_new(ngx_slab_pool_t
         return NULL;
     }
 
+    // Allocate the native buckets if the histogram has them
+    if (buckets->native_max_buckets != 0) {
+        self->native = prom_native_histogram_new(shpool, buckets->native_schema, buckets->native_max_buckets);
+        if (self->native == NULL) {
+            prom_metric_sample_histogram_destroy(self);
+            return NULL;
+        }
+    }
+
     // The value of nodes in this map will be simple prom_metric_sample pointers.
     r = prom_map_set_free_value_fn(self->samples, &prom_metric_sample_free_generic);
     if (r) {
@@ -137,6 +164,13 @@ static int prom_metric_sample_histogram_init_bucket_samples(prom_metric_sample_h
     char *item;
     int bucket_count = prom_histogram_buckets_count(self->buckets);
 
+    // A native histogram may have no classic buckets
+    if (bucket_count == 0) return 0;
+
+    self->bucket_samples =
+        (prom_metric_sample_t **)ngx_slab_calloc(self->shpool, sizeof(prom_metric_sample_t *) * bucket_count);
+    if (self->bucket_samples == NULL) return 1;
+
     // For each bucket, create an prom_metric_sample_t with an appropriate l_value and default value of 0.0. The
     // l_value will contain the metric name, user labels, and finally, the le label and bucket value.
     for (int i = 0; i < bucket_count; i++) {
@@ -148,12 +182,12 @@ static int prom_metric_sample_histogram_init_bucket_samples(prom_metric_sample_h
         const char *bucket_key = prom_metric_sample_histogram_bucket_to_str(self->buckets->upper_bounds[i]);
         if (bucket_key == NULL) return 1;
 
-        item = ngx_slab_alloc(self->shpool, ngx_strlen(l_value));
+        item = ngx_slab_calloc(self->shpool, ngx_strlen(l_value) + 1);
         if (item == NULL) {
             prom_free((void *)bucket_key);
-            return NULL;
+            return 1;
         }
-        ngx_memcpy(item, name, ngx_strlen(l_value));
+        ngx_memcpy(item, l_value, ngx_strlen(l_value));
         r = prom_linked_list_append(self->l_value_list, item);
         if (r) {
             ngx_slab_free(self->shpool, item);
@@ -183,6 +217,7 @@ static int prom_metric_sample_histogram_init_bucket_samples(prom_metric_sample_h
             return r;
         }
 
+        self->bucket_samples[i] = sample;
         prom_free((void *)bucket_key);
     }
     return 0;
@@ -198,11 +233,11 @@ static int prom_metric_sample_histogram_init_inf(prom_metric_sample_histogram_t
     const char *inf_l_value =
         prom_metric_sample_histogram_l_value_for_inf(self, name, label_count, label_keys, label_values);
     if (inf_l_value == NULL) return 1;
-    item = ngx_slab_alloc(self->shpool, ngx_strlen(inf_l_value));
+    item = ngx_slab_calloc(self->shpool, ngx_strlen(inf_l_value) + 1);
     if (item == NULL) {
-        return NULL;
+        return 1;
     }
-    ngx_memcpy(item, name, ngx_strlen(inf_l_value));
+    ngx_memcpy(item, inf_l_value, ngx_strlen(inf_l_value));
 
     r = prom_linked_list_append(self->l_value_list, item);
     if (r) {
@@ -228,6 +263,8 @@ static int prom_metric_sample_histogram_init_inf(prom_metric_sample_histogram_t
         return r;
     }
 
+    self->inf_sample = inf_sample;
+
     return r;
 }
 
@@ -244,11 +281,11 @@ static int prom_metric_sample_histogram_init_count(prom_metric_sample_histogram_
     const char *count_l_value = prom_metric_formatter_dump(self->metric_formatter);
     if (count_l_value == NULL) return 1;
 
-    item = ngx_slab_alloc(self->shpool, ngx_strlen(count_l_value));
+    item = ngx_slab_calloc(self->shpool, ngx_strlen(count_l_value) + 1);
     if (item == NULL) {
-        return NULL;
+        return 1;
     }
-    ngx_memcpy(item, name, ngx_strlen(count_l_value));
+    ngx_memcpy(item, count_l_value, ngx_strlen(count_l_value));
 
     r = prom_linked_list_append(self->l_value_list, item);
     if (r) {
@@ -273,6 +310,8 @@ static int prom_metric_sample_histogram_init_count(prom_metric_sample_histogram_
         return r;
     }
 
+    self->count_sample = count_sample;
+
     return r;
 }
 
@@ -289,11 +328,11 @@ static int prom_metric_sample_histogram_init_summary(prom_metric_sample_histogra
     const char *sum_l_value = prom_metric_formatter_dump(self->metric_formatter);
     if (sum_l_value == NULL) return 1;
 
-    item = ngx_slab_alloc(self->shpool, ngx_strlen(sum_l_value));
+    item = ngx_slab_calloc(self->shpool, ngx_strlen(sum_l_value) + 1);
     if (item == NULL) {
-        return NULL;
+        return 1;
     }
-    ngx_memcpy(item, name, ngx_strlen(sum_l_value));
+    ngx_memcpy(item, sum_l_value, ngx_strlen(sum_l_value));
 
     r = prom_linked_list_append(self->l_value_list, item);
     if (r) {
@@ -318,6 +357,8 @@ static int prom_metric_sample_histogram_init_summary(prom_metric_sample_histogra
         return r;
     }
 
+    self->sum_sample = sum_sample;
+
     return r;
 }
 
@@ -344,6 +385,30 @@ int prom_metric_sample_histogram_destroy(prom_metric_sample_histogram_t *self) {
   if (r) ret = r;
   self->metric_formatter = NULL;
 
+  if (self->bucket_samples != NULL) {
+    ngx_slab_free(self->shpool, self->bucket_samples);
+    self->bucket_samples = NULL;
+  }
+
+  for (int i = 0; i < 2; i++) {
+    if (self->counts[i].buckets != NULL) {
+      ngx_slab_free(self->shpool, (void *)self->counts[i].buckets);
+      self->counts[i].buckets = NULL;
+    }
+  }
+
+  if (self->exemplars != NULL) {
+    ngx_slab_free(self->shpool, self->exemplars);
+    self->exemplars = NULL;
+  }
+
+  r = prom_window_destroy(self->window);
+  if (r) ret = r;
+  self->window = NULL;
+
+  r = prom_native_histogram_destroy(self->native);
+  if (r) ret = r;
+  self->native = NULL;
 
   ngx_slab_free(self->shpool, self);
   self = NULL;
@@ -364,91 +429,188 @@ void prom_metric_sample_histogram_free_generic(void *gen) {
   prom_metric_sample_histogram_destroy(self);
 }
 
-int prom_metric_sample_histogram_observe(prom_metric_sample_histogram_t *self, double value) {
-  int r = 0;
-
-    ngx_rwlock_wlock(self->rwlock);
+/**
+ * @brief API PRIVATE Counts an observation on the hot counts, see prom_metric_sample_histogram_t
+ * @param weight The observations it stands for, the sampling of the buckets or 1
+ */
+static void prom_metric_sample_histogram_count(prom_metric_sample_histogram_t *self, size_t bucket, double value,
+                                               uint64_t weight) {
+  uint64_t n = atomic_fetch_add(&self->count_and_hot, 1);
+  prom_histogram_counts_t *hot = &self->counts[(n & PROM_HISTOGRAM_HOT_BIT) ? 1 : 0];
+
+  // The count exposed is the sum of the buckets, it is weighted with them
+  atomic_fetch_add(&hot->buckets[bucket], weight);
+  prom_atomic_add_double(&hot->sum, value * weight);
+
+  // The observation is complete, a snapshot that flipped the hot bit meanwhile waits for this increment. It counts
+  // the observations started in count_and_hot, so it is not weighted.
+  atomic_fetch_add(&hot->count, 1);
+
+  if (self->window != NULL) {
+    (void)prom_window_observe(self->window, bucket, value, weight);
+  }
 
-#define PROM_METRIC_SAMPLE_HISTOGRAM_OBSERVE_HANDLE_UNLOCK(r) \
-    ngx_rwlock_unlock(self->rwlock);                          \
-    return r;
+  prom_metric_sample_updated = 1;
+}
 
-  // Update the counter for the proper bucket if found
-  int bucket_count = prom_histogram_buckets_count(self->buckets);
-  for (int i = (bucket_count - 1); i >= 0; i--) {
-    if (value > self->buckets->upper_bounds[i]) {
-      break;
-    }
+int prom_metric_sample_histogram_observe(prom_metric_sample_histogram_t *self, double value) {
+  return prom_metric_sample_histogram_observe_exemplar(self, value, NULL, 0);
+}
 
-    const char *bucket_key = prom_metric_sample_histogram_bucket_to_str(self->buckets->upper_bounds[i]);
-    if (bucket_key == NULL) {
-      PROM_METRIC_SAMPLE_HISTOGRAM_OBSERVE_HANDLE_UNLOCK(1)
-    }
+int prom_metric_sample_histogram_observe_exemplar(prom_metric_sample_histogram_t *self, double value,
+                                                  const char *labels, size_t len) {
+  if (self == NULL) return 1;
 
-    const char *l_value = prom_map_get(self->l_values, bucket_key);
-    if (l_value == NULL) {
-      prom_free((void *)bucket_key);
-      PROM_METRIC_SAMPLE_HISTOGRAM_OBSERVE_HANDLE_UNLOCK(1)
-    }
+  // The caller drew the observation into the sample, see prom_histogram_buckets_sample()
+  uint64_t weight = self->buckets->sampling > 1 ? self->buckets->sampling : 1;
 
-    prom_metric_sample_t *sample = prom_map_get(self->samples, l_value);
-    if (sample == NULL) {
-      prom_free((void *)bucket_key);
-      PROM_METRIC_SAMPLE_HISTOGRAM_OBSERVE_HANDLE_UNLOCK(1)
-    }
+  // The first bucket whose upper bound is not below the value, in constant time for log-linear buckets. Buckets are
+  // not cumulative, above the last bound the value is counted by the last count.
+  size_t bucket = prom_histogram_buckets_index(self->buckets, value);
+  prom_metric_sample_histogram_count(self, bucket, value, weight);
 
-    prom_free((void *)bucket_key);
-    r = prom_metric_sample_add(sample, 1.0);
-    if (r) {
-      PROM_METRIC_SAMPLE_HISTOGRAM_OBSERVE_HANDLE_UNLOCK(r);
-    }
+  // An exemplar that does not fit is dropped, the observation counts all the same
+  if (labels != NULL && self->exemplars != NULL) {
+    (void)prom_exemplar_record(&self->exemplars[bucket], labels, len, value);
   }
 
-  // Update the +Inf and count samples
-  const char *inf_l_value = prom_map_get(self->l_values, "+Inf");
-  if (inf_l_value == NULL) {
-    PROM_METRIC_SAMPLE_HISTOGRAM_OBSERVE_HANDLE_UNLOCK(1);
+  // Update the native buckets. NaN and infinite values have none, the classic buckets count them all the same.
+  if (self->native != NULL) {
+    ngx_rwlock_wlock(&self->rwlock);
+    (void)prom_native_histogram_observe(self->native, value, weight);
+    ngx_rwlock_unlock(&self->rwlock);
   }
 
-  prom_metric_sample_t *inf_sample = prom_map_get(self->samples, inf_l_value);
-  if (inf_sample == NULL) {
-    PROM_METRIC_SAMPLE_HISTOGRAM_OBSERVE_HANDLE_UNLOCK(1);
-  }
+  return 0;
+}
 
-  r = prom_metric_sample_add(inf_sample, 1.0);
-  if (r) {
-    PROM_METRIC_SAMPLE_HISTOGRAM_OBSERVE_HANDLE_UNLOCK(1);
-  }
+int prom_metric_sample_histogram_set_exemplars(prom_metric_sample_histogram_t *self) {
+  if (self == NULL || self->exemplars != NULL) return 1;
+
+  size_t bucket_count = prom_histogram_buckets_count(self->buckets);
+  self->exemplars = (prom_exemplar_t *)ngx_slab_calloc(self->shpool, sizeof(prom_exemplar_t) * (bucket_count + 1));
+  if (self->exemplars == NULL) return 1;
+
+  return 0;
+}
 
-  const char *count_l_value = prom_map_get(self->l_values, "count");
-  if (count_l_value == NULL) {
-    PROM_METRIC_SAMPLE_HISTOGRAM_OBSERVE_HANDLE_UNLOCK(1);
+int prom_metric_sample_histogram_set_window(prom_metric_sample_histogram_t *self, uint32_t seconds) {
+  if (self == NULL || self->window != NULL) return 1;
+
+  self->window = prom_window_new(self->shpool, seconds, self->buckets);
+  if (self->window == NULL) return 1;
+
+  return 0;
+}
+
+int prom_metric_sample_histogram_observe_ticks(prom_metric_sample_histogram_t *self, uint64_t ticks) {
+  int r = 0;
+  if (self->buckets->tick_bounds == NULL) return 1;
+
+  uint64_t weight = self->buckets->sampling > 1 ? self->buckets->sampling : 1;
+
+  // The first bucket whose upper bound is not below the duration, found by integer comparisons only
+  size_t bucket = prom_histogram_buckets_tick_index(self->buckets, ticks);
+
+  double seconds = (double)ticks * self->buckets->tick_seconds;
+
+  prom_metric_sample_histogram_count(self, bucket, seconds, weight);
+
+  if (self->native != NULL) {
+    ngx_rwlock_wlock(&self->rwlock);
+    r = prom_native_histogram_observe(self->native, seconds, weight);
+    ngx_rwlock_unlock(&self->rwlock);
   }
 
-  prom_metric_sample_t *count_sample = prom_map_get(self->samples, count_l_value);
-  if (count_sample == NULL) {
-    PROM_METRIC_SAMPLE_HISTOGRAM_OBSERVE_HANDLE_UNLOCK(1);
+  return r;
+}
+
+int prom_metric_sample_histogram_add_counts(prom_metric_sample_histogram_t *self, const uint64_t *counts, double sum) {
+  if (self == NULL || self->native != NULL || self->window != NULL) return 1;
+
+  size_t bucket_count = prom_histogram_buckets_count(self->buckets);
+  uint64_t n = 0;
+  for (size_t i = 0; i <= bucket_count; i++) n += counts[i];
+  if (n == 0) return 0;
+
+  // As the observations one by one, see prom_metric_sample_histogram_count()
+  uint64_t started = atomic_fetch_add(&self->count_and_hot, n);
+  prom_histogram_counts_t *hot = &self->counts[(started & PROM_HISTOGRAM_HOT_BIT) ? 1 : 0];
+
+  for (size_t i = 0; i <= bucket_count; i++) {
+    if (counts[i] != 0) atomic_fetch_add(&hot->buckets[i], counts[i]);
   }
+  prom_atomic_add_double(&hot->sum, sum);
 
-  r = prom_metric_sample_add(count_sample, 1.0);
-  if (r) {
-    PROM_METRIC_SAMPLE_HISTOGRAM_OBSERVE_HANDLE_UNLOCK(1);
+  atomic_fetch_add(&hot->count, n);
+
+  prom_metric_sample_updated = 1;
+  return 0;
+}
+
+int prom_metric_sample_histogram_snapshot(prom_metric_sample_histogram_t *self, uint64_t *count, double *sum) {
+  if (self == NULL) return 1;
+
+  size_t bucket_count = prom_histogram_buckets_count(self->buckets);
+
+  ngx_rwlock_wlock(&self->swap_lock);
+
+  // Flip the hot bit. The observations counted before are all the cold counts will ever receive.
+  uint64_t n = atomic_fetch_add(&self->count_and_hot, PROM_HISTOGRAM_HOT_BIT);
+  uint64_t started = n & ~PROM_HISTOGRAM_HOT_BIT;
+  prom_histogram_counts_t *cold = &self->counts[(n & PROM_HISTOGRAM_HOT_BIT) ? 1 : 0];
+  prom_histogram_counts_t *hot = &self->counts[(n & PROM_HISTOGRAM_HOT_BIT) ? 0 : 1];
+
+  // The observations in flight are a few instructions from completion. Those left in flight on the hot counts by an
+  // earlier snapshot will never complete on the cold ones.
+  started -= hot->abandoned;
+
+  uint64_t spins = 0;
+  while (atomic_load(&cold->count) < started && spins++ < PROM_HISTOGRAM_SWAP_SPINS) {
+    if (ngx_ncpu > 1) {
+      ngx_cpu_pause();
+    } else {
+      ngx_sched_yield();
+    }
   }
 
-  // Update the sum sample
-  const char *sum_l_value = prom_map_get(self->l_values, "sum");
-  if (sum_l_value == NULL) {
-    PROM_METRIC_SAMPLE_HISTOGRAM_OBSERVE_HANDLE_UNLOCK(1);
+  // An observation still in flight, e.g. of a preempted worker, is left behind rather than waited for: it stays
+  // started, and completes on these counts, which the next snapshot of them exposes and waits for. Without a new
+  // straggler, those left in flight on the cold counts by an earlier snapshot completed.
+  uint64_t completed = atomic_load(&cold->count);
+  cold->abandoned = completed < started ? started - completed : 0;
+
+  // The count is that of the +Inf bucket, the sum of the non-cumulative counts
+  uint64_t total = 0;
+  for (size_t i = 0; i <= bucket_count; i++) {
+    total += atomic_load(&cold->buckets[i]);
   }
+  *count = total;
+  *sum = atomic_load(&cold->sum);
+
+  self->snapshot = cold;
+  return 0;
+}
+
+uint64_t prom_metric_sample_histogram_snapshot_bucket(prom_metric_sample_histogram_t *self, size_t bucket) {
+  return atomic_load(&self->snapshot->buckets[bucket]);
+}
 
-  prom_metric_sample_t *sum_sample = prom_map_get(self->samples, sum_l_value);
-  if (sum_sample == NULL) {
-    PROM_METRIC_SAMPLE_HISTOGRAM_OBSERVE_HANDLE_UNLOCK(1);
+void prom_metric_sample_histogram_snapshot_end(prom_metric_sample_histogram_t *self) {
+  prom_histogram_counts_t *cold = self->snapshot;
+  prom_histogram_counts_t *hot = cold == &self->counts[0] ? &self->counts[1] : &self->counts[0];
+  size_t bucket_count = prom_histogram_buckets_count(self->buckets);
+
+  // Move the cold counts into the hot ones, which then hold every observation again
+  for (size_t i = 0; i <= bucket_count; i++) {
+    uint64_t c = atomic_exchange(&cold->buckets[i], 0);
+    if (c != 0) atomic_fetch_add(&hot->buckets[i], c);
   }
+  prom_atomic_add_double(&hot->sum, atomic_exchange(&cold->sum, 0.0));
+  atomic_fetch_add(&hot->count, atomic_exchange(&cold->count, 0));
 
-  r = prom_metric_sample_add(sum_sample, value);
-  PROM_METRIC_SAMPLE_HISTOGRAM_OBSERVE_HANDLE_UNLOCK(r);
-  return r;
+  self->snapshot = NULL;
+  ngx_rwlock_unlock(&self->swap_lock);
 }
 
 static const char *prom_metric_sample_histogram_l_value_for_bucket(prom_metric_sample_histogram_t *self,
@@ -481,7 +643,7 @@ static const char *prom_metric_sample_histogram_l_value_for_bucket(prom_metric_s
 
   new_values[label_count] = prom_metric_sample_histogram_bucket_to_str(bucket);
 
-  r = prom_metric_formatter_load_l_value(self->metric_formatter, name, NULL, label_count + 1, new_keys, new_values);
+  r = prom_metric_formatter_load_l_value(self->metric_formatter, name, "bucket", label_count + 1, new_keys, new_values);
   if (r) {
     PROM_METRIC_SAMPLE_HISTOGRAM_L_VALUE_FOR_BUCKET_CLEANUP();
     return NULL;
@@ -520,7 +682,7 @@ static const char *prom_metric_sample_histogram_l_value_for_inf(prom_metric_samp
 
   new_values[label_count] = prom_strdup("+Inf");
 
-  r = prom_metric_formatter_load_l_value(self->metric_formatter, name, NULL, label_count + 1, new_keys, new_values);
+  r = prom_metric_formatter_load_l_value(self->metric_formatter, name, "bucket", label_count + 1, new_keys, new_values);
   if (r) {
     PROM_METRIC_SAMPLE_HISTOGRAM_L_VALUE_FOR_INF_CLEANUP()
     return NULL;
@@ -538,8 +700,16 @@ static void prom_metric_sample_histogram_free_str_generic(void *gen) {
 
 char *prom_metric_sample_histogram_bucket_to_str(double bucket) {
   char *buf = (char *)prom_malloc(sizeof(char) * 50);
-  sprintf(buf, "%g", bucket);
-  if (!strchr(buf, '.')) {
+  if (buf == NULL) return NULL;
+
+  // The shortest form that reads back as the same double, as the bound in the protobuf format
+  for (int precision = 15; precision <= 17; precision++) {
+    snprintf(buf, 50, "%.*g", precision, bucket);
+    if (strtod(buf, NULL) == bucket) break;
+  }
+
+  // An integer gets a fraction, an exponent or inf already reads as a float
+  if (strspn(buf, "-0123456789") == strlen(buf)) {
     strcat(buf, ".0");
   }
   return buf;
@@ -17,23 +17,75 @@
 #ifndef PROM_METRIC_SAMPLE_HISOTGRAM_H
 #define PROM_METRIC_SAMPLE_HISOTGRAM_H
 
+#include <stdatomic.h>
+
+#include "prom_exemplar.h"
+#include "prom_histogram_buckets.h"
+#include "prom_map.h"
 #include "prom_metric.h"
+#include "prom_native_histogram.h"
+#include "prom_window.h"
+
+/**
+ * @brief The bit of count_and_hot that selects the hot counts
+ */
+#define PROM_HISTOGRAM_HOT_BIT ((uint64_t)1 << 63)
+
+/**
+ * @brief The busy-waits of a snapshot for observations in flight on the cold counts, a few microseconds. An
+ * observation still in flight then, e.g. of a preempted worker, is left to the next snapshot of the counts, see
+ * prom_histogram_counts_t.
+ */
+#define PROM_HISTOGRAM_SWAP_SPINS 1024
+
+/**
+ * @brief API PRIVATE One of the two sets of counts of a histogram sample
+ */
+typedef struct prom_histogram_counts {
+  _Atomic uint64_t count;    /**< count     The observations completed on these counts */
+  _Atomic double sum;        /**< sum       The sum of the observations */
+  _Atomic uint64_t *buckets; /**< buckets   One count per bucket and a last one above every bound, non-cumulative */
+  uint64_t abandoned;        /**< abandoned The observations a snapshot left in flight on these counts, which the
+                                            snapshots of the other counts do not wait for. Guarded by swap_lock. */
+} prom_histogram_counts_t;
 
+/**
+ * @brief A histogram metric sample
+ *
+ * The counts are double-buffered. An observation counts itself in count_and_hot, whose top bit selects the hot
+ * counts, then increments one non-cumulative bucket, the sum and last the completed count of the hot counts. It takes
+ * no lock and never waits. A snapshot flips the top bit, waits for the few observations still in flight on the now
+ * cold counts, whose number it knows from count_and_hot, and reads them: the buckets, the count and the sum always
+ * agree. It then adds the cold counts into the hot ones and clears them for the next flip. Only the snapshots of a
+ * sample wait for each other.
+ *
+ * The native buckets rescale as they grow, an observation updates them under the write lock.
+ *
+ * A histogram whose buckets sample observations, see prom_histogram_buckets_set_sampling(), records the observations
+ * drawn by the caller with a weight of sampling in every count and in the sum.
+ */
 struct prom_metric_sample_histogram {
   prom_linked_list_t *l_value_list;
   prom_map_t *l_values;
   prom_map_t *samples;
+  prom_metric_sample_t **bucket_samples; /**< bucket_samples The le l_values in upper bound order */
+  prom_metric_sample_t *inf_sample;      /**< inf_sample     The le="+Inf" l_value */
+  prom_metric_sample_t *count_sample;    /**< count_sample   The _count l_value */
+  prom_metric_sample_t *sum_sample;      /**< sum_sample     The _sum l_value */
+  double created;                        /**< created        Creation time in seconds since the epoch */
+  _Atomic uint64_t count_and_hot;        /**< count_and_hot  The observations started, and PROM_HISTOGRAM_HOT_BIT */
+  prom_histogram_counts_t counts[2];     /**< counts         The hot counts take the observations */
+  ngx_atomic_t swap_lock;                /**< swap_lock      Serializes the snapshots */
+  prom_histogram_counts_t *snapshot;     /**< snapshot       The cold counts of the snapshot in progress, under swap_lock */
+  prom_native_histogram_t *native;       /**< native         The native buckets, NULL for a classic histogram */
+  prom_exemplar_t *exemplars;            /**< exemplars      One slot per bucket and one for +Inf, NULL without */
+  prom_window_t *window;                 /**< window         The per-second counts of a windowed histogram, or NULL */
   prom_metric_formatter_t *metric_formatter;
   prom_histogram_buckets_t *buckets;
-  ngx_atomic_t              rwlock;
+  ngx_atomic_t              rwlock;      /**< rwlock         Guards the native buckets */
   ngx_slab_pool_t          *shpool;
 };
 
-/**
- * @brief A histogram metric sample
- */
-typedef struct prom_metric_sample_histogram prom_metric_sample_histogram_t;
-
 /**
  * @brief Observe the double for the given prom_metric_sample_histogram_observe_t
  * @param self The target prom_metric_sample_histogram_t*
@@ -42,6 +94,84 @@ typedef struct prom_metric_sample_histogram prom_metric_sample_histogram_t;
  */
 int prom_metric_sample_histogram_observe(prom_metric_sample_histogram_t *self, double value);
 
+/**
+ * @brief Observe the double and record an exemplar for its bucket, see prom_exemplar_record()
+ *
+ * Recording the exemplar takes no lock. Without exemplar slots, the value is only observed.
+ *
+ * @param self The target prom_metric_sample_histogram_t*
+ * @param value The value to observe
+ * @param labels The label set of the exemplar as written in the exposition, e.g. trace_id="4bf92f3577b34da6"
+ * @param len The length of labels
+ * @return Non-zero integer value upon failure
+ */
+int prom_metric_sample_histogram_observe_exemplar(prom_metric_sample_histogram_t *self, double value,
+                                                  const char *labels, size_t len);
+
+/**
+ * @brief API PRIVATE Gives every bucket of the histogram sample an exemplar slot
+ * @return Non-zero integer value upon failure
+ */
+int prom_metric_sample_histogram_set_exemplars(prom_metric_sample_histogram_t *self);
+
+/**
+ * @brief API PRIVATE Gives the histogram sample a sliding window of its observations, see prom_window.h
+ * @return Non-zero integer value upon failure
+ */
+int prom_metric_sample_histogram_set_window(prom_metric_sample_histogram_t *self, uint32_t seconds);
+
+/**
+ * @brief Observe a duration measured in ticks of the clock selected with prom_histogram_buckets_set_precision()
+ *
+ * The bucket is found by comparing integers with the precomputed tick bounds; only the sum is converted to seconds.
+ * Most callers use prom_timer_observe() instead.
+ *
+ * @param self The target prom_metric_sample_histogram_t*
+ * @param ticks The duration in ticks
+ * @return Non-zero integer value upon failure or if the histogram is not timed
+ */
+int prom_metric_sample_histogram_observe_ticks(prom_metric_sample_histogram_t *self, uint64_t ticks);
+
+/**
+ * @brief Adds observations counted by the caller, e.g. a worker that buckets a hot path with
+ * prom_histogram_buckets_tick_index() and publishes the counts periodically
+ *
+ * The histogram MUST have neither native buckets nor a window, which need the value of each observation.
+ *
+ * @param self The target prom_metric_sample_histogram_t*
+ * @param counts The observations per bucket, non-cumulative, the last one above every bound
+ * @param sum The sum of the observations
+ * @return Non-zero integer value upon failure
+ */
+int prom_metric_sample_histogram_add_counts(prom_metric_sample_histogram_t *self, const uint64_t *counts, double sum);
+
+/**
+ * @brief API PRIVATE Takes a consistent snapshot of the classic buckets, without blocking the observations
+ *
+ * The buckets are read from the snapshot with prom_metric_sample_histogram_snapshot_bucket() while they are rendered,
+ * so that no copy is made, and the snapshot MUST then be released with prom_metric_sample_histogram_snapshot_end().
+ * Until then the other snapshots of the sample wait.
+ *
+ * @param self The target prom_metric_sample_histogram_t*
+ * @param count Receives the number of observations, the count of the +Inf bucket
+ * @param sum Receives the sum of the observations
+ * @return Non-zero integer value upon failure, the snapshot is not taken
+ */
+int prom_metric_sample_histogram_snapshot(prom_metric_sample_histogram_t *self, uint64_t *count, double *sum);
+
+/**
+ * @brief API PRIVATE Returns the non-cumulative count of a bucket in the snapshot taken
+ * @param self The target prom_metric_sample_histogram_t*
+ * @param bucket The index of the bucket in upper bound order
+ */
+uint64_t prom_metric_sample_histogram_snapshot_bucket(prom_metric_sample_histogram_t *self, size_t bucket);
+
+/**
+ * @brief API PRIVATE Releases the snapshot taken, its counts are merged back into those of the observations
+ * @param self The target prom_metric_sample_histogram_t*
+ */
+void prom_metric_sample_histogram_snapshot_end(prom_metric_sample_histogram_t *self);
+
 /**
  * @brief API PRIVATE Create a pointer to a prom_metric_sample_histogram_t
  */
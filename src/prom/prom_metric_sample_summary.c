@@ -0,0 +1,302 @@
+#include <math.h>
+
+#include "prom_metric.h"
+#include "prom_metric_formatter.h"
+#include "prom_metric_sample_summary.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Static Declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static double prom_summary_log_gamma(void);
+
+static void prom_summary_shard_add(prom_summary_shard_t *shard, int32_t key, uint64_t n);
+
+static prom_summary_shard_t *prom_metric_sample_summary_shard(prom_metric_sample_summary_t *self);
+
+static char *prom_metric_sample_summary_l_value(prom_metric_sample_summary_t *self,
+                                                prom_metric_formatter_t *formatter, const char *name,
+                                                const char *suffix, size_t label_count, const char **label_keys,
+                                                const char **label_values, double quantile);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// End static declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief API PRIVATE Returns log(gamma). The argument is constant, the compiler folds the logarithm.
+ */
+static double prom_summary_log_gamma(void) {
+  return log((1.0 + PROM_SUMMARY_ACCURACY) / (1.0 - PROM_SUMMARY_ACCURACY));
+}
+
+/**
+ * @brief API PRIVATE Counts n values of the key, moving the window up if the key is above it
+ */
+static void prom_summary_shard_add(prom_summary_shard_t *shard, int32_t key, uint64_t n) {
+  uint64_t *bins = shard->bins;
+
+  // The first key is placed in the middle, the window can then move either way before anything is folded
+  if (!shard->used) {
+    shard->offset = key - PROM_SUMMARY_BINS / 2;
+    shard->used = 1;
+  }
+
+  int64_t i = (int64_t)key - shard->offset;
+
+  if (i < 0) {
+    i = 0;
+
+  } else if (i >= PROM_SUMMARY_BINS) {
+    int64_t shift = i - PROM_SUMMARY_BINS + 1;
+    int64_t folded_bins = shift < PROM_SUMMARY_BINS ? shift : PROM_SUMMARY_BINS;
+    uint64_t folded = 0;
+
+    for (int64_t j = 0; j < folded_bins; j++) {
+      folded += bins[j];
+    }
+
+    if (shift < PROM_SUMMARY_BINS) {
+      memmove(bins, bins + shift, (PROM_SUMMARY_BINS - shift) * sizeof(uint64_t));
+      memset(bins + PROM_SUMMARY_BINS - shift, 0, shift * sizeof(uint64_t));
+    } else {
+      memset(bins, 0, PROM_SUMMARY_BINS * sizeof(uint64_t));
+    }
+
+    bins[0] += folded;
+    shard->offset += (int32_t)shift;
+    i = PROM_SUMMARY_BINS - 1;
+  }
+
+  bins[i] += n;
+}
+
+/**
+ * @brief API PRIVATE Returns the shard of the executing worker. Other processes, and workers beyond the shard count,
+ * share the first shard; its lock keeps their updates consistent.
+ */
+static prom_summary_shard_t *prom_metric_sample_summary_shard(prom_metric_sample_summary_t *self) {
+  return &self->shards[ngx_worker < self->shard_count ? ngx_worker : 0];
+}
+
+prom_metric_sample_summary_t *prom_metric_sample_summary_new(ngx_slab_pool_t *shpool, const char *name,
+                                                             const double *quantiles, size_t quantile_count,
+                                                             size_t shard_count, size_t label_count,
+                                                             const char **label_keys, const char **label_values) {
+  if (quantile_count > PROM_SUMMARY_QUANTILES_MAX || shard_count == 0) return NULL;
+
+  prom_metric_sample_summary_t *self =
+      (prom_metric_sample_summary_t *)ngx_slab_calloc(shpool, sizeof(prom_metric_sample_summary_t));
+  if (self == NULL) return NULL;
+
+  self->shpool = shpool;
+  self->quantiles = quantiles;
+  self->quantile_count = quantile_count;
+  self->created = prom_metric_sample_timestamp();
+
+  self->shards = (prom_summary_shard_t *)ngx_slab_calloc(shpool, sizeof(prom_summary_shard_t) * shard_count);
+  if (self->shards == NULL) {
+    prom_metric_sample_summary_destroy(self);
+    return NULL;
+  }
+  self->shard_count = shard_count;
+
+  if (quantile_count != 0) {
+    self->quantile_l_values = (char **)ngx_slab_calloc(shpool, sizeof(char *) * quantile_count);
+    if (self->quantile_l_values == NULL) {
+      prom_metric_sample_summary_destroy(self);
+      return NULL;
+    }
+  }
+
+  prom_metric_formatter_t *formatter = prom_metric_formatter_new();
+  if (formatter == NULL) {
+    prom_metric_sample_summary_destroy(self);
+    return NULL;
+  }
+
+  int r = 0;
+
+  for (size_t i = 0; i < quantile_count && r == 0; i++) {
+    self->quantile_l_values[i] = prom_metric_sample_summary_l_value(self, formatter, name, NULL, label_count,
+                                                                    label_keys, label_values, quantiles[i]);
+    if (self->quantile_l_values[i] == NULL) r = 1;
+  }
+
+  if (r == 0) {
+    self->sum_l_value = prom_metric_sample_summary_l_value(self, formatter, name, "sum", label_count, label_keys,
+                                                           label_values, -1.0);
+    self->count_l_value = prom_metric_sample_summary_l_value(self, formatter, name, "count", label_count, label_keys,
+                                                             label_values, -1.0);
+    if (self->sum_l_value == NULL || self->count_l_value == NULL) r = 1;
+  }
+
+  prom_metric_formatter_destroy(formatter);
+
+  if (r) {
+    prom_metric_sample_summary_destroy(self);
+    return NULL;
+  }
+
+  prom_metric_sample_updated = 1;
+  return self;
+}
+
+/**
+ * @brief API PRIVATE Writes an l_value into shared memory, with a quantile label unless quantile is negative
+ */
+static char *prom_metric_sample_summary_l_value(prom_metric_sample_summary_t *self,
+                                                prom_metric_formatter_t *formatter, const char *name,
+                                                const char *suffix, size_t label_count, const char **label_keys,
+                                                const char **label_values, double quantile) {
+  int r = 0;
+  char buf[50];
+
+  const char **keys = (const char **)prom_malloc((label_count + 1) * sizeof(char *));
+  const char **values = (const char **)prom_malloc((label_count + 1) * sizeof(char *));
+  if (keys == NULL || values == NULL) {
+    prom_free(keys);
+    prom_free(values);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < label_count; i++) {
+    keys[i] = label_keys[i];
+    values[i] = label_values[i];
+  }
+
+  size_t n = label_count;
+  if (quantile >= 0.0) {
+    snprintf(buf, sizeof(buf), "%g", quantile);
+    keys[n] = "quantile";
+    values[n] = buf;
+    n++;
+  }
+
+  r = prom_metric_formatter_load_l_value(formatter, name, suffix, n, keys, values);
+  prom_free(keys);
+  prom_free(values);
+  if (r) return NULL;
+
+  char *l_value = prom_metric_formatter_dump(formatter);
+  if (l_value == NULL) return NULL;
+
+  size_t len = ngx_strlen(l_value);
+  char *item = (char *)ngx_slab_alloc(self->shpool, len + 1);
+  if (item != NULL) {
+    ngx_memcpy(item, l_value, len + 1);
+  }
+
+  prom_free(l_value);
+  return item;
+}
+
+int prom_metric_sample_summary_destroy(prom_metric_sample_summary_t *self) {
+  if (self == NULL) return 0;
+
+  if (self->quantile_l_values != NULL) {
+    for (size_t i = 0; i < self->quantile_count; i++) {
+      if (self->quantile_l_values[i] != NULL) ngx_slab_free(self->shpool, self->quantile_l_values[i]);
+    }
+    ngx_slab_free(self->shpool, self->quantile_l_values);
+    self->quantile_l_values = NULL;
+  }
+
+  if (self->sum_l_value != NULL) ngx_slab_free(self->shpool, self->sum_l_value);
+  if (self->count_l_value != NULL) ngx_slab_free(self->shpool, self->count_l_value);
+
+  if (self->shards != NULL) {
+    ngx_slab_free(self->shpool, self->shards);
+    self->shards = NULL;
+  }
+
+  ngx_slab_free(self->shpool, self);
+  return 0;
+}
+
+void prom_metric_sample_summary_free_generic(void *gen) {
+  prom_metric_sample_summary_t *self = (prom_metric_sample_summary_t *)gen;
+  prom_metric_sample_summary_destroy(self);
+}
+
+int prom_metric_sample_summary_observe(prom_metric_sample_summary_t *self, double value) {
+  if (self == NULL || !isfinite(value)) return 1;
+
+  int zero = value < PROM_SUMMARY_MIN_VALUE;
+  int32_t key = zero ? 0 : (int32_t)ceil(log(value) / prom_summary_log_gamma());
+
+  prom_summary_shard_t *shard = prom_metric_sample_summary_shard(self);
+
+  ngx_rwlock_wlock(&shard->lock);
+
+  shard->count++;
+  shard->sum += value;
+  if (zero) {
+    shard->zero_count++;
+  } else {
+    prom_summary_shard_add(shard, key, 1);
+  }
+
+  ngx_rwlock_unlock(&shard->lock);
+
+  prom_metric_sample_updated = 1;
+  return 0;
+}
+
+int prom_metric_sample_summary_snapshot(prom_metric_sample_summary_t *self, double *values, uint64_t *count,
+                                        double *sum) {
+  prom_summary_shard_t merged;
+
+  if (self == NULL) return 1;
+
+  // The shards are merged the way a single shard would have counted them, lower windows fold into the highest one
+  ngx_memzero(&merged, sizeof(prom_summary_shard_t));
+
+  for (size_t i = 0; i < self->shard_count; i++) {
+    prom_summary_shard_t *shard = &self->shards[i];
+
+    ngx_rwlock_rlock(&shard->lock);
+
+    merged.count += shard->count;
+    merged.zero_count += shard->zero_count;
+    merged.sum += shard->sum;
+
+    if (shard->used) {
+      for (int32_t j = 0; j < PROM_SUMMARY_BINS; j++) {
+        if (shard->bins[j] != 0) prom_summary_shard_add(&merged, shard->offset + j, shard->bins[j]);
+      }
+    }
+
+    ngx_rwlock_unlock(&shard->lock);
+  }
+
+  *count = merged.count;
+  *sum = merged.sum;
+
+  double log_gamma = prom_summary_log_gamma();
+  double gamma = exp(log_gamma);
+
+  for (size_t q = 0; q < self->quantile_count; q++) {
+    if (merged.count == 0) {
+      values[q] = NAN;
+      continue;
+    }
+
+    // The value of the given rank is estimated by the middle of its bin, within the relative accuracy
+    double rank = self->quantiles[q] * (double)(merged.count - 1);
+    uint64_t seen = merged.zero_count;
+
+    values[q] = 0.0;
+    if ((double)seen > rank) continue;
+
+    for (int32_t j = 0; j < PROM_SUMMARY_BINS; j++) {
+      seen += merged.bins[j];
+      if ((double)seen > rank) {
+        values[q] = 2.0 * exp((double)(merged.offset + j) * log_gamma) / (gamma + 1.0);
+        break;
+      }
+    }
+  }
+
+  return 0;
+}
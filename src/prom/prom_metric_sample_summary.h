@@ -0,0 +1,117 @@
+#ifndef PROM_METRIC_SAMPLE_SUMMARY_H
+#define PROM_METRIC_SAMPLE_SUMMARY_H
+
+#include <stdint.h>
+
+#include "ngx_core.h"
+
+/**
+ * @file prom_metric_sample_summary.h
+ * @brief Summaries on DDSketch, a streaming quantile sketch with a relative error guarantee
+ *
+ * A value v > 0 is counted in the bin of key ceil(log(v) / log(gamma)) with gamma = (1 + a) / (1 - a), and every value
+ * of a bin is estimated within the relative accuracy a of its true value. Each worker owns a shard holding a window of
+ * PROM_SUMMARY_BINS consecutive bins, so memory per series is fixed. A value above the window moves the window up and
+ * folds the lowest bins into the new lowest one, a value below it is counted in the lowest bin: the high quantiles,
+ * which a summary is for, keep their accuracy. Shards merge by adding the bins of equal keys, which the scrape does
+ * before it computes the quantiles.
+ *
+ * Reference: Masson, Rim, Lee. DDSketch: A Fast and Fully-Mergeable Quantile Sketch with Relative-Error Guarantees.
+ */
+
+/**
+ * @brief The relative accuracy of the quantiles
+ */
+#define PROM_SUMMARY_ACCURACY 0.01
+
+/**
+ * @brief The bins of a shard. At 1% accuracy they span a factor of about 27000, e.g. 1ms to 27s.
+ */
+#define PROM_SUMMARY_BINS 512
+
+/**
+ * @brief Values below, including zero and negative values, are counted as zero
+ */
+#define PROM_SUMMARY_MIN_VALUE 1e-9
+
+/**
+ * @brief The largest number of quantiles of a summary
+ */
+#define PROM_SUMMARY_QUANTILES_MAX 16
+
+/**
+ * @brief API PRIVATE The sketch of one worker. The worker write-locks it to update, the scrape read-locks it to merge,
+ * and the two rarely meet.
+ */
+typedef struct prom_summary_shard {
+  ngx_atomic_t lock;                 /**< lock       Guards the shard */
+  uint64_t count;                    /**< count      The number of observations */
+  uint64_t zero_count;               /**< zero_count The observations below PROM_SUMMARY_MIN_VALUE */
+  double sum;                        /**< sum        The sum of the observations */
+  int32_t offset;                    /**< offset     The key of bins[0] */
+  int32_t used;                      /**< used       Whether the window is placed */
+  uint64_t bins[PROM_SUMMARY_BINS];  /**< bins       The counts of consecutive keys */
+} prom_summary_shard_t;
+
+struct prom_metric_sample_summary {
+  const double *quantiles;           /**< quantiles         The quantiles of the metric, not owned */
+  size_t quantile_count;             /**< quantile_count    The number of quantiles */
+  char **quantile_l_values;          /**< quantile_l_values One l_value per quantile, with the quantile label */
+  char *sum_l_value;                 /**< sum_l_value       The _sum l_value */
+  char *count_l_value;               /**< count_l_value     The _count l_value */
+  prom_summary_shard_t *shards;      /**< shards            Indexed by ngx_worker */
+  size_t shard_count;                /**< shard_count       The number of shards */
+  double created;                    /**< created           Creation time in seconds since the epoch */
+  ngx_slab_pool_t *shpool;
+};
+
+/**
+ * @brief A summary metric sample
+ */
+typedef struct prom_metric_sample_summary prom_metric_sample_summary_t;
+
+/**
+ * @brief Observe the double for the given prom_metric_sample_summary_t
+ *
+ * The observation takes a logarithm and updates the shard of the calling worker. It is O(1), except when the window
+ * of the shard moves, which is bounded by the number of bins and amortized over the observations that moved it.
+ *
+ * @param self The target prom_metric_sample_summary_t*
+ * @param value The value to observe
+ * @return Non-zero integer value upon failure
+ */
+int prom_metric_sample_summary_observe(prom_metric_sample_summary_t *self, double value);
+
+/**
+ * @brief API PRIVATE Merges the shards and computes the quantiles
+ * @param self The target prom_metric_sample_summary_t*
+ * @param values Receives one value per quantile, NaN while the summary is empty
+ * @param count Receives the number of observations
+ * @param sum Receives the sum of the observations
+ * @return Non-zero integer value upon failure
+ */
+int prom_metric_sample_summary_snapshot(prom_metric_sample_summary_t *self, double *values, uint64_t *count,
+                                        double *sum);
+
+/**
+ * @brief API PRIVATE Create a pointer to a prom_metric_sample_summary_t
+ * @param quantiles The quantiles, referenced for the lifetime of the sample
+ * @param shard_count The number of workers, at least 1
+ * @param label_values The label values, escaped as in an l_value
+ */
+prom_metric_sample_summary_t *prom_metric_sample_summary_new(ngx_slab_pool_t *shpool, const char *name,
+                                                             const double *quantiles, size_t quantile_count,
+                                                             size_t shard_count, size_t label_count,
+                                                             const char **label_keys, const char **label_values);
+
+/**
+ * @brief API PRIVATE Destroy a prom_metric_sample_summary_t
+ */
+int prom_metric_sample_summary_destroy(prom_metric_sample_summary_t *self);
+
+/**
+ * @brief API PRIVATE Destroy a void pointer that is cast to a prom_metric_sample_summary_t*. Discards any errors.
+ */
+void prom_metric_sample_summary_free_generic(void *gen);
+
+#endif  // PROM_METRIC_SAMPLE_SUMMARY_H
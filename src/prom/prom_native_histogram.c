@@ -0,0 +1,196 @@
+#include <math.h>
+
+#include "prom_native_histogram.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Static Declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static int32_t prom_native_floor_shift(int64_t value, int shift);
+
+static const double *prom_native_bounds(int32_t schema);
+
+static int32_t prom_native_key(double value, int32_t schema);
+
+static int prom_native_buckets_add(prom_native_buckets_t *self, int32_t key, uint32_t max_buckets, uint64_t count);
+
+static void prom_native_buckets_reduce(prom_native_buckets_t *self);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// End static declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief API PRIVATE Returns floor(value / 2^shift), signed right shifts being implementation defined
+ */
+static int32_t prom_native_floor_shift(int64_t value, int shift) {
+  if (value >= 0) return (int32_t)(value >> shift);
+  return (int32_t)-((-value + ((int64_t)1 << shift) - 1) >> shift);
+}
+
+/**
+ * @brief API PRIVATE Returns the 2^schema bucket boundaries of the octave [0.5, 1) for a positive schema. Each process
+ * computes a table on its first use.
+ */
+static const double *prom_native_bounds(int32_t schema) {
+  static double bounds[PROM_NATIVE_HISTOGRAM_SCHEMA_MAX + 1][1 << PROM_NATIVE_HISTOGRAM_SCHEMA_MAX];
+  static int computed[PROM_NATIVE_HISTOGRAM_SCHEMA_MAX + 1];
+
+  if (!computed[schema]) {
+    int n = 1 << schema;
+    for (int i = 0; i < n; i++) {
+      bounds[schema][i] = exp2((double)i / n - 1.0);
+    }
+    computed[schema] = 1;
+  }
+
+  return bounds[schema];
+}
+
+/**
+ * @brief API PRIVATE Returns the bucket index of a positive finite value
+ *
+ * frexp() splits the value into frac * 2^exp with frac in [0.5, 1). A positive schema divides the octave into 2^schema
+ * buckets, the one of frac is found by binary search. A schema of zero or below merges 2^-schema octaves per bucket.
+ */
+static int32_t prom_native_key(double value, int32_t schema) {
+  int exp;
+  double frac = frexp(value, &exp);
+
+  if (schema > 0) {
+    const double *bounds = prom_native_bounds(schema);
+    int32_t n = (int32_t)1 << schema;
+    int32_t lo = 0, hi = n;
+
+    // The first boundary at or above frac, the buckets being closed on the upper side
+    while (lo < hi) {
+      int32_t mid = lo + (hi - lo) / 2;
+      if (bounds[mid] < frac) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+
+    return lo + (int32_t)(exp - 1) * n;
+  }
+
+  int64_t key = exp;
+
+  // A power of two is the upper boundary of its bucket
+  if (frac == 0.5) key--;
+
+  return prom_native_floor_shift(key + ((int64_t)1 << -schema) - 1, -schema);
+}
+
+/**
+ * @brief API PRIVATE Counts observations of the key, widening the window
+ * @return Non-zero integer value if the window would become wider than max_buckets
+ */
+static int prom_native_buckets_add(prom_native_buckets_t *self, int32_t key, uint32_t max_buckets, uint64_t count) {
+  if (self->length == 0) {
+    self->offset = key;
+    self->length = 1;
+    self->counts[0] = count;
+    return 0;
+  }
+
+  if (key < self->offset) {
+    int64_t shift = (int64_t)self->offset - key;
+    if (shift + self->length > max_buckets) return 1;
+
+    memmove(self->counts + shift, self->counts, self->length * sizeof(uint64_t));
+    memset(self->counts, 0, shift * sizeof(uint64_t));
+    self->offset = key;
+    self->length += (uint32_t)shift;
+
+  } else if ((int64_t)key >= (int64_t)self->offset + self->length) {
+    int64_t length = (int64_t)key - self->offset + 1;
+    if (length > max_buckets) return 1;
+
+    memset(self->counts + self->length, 0, (length - self->length) * sizeof(uint64_t));
+    self->length = (uint32_t)length;
+  }
+
+  self->counts[key - self->offset] += count;
+  return 0;
+}
+
+/**
+ * @brief API PRIVATE Merges the buckets pairwise for the schema below, bucket i becoming floor((i + 1) / 2). The
+ * buckets are moved in ascending order, each one to a position at or below its own.
+ */
+static void prom_native_buckets_reduce(prom_native_buckets_t *self) {
+  if (self->length == 0) return;
+
+  int32_t offset = prom_native_floor_shift((int64_t)self->offset + 1, 1);
+  int32_t last = prom_native_floor_shift((int64_t)self->offset + self->length, 1);
+
+  for (uint32_t i = 0; i < self->length; i++) {
+    uint64_t count = self->counts[i];
+    self->counts[i] = 0;
+    self->counts[prom_native_floor_shift((int64_t)self->offset + i + 1, 1) - offset] += count;
+  }
+
+  self->offset = offset;
+  self->length = (uint32_t)(last - offset + 1);
+}
+
+prom_native_histogram_t *prom_native_histogram_new(ngx_slab_pool_t *shpool, int32_t schema, uint32_t max_buckets) {
+  if (schema < PROM_NATIVE_HISTOGRAM_SCHEMA_MIN || schema > PROM_NATIVE_HISTOGRAM_SCHEMA_MAX || max_buckets == 0) {
+    return NULL;
+  }
+
+  prom_native_histogram_t *self = (prom_native_histogram_t *)ngx_slab_calloc(shpool, sizeof(prom_native_histogram_t));
+  if (self == NULL) return NULL;
+
+  self->shpool = shpool;
+  self->schema = schema;
+  self->zero_threshold = PROM_NATIVE_HISTOGRAM_ZERO_THRESHOLD;
+  self->max_buckets = max_buckets;
+
+  self->positive.counts = (uint64_t *)ngx_slab_calloc(shpool, sizeof(uint64_t) * max_buckets);
+  self->negative.counts = (uint64_t *)ngx_slab_calloc(shpool, sizeof(uint64_t) * max_buckets);
+  if (self->positive.counts == NULL || self->negative.counts == NULL) {
+    prom_native_histogram_destroy(self);
+    return NULL;
+  }
+
+  return self;
+}
+
+int prom_native_histogram_destroy(prom_native_histogram_t *self) {
+  if (self == NULL) return 0;
+
+  if (self->positive.counts != NULL) ngx_slab_free(self->shpool, self->positive.counts);
+  if (self->negative.counts != NULL) ngx_slab_free(self->shpool, self->negative.counts);
+
+  ngx_slab_free(self->shpool, self);
+  return 0;
+}
+
+int prom_native_histogram_observe(prom_native_histogram_t *self, double value, uint64_t count) {
+  if (self == NULL || !isfinite(value)) return 1;
+
+  double magnitude = fabs(value);
+
+  if (magnitude <= self->zero_threshold) {
+    self->zero_count += count;
+    return 0;
+  }
+
+  prom_native_buckets_t *buckets = value > 0 ? &self->positive : &self->negative;
+
+  for (;;) {
+    int32_t key = prom_native_key(magnitude, self->schema);
+
+    if (prom_native_buckets_add(buckets, key, self->max_buckets, count) == 0) return 0;
+
+    // Out of buckets at the coarsest schema, which only a very small limit allows
+    if (self->schema == PROM_NATIVE_HISTOGRAM_SCHEMA_MIN) return 1;
+
+    prom_native_buckets_reduce(&self->positive);
+    prom_native_buckets_reduce(&self->negative);
+    self->schema--;
+  }
+}
@@ -0,0 +1,84 @@
+#ifndef PROM_NATIVE_HISTOGRAM_H
+#define PROM_NATIVE_HISTOGRAM_H
+
+#include <stdint.h>
+
+#include "ngx_core.h"
+
+/**
+ * @file prom_native_histogram.h
+ * @brief Prometheus native histograms: sparse exponential buckets, exposed in the protobuf format only
+ *
+ * At schema s the bucket of index i holds the values in (2^((i-1)/2^s), 2^(i/2^s)], so every bucket boundary is the
+ * previous one times 2^(2^-s). The index is found with frexp() and, for positive schemas, a binary search of the
+ * boundaries within an octave. Values whose magnitude is at most the zero threshold are counted in the zero bucket.
+ *
+ * Each sign keeps the counts of a window of consecutive indices in shared memory, at most max_buckets wide. When an
+ * observation would widen a window past the limit, the schema of the histogram is reduced: each pair of neighbouring
+ * buckets merges into one, which halves the width of both windows. The exposition encodes the populated buckets as
+ * spans and deltas, skipping the empty ones.
+ *
+ * Reference: https://prometheus.io/docs/specs/native_histograms/
+ */
+
+/**
+ * @brief The lowest and the highest schema
+ */
+#define PROM_NATIVE_HISTOGRAM_SCHEMA_MIN -4
+#define PROM_NATIVE_HISTOGRAM_SCHEMA_MAX 8
+
+/**
+ * @brief The default schema, a bucket boundary factor of 2^(1/8), about 1.09
+ */
+#define PROM_NATIVE_HISTOGRAM_SCHEMA 3
+
+/**
+ * @brief The default width limit of the bucket windows
+ */
+#define PROM_NATIVE_HISTOGRAM_MAX_BUCKETS 160
+
+/**
+ * @brief The zero threshold, 2^-128 as in the Go client
+ */
+#define PROM_NATIVE_HISTOGRAM_ZERO_THRESHOLD 2.938735877055719e-39
+
+/**
+ * @brief API PRIVATE The buckets of one sign
+ */
+typedef struct prom_native_buckets {
+  int32_t offset;   /**< offset The index of counts[0] */
+  uint32_t length;  /**< length The width of the window, 0 if no bucket is populated */
+  uint64_t *counts; /**< counts The counts of the window, max_buckets of which are allocated */
+} prom_native_buckets_t;
+
+typedef struct prom_native_histogram {
+  int32_t schema;                 /**< schema         The current schema, reduced as the windows widen */
+  double zero_threshold;          /**< zero_threshold The largest magnitude counted in the zero bucket */
+  uint64_t zero_count;            /**< zero_count     The observations of the zero bucket */
+  uint32_t max_buckets;           /**< max_buckets    The width limit of a window */
+  prom_native_buckets_t positive; /**< positive       The buckets of positive values */
+  prom_native_buckets_t negative; /**< negative       The buckets of negative values, by magnitude */
+  ngx_slab_pool_t *shpool;
+} prom_native_histogram_t;
+
+/**
+ * @brief API PRIVATE Create a pointer to a prom_native_histogram_t
+ * @param schema The initial schema
+ * @param max_buckets The width limit of the bucket windows
+ * @return The prom_native_histogram_t*, NULL upon failure or if the schema is out of range
+ */
+prom_native_histogram_t *prom_native_histogram_new(ngx_slab_pool_t *shpool, int32_t schema, uint32_t max_buckets);
+
+/**
+ * @brief API PRIVATE Counts a value. The caller MUST hold the write lock of the histogram sample.
+ * @param count The observations the value stands for, 1 unless the histogram is sampled
+ * @return Non-zero integer value upon failure, for NaN and infinite values
+ */
+int prom_native_histogram_observe(prom_native_histogram_t *self, double value, uint64_t count);
+
+/**
+ * @brief API PRIVATE Destroy a prom_native_histogram_t
+ */
+int prom_native_histogram_destroy(prom_native_histogram_t *self);
+
+#endif  // PROM_NATIVE_HISTOGRAM_H
@@ -0,0 +1,629 @@
+#include "prom_protobuf.h"
+#include "prom_log.h"
+
+// io.prometheus.client.MetricFamily
+#define PROM_PROTOBUF_FAMILY_NAME 1
+#define PROM_PROTOBUF_FAMILY_HELP 2
+#define PROM_PROTOBUF_FAMILY_TYPE 3
+#define PROM_PROTOBUF_FAMILY_METRIC 4
+#define PROM_PROTOBUF_FAMILY_UNIT 5
+
+// io.prometheus.client.Metric
+#define PROM_PROTOBUF_METRIC_LABEL 1
+#define PROM_PROTOBUF_METRIC_GAUGE 2
+#define PROM_PROTOBUF_METRIC_COUNTER 3
+#define PROM_PROTOBUF_METRIC_SUMMARY 4
+#define PROM_PROTOBUF_METRIC_HISTOGRAM 7
+
+// io.prometheus.client.LabelPair
+#define PROM_PROTOBUF_LABEL_NAME 1
+#define PROM_PROTOBUF_LABEL_VALUE 2
+
+// io.prometheus.client.Gauge and io.prometheus.client.Counter
+#define PROM_PROTOBUF_GAUGE_VALUE 1
+#define PROM_PROTOBUF_COUNTER_VALUE 1
+#define PROM_PROTOBUF_COUNTER_CREATED 3
+
+// io.prometheus.client.Histogram and io.prometheus.client.Bucket
+#define PROM_PROTOBUF_HISTOGRAM_SAMPLE_COUNT 1
+#define PROM_PROTOBUF_HISTOGRAM_SAMPLE_SUM 2
+#define PROM_PROTOBUF_HISTOGRAM_BUCKET 3
+#define PROM_PROTOBUF_HISTOGRAM_SCHEMA 5
+#define PROM_PROTOBUF_HISTOGRAM_ZERO_THRESHOLD 6
+#define PROM_PROTOBUF_HISTOGRAM_ZERO_COUNT 7
+#define PROM_PROTOBUF_HISTOGRAM_NEGATIVE_SPAN 9
+#define PROM_PROTOBUF_HISTOGRAM_NEGATIVE_DELTA 10
+#define PROM_PROTOBUF_HISTOGRAM_POSITIVE_SPAN 12
+#define PROM_PROTOBUF_HISTOGRAM_POSITIVE_DELTA 13
+#define PROM_PROTOBUF_HISTOGRAM_CREATED 15
+#define PROM_PROTOBUF_BUCKET_CUMULATIVE_COUNT 1
+#define PROM_PROTOBUF_BUCKET_UPPER_BOUND 2
+
+// io.prometheus.client.BucketSpan
+#define PROM_PROTOBUF_SPAN_OFFSET 1
+#define PROM_PROTOBUF_SPAN_LENGTH 2
+
+// io.prometheus.client.Summary and io.prometheus.client.Quantile
+#define PROM_PROTOBUF_SUMMARY_SAMPLE_COUNT 1
+#define PROM_PROTOBUF_SUMMARY_SAMPLE_SUM 2
+#define PROM_PROTOBUF_SUMMARY_QUANTILE 3
+#define PROM_PROTOBUF_SUMMARY_CREATED 4
+#define PROM_PROTOBUF_QUANTILE_QUANTILE 1
+#define PROM_PROTOBUF_QUANTILE_VALUE 2
+
+// google.protobuf.Timestamp
+#define PROM_PROTOBUF_TIMESTAMP_SECONDS 1
+#define PROM_PROTOBUF_TIMESTAMP_NANOS 2
+
+/**
+ * @brief io.prometheus.client.MetricType values indexed by prom_metric_type_t
+ */
+static const uint64_t prom_protobuf_metric_type_map[4] = {0 /* COUNTER */, 1 /* GAUGE */, 4 /* HISTOGRAM */,
+                                                          2 /* SUMMARY */};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Static Declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static size_t prom_protobuf_encode_varint(char *buf, uint64_t value);
+
+static int prom_protobuf_add_timestamp(prom_string_builder_t *sb, uint32_t field, double timestamp);
+
+static int prom_protobuf_load_labels(prom_string_builder_t *sb, const char *labels);
+
+static int prom_protobuf_load_sample(prom_string_builder_t *sb, prom_metric_t *metric, size_t name_len,
+                                     prom_metric_sample_t *sample);
+
+static int prom_protobuf_load_histogram(prom_string_builder_t *sb, size_t name_len,
+                                        prom_metric_sample_histogram_t *hist_sample);
+
+static int prom_protobuf_load_histogram_snapshot(prom_string_builder_t *sb, size_t name_len,
+                                                 prom_metric_sample_histogram_t *hist_sample,
+                                                 uint64_t count, double sum);
+
+static int prom_protobuf_load_native_buckets(prom_string_builder_t *sb, uint32_t span_field, uint32_t delta_field,
+                                             prom_native_buckets_t *buckets);
+
+static int prom_protobuf_load_native(prom_string_builder_t *sb, prom_native_histogram_t *native);
+
+static int prom_protobuf_load_summary(prom_string_builder_t *sb, size_t name_len,
+                                      prom_metric_sample_summary_t *summary);
+
+static int prom_protobuf_load_value_end(prom_string_builder_t *sb, prom_metric_type_t type, double value,
+                                        size_t metric_start);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// End static declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static size_t prom_protobuf_encode_varint(char *buf, uint64_t value) {
+  size_t n = 0;
+  while (value >= 0x80) {
+    buf[n++] = (char)((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  buf[n++] = (char)value;
+  return n;
+}
+
+int prom_protobuf_add_varint(prom_string_builder_t *sb, uint64_t value) {
+  // A 64 bit varint never takes more than 10 bytes
+  char *p = prom_string_builder_reserve(sb, 10);
+  if (p == NULL) return 1;
+  return prom_string_builder_commit(sb, prom_protobuf_encode_varint(p, value));
+}
+
+int prom_protobuf_add_tag(prom_string_builder_t *sb, uint32_t field, prom_protobuf_wire_type_t wire_type) {
+  return prom_protobuf_add_varint(sb, ((uint64_t)field << 3) | wire_type);
+}
+
+int prom_protobuf_add_uint64(prom_string_builder_t *sb, uint32_t field, uint64_t value) {
+  int r = 0;
+  if (value == 0) return 0;
+  r = prom_protobuf_add_tag(sb, field, PROM_PROTOBUF_VARINT);
+  if (r) return r;
+  return prom_protobuf_add_varint(sb, value);
+}
+
+int prom_protobuf_add_sint64(prom_string_builder_t *sb, uint32_t field, int64_t value) {
+  return prom_protobuf_add_uint64(sb, field, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+int prom_protobuf_add_double(prom_string_builder_t *sb, uint32_t field, double value) {
+  int r = 0;
+  uint64_t bits;
+
+  r = prom_protobuf_add_tag(sb, field, PROM_PROTOBUF_FIXED64);
+  if (r) return r;
+
+  char *p = prom_string_builder_reserve(sb, 8);
+  if (p == NULL) return 1;
+
+  // fixed64 is little endian on the wire regardless of the host byte order
+  memcpy(&bits, &value, sizeof(bits));
+  for (int i = 0; i < 8; i++) {
+    p[i] = (char)(bits >> (i * 8));
+  }
+  return prom_string_builder_commit(sb, 8);
+}
+
+int prom_protobuf_add_string(prom_string_builder_t *sb, uint32_t field, const char *data, size_t len) {
+  int r = 0;
+
+  r = prom_protobuf_add_tag(sb, field, PROM_PROTOBUF_LEN);
+  if (r) return r;
+
+  r = prom_protobuf_add_varint(sb, len);
+  if (r) return r;
+
+  return prom_string_builder_add_data(sb, data, len);
+}
+
+int prom_protobuf_begin(prom_string_builder_t *sb, uint32_t field, size_t *start) {
+  int r = 0;
+
+  if (field != 0) {
+    r = prom_protobuf_add_tag(sb, field, PROM_PROTOBUF_LEN);
+    if (r) return r;
+  }
+
+  // The length is not known yet, keep room for the largest varint we allow and shrink it in prom_protobuf_end()
+  if (prom_string_builder_reserve(sb, PROM_PROTOBUF_LEN_RESERVED) == NULL) return 1;
+  r = prom_string_builder_commit(sb, PROM_PROTOBUF_LEN_RESERVED);
+  if (r) return r;
+
+  *start = prom_string_builder_len(sb);
+  return 0;
+}
+
+int prom_protobuf_end(prom_string_builder_t *sb, size_t start) {
+  char varint[10];
+  size_t len = prom_string_builder_len(sb) - start;
+
+  if (len >> (7 * PROM_PROTOBUF_LEN_RESERVED)) {
+    PROM_LOG("protobuf message too large");
+    return 1;
+  }
+
+  size_t n = prom_protobuf_encode_varint(varint, len);
+  char *slot = prom_string_builder_str(sb) + start - PROM_PROTOBUF_LEN_RESERVED;
+
+  if (n < PROM_PROTOBUF_LEN_RESERVED) {
+    memmove(slot + n, slot + PROM_PROTOBUF_LEN_RESERVED, len);
+  }
+  memcpy(slot, varint, n);
+
+  return prom_string_builder_truncate(sb, start - PROM_PROTOBUF_LEN_RESERVED + n + len);
+}
+
+static int prom_protobuf_add_timestamp(prom_string_builder_t *sb, uint32_t field, double timestamp) {
+  int r = 0;
+  size_t start;
+
+  int64_t seconds = (int64_t)timestamp;
+  int64_t nanos = (int64_t)((timestamp - (double)seconds) * 1000.0 + 0.5) * 1000000;
+  if (nanos > 999000000) nanos = 999000000;
+
+  r = prom_protobuf_begin(sb, field, &start);
+  if (r) return r;
+  r = prom_protobuf_add_uint64(sb, PROM_PROTOBUF_TIMESTAMP_SECONDS, (uint64_t)seconds);
+  if (r) return r;
+  r = prom_protobuf_add_uint64(sb, PROM_PROTOBUF_TIMESTAMP_NANOS, (uint64_t)nanos);
+  if (r) return r;
+  return prom_protobuf_end(sb, start);
+}
+
+/**
+ * @brief API PRIVATE Appends a LabelPair for every label in the label part of an l_value.
+ *
+ * labels is either empty or {key="value",...} exactly as written by prom_metric_formatter_load_l_value(), so the
+ * label pairs can be taken from the l_value instead of being stored a second time with every sample.
+ */
+static int prom_protobuf_load_labels(prom_string_builder_t *sb, const char *labels) {
+  int r = 0;
+  size_t start;
+
+  if (*labels != '{') return 0;
+
+  const char *p = labels + 1;
+  while (*p != '\0' && *p != '}') {
+    const char *key = p;
+    while (*p != '\0' && *p != '=') p++;
+    if (*p != '=' || p[1] != '"') return 1;
+    size_t key_len = p - key;
+
+    p += 2;
+    const char *value = p;
+    size_t escapes = 0;
+    while (*p != '\0' && *p != '"') {
+      if (*p == '\\' && p[1] != '\0') {
+        p++;
+        escapes++;
+      }
+      p++;
+    }
+    if (*p != '"') return 1;
+    size_t value_len = p - value;
+    p++;
+
+    r = prom_protobuf_begin(sb, PROM_PROTOBUF_METRIC_LABEL, &start);
+    if (r) return r;
+    r = prom_protobuf_add_string(sb, PROM_PROTOBUF_LABEL_NAME, key, key_len);
+    if (r) return r;
+    if (escapes == 0) {
+      r = prom_protobuf_add_string(sb, PROM_PROTOBUF_LABEL_VALUE, value, value_len);
+      if (r) return r;
+    } else {
+      // Label values are stored escaped for the text formats, protobuf carries them verbatim
+      r = prom_protobuf_add_tag(sb, PROM_PROTOBUF_LABEL_VALUE, PROM_PROTOBUF_LEN);
+      if (r) return r;
+      r = prom_protobuf_add_varint(sb, value_len - escapes);
+      if (r) return r;
+      for (size_t i = 0; i < value_len; i++) {
+        char ch = value[i];
+        if (ch == '\\') {
+          ch = value[++i];
+          if (ch == 'n') ch = '\n';
+        }
+        r = prom_string_builder_add_char(sb, ch);
+        if (r) return r;
+      }
+    }
+    r = prom_protobuf_end(sb, start);
+    if (r) return r;
+
+    if (*p == ',') p++;
+  }
+  return 0;
+}
+
+static int prom_protobuf_load_sample(prom_string_builder_t *sb, prom_metric_t *metric, size_t name_len,
+                                     prom_metric_sample_t *sample) {
+  int r = 0;
+  size_t metric_start, value_start;
+
+  r = prom_protobuf_begin(sb, PROM_PROTOBUF_FAMILY_METRIC, &metric_start);
+  if (r) return r;
+
+  r = prom_protobuf_load_labels(sb, sample->l_value + name_len);
+  if (r) return r;
+
+  if (metric->type == PROM_COUNTER) {
+    r = prom_protobuf_begin(sb, PROM_PROTOBUF_METRIC_COUNTER, &value_start);
+    if (r) return r;
+    r = prom_protobuf_add_double(sb, PROM_PROTOBUF_COUNTER_VALUE, prom_metric_sample_value(sample));
+    if (r) return r;
+    r = prom_protobuf_add_timestamp(sb, PROM_PROTOBUF_COUNTER_CREATED, sample->created);
+    if (r) return r;
+  } else {
+    r = prom_protobuf_begin(sb, PROM_PROTOBUF_METRIC_GAUGE, &value_start);
+    if (r) return r;
+    r = prom_protobuf_add_double(sb, PROM_PROTOBUF_GAUGE_VALUE, prom_metric_sample_value(sample));
+    if (r) return r;
+  }
+
+  r = prom_protobuf_end(sb, value_start);
+  if (r) return r;
+
+  return prom_protobuf_end(sb, metric_start);
+}
+
+static int prom_protobuf_load_histogram(prom_string_builder_t *sb, size_t name_len,
+                                        prom_metric_sample_histogram_t *hist_sample) {
+  int r = 0;
+  uint64_t count;
+  double sum;
+
+  // The buckets, the count and the sum of one snapshot always agree
+  r = prom_metric_sample_histogram_snapshot(hist_sample, &count, &sum);
+  if (r) return r;
+
+  r = prom_protobuf_load_histogram_snapshot(sb, name_len, hist_sample, count, sum);
+
+  prom_metric_sample_histogram_snapshot_end(hist_sample);
+  return r;
+}
+
+static int prom_protobuf_load_histogram_snapshot(prom_string_builder_t *sb, size_t name_len,
+                                                 prom_metric_sample_histogram_t *hist_sample,
+                                                 uint64_t count, double sum) {
+  int r = 0;
+  size_t metric_start, histogram_start, bucket_start;
+
+  r = prom_protobuf_begin(sb, PROM_PROTOBUF_FAMILY_METRIC, &metric_start);
+  if (r) return r;
+
+  // The count l_value carries the label set of the series without the le label
+  r = prom_protobuf_load_labels(sb, hist_sample->count_sample->l_value + name_len + sizeof("_count") - 1);
+  if (r) return r;
+
+  r = prom_protobuf_begin(sb, PROM_PROTOBUF_METRIC_HISTOGRAM, &histogram_start);
+  if (r) return r;
+
+  r = prom_protobuf_add_uint64(sb, PROM_PROTOBUF_HISTOGRAM_SAMPLE_COUNT, count);
+  if (r) return r;
+  r = prom_protobuf_add_double(sb, PROM_PROTOBUF_HISTOGRAM_SAMPLE_SUM, sum);
+  if (r) return r;
+
+  // The +Inf bucket is implicit, its count is the sample count. The buckets are made cumulative as they are written.
+  uint64_t cumulative = 0;
+  int bucket_count = prom_histogram_buckets_count(hist_sample->buckets);
+  for (int i = 0; i < bucket_count; i++) {
+    cumulative += prom_metric_sample_histogram_snapshot_bucket(hist_sample, i);
+    r = prom_protobuf_begin(sb, PROM_PROTOBUF_HISTOGRAM_BUCKET, &bucket_start);
+    if (r) return r;
+    r = prom_protobuf_add_uint64(sb, PROM_PROTOBUF_BUCKET_CUMULATIVE_COUNT, cumulative);
+    if (r) return r;
+    r = prom_protobuf_add_double(sb, PROM_PROTOBUF_BUCKET_UPPER_BOUND, hist_sample->buckets->upper_bounds[i]);
+    if (r) return r;
+    r = prom_protobuf_end(sb, bucket_start);
+    if (r) return r;
+  }
+
+  if (hist_sample->native != NULL) {
+    ngx_rwlock_rlock(&hist_sample->rwlock);
+    r = prom_protobuf_load_native(sb, hist_sample->native);
+    ngx_rwlock_unlock(&hist_sample->rwlock);
+    if (r) return r;
+  }
+
+  r = prom_protobuf_add_timestamp(sb, PROM_PROTOBUF_HISTOGRAM_CREATED, hist_sample->created);
+  if (r) return r;
+
+  r = prom_protobuf_end(sb, histogram_start);
+  if (r) return r;
+
+  return prom_protobuf_end(sb, metric_start);
+}
+
+/**
+ * @brief API PRIVATE Appends the populated buckets of one sign as BucketSpans and packed deltas.
+ *
+ * A span is a run of populated buckets, its offset the gap from the end of the previous span, or the index of its first
+ * bucket for the first span. The deltas are the differences between the counts of consecutive populated buckets, the
+ * first one being its count.
+ */
+static int prom_protobuf_load_native_buckets(prom_string_builder_t *sb, uint32_t span_field, uint32_t delta_field,
+                                             prom_native_buckets_t *buckets) {
+  int r = 0;
+  size_t start;
+  int64_t end = 0;
+  int populated = 0;
+
+  for (uint32_t i = 0; i < buckets->length;) {
+    if (buckets->counts[i] == 0) {
+      i++;
+      continue;
+    }
+
+    uint32_t j = i;
+    while (j < buckets->length && buckets->counts[j] != 0) j++;
+
+    r = prom_protobuf_begin(sb, span_field, &start);
+    if (r) return r;
+    r = prom_protobuf_add_sint64(sb, PROM_PROTOBUF_SPAN_OFFSET, (int64_t)buckets->offset + i - end);
+    if (r) return r;
+    r = prom_protobuf_add_uint64(sb, PROM_PROTOBUF_SPAN_LENGTH, j - i);
+    if (r) return r;
+    r = prom_protobuf_end(sb, start);
+    if (r) return r;
+
+    end = (int64_t)buckets->offset + j;
+    populated = 1;
+    i = j;
+  }
+
+  if (!populated) return 0;
+
+  r = prom_protobuf_begin(sb, delta_field, &start);
+  if (r) return r;
+
+  int64_t previous = 0;
+  for (uint32_t i = 0; i < buckets->length; i++) {
+    if (buckets->counts[i] == 0) continue;
+
+    // Packed sint64, zigzag encoded; unlike a single field a zero delta is written
+    int64_t delta = (int64_t)buckets->counts[i] - previous;
+    r = prom_protobuf_add_varint(sb, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+    if (r) return r;
+    previous = (int64_t)buckets->counts[i];
+  }
+
+  return prom_protobuf_end(sb, start);
+}
+
+/**
+ * @brief API PRIVATE Appends the native fields of a Histogram. The caller MUST hold the read lock of the sample.
+ */
+static int prom_protobuf_load_native(prom_string_builder_t *sb, prom_native_histogram_t *native) {
+  int r = 0;
+
+  r = prom_protobuf_add_sint64(sb, PROM_PROTOBUF_HISTOGRAM_SCHEMA, native->schema);
+  if (r) return r;
+  // The zero threshold is never 0, it marks the histogram as native even before the first observation
+  r = prom_protobuf_add_double(sb, PROM_PROTOBUF_HISTOGRAM_ZERO_THRESHOLD, native->zero_threshold);
+  if (r) return r;
+  r = prom_protobuf_add_uint64(sb, PROM_PROTOBUF_HISTOGRAM_ZERO_COUNT, native->zero_count);
+  if (r) return r;
+
+  r = prom_protobuf_load_native_buckets(sb, PROM_PROTOBUF_HISTOGRAM_NEGATIVE_SPAN,
+                                        PROM_PROTOBUF_HISTOGRAM_NEGATIVE_DELTA, &native->negative);
+  if (r) return r;
+
+  return prom_protobuf_load_native_buckets(sb, PROM_PROTOBUF_HISTOGRAM_POSITIVE_SPAN,
+                                           PROM_PROTOBUF_HISTOGRAM_POSITIVE_DELTA, &native->positive);
+}
+
+static int prom_protobuf_load_summary(prom_string_builder_t *sb, size_t name_len,
+                                      prom_metric_sample_summary_t *summary) {
+  int r = 0;
+  size_t metric_start, summary_start, quantile_start;
+  double values[PROM_SUMMARY_QUANTILES_MAX];
+  uint64_t count;
+  double sum;
+
+  r = prom_metric_sample_summary_snapshot(summary, values, &count, &sum);
+  if (r) return r;
+
+  r = prom_protobuf_begin(sb, PROM_PROTOBUF_FAMILY_METRIC, &metric_start);
+  if (r) return r;
+
+  // The count l_value carries the label set of the series without the quantile label
+  r = prom_protobuf_load_labels(sb, summary->count_l_value + name_len + sizeof("_count") - 1);
+  if (r) return r;
+
+  r = prom_protobuf_begin(sb, PROM_PROTOBUF_METRIC_SUMMARY, &summary_start);
+  if (r) return r;
+
+  r = prom_protobuf_add_uint64(sb, PROM_PROTOBUF_SUMMARY_SAMPLE_COUNT, count);
+  if (r) return r;
+  r = prom_protobuf_add_double(sb, PROM_PROTOBUF_SUMMARY_SAMPLE_SUM, sum);
+  if (r) return r;
+
+  for (size_t i = 0; i < summary->quantile_count; i++) {
+    r = prom_protobuf_begin(sb, PROM_PROTOBUF_SUMMARY_QUANTILE, &quantile_start);
+    if (r) return r;
+    r = prom_protobuf_add_double(sb, PROM_PROTOBUF_QUANTILE_QUANTILE, summary->quantiles[i]);
+    if (r) return r;
+    r = prom_protobuf_add_double(sb, PROM_PROTOBUF_QUANTILE_VALUE, values[i]);
+    if (r) return r;
+    r = prom_protobuf_end(sb, quantile_start);
+    if (r) return r;
+  }
+
+  r = prom_protobuf_add_timestamp(sb, PROM_PROTOBUF_SUMMARY_CREATED, summary->created);
+  if (r) return r;
+
+  r = prom_protobuf_end(sb, summary_start);
+  if (r) return r;
+
+  return prom_protobuf_end(sb, metric_start);
+}
+
+int prom_protobuf_load_metric(prom_string_builder_t *sb, prom_metric_t *metric) {
+  int r = 0;
+  size_t family_start;
+
+  // Families without series carry no information in this format
+  if (prom_map_size(metric->samples) == 0) return 0;
+
+  size_t name_len = ngx_strlen(metric->name);
+
+  r = prom_protobuf_begin_family(sb, metric->name, name_len, metric->help, metric->type, &family_start);
+  if (r) return r;
+
+  for (prom_linked_list_node_t *current_node = metric->samples->keys->head; current_node != NULL;
+       current_node = current_node->next) {
+    const char *key = (const char *)current_node->item;
+
+    if (metric->type == PROM_HISTOGRAM) {
+      prom_metric_sample_histogram_t *hist_sample =
+          (prom_metric_sample_histogram_t *)prom_map_get(metric->samples, key);
+      if (hist_sample == NULL) return 1;
+      r = prom_protobuf_load_histogram(sb, name_len, hist_sample);
+    } else if (metric->type == PROM_SUMMARY) {
+      prom_metric_sample_summary_t *summary = (prom_metric_sample_summary_t *)prom_map_get(metric->samples, key);
+      if (summary == NULL) return 1;
+      r = prom_protobuf_load_summary(sb, name_len, summary);
+    } else {
+      prom_metric_sample_t *sample = (prom_metric_sample_t *)prom_map_get(metric->samples, key);
+      if (sample == NULL) return 1;
+      r = prom_protobuf_load_sample(sb, metric, name_len, sample);
+    }
+    if (r) return r;
+  }
+
+  if (metric->unit != NULL) {
+    r = prom_protobuf_add_string(sb, PROM_PROTOBUF_FAMILY_UNIT, metric->unit, ngx_strlen(metric->unit));
+    if (r) return r;
+  }
+
+  return prom_protobuf_end(sb, family_start);
+}
+
+int prom_protobuf_begin_family(prom_string_builder_t *sb, const char *name, size_t name_len, const char *help,
+                               prom_metric_type_t type, size_t *start) {
+  int r = 0;
+
+  r = prom_protobuf_begin(sb, 0, start);
+  if (r) return r;
+
+  r = prom_protobuf_add_string(sb, PROM_PROTOBUF_FAMILY_NAME, name, name_len);
+  if (r) return r;
+  r = prom_protobuf_add_string(sb, PROM_PROTOBUF_FAMILY_HELP, help, ngx_strlen(help));
+  if (r) return r;
+  return prom_protobuf_add_uint64(sb, PROM_PROTOBUF_FAMILY_TYPE, prom_protobuf_metric_type_map[type]);
+}
+
+int prom_protobuf_load_value(prom_string_builder_t *sb, prom_metric_type_t type, size_t label_count,
+                             const char **label_keys, const char **label_values, double value) {
+  int r = 0;
+  size_t metric_start, label_start;
+
+  r = prom_protobuf_begin(sb, PROM_PROTOBUF_FAMILY_METRIC, &metric_start);
+  if (r) return r;
+
+  for (size_t i = 0; i < label_count; i++) {
+    r = prom_protobuf_begin(sb, PROM_PROTOBUF_METRIC_LABEL, &label_start);
+    if (r) return r;
+    r = prom_protobuf_add_string(sb, PROM_PROTOBUF_LABEL_NAME, label_keys[i], ngx_strlen(label_keys[i]));
+    if (r) return r;
+    r = prom_protobuf_add_string(sb, PROM_PROTOBUF_LABEL_VALUE, label_values[i], ngx_strlen(label_values[i]));
+    if (r) return r;
+    r = prom_protobuf_end(sb, label_start);
+    if (r) return r;
+  }
+
+  return prom_protobuf_load_value_end(sb, type, value, metric_start);
+}
+
+int prom_protobuf_load_value_l_value(prom_string_builder_t *sb, prom_metric_type_t type, const char *labels,
+                                     const char *key, const char *label_value, double value) {
+  int r = 0;
+  size_t metric_start, label_start;
+
+  r = prom_protobuf_begin(sb, PROM_PROTOBUF_FAMILY_METRIC, &metric_start);
+  if (r) return r;
+
+  r = prom_protobuf_load_labels(sb, labels);
+  if (r) return r;
+
+  if (key != NULL) {
+    r = prom_protobuf_begin(sb, PROM_PROTOBUF_METRIC_LABEL, &label_start);
+    if (r) return r;
+    r = prom_protobuf_add_string(sb, PROM_PROTOBUF_LABEL_NAME, key, ngx_strlen(key));
+    if (r) return r;
+    r = prom_protobuf_add_string(sb, PROM_PROTOBUF_LABEL_VALUE, label_value, ngx_strlen(label_value));
+    if (r) return r;
+    r = prom_protobuf_end(sb, label_start);
+    if (r) return r;
+  }
+
+  return prom_protobuf_load_value_end(sb, type, value, metric_start);
+}
+
+/**
+ * @brief API PRIVATE Appends the counter or gauge value of a Metric message begun at metric_start and ends it
+ */
+static int prom_protobuf_load_value_end(prom_string_builder_t *sb, prom_metric_type_t type, double value,
+                                        size_t metric_start) {
+  int r = 0;
+  size_t value_start;
+
+  if (type == PROM_COUNTER) {
+    r = prom_protobuf_begin(sb, PROM_PROTOBUF_METRIC_COUNTER, &value_start);
+    if (r) return r;
+    r = prom_protobuf_add_double(sb, PROM_PROTOBUF_COUNTER_VALUE, value);
+    if (r) return r;
+  } else {
+    r = prom_protobuf_begin(sb, PROM_PROTOBUF_METRIC_GAUGE, &value_start);
+    if (r) return r;
+    r = prom_protobuf_add_double(sb, PROM_PROTOBUF_GAUGE_VALUE, value);
+    if (r) return r;
+  }
+
+  r = prom_protobuf_end(sb, value_start);
+  if (r) return r;
+
+  return prom_protobuf_end(sb, metric_start);
+}
@@ -0,0 +1,106 @@
+#ifndef PROM_PROTOBUF_H
+#define PROM_PROTOBUF_H
+
+#include <stdint.h>
+
+#include "prom_metric.h"
+
+/**
+ * @file prom_protobuf.h
+ * @brief A self-contained encoder for the Prometheus protobuf exposition format
+ *
+ * Metric families are written as length-delimited io.prometheus.client.MetricFamily messages straight from the
+ * metric and sample structures, without any protobuf runtime. Varints are encoded in place into the string builder;
+ * the length of a nested message is back-patched once the message has been written.
+ *
+ * Reference: https://github.com/prometheus/client_model/blob/master/io/prometheus/client/metrics.proto
+ */
+
+/**
+ * @brief API PRIVATE Protobuf wire types
+ */
+typedef enum prom_protobuf_wire_type {
+  PROM_PROTOBUF_VARINT = 0,
+  PROM_PROTOBUF_FIXED64 = 1,
+  PROM_PROTOBUF_LEN = 2
+} prom_protobuf_wire_type_t;
+
+/**
+ * @brief API PRIVATE The number of bytes reserved for the length of a nested message. This bounds a message to 32GB.
+ */
+#define PROM_PROTOBUF_LEN_RESERVED 5
+
+/**
+ * @brief API PRIVATE Appends value as a base 128 varint
+ */
+int prom_protobuf_add_varint(prom_string_builder_t *sb, uint64_t value);
+
+/**
+ * @brief API PRIVATE Appends a field tag
+ */
+int prom_protobuf_add_tag(prom_string_builder_t *sb, uint32_t field, prom_protobuf_wire_type_t wire_type);
+
+/**
+ * @brief API PRIVATE Appends a varint field. Zero values are skipped, as in proto3.
+ */
+int prom_protobuf_add_uint64(prom_string_builder_t *sb, uint32_t field, uint64_t value);
+
+/**
+ * @brief API PRIVATE Appends a sint32/sint64 field using the zigzag encoding. Zero values are skipped.
+ */
+int prom_protobuf_add_sint64(prom_string_builder_t *sb, uint32_t field, int64_t value);
+
+/**
+ * @brief API PRIVATE Appends a double field
+ */
+int prom_protobuf_add_double(prom_string_builder_t *sb, uint32_t field, double value);
+
+/**
+ * @brief API PRIVATE Appends a string or bytes field
+ */
+int prom_protobuf_add_string(prom_string_builder_t *sb, uint32_t field, const char *data, size_t len);
+
+/**
+ * @brief API PRIVATE Starts a nested message. Pass field 0 to start a top-level length-delimited message.
+ * @param start Receives the offset of the message body, to be passed to prom_protobuf_end()
+ */
+int prom_protobuf_begin(prom_string_builder_t *sb, uint32_t field, size_t *start);
+
+/**
+ * @brief API PRIVATE Ends the message started at start and back-patches its length
+ */
+int prom_protobuf_end(prom_string_builder_t *sb, size_t start);
+
+/**
+ * @brief API PRIVATE Appends the metric as a length-delimited io.prometheus.client.MetricFamily message
+ */
+int prom_protobuf_load_metric(prom_string_builder_t *sb, prom_metric_t *metric);
+
+/**
+ * @brief API PRIVATE Starts a length-delimited MetricFamily message, to be ended with prom_protobuf_end()
+ * @param help The help text. It MUST be null-terminated.
+ * @param start Receives the offset of the message body
+ */
+int prom_protobuf_begin_family(prom_string_builder_t *sb, const char *name, size_t name_len, const char *help,
+                               prom_metric_type_t type, size_t *start);
+
+/**
+ * @brief API PRIVATE Appends a counter or gauge Metric message to the family being written.
+ *
+ * Unlike prom_protobuf_load_metric(), the series is given by its label pairs and value rather than by a sample, so
+ * values read at scrape time are encoded without a prom_metric_sample_t. Label values are taken verbatim.
+ */
+int prom_protobuf_load_value(prom_string_builder_t *sb, prom_metric_type_t type, size_t label_count,
+                             const char **label_keys, const char **label_values, double value);
+
+/**
+ * @brief API PRIVATE Appends a counter or gauge Metric message labelled with the label part of an l_value, e.g. to
+ * expose a value derived from a sample, and optionally one more label.
+ * @param labels Either empty or {key="value",...} as written by prom_metric_formatter_load_l_value()
+ * @param key The additional label, or NULL
+ * @param label_value The value of the additional label, taken verbatim
+ */
+int prom_protobuf_load_value_l_value(prom_string_builder_t *sb, prom_metric_type_t type, const char *labels,
+                                     const char *key, const char *label_value, double value);
+
+#endif  // PROM_PROTOBUF_H
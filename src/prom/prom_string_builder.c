@@ -1,8 +1,11 @@
+#include "prom_alloc.h"
 #include "prom_string_builder.h"
 
 // The initial size of a string created via prom_string_builder
 #define PROM_STRING_BUILDER_INIT_SIZE 32
 
+static int prom_string_builder_init(prom_string_builder_t *self);
+
 prom_string_builder_t *prom_string_builder_new(void) {
   int r = 0;
 
@@ -17,7 +20,7 @@ prom_string_builder_t *prom_string_builder_new(void) {
   return self;
 }
 
-int prom_string_builder_init(prom_string_builder_t *self) {
+static int prom_string_builder_init(prom_string_builder_t *self) {
   if (self == NULL) return 1;
   self->str = (char *)prom_malloc(self->init_size);
   *self->str = '\0';
@@ -65,6 +68,40 @@ int prom_string_builder_add_str(prom_string_builder_t *self, const char *str) {
   return 0;
 }
 
+int prom_string_builder_add_data(prom_string_builder_t *self, const char *data, size_t len) {
+  int r = 0;
+
+  if (self == NULL) return 1;
+  if (len == 0) return 0;
+
+  r = prom_string_builder_ensure_space(self, len);
+  if (r) return r;
+
+  memcpy(self->str + self->len, data, len);
+  self->len += len;
+  self->str[self->len] = '\0';
+  return 0;
+}
+
+char *prom_string_builder_reserve(prom_string_builder_t *self, size_t len) {
+  int r = 0;
+
+  if (self == NULL) return NULL;
+  r = prom_string_builder_ensure_space(self, len);
+  if (r) return NULL;
+
+  return self->str + self->len;
+}
+
+int prom_string_builder_commit(prom_string_builder_t *self, size_t len) {
+  if (self == NULL) return 1;
+  if (self->len + len >= self->allocated) return 1;
+
+  self->len += len;
+  self->str[self->len] = '\0';
+  return 0;
+}
+
 int prom_string_builder_add_char(prom_string_builder_t *self, char c) {
   int r = 0;
 
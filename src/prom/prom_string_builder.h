@@ -2,7 +2,6 @@
 #define PROM_STRING_BUILDER_I_H
 
 #include <stddef.h>
-#include "prom_metric.h"
 
 typedef struct prom_string_builder {
   char *str;        /**< the target string  */
@@ -29,6 +28,25 @@ int prom_string_builder_destroy(prom_string_builder_t *self);
  */
 int prom_string_builder_add_str(prom_string_builder_t *self, const char *str);
 
+/**
+ * API PRIVATE
+ * @brief Adds len bytes of data, which may contain NUL bytes
+ */
+int prom_string_builder_add_data(prom_string_builder_t *self, const char *data, size_t len);
+
+/**
+ * API PRIVATE
+ * @brief Ensures len bytes can be written at the end of the string and returns a pointer to them. The bytes only
+ * become part of the string once prom_string_builder_commit() is called. Returns NULL upon failure.
+ */
+char *prom_string_builder_reserve(prom_string_builder_t *self, size_t len);
+
+/**
+ * API PRIVATE
+ * @brief Appends len bytes previously written through the pointer returned by prom_string_builder_reserve()
+ */
+int prom_string_builder_commit(prom_string_builder_t *self, size_t len);
+
 /**
  * API PRIVATE
  * @brief Adds a char
@@ -45,7 +63,7 @@ int prom_string_builder_clear(prom_string_builder_t *self);
  * API PRIVATE
  * @brief Remove data from the end
  */
-int prom_string_buillder_truncate(prom_string_builder_t *self, size_t len);
+int prom_string_builder_truncate(prom_string_builder_t *self, size_t len);
 
 /**
  * API PRIVATE
@@ -0,0 +1,119 @@
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROM_TIMER_HAVE_TSC 1
+#endif
+
+#include "prom_timer.h"
+#include "prom_metric_sample_histogram.h"
+
+// How long the time stamp counter is compared with CLOCK_MONOTONIC to find its frequency
+#define PROM_TIMER_TSC_CALIBRATION_NSEC 10000000
+
+#ifdef CLOCK_MONOTONIC_COARSE
+#define PROM_TIMER_CLOCK_COARSE CLOCK_MONOTONIC_COARSE
+#else
+#define PROM_TIMER_CLOCK_COARSE CLOCK_MONOTONIC
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Static Declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static uint64_t prom_timer_clock_nsec(clockid_t clock);
+
+static double prom_timer_tsc_calibrate(void);
+
+/**
+ * @brief API PRIVATE Seconds per time stamp counter tick. Calibrated once, before the workers are forked.
+ */
+static double prom_timer_tsc_seconds;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// End static declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static uint64_t prom_timer_clock_nsec(clockid_t clock) {
+  struct timespec ts;
+  if (clock_gettime(clock, &ts) != 0) return 0;
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static double prom_timer_tsc_calibrate(void) {
+#ifdef PROM_TIMER_HAVE_TSC
+  uint64_t start_nsec = prom_timer_clock_nsec(CLOCK_MONOTONIC);
+  uint64_t start_tsc = __rdtsc();
+  uint64_t nsec;
+
+  do {
+    nsec = prom_timer_clock_nsec(CLOCK_MONOTONIC);
+  } while (nsec - start_nsec < PROM_TIMER_TSC_CALIBRATION_NSEC);
+
+  uint64_t ticks = __rdtsc() - start_tsc;
+  if (ticks == 0) return 0.0;
+  return (double)(nsec - start_nsec) / 1e9 / (double)ticks;
+#else
+  return 1e-9;
+#endif
+}
+
+uint64_t prom_timer_now(prom_timer_precision_t precision) {
+  switch (precision) {
+    case PROM_TIMER_MSEC:
+      return (uint64_t)ngx_current_msec;
+    case PROM_TIMER_COARSE:
+      return prom_timer_clock_nsec(PROM_TIMER_CLOCK_COARSE);
+    case PROM_TIMER_TSC:
+#ifdef PROM_TIMER_HAVE_TSC
+      return __rdtsc();
+#else
+      return prom_timer_clock_nsec(CLOCK_MONOTONIC);
+#endif
+    default:
+      return 0;
+  }
+}
+
+double prom_timer_tick_seconds(prom_timer_precision_t precision) {
+  switch (precision) {
+    case PROM_TIMER_MSEC:
+      return 1e-3;
+    case PROM_TIMER_COARSE:
+      return 1e-9;
+    case PROM_TIMER_TSC:
+      if (prom_timer_tsc_seconds == 0.0) {
+        prom_timer_tsc_seconds = prom_timer_tsc_calibrate();
+      }
+      return prom_timer_tsc_seconds;
+    default:
+      return 0.0;
+  }
+}
+
+int prom_timer_start(prom_timer_t *handle) {
+  if (handle == NULL || handle->histogram == NULL) return 1;
+
+  prom_histogram_buckets_t *buckets = handle->histogram->buckets;
+  if (buckets->tick_bounds == NULL) return 1;
+
+  handle->start = prom_timer_now(buckets->precision);
+  return 0;
+}
+
+int prom_timer_observe(prom_timer_t *handle) {
+  if (handle == NULL || handle->histogram == NULL) return 1;
+
+  prom_histogram_buckets_t *buckets = handle->histogram->buckets;
+  if (buckets->tick_bounds == NULL) return 1;
+
+  // A duration left out of the sample costs the draw only
+  if (!prom_histogram_buckets_sample(buckets)) return 0;
+
+  uint64_t now = prom_timer_now(buckets->precision);
+
+  // The time stamp counters of different cores may be slightly apart
+  uint64_t ticks = now > handle->start ? now - handle->start : 0;
+
+  return prom_metric_sample_histogram_observe_ticks(handle->histogram, ticks);
+}
@@ -0,0 +1,65 @@
+#ifndef PROM_TIMER_H
+#define PROM_TIMER_H
+
+#include <stdint.h>
+
+#include "ngx_core.h"
+
+/**
+ * @file prom_timer.h
+ * @brief Measures durations in integer clock ticks and records them into a histogram
+ *
+ * The clock is chosen per histogram with prom_histogram_buckets_set_precision(), which converts the bucket upper
+ * bounds into ticks once. Observing a duration then takes two clock reads, an integer subtraction and an integer
+ * search of the bucket, without a floating point conversion of the duration.
+ */
+
+/**
+ * @brief The clocks of a timer, from the cheapest to the most precise
+ */
+typedef enum prom_timer_precision {
+  PROM_TIMER_NONE,   /**< Not timed, prom_timer_start() fails */
+  PROM_TIMER_MSEC,   /**< ngx_current_msec, cached by the event loop. Costs a memory read. */
+  PROM_TIMER_COARSE, /**< CLOCK_MONOTONIC_COARSE in nanoseconds, read from the vDSO at timer interrupt resolution */
+  PROM_TIMER_TSC     /**< The time stamp counter on x86, CLOCK_MONOTONIC in nanoseconds elsewhere */
+} prom_timer_precision_t;
+
+struct prom_metric_sample_histogram;
+
+/**
+ * @brief A running measurement. It is owned by the caller, e.g. kept in a request context.
+ */
+typedef struct prom_timer {
+  struct prom_metric_sample_histogram *histogram; /**< histogram The series the duration is recorded into */
+  uint64_t start;                                 /**< start     The clock reading of prom_timer_start() */
+} prom_timer_t;
+
+/**
+ * @brief Reads the clock
+ * @param precision The clock to read
+ * @return The current time in ticks of the clock
+ */
+uint64_t prom_timer_now(prom_timer_precision_t precision);
+
+/**
+ * @brief Returns the duration of a tick of the clock in seconds, calibrating the time stamp counter on first use
+ * @param precision The clock
+ * @return The duration of a tick, 0 if the clock is not available
+ */
+double prom_timer_tick_seconds(prom_timer_precision_t precision);
+
+/**
+ * @brief Starts measuring a duration with the clock of the histogram
+ * @param handle The timer. Its histogram field MUST be set.
+ * @return Non-zero integer value upon failure, if the histogram is not timed
+ */
+int prom_timer_start(prom_timer_t *handle);
+
+/**
+ * @brief Records the duration since prom_timer_start() into the histogram, if a sampled histogram draws it
+ * @param handle The started timer
+ * @return Non-zero integer value upon failure
+ */
+int prom_timer_observe(prom_timer_t *handle);
+
+#endif  // PROM_TIMER_H
@@ -0,0 +1,296 @@
+#include "prom_hash.h"
+#include "prom_metric_sample.h"
+#include "prom_topk.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Static Declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static size_t prom_topk_find(prom_topk_t *self, prom_topk_shard_t *shard, uint64_t hash, const char *key, size_t len);
+
+static void prom_topk_table_remove(prom_topk_t *self, prom_topk_shard_t *shard, size_t slot);
+
+static void prom_topk_sift_up(prom_topk_shard_t *shard, uint32_t pos);
+
+static void prom_topk_sift_down(prom_topk_shard_t *shard, uint32_t pos);
+
+static prom_topk_shard_t *prom_topk_shard(prom_topk_t *self);
+
+static int prom_topk_compare(const void *a, const void *b);
+
+static int prom_topk_compare_key(const void *a, const void *b);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// End static declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief API PRIVATE Returns the table slot of the key, or the empty slot where it belongs. The table is never full.
+ */
+static size_t prom_topk_find(prom_topk_t *self, prom_topk_shard_t *shard, uint64_t hash, const char *key, size_t len) {
+  size_t slot = hash & self->table_mask;
+
+  while (shard->table[slot] != 0) {
+    prom_topk_entry_t *entry = &shard->entries[shard->table[slot] - 1];
+
+    if (entry->hash == hash && ngx_strncmp(entry->key, key, len) == 0 && entry->key[len] == '\0') return slot;
+
+    slot = (slot + 1) & self->table_mask;
+  }
+
+  return slot;
+}
+
+/**
+ * @brief API PRIVATE Empties a table slot, moving back the following entries that would no longer be found
+ */
+static void prom_topk_table_remove(prom_topk_t *self, prom_topk_shard_t *shard, size_t slot) {
+  size_t next = slot;
+
+  for (;;) {
+    shard->table[slot] = 0;
+
+    for (;;) {
+      next = (next + 1) & self->table_mask;
+      if (shard->table[next] == 0) return;
+
+      // The entry stays if its home slot lies cyclically in (slot, next]
+      size_t home = shard->entries[shard->table[next] - 1].hash & self->table_mask;
+      if (slot <= next ? (slot < home && home <= next) : (slot < home || home <= next)) continue;
+
+      break;
+    }
+
+    shard->table[slot] = shard->table[next];
+    slot = next;
+  }
+}
+
+static void prom_topk_sift_up(prom_topk_shard_t *shard, uint32_t pos) {
+  uint32_t index = shard->heap[pos];
+  double count = shard->entries[index].count;
+
+  while (pos > 0) {
+    uint32_t parent = (pos - 1) / 2;
+    if (shard->entries[shard->heap[parent]].count <= count) break;
+
+    shard->heap[pos] = shard->heap[parent];
+    shard->entries[shard->heap[pos]].heap = pos;
+    pos = parent;
+  }
+
+  shard->heap[pos] = index;
+  shard->entries[index].heap = pos;
+}
+
+static void prom_topk_sift_down(prom_topk_shard_t *shard, uint32_t pos) {
+  uint32_t index = shard->heap[pos];
+  double count = shard->entries[index].count;
+  uint32_t size = (uint32_t)shard->size;
+
+  for (;;) {
+    uint32_t child = 2 * pos + 1;
+    if (child >= size) break;
+
+    if (child + 1 < size && shard->entries[shard->heap[child + 1]].count < shard->entries[shard->heap[child]].count) {
+      child++;
+    }
+    if (count <= shard->entries[shard->heap[child]].count) break;
+
+    shard->heap[pos] = shard->heap[child];
+    shard->entries[shard->heap[pos]].heap = pos;
+    pos = child;
+  }
+
+  shard->heap[pos] = index;
+  shard->entries[index].heap = pos;
+}
+
+/**
+ * @brief API PRIVATE Returns the shard of the executing worker. The master and the helper processes share the first.
+ */
+static prom_topk_shard_t *prom_topk_shard(prom_topk_t *self) {
+  return &self->shards[ngx_worker < self->shard_count ? ngx_worker : 0];
+}
+
+static int prom_topk_compare(const void *a, const void *b) {
+  const prom_topk_entry_t *entry_a = (const prom_topk_entry_t *)a;
+  const prom_topk_entry_t *entry_b = (const prom_topk_entry_t *)b;
+
+  if (entry_a->count != entry_b->count) return entry_a->count < entry_b->count ? 1 : -1;
+  return strcmp(entry_a->key, entry_b->key);
+}
+
+static int prom_topk_compare_key(const void *a, const void *b) {
+  const prom_topk_entry_t *entry_a = (const prom_topk_entry_t *)a;
+  const prom_topk_entry_t *entry_b = (const prom_topk_entry_t *)b;
+
+  if (entry_a->hash != entry_b->hash) return entry_a->hash < entry_b->hash ? -1 : 1;
+  return strcmp(entry_a->key, entry_b->key);
+}
+
+prom_topk_t *prom_topk_new(ngx_slab_pool_t *shpool, size_t k, size_t capacity, size_t shard_count) {
+  if (k == 0 || capacity < k || capacity > PROM_TOPK_CAPACITY_MAX || shard_count == 0) return NULL;
+
+  prom_topk_t *self = (prom_topk_t *)ngx_slab_calloc(shpool, sizeof(prom_topk_t));
+  if (self == NULL) return NULL;
+
+  self->shpool = shpool;
+  self->k = k;
+  self->capacity = capacity;
+
+  size_t table_size = 1;
+  while (table_size < 2 * capacity) table_size <<= 1;
+  self->table_mask = table_size - 1;
+
+  self->shards = (prom_topk_shard_t *)ngx_slab_calloc(shpool, sizeof(prom_topk_shard_t) * shard_count);
+  if (self->shards == NULL) {
+    prom_topk_destroy(self);
+    return NULL;
+  }
+  self->shard_count = shard_count;
+
+  for (size_t i = 0; i < shard_count; i++) {
+    prom_topk_shard_t *shard = &self->shards[i];
+
+    shard->entries = (prom_topk_entry_t *)ngx_slab_calloc(shpool, sizeof(prom_topk_entry_t) * capacity);
+    shard->heap = (uint32_t *)ngx_slab_calloc(shpool, sizeof(uint32_t) * capacity);
+    shard->table = (uint32_t *)ngx_slab_calloc(shpool, sizeof(uint32_t) * table_size);
+    if (shard->entries == NULL || shard->heap == NULL || shard->table == NULL) {
+      prom_topk_destroy(self);
+      return NULL;
+    }
+  }
+
+  return self;
+}
+
+int prom_topk_destroy(prom_topk_t *self) {
+  if (self == NULL) return 0;
+
+  for (size_t i = 0; i < self->shard_count; i++) {
+    prom_topk_shard_t *shard = &self->shards[i];
+
+    if (shard->entries != NULL) ngx_slab_free(self->shpool, shard->entries);
+    if (shard->heap != NULL) ngx_slab_free(self->shpool, shard->heap);
+    if (shard->table != NULL) ngx_slab_free(self->shpool, shard->table);
+  }
+
+  if (self->shards != NULL) ngx_slab_free(self->shpool, self->shards);
+
+  ngx_slab_free(self->shpool, self);
+  return 0;
+}
+
+int prom_topk_add(prom_topk_t *self, const char *key, size_t len, double value) {
+  if (self == NULL || key == NULL || !(value >= 0)) return 1;
+
+  if (len > PROM_TOPK_KEY_LEN - 1) len = PROM_TOPK_KEY_LEN - 1;
+
+  uint64_t hash = prom_hash(key, len);
+
+  // Only a scrape contends for the lock of the shard
+  prom_topk_shard_t *shard = prom_topk_shard(self);
+
+  ngx_rwlock_wlock(&shard->lock);
+
+  size_t slot = prom_topk_find(self, shard, hash, key, len);
+  prom_topk_entry_t *entry;
+
+  if (shard->table[slot] != 0) {
+    entry = &shard->entries[shard->table[slot] - 1];
+    entry->count += value;
+    prom_topk_sift_down(shard, entry->heap);
+
+  } else if (shard->size < self->capacity) {
+    uint32_t index = (uint32_t)shard->size++;
+
+    entry = &shard->entries[index];
+    entry->hash = hash;
+    entry->count = value;
+    entry->error = 0.0;
+    ngx_memcpy(entry->key, key, len);
+    entry->key[len] = '\0';
+
+    shard->table[slot] = index + 1;
+    shard->heap[index] = index;
+    prom_topk_sift_up(shard, index);
+
+  } else {
+    // The key replaces the one of the lowest count and inherits the count as its error
+    uint32_t index = shard->heap[0];
+
+    entry = &shard->entries[index];
+    prom_topk_table_remove(self, shard,
+                           prom_topk_find(self, shard, entry->hash, entry->key, ngx_strlen(entry->key)));
+
+    entry->hash = hash;
+    entry->error = entry->count;
+    entry->count += value;
+    ngx_memcpy(entry->key, key, len);
+    entry->key[len] = '\0';
+
+    // The removal may have moved the entries of the probe sequence
+    shard->table[prom_topk_find(self, shard, hash, key, len)] = index + 1;
+    prom_topk_sift_down(shard, 0);
+  }
+
+  ngx_rwlock_unlock(&shard->lock);
+
+  prom_metric_sample_updated = 1;
+  return 0;
+}
+
+size_t prom_topk_snapshot(prom_topk_t *self, prom_topk_entry_t *entries) {
+  if (self == NULL) return 0;
+
+  // Each entry keeps its count above the lowest count of its shard if the shard is full, 0 otherwise. A key then
+  // counts the sum of these excesses over the shards that monitor it plus the lowest counts of all shards.
+  size_t n = 0;
+  double lowest = 0.0;
+
+  for (size_t i = 0; i < self->shard_count; i++) {
+    prom_topk_shard_t *shard = &self->shards[i];
+
+    ngx_rwlock_rlock(&shard->lock);
+
+    size_t size = shard->size;
+    ngx_memcpy(&entries[n], shard->entries, sizeof(prom_topk_entry_t) * size);
+    double min = size == self->capacity ? shard->entries[shard->heap[0]].count : 0.0;
+
+    ngx_rwlock_unlock(&shard->lock);
+
+    for (size_t j = n; j < n + size; j++) {
+      entries[j].count -= min;
+      entries[j].error -= min;
+    }
+
+    lowest += min;
+    n += size;
+  }
+
+  // The entries of a key in several shards are adjacent once ordered by key
+  if (self->shard_count > 1) {
+    qsort(entries, n, sizeof(prom_topk_entry_t), &prom_topk_compare_key);
+  }
+
+  size_t size = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (size > 0 && prom_topk_compare_key(&entries[size - 1], &entries[i]) == 0) {
+      entries[size - 1].count += entries[i].count;
+      entries[size - 1].error += entries[i].error;
+      continue;
+    }
+
+    if (size != i) entries[size] = entries[i];
+    size++;
+  }
+
+  for (size_t i = 0; i < size; i++) {
+    entries[i].count += lowest;
+    entries[i].error += lowest;
+  }
+
+  qsort(entries, size, sizeof(prom_topk_entry_t), &prom_topk_compare);
+  return size;
+}
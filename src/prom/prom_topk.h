@@ -0,0 +1,105 @@
+#ifndef PROM_TOPK_H
+#define PROM_TOPK_H
+
+#include <stdint.h>
+
+#include "ngx_core.h"
+
+/**
+ * @file prom_topk.h
+ * @brief Heavy hitters of an unbounded key space with the Space-Saving algorithm
+ *
+ * A sketch monitors a fixed number of keys, its capacity. A monitored key adds the value to its count. A new key
+ * replaces the key of the lowest count and inherits that count, which becomes its error: a count overestimates the
+ * true sum of a key by at most its error, and every key whose sum exceeds the total divided by the capacity is
+ * monitored. The larger the capacity relative to the K keys exposed, the more accurate their order. The count of a key
+ * never decreases while it is monitored, and a key coming back starts above the count it was evicted with.
+ *
+ * The counts are kept in a min-heap and the keys are found through an open-addressing table of their hashes. Each
+ * worker updates a sketch of its own, a shard, so an update hashes the key once and takes O(log capacity) under a lock
+ * no other worker takes. A scrape merges the shards: a key counts in each shard either its count there or, if the shard
+ * is full and does not monitor it, the lowest count of the shard, which bounds its evicted sum. Memory depends on the
+ * capacity and the workers only.
+ *
+ * Reference: Metwally, Agrawal, El Abbadi. Efficient Computation of Frequent and Top-k Elements in Data Streams.
+ */
+
+/**
+ * @brief The longest key kept, including the terminating null character. Longer keys are truncated and the truncated
+ * keys are counted as one.
+ */
+#define PROM_TOPK_KEY_LEN 128
+
+/**
+ * @brief The largest capacity of a sketch
+ */
+#define PROM_TOPK_CAPACITY_MAX 65536
+
+/**
+ * @brief A monitored key
+ */
+typedef struct prom_topk_entry {
+  uint64_t hash;                /**< hash  The hash of the key */
+  double count;                 /**< count The estimated sum of the values of the key */
+  double error;                 /**< error The most count may overestimate the true sum by */
+  uint32_t heap;                /**< heap  The position of the entry in the heap */
+  char key[PROM_TOPK_KEY_LEN];  /**< key   The key, null-terminated */
+} prom_topk_entry_t;
+
+/**
+ * @brief API PRIVATE The sketch of one worker
+ */
+typedef struct prom_topk_shard {
+  size_t size;                 /**< size    The number of entries in use */
+  prom_topk_entry_t *entries;  /**< entries capacity entries */
+  uint32_t *heap;              /**< heap    Entry indices, a min-heap on the counts */
+  uint32_t *table;             /**< table   Entry indices plus one by hash, zero for an empty slot */
+  ngx_atomic_t lock;           /**< lock    Guards the shard against the scrapes */
+} prom_topk_shard_t;
+
+/**
+ * @brief A Space-Saving sketch in shared memory, sharded by worker
+ */
+typedef struct prom_topk {
+  size_t k;                    /**< k           The number of keys exposed */
+  size_t capacity;             /**< capacity    The number of keys monitored by each shard */
+  size_t table_mask;           /**< table_mask  The table size minus one, a power of two above twice the capacity */
+  size_t shard_count;          /**< shard_count The number of shards */
+  prom_topk_shard_t *shards;   /**< shards      One shard per worker */
+  ngx_slab_pool_t *shpool;
+} prom_topk_t;
+
+/**
+ * @brief API PRIVATE Creates a sketch
+ * @param shpool The slab pool of the zone
+ * @param k The number of keys exposed
+ * @param capacity The number of keys monitored by each shard, at least k and at most PROM_TOPK_CAPACITY_MAX
+ * @param shard_count The number of workers
+ * @return The prom_topk_t*, NULL upon failure
+ */
+prom_topk_t *prom_topk_new(ngx_slab_pool_t *shpool, size_t k, size_t capacity, size_t shard_count);
+
+/**
+ * @brief API PRIVATE Destroys a sketch
+ */
+int prom_topk_destroy(prom_topk_t *self);
+
+/**
+ * @brief Adds a value, e.g. 1 per request or the bytes sent, to the count of a key in the shard of the worker
+ * @param self The target prom_topk_t*
+ * @param key The key, it need not be null-terminated
+ * @param len The length of the key
+ * @param value A non-negative value
+ * @return Non-zero integer value upon failure or if the value is negative or not a number
+ */
+int prom_topk_add(prom_topk_t *self, const char *key, size_t len, double value);
+
+/**
+ * @brief API PRIVATE Merges the shards into the monitored keys by decreasing count
+ * @param self The target prom_topk_t*
+ * @param entries Receives up to capacity * shard_count entries
+ * @return The number of entries copied
+ */
+size_t prom_topk_snapshot(prom_topk_t *self, prom_topk_entry_t *entries);
+
+#endif  // PROM_TOPK_H
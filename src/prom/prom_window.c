@@ -0,0 +1,226 @@
+#include <math.h>
+
+#include "prom_atomic.h"
+#include "prom_histogram_buckets.h"
+#include "prom_metric_sample.h"
+#include "prom_window.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Static Declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief API PRIVATE A bit per slot, set for the slots a read covers
+ */
+typedef uint64_t prom_window_slots_t[(PROM_WINDOW_SECONDS_MAX + 1 + 63) / 64];
+
+static int64_t prom_window_slot(prom_window_t *self, int64_t second);
+
+static int prom_window_merge(prom_window_t *self, uint32_t seconds, prom_window_slots_t slots, uint64_t *count,
+                             double *sum);
+
+static uint64_t prom_window_bucket(prom_window_t *self, prom_window_slots_t slots, size_t bucket);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// End static declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief API PRIVATE Returns the slot of the second, clearing it if it still holds an older second. -1 while another
+ * process clears it, the update is then not counted in the window.
+ */
+static int64_t prom_window_slot(prom_window_t *self, int64_t second) {
+  int64_t slot = second % self->slot_count;
+  int claim = prom_atomic_claim(&self->stamps[slot], second);
+
+  if (claim == 0) return slot;
+  if (claim == -1) return -1;
+
+  atomic_store_explicit(&self->sums[slot], 0.0, memory_order_relaxed);
+  if (self->counts != NULL) {
+    for (size_t i = 0; i < self->bucket_count; i++) {
+      atomic_store_explicit(&self->counts[slot * self->bucket_count + i], 0, memory_order_relaxed);
+    }
+  }
+
+  prom_atomic_publish(&self->stamps[slot], second);
+  return slot;
+}
+
+prom_window_t *prom_window_new(ngx_slab_pool_t *shpool, uint32_t seconds, struct prom_histogram_buckets *buckets) {
+  if (seconds == 0 || seconds > PROM_WINDOW_SECONDS_MAX) return NULL;
+
+  prom_window_t *self = (prom_window_t *)ngx_slab_calloc(shpool, sizeof(prom_window_t));
+  if (self == NULL) return NULL;
+
+  self->shpool = shpool;
+  self->seconds = seconds;
+  self->slot_count = seconds + 1;
+  self->buckets = buckets;
+
+  self->stamps = (_Atomic int64_t *)ngx_slab_calloc(shpool, sizeof(_Atomic int64_t) * self->slot_count);
+  self->sums = (_Atomic double *)ngx_slab_calloc(shpool, sizeof(_Atomic double) * self->slot_count);
+  if (self->stamps == NULL || self->sums == NULL) {
+    prom_window_destroy(self);
+    return NULL;
+  }
+
+  if (buckets != NULL) {
+    self->bucket_count = prom_histogram_buckets_count(buckets) + 1;
+    self->counts =
+        (_Atomic uint64_t *)ngx_slab_calloc(shpool, sizeof(_Atomic uint64_t) * self->slot_count * self->bucket_count);
+    if (self->counts == NULL) {
+      prom_window_destroy(self);
+      return NULL;
+    }
+  }
+
+  return self;
+}
+
+int prom_window_destroy(prom_window_t *self) {
+  if (self == NULL) return 0;
+
+  if (self->stamps != NULL) ngx_slab_free(self->shpool, (void *)self->stamps);
+  if (self->sums != NULL) ngx_slab_free(self->shpool, (void *)self->sums);
+  if (self->counts != NULL) ngx_slab_free(self->shpool, (void *)self->counts);
+
+  ngx_slab_free(self->shpool, self);
+  return 0;
+}
+
+int prom_window_add(prom_window_t *self, double value) {
+  if (self == NULL) return 1;
+
+  int64_t slot = prom_window_slot(self, (int64_t)ngx_time());
+  if (slot == -1) return 0;
+
+  prom_atomic_add_double(&self->sums[slot], value);
+  return 0;
+}
+
+int prom_window_observe(prom_window_t *self, size_t bucket, double value, uint64_t count) {
+  if (self == NULL || self->counts == NULL || bucket >= self->bucket_count) return 1;
+
+  int64_t slot = prom_window_slot(self, (int64_t)ngx_time());
+  if (slot == -1) return 0;
+
+  atomic_fetch_add_explicit(&self->counts[slot * self->bucket_count + bucket], count, memory_order_relaxed);
+  prom_atomic_add_double(&self->sums[slot], value * count);
+  return 0;
+}
+
+/**
+ * @brief API PRIVATE Adds up the slots of the last seconds before the current one
+ * @param slots Receives the slots covered, or NULL
+ * @param count Receives the number of observations, 0 for a counter
+ * @param sum Receives the sum of the values
+ */
+static int prom_window_merge(prom_window_t *self, uint32_t seconds, prom_window_slots_t slots, uint64_t *count,
+                             double *sum) {
+  if (self == NULL) return 1;
+
+  if (seconds > self->seconds) seconds = self->seconds;
+
+  int64_t now = (int64_t)ngx_time();
+
+  *count = 0;
+  *sum = 0.0;
+  if (slots != NULL) ngx_memzero(slots, sizeof(prom_window_slots_t));
+
+  for (uint32_t i = 1; i <= seconds; i++) {
+    int64_t second = now - i;
+    int64_t slot = second % self->slot_count;
+
+    // A slot stamped with another second is stale or being cleared
+    if (atomic_load_explicit(&self->stamps[slot], memory_order_acquire) != second) continue;
+
+    if (slots != NULL) slots[slot / 64] |= (uint64_t)1 << (slot % 64);
+
+    *sum += atomic_load_explicit(&self->sums[slot], memory_order_relaxed);
+
+    if (self->counts == NULL) continue;
+
+    for (size_t b = 0; b < self->bucket_count; b++) {
+      *count += atomic_load_explicit(&self->counts[slot * self->bucket_count + b], memory_order_relaxed);
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @brief API PRIVATE Adds up the count of a bucket in the slots covered
+ */
+static uint64_t prom_window_bucket(prom_window_t *self, prom_window_slots_t slots, size_t bucket) {
+  uint64_t count = 0;
+
+  for (size_t slot = 0; slot < self->slot_count; slot++) {
+    if (!(slots[slot / 64] & ((uint64_t)1 << (slot % 64)))) continue;
+    count += atomic_load_explicit(&self->counts[slot * self->bucket_count + bucket], memory_order_relaxed);
+  }
+
+  return count;
+}
+
+int prom_window_read(prom_window_t *self, uint32_t seconds, uint64_t *count, double *sum) {
+  uint64_t c;
+  double s;
+
+  if (prom_window_merge(self, seconds, NULL, &c, &s)) return 1;
+
+  if (count != NULL) *count = c;
+  if (sum != NULL) *sum = s;
+  return 0;
+}
+
+double prom_window_rate(prom_window_t *self, uint32_t seconds) {
+  uint64_t count;
+  double sum;
+
+  if (self == NULL || seconds == 0) return NAN;
+  if (seconds > self->seconds) seconds = self->seconds;
+
+  if (self->counts == NULL) {
+    if (prom_window_read(self, seconds, NULL, &sum)) return NAN;
+    return sum / seconds;
+  }
+
+  if (prom_window_read(self, seconds, &count, NULL)) return NAN;
+  return (double)count / seconds;
+}
+
+double prom_window_quantile(prom_window_t *self, uint32_t seconds, double q) {
+  prom_window_slots_t slots;
+  uint64_t total;
+  double sum;
+
+  if (self == NULL || self->counts == NULL || !(q >= 0.0 && q <= 1.0)) return NAN;
+
+  // The buckets are added up one at a time over the slots covered, a read allocates nothing
+  if (prom_window_merge(self, seconds, slots, &total, &sum) || total == 0) return NAN;
+
+  const double *bounds = self->buckets->upper_bounds;
+  size_t last = self->bucket_count - 1;
+  double rank = q * (double)total;
+  uint64_t below = 0;
+  uint64_t count = prom_window_bucket(self, slots, 0);
+  size_t b = 0;
+
+  while (b < last && (double)(below + count) < rank) {
+    below += count;
+    b++;
+    count = prom_window_bucket(self, slots, b);
+  }
+
+  if (b == last) {
+    // Above every bound, or a histogram without classic buckets
+    return last == 0 ? NAN : bounds[last - 1];
+  }
+
+  // The first bucket starts at 0, unless its bound is not positive
+  double lower = b == 0 ? (bounds[0] > 0.0 ? 0.0 : bounds[0]) : bounds[b - 1];
+  double upper = bounds[b];
+
+  return count == 0 ? upper : lower + (upper - lower) * ((rank - (double)below) / (double)count);
+}
@@ -0,0 +1,107 @@
+#ifndef PROM_WINDOW_H
+#define PROM_WINDOW_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "ngx_core.h"
+
+struct prom_histogram_buckets;
+
+/**
+ * @file prom_window.h
+ * @brief Sliding windows of per-second counts
+ *
+ * A window is a ring of one slot per second, plus one for the second in progress. A slot holds the sum of the values
+ * counted during its second and, for a histogram, one non-cumulative count per bucket. The first update of a slot in a
+ * new second clears it, so the ring rotates lazily with the writes and needs no timer: a read only takes the slots
+ * stamped with one of the seconds it covers, and slots left over from seconds without updates are skipped.
+ *
+ * Reads cover whole seconds and leave out the second in progress, e.g. the rate over the last 10 seconds is the sum of
+ * the 10 slots before the current one divided by 10. Memory is (seconds + 1) * (bucket count + 3) * 8 bytes per
+ * series, e.g. 7KB for a 60s window on 12 buckets.
+ */
+
+/**
+ * @brief The longest window
+ */
+#define PROM_WINDOW_SECONDS_MAX 3600
+
+/**
+ * @brief The quantiles exposed for the window of every series of a windowed histogram
+ */
+#define PROM_WINDOW_QUANTILES {0.5, 0.9, 0.99}
+#define PROM_WINDOW_QUANTILE_COUNT 3
+
+/**
+ * @brief A ring of per-second slots in shared memory
+ */
+typedef struct prom_window {
+  uint32_t seconds;                        /**< seconds      The seconds of the window */
+  uint32_t slot_count;                     /**< slot_count   seconds + 1, the slot of the second in progress */
+  size_t bucket_count;                     /**< bucket_count The counts per slot, the buckets and the one above */
+  struct prom_histogram_buckets *buckets;  /**< buckets      The buckets of a histogram, not owned, or NULL */
+  _Atomic int64_t *stamps;                 /**< stamps       The second of each slot, 0 before any, -1 if cleared */
+  _Atomic double *sums;                    /**< sums         The sum of the values of each slot */
+  _Atomic uint64_t *counts;                /**< counts       bucket_count counts per slot, NULL for a counter */
+  ngx_slab_pool_t *shpool;
+} prom_window_t;
+
+/**
+ * @brief API PRIVATE Creates a window
+ * @param shpool The slab pool of the zone
+ * @param seconds From 1 to PROM_WINDOW_SECONDS_MAX
+ * @param buckets The buckets of a histogram, referenced for the lifetime of the window, or NULL for a counter
+ * @return The prom_window_t*, NULL upon failure
+ */
+prom_window_t *prom_window_new(ngx_slab_pool_t *shpool, uint32_t seconds, struct prom_histogram_buckets *buckets);
+
+/**
+ * @brief API PRIVATE Destroys a window
+ */
+int prom_window_destroy(prom_window_t *self);
+
+/**
+ * @brief API PRIVATE Adds the increment of a counter to the current second
+ * @return Non-zero integer value upon failure
+ */
+int prom_window_add(prom_window_t *self, double value);
+
+/**
+ * @brief API PRIVATE Counts the observation of a histogram in a bucket of the current second
+ * @param bucket The index of the non-cumulative bucket, as returned by prom_histogram_buckets_index()
+ * @param count The observations the value stands for, 1 unless the histogram is sampled
+ * @return Non-zero integer value upon failure
+ */
+int prom_window_observe(prom_window_t *self, size_t bucket, double value, uint64_t count);
+
+/**
+ * @brief Reads the last seconds before the current one
+ * @param self The target prom_window_t*
+ * @param seconds The seconds read, at most the seconds of the window
+ * @param count Receives the number of observations of a histogram, 0 for a counter. May be NULL.
+ * @param sum Receives the sum of the values. May be NULL.
+ * @return Non-zero integer value upon failure
+ */
+int prom_window_read(prom_window_t *self, uint32_t seconds, uint64_t *count, double *sum);
+
+/**
+ * @brief Returns the increase of a counter per second, or the observations of a histogram per second, over the last
+ * seconds before the current one
+ */
+double prom_window_rate(prom_window_t *self, uint32_t seconds);
+
+/**
+ * @brief Estimates a quantile of the observations of a histogram over the last seconds before the current one
+ *
+ * As histogram_quantile() in PromQL, the value is interpolated linearly within the bucket holding the quantile, and a
+ * quantile above the last bound is the last bound.
+ *
+ * @param self The target prom_window_t*
+ * @param seconds The seconds read, at most the seconds of the window
+ * @param q The quantile, between 0 and 1
+ * @return The estimate, NaN without observations or for a counter
+ */
+double prom_window_quantile(prom_window_t *self, uint32_t seconds, double q);
+
+#endif  // PROM_WINDOW_H
@@ -0,0 +1,121 @@
+use Test::Nginx::Socket 'no_plan';
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: the estimate of 1000 keys is within 20% at precision 8
+--- main_config
+prometheus_zone 1m;
+prometheus_distinct users "Users" precision=8;
+--- config
+    location = /observe {
+        prometheus_observe users $arg_k;
+        return 204;
+    }
+
+    location = /metrics {
+        prometheus;
+    }
+--- pipelined_requests eval
+[(map { "GET /observe?k=user$_" } 1 .. 1000), "GET /metrics?name[]=users"]
+--- response_body_like eval
+[("") x 1000, qr/\nusers (?:[89]\d\d|1[01]\d\d|1200)(?:\.\d+)?\n\z/]
+
+
+
+=== TEST 2: the small-range correction counts 1000 keys within 4% at precision 12
+--- main_config
+prometheus_zone 1m;
+prometheus_distinct users "Users";
+--- config
+    location = /observe {
+        prometheus_observe users $arg_k;
+        return 204;
+    }
+
+    location = /metrics {
+        prometheus;
+    }
+--- pipelined_requests eval
+[(map { "GET /observe?k=user$_" } 1 .. 1000), "GET /metrics?name[]=users"]
+--- response_body_like eval
+[("") x 1000, qr/\nusers (?:9[6-9]\d|10[0-3]\d|1040)(?:\.\d+)?\n\z/]
+
+
+
+=== TEST 3: repeated keys are counted once
+--- main_config
+prometheus_zone 1m;
+prometheus_distinct users "Users";
+--- config
+    location = /observe {
+        prometheus_observe users $arg_k;
+        return 204;
+    }
+
+    location = /metrics {
+        prometheus;
+    }
+--- pipelined_requests eval
+[(map { "GET /observe?k=user" . ($_ % 10) } 1 .. 100), "GET /metrics?name[]=users"]
+--- response_body_like eval
+[("") x 100, qr/\nusers (?:9|10|11)(?:\.\d+)?\n\z/]
+
+
+
+=== TEST 4: a windowed count keeps the keys of the previous period
+--- http_config
+limit_req_zone $server_name zone=wait:1m rate=60r/m;
+--- main_config
+prometheus_zone 1m;
+prometheus_distinct users "Users" window=4s;
+--- config
+    location = /observe {
+        prometheus_observe users $arg_k;
+        return 204;
+    }
+
+    location = /wait {
+        limit_req zone=wait burst=1;
+        return 204;
+    }
+
+    location = /metrics {
+        prometheus;
+    }
+--- pipelined_requests eval
+[(map { "GET /observe?k=user$_" } 1 .. 10), "GET /wait", "GET /wait",
+ "GET /metrics?name[]=users"]
+--- response_body_like eval
+[("") x 12, qr/\nusers (?:9|10|11)(?:\.\d+)?\n\z/]
+
+
+
+=== TEST 5: a windowed count forgets the keys once the window has rotated
+--- http_config
+limit_req_zone $server_name zone=wait:1m rate=10r/m;
+--- main_config
+prometheus_zone 1m;
+prometheus_distinct users "Users" window=4s;
+--- config
+    location = /observe {
+        prometheus_observe users $arg_k;
+        return 204;
+    }
+
+    location = /wait {
+        limit_req zone=wait burst=1;
+        return 204;
+    }
+
+    location = /metrics {
+        prometheus;
+    }
+--- pipelined_requests eval
+[(map { "GET /observe?k=user$_" } 1 .. 10), "GET /wait", "GET /wait",
+ "GET /metrics?name[]=users"]
+--- response_body_like eval
+[("") x 12, qr/\nusers 0\n\z/]
+--- timeout: 10
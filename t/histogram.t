@@ -0,0 +1,110 @@
+use Test::Nginx::Socket 'no_plan';
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: le of a large bound reads as a float
+--- main_config
+prometheus_zone 1m;
+prometheus_histogram request_bytes "Request bytes" buckets=1000,1000000,1e20;
+--- config
+    location = /observe {
+        prometheus_observe request_bytes 5000;
+        return 204;
+    }
+
+    location = /metrics {
+        prometheus;
+    }
+--- pipelined_requests eval
+["GET /observe", "GET /metrics"]
+--- response_body_like eval
+["", qr/request_bytes_bucket\{le="1000\.0"\} 0\nrequest_bytes_bucket\{le="1000000\.0"\} 1\nrequest_bytes_bucket\{le="1e\+20"\} 1\n/]
+
+
+
+=== TEST 2: le of a fractional bound reads back as the same double
+--- main_config
+prometheus_zone 1m;
+prometheus_histogram latency_seconds "Latency" buckets=0.005,0.30000000000000004;
+--- config
+    location = /observe {
+        prometheus_observe latency_seconds 0.1;
+        return 204;
+    }
+
+    location = /metrics {
+        prometheus;
+    }
+--- pipelined_requests eval
+["GET /observe", "GET /metrics"]
+--- response_body_like eval
+["", qr/latency_seconds_bucket\{le="0\.005"\} 0\nlatency_seconds_bucket\{le="0\.30000000000000004"\} 1\n/]
+
+
+
+=== TEST 3: log-linear le bounds are exact at powers of two and sub-bucket edges
+--- main_config
+prometheus_zone 1m;
+prometheus_histogram latency "Latency" log_buckets=1,8,4;
+--- config
+    location = /observe {
+        prometheus_observe latency $arg_v;
+        return 204;
+    }
+
+    location = /metrics {
+        prometheus;
+    }
+--- pipelined_requests eval
+["GET /observe?v=2", "GET /observe?v=2.5", "GET /observe?v=2.5000001",
+ "GET /observe?v=8", "GET /metrics"]
+--- response_body_like eval
+["", "", "", "",
+ qr/latency_bucket\{le="1\.0"\} 0\nlatency_bucket\{le="1\.25"\} 0\nlatency_bucket\{le="1\.5"\} 0\nlatency_bucket\{le="1\.75"\} 0\nlatency_bucket\{le="2\.0"\} 1\nlatency_bucket\{le="2\.5"\} 2\nlatency_bucket\{le="3\.0"\} 3\nlatency_bucket\{le="3\.5"\} 3\nlatency_bucket\{le="4\.0"\} 3\nlatency_bucket\{le="5\.0"\} 3\nlatency_bucket\{le="6\.0"\} 3\nlatency_bucket\{le="7\.0"\} 3\nlatency_bucket\{le="8\.0"\} 4\nlatency_bucket\{le="\+Inf"\} 4\nlatency_count 4\n/]
+
+
+
+=== TEST 4: log-linear values below the range fall into the first bucket
+--- main_config
+prometheus_zone 1m;
+prometheus_histogram latency "Latency" log_buckets=1,8,4;
+--- config
+    location = /observe {
+        prometheus_observe latency $arg_v;
+        return 204;
+    }
+
+    location = /metrics {
+        prometheus;
+    }
+--- pipelined_requests eval
+["GET /observe?v=1", "GET /observe?v=0.5", "GET /observe?v=0",
+ "GET /observe?v=-1", "GET /observe?v=9", "GET /metrics"]
+--- response_body_like eval
+["", "", "", "", "",
+ qr/latency_bucket\{le="1\.0"\} 4\n.*latency_bucket\{le="8\.0"\} 4\nlatency_bucket\{le="\+Inf"\} 5\nlatency_count 5\n/s]
+
+
+
+=== TEST 5: log-linear histograms skip NaN and infinite values
+--- main_config
+prometheus_zone 1m;
+prometheus_histogram latency "Latency" log_buckets=1,8,4;
+--- config
+    location = /observe {
+        prometheus_observe latency $arg_v;
+        return 204;
+    }
+
+    location = /metrics {
+        prometheus;
+    }
+--- pipelined_requests eval
+["GET /observe?v=NaN", "GET /observe?v=Inf", "GET /observe?v=-Inf",
+ "GET /observe?v=3", "GET /metrics"]
+--- response_body_like eval
+["", "", "", "",
+ qr/latency_bucket\{le="1\.0"\} 0\n.*latency_bucket\{le="3\.0"\} 1\n.*latency_bucket\{le="\+Inf"\} 1\nlatency_count 1\nlatency_sum 3\n/s]
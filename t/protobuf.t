@@ -0,0 +1,152 @@
+use Test::Nginx::Socket 'no_plan';
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: the Accept header of Prometheus selects protobuf
+--- main_config
+prometheus_zone 1m;
+--- config
+    location = /metrics {
+        prometheus;
+    }
+--- request
+GET /metrics
+--- more_headers
+Accept: application/vnd.google.protobuf;proto=io.prometheus.client.MetricFamily;encoding=delimited;q=0.7,text/plain;version=0.0.4;q=0.3,*/*;q=0.1
+--- response_headers
+Content-Type: application/vnd.google.protobuf; proto=io.prometheus.client.MetricFamily; encoding=delimited
+Vary: Accept, Accept-Encoding
+
+
+
+=== TEST 2: a higher quality selects text
+--- main_config
+prometheus_zone 1m;
+--- config
+    location = /metrics {
+        prometheus;
+    }
+--- request
+GET /metrics
+--- more_headers
+Accept: application/vnd.google.protobuf;proto=io.prometheus.client.MetricFamily;encoding=delimited;q=0.2,text/plain;version=0.0.4;q=0.5
+--- response_headers
+Content-Type: text/plain; version=0.0.4; charset=utf-8
+
+
+
+=== TEST 3: a quality of 0 refuses protobuf
+--- main_config
+prometheus_zone 1m;
+--- config
+    location = /metrics {
+        prometheus;
+    }
+--- request
+GET /metrics
+--- more_headers
+Accept: application/vnd.google.protobuf;q=0
+--- response_headers
+Content-Type: text/plain; version=0.0.4; charset=utf-8
+
+
+
+=== TEST 4: on equal quality protobuf is preferred
+--- main_config
+prometheus_zone 1m;
+--- config
+    location = /metrics {
+        prometheus;
+    }
+--- request
+GET /metrics
+--- more_headers
+Accept: text/plain, application/vnd.google.protobuf
+--- response_headers
+Content-Type: application/vnd.google.protobuf; proto=io.prometheus.client.MetricFamily; encoding=delimited
+
+
+
+=== TEST 5: without Accept the format is text
+--- main_config
+prometheus_zone 1m;
+--- config
+    location = /metrics {
+        prometheus;
+    }
+--- request
+GET /metrics
+--- response_headers
+Content-Type: text/plain; version=0.0.4; charset=utf-8
+
+
+
+=== TEST 6: a gauge is one delimited MetricFamily
+--- main_config
+prometheus_zone 1m;
+prometheus_gauge temperature "Temp" labels=room;
+--- config
+    location = /observe {
+        prometheus_observe temperature 1.5 room=kitchen;
+        return 204;
+    }
+
+    location = /metrics {
+        prometheus;
+    }
+--- pipelined_requests eval
+["GET /observe", "GET /metrics?name[]=temperature"]
+--- more_headers
+Accept: application/vnd.google.protobuf;proto=io.prometheus.client.MetricFamily;encoding=delimited
+--- response_body eval
+["", "\x33\x0a\x0btemperature\x12\x04Temp\x18\x01\x22\x1c\x0a\x0f\x0a\x04room\x12\x07kitchen\x12\x09\x09\x00\x00\x00\x00\x00\x00\xf8\x3f"]
+
+
+
+=== TEST 7: a family over 127 bytes has a two-byte length prefix
+--- main_config
+prometheus_zone 1m;
+prometheus_gauge temperature "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx";
+--- config
+    location = /observe {
+        prometheus_observe temperature 1.5;
+        return 204;
+    }
+
+    location = /metrics {
+        prometheus;
+    }
+--- pipelined_requests eval
+["GET /observe", "GET /metrics?name[]=temperature"]
+--- more_headers
+Accept: application/vnd.google.protobuf;proto=io.prometheus.client.MetricFamily;encoding=delimited
+--- response_body eval
+["", "\x96\x01\x0a\x0btemperature\x12\x78" . ("x" x 120) . "\x18\x01\x22\x0b\x12\x09\x09\x00\x00\x00\x00\x00\x00\xf8\x3f"]
+
+
+
+=== TEST 8: native buckets are spans and packed zigzag deltas
+--- main_config
+prometheus_zone 1m;
+prometheus_histogram latency "Latency" native=0;
+--- config
+    location = /observe {
+        prometheus_observe latency $arg_v;
+        return 204;
+    }
+
+    location = /metrics {
+        prometheus;
+    }
+--- pipelined_requests eval
+["GET /observe?v=1", "GET /observe?v=2", "GET /observe?v=2",
+ "GET /observe?v=8", "GET /observe?v=0", "GET /observe?v=-2",
+ "GET /metrics?name[]=latency"]
+--- more_headers
+Accept: application/vnd.google.protobuf;proto=io.prometheus.client.MetricFamily;encoding=delimited
+--- response_body_like eval
+["", "", "", "", "", "",
+ qr/\A.\x0a\x07latency\x12\x07Latency\x18\x04\x22.\x3a.\x08\x06\x11\x00\x00\x00\x00\x00\x00\x26\x40\x31\x00\x00\x00\x00\x00\x00\xf0\x37\x38\x01\x4a\x04\x08\x02\x10\x01\x52\x01\x02\x62\x02\x10\x02\x62\x04\x08\x02\x10\x01\x6a\x03\x02\x02\x01\x7a.+\z/s]
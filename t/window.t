@@ -0,0 +1,64 @@
+use Test::Nginx::Socket 'no_plan';
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: a name filter selects the window family of a counter
+--- main_config
+prometheus_zone 1m;
+prometheus_counter requests_total "Requests" window=60s;
+--- config
+    location = /observe {
+        prometheus_observe requests_total 1;
+        return 204;
+    }
+
+    location = /metrics {
+        prometheus;
+    }
+--- pipelined_requests eval
+["GET /observe", "GET /metrics?name[]=requests_rate"]
+--- response_body_like eval
+["", qr/\A# HELP requests_rate Requests\n# TYPE requests_rate gauge\nrequests_rate [0-9.e+-]+\n\z/]
+
+
+
+=== TEST 2: a name filter on the counter leaves its window family out
+--- main_config
+prometheus_zone 1m;
+prometheus_counter requests_total "Requests" window=60s;
+--- config
+    location = /observe {
+        prometheus_observe requests_total 1;
+        return 204;
+    }
+
+    location = /metrics {
+        prometheus;
+    }
+--- pipelined_requests eval
+["GET /observe", "GET /metrics?name[]=requests_total"]
+--- response_body_like eval
+["", qr/\A# HELP requests_total Requests\n# TYPE requests_total counter\nrequests_total 1\n\z/]
+
+
+
+=== TEST 3: a prefix filter selects both families
+--- main_config
+prometheus_zone 1m;
+prometheus_histogram latency_seconds "Latency" buckets=0.1,1 window=60s;
+--- config
+    location = /observe {
+        prometheus_observe latency_seconds 0.5;
+        return 204;
+    }
+
+    location = /metrics {
+        prometheus;
+    }
+--- pipelined_requests eval
+["GET /observe", "GET /metrics?name[]=latency*"]
+--- response_body_like eval
+["", qr/# TYPE latency_seconds histogram\n.*# TYPE latency_seconds_window gauge\nlatency_seconds_window\{quantile="0.5"\} /s]